@@ -10,15 +10,15 @@ manager = vesc.Manager(config)
 # Get the motor object
 atom1 = manager.motor("atomiser1")
 
-print("Setting RPM to 1000")
-atom1.set_rpm(1000)
+print("Running at 1000 RPM")
 
-print("Done")
-
-# Wait forever
+# Keep sending the setpoint, if it isn't refreshed within the motor's
+# driveTimeout the motor is released.
 while True:
+    for i in range(10):
+        atom1.set_rpm(1000)
+        time.sleep(0.1)
     print(f"Speed {atom1.rpm()}")
-    time.sleep(1)
 
 
 
@@ -0,0 +1,54 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#ifndef MULTIVESC_ARRIVALESTIMATOR_HH
+#define MULTIVESC_ARRIVALESTIMATOR_HH
+
+#include <chrono>
+#include <cstdint>
+
+namespace multivesc {
+
+    //! Estimate the period and phase of a periodic message stream.
+    //! This is a simple phase locked loop, each arrival nudges the predicted phase and period towards
+    //! what was seen, so a single late frame doesn't move the estimate much.  Missed frames are skipped over.
+
+    class ArrivalEstimator
+    {
+    public:
+        using TimePointT = std::chrono::steady_clock::time_point;
+        using DurationT = std::chrono::steady_clock::duration;
+
+        //! Record a message arriving at 'when'.
+        void sample(TimePointT when);
+
+        //! Forget all history.
+        void reset();
+
+        //! Check if the estimate is good enough to schedule against.
+        [[nodiscard]] bool locked() const;
+
+        //! Estimated period between messages, zero if unknown.
+        [[nodiscard]] DurationT period() const;
+
+        //! Smoothed absolute difference between the predicted and actual arrival times.
+        [[nodiscard]] DurationT jitter() const;
+
+        //! Time the last message arrived.
+        [[nodiscard]] TimePointT lastArrival() const { return mLastArrival; }
+
+        //! Predicted time of the first arrival after 'after'.
+        [[nodiscard]] TimePointT nextArrival(TimePointT after) const;
+
+    protected:
+        uint32_t mCount = 0;
+        TimePointT mLastArrival;
+        TimePointT mPredicted; //!< Filtered time of the last arrival
+        double mPeriod = 0.0; //!< Seconds
+        double mJitter = 0.0; //!< Seconds
+    };
+
+} // multivesc
+
+#endif //MULTIVESC_ARRIVALESTIMATOR_HH
@@ -9,9 +9,16 @@
 #include <cstdint>
 #include <thread>
 #include <atomic>
+#include <vector>
+#include <array>
+#include <mutex>
+#include <condition_variable>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <linux/can.h>
 #include <nlohmann/json.hpp>
 #include "multivesc/BusInterface.hh"
+#include "multivesc/CanCapture.hh"
 
 namespace multivesc {
 
@@ -23,6 +30,10 @@ namespace multivesc {
         CAN_PACKET_SET_CURRENT_BRAKE,
         CAN_PACKET_SET_RPM,
         CAN_PACKET_SET_POS,
+        CAN_PACKET_FILL_RX_BUFFER,
+        CAN_PACKET_FILL_RX_BUFFER_LONG,
+        CAN_PACKET_PROCESS_RX_BUFFER,
+        CAN_PACKET_PROCESS_SHORT_BUFFER,
         CAN_PACKET_STATUS = 9,
         CAN_PACKET_SET_CURRENT_REL = 10,
         CAN_PACKET_SET_CURRENT_BRAKE_REL,
@@ -31,6 +42,8 @@ namespace multivesc {
         CAN_PACKET_STATUS_2 = 14,
         CAN_PACKET_STATUS_3 = 15,
         CAN_PACKET_STATUS_4 = 16,
+        CAN_PACKET_PING = 17,
+        CAN_PACKET_PONG = 18,
         CAN_PACKET_STATUS_5 = 27,
         CAN_PACKET_STATUS_6 = 28
     } CAN_PACKET_ID;
@@ -54,6 +67,9 @@ namespace multivesc {
         //! Open the CAN interface.
         bool open() override;
 
+        //! Register a motor, leaving out any host id it uses from those requests are sent from.
+        bool register_motor(const std::shared_ptr<Motor> &motor) override;
+
         //! Stop the CAN interface and close the socket.
         bool stop() override;
 
@@ -90,7 +106,133 @@ namespace multivesc {
         //! Set handbrake current in Amps as a percentage of the maximum current.
         void setHandbrakeRel(uint8_t controller_id, float current_rel) override;
 
+        //! Send a batch of drive commands with a single system call.
+        //! Commands that don't fit in the transmit budget are deferred, a newer command for the same
+        //! controller replaces a deferred one.
+        void sendDriveCommands(const DriveCommand *commands, size_t count) override;
+
+        //! Choose the phase of periodic updates so the bus load is spread evenly over time.
+        std::chrono::steady_clock::duration phaseOffset(uint8_t controller_id, std::chrono::steady_clock::duration period) override;
+
+        //! Send a packet payload to a controller using the CAN buffer transport.
+        //! Payloads of up to 6 bytes go in a single frame, longer ones are sent in chunks that are streamed
+        //! back to back, followed by a frame asking the controller to check the CRC and process them.
+        //! Replies sent back to 'hostId' are reassembled and passed to the packet callback.
+        bool sendPacket(uint8_t controller_id, const uint8_t *payload, size_t len) override;
+
+        //! Find which of a set of controllers are on the bus with CAN_PACKET_PING.
+        //! The pings are sent in one burst and the replies collected until all have answered, or until 'timeout'
+        //! seconds after the last ping was sent.
+        std::vector<uint8_t> scan(const std::vector<uint8_t> &ids, float timeout = 0.1f) override;
+
+        //! Set the CAN id used as the sender of packets, replies are sent to this id.
+        //! It must not be used by any controller on the bus, and should be set before the bus is opened.
+        //! Only one request can then be waiting for a reply at a time.
+        void setHostId(uint8_t id) { mHostIds = {id}; }
+
+        //! Set several CAN ids to send requests from, by default 254 down to 247.
+        //! Replies longer than 6 bytes sent to the same id at the same time would be mixed up, so one request
+        //! with a reply outstanding is allowed for each id.  The first is used by sendPacket().
+        //! They must not be used by any controller on the bus, and should be set before the bus is opened.
+        //! Ids after the first that a motor on the bus uses are not sent from.
+        void setHostIds(const std::vector<uint8_t> &ids) { if(!ids.empty()) mHostIds = ids; }
+
+        //! Get the CAN id used as the sender of packets.
+        [[nodiscard]] uint8_t hostId() const { return mHostIds[0]; }
+
+        //! Have the kernel timestamp each frame as it is handed to the interface, with SO_TIMESTAMPING.
+        //! The times of drive commands are passed to their motors for latency tracing.
+        bool setTxTimestamps(bool enable) override;
+
+        //! Record every frame sent and received to a capture file, replacing any that exists.
+        //! Received frames are stamped by the kernel where it can, sent ones as they are handed to the interface.
+        bool startCapture(const std::string &filename);
+
+        //! Stop recording, writing out what is buffered.  Stopping the bus stops the capture too.
+        void stopCapture();
+
+        //! Check if frames are being recorded.
+        [[nodiscard]] bool capturing() const { return mCapturing; }
+
+        //! Get statistics for the bus, including the bus load and how much of the transmit budget is used.
+        [[nodiscard]] json stats() override;
+
+        //! Number of bits a frame takes on the bus, including worst case bit stuffing and the inter-frame space.
+        static uint32_t frameBits(const struct can_frame &frame);
+
+        //! Longest payload that can be sent with the buffer transport.
+        static constexpr size_t MaxPacketLength = 0xFFFF;
+
+        //! Encode a packet payload as the frames of the buffer transport, replacing the contents of 'frames'.
+        //! 'sender' is the id the receiver replies to. 'send' is 0 to have the receiver process the packet and
+        //! reply, 1 for a reply that is only processed.
+        static void encodePacketFrames(uint8_t controller_id, uint8_t sender, const uint8_t *payload, size_t len,
+                                       std::vector<struct can_frame> &frames, uint8_t send = 0);
+
+    protected:
+        //! One request may be outstanding for each host id.
+        [[nodiscard]] size_t requestChannels() const override { return mHostIds.size(); }
+
+        //! Send a request from the host id for the channel.
+        bool sendRequest(size_t channel, uint8_t controller_id, const uint8_t *payload, size_t len) override;
+
+        // The transport, a raw CAN socket.  Other ways of moving frames override these.
+
+        //! Check if the transport is open.
+        [[nodiscard]] virtual bool isOpen() const { return mSocket >= 0; }
+
+        //! Open the transport.
+        virtual bool openDevice();
+
+        //! Close the transport.
+        virtual void closeDevice();
+
+        //! Write frames to the transport.
+        //! @return Number of frames written.
+        virtual size_t writeFrames(struct can_frame *frames, size_t count);
+
+        //! Read up to 'maxFrames' frames, waiting up to 'timeoutSeconds' for the first.
+        //! @return Number of frames read, negative if the transport failed.
+        virtual int readFrames(struct can_frame *frames, unsigned maxFrames, float timeoutSeconds);
+
+        //! Set up the buffers for receiving packets, before any frames are received.
+        void prepareReceive();
+
+        //! Count, record and decode received frames.
+        //! @param timesNs - Kernel receive time of each frame, CLOCK_REALTIME in nanoseconds, zero if unknown. May be null.
+        void receiveFrames(const struct can_frame *frames, size_t count, const int64_t *timesNs = nullptr);
+
+        //! Decode a CAN frame and call the appropriate callback functions.
+        void decode(const struct can_frame &frame);
+
+        //! Send frames, keeping the statistics.
+        //! @return Number of frames sent.
+        size_t sendFrames(struct can_frame *frames, size_t count);
+
+        //! Send any deferred frames that now fit in the budget.
+        //! Must be called with mTxMutex held.
+        void flushDeferred();
+
+        //! Send the deferred frames that fit in the budget.
+        //! @return True if some are still waiting.
+        bool sendDeferred();
+
+        //! Top up the transmit budget for the time passed.
+        //! Must be called with mTxMutex held.
+        void refillBudget(std::chrono::steady_clock::time_point now);
+
+        std::mutex mTxMutex;
+        std::atomic_bool mTerminate = false;
+        uint32_t mBitrate = 500000;
+
     private:
+        //! Send a packet with the given id as the sender.
+        bool sendPacketFrom(uint8_t controller_id, uint8_t sender, const uint8_t *payload, size_t len);
+
+        //! Send frames in bursts outside the transmit budget, waiting for room in the interface queue if needed.
+        //! @return False if the queue didn't drain in time.
+        bool sendBurst(struct can_frame *frames, size_t count);
+
         void can_transmit_eid(uint32_t id, const uint8_t *data, uint8_t len);
 
         //! Read packets from the CAN interface and call the appropriate callback functions.
@@ -100,13 +242,76 @@ namespace multivesc {
         //! @return True if data is available, false if timeout.
         bool wait_for_data(float timeoutSeconds);
 
-        //! Decode a CAN frame and call the appropriate callback functions.
-        void decode(const struct can_frame &frame);
+
+        //! Set SO_TIMESTAMPING on the socket to match mTxTimestamps.
+        bool applyTxTimestamps();
+
+        //! Set SO_TIMESTAMPNS on the socket while capturing, so received frames have kernel times.
+        bool applyRxTimestamps();
+
+        //! Read the transmit timestamps waiting in the socket error queue and pass them to the motors.
+        void readTxTimestamps();
+
+        //! Add a buffer transport frame sent to us to the packet being received, passing it on when complete.
+        void decodeBuffer(const struct can_frame &frame);
 
         std::string mDeviceName;
         int mSocket = -1;
-        std::atomic_bool mTerminate = false;
         std::thread mReceiveThread;
+
+        // Transmit buffers for batches of drive commands, reused each tick.
+        std::vector<struct can_frame> mTxFrames;
+        std::vector<struct iovec> mTxIov;
+        std::vector<struct mmsghdr> mTxMsgs;
+
+        // Receive buffers, only used from the receive thread.
+        std::vector<struct iovec> mRxIov;
+        std::vector<struct mmsghdr> mRxMsgs;
+        std::vector<uint64_t> mRxControl; //!< Ancillary data for each message, 8 aligned words each
+        std::vector<int64_t> mRxTimes; //!< Kernel time of each frame read, zero if not known
+
+        // Transmit scheduling, protected by mTxMutex.
+        float mTxBudget = 0.5f; //!< Fraction of the bus bit rate periodic commands may use
+        std::chrono::steady_clock::duration mBudgetWindow = std::chrono::milliseconds(5); //!< Period over which the budget can be used in a burst
+        double mBudgetBits = 0.0;
+        std::chrono::steady_clock::time_point mBudgetTime;
+        std::vector<struct can_frame> mDeferred;
+        std::vector<uint32_t> mPhaseLoad; //!< Bits per millisecond over a second, used to choose phases
+
+        // Buffer transport
+        std::vector<uint8_t> mHostIds {254, 253, 252, 251, 250, 249, 248, 247};
+        std::array<int16_t, 256> mHostChannel {}; //!< Channel for each host id, -1 if it isn't one of ours. Set in open()
+        std::mutex mPacketTxMutex; //!< Held while a packet is sent, so the chunks of different packets don't mix
+        std::vector<struct can_frame> mPacketFrames; //!< Protected by mPacketTxMutex
+        std::vector<std::vector<uint8_t>> mRxBuffers; //!< Packet being received for each host id, only used from the receive thread
+
+        // Node scan
+        std::mutex mScanMutex; //!< Held during a scan
+        std::mutex mPongMutex;
+        std::condition_variable mPongCondition;
+        std::array<bool, 256> mPongSeen {}; //!< Protected by mPongMutex
+
+        std::atomic<bool> mTxTimestamps = false;
+
+        // Capture
+        CaptureWriter mCapture;
+        std::atomic<bool> mCapturing = false;
+
+        // Statistics
+        std::atomic<uint64_t> mTxBitCount = 0;
+        std::atomic<uint64_t> mRxBitCount = 0;
+        std::atomic<uint64_t> mTxFrameCount = 0;
+        std::atomic<uint64_t> mRxFrameCount = 0;
+        std::atomic<uint64_t> mDeferredCount = 0;
+        std::atomic<uint64_t> mSupersededCount = 0;
+        std::atomic<uint64_t> mTxPacketCount = 0;
+        std::atomic<uint64_t> mTxPacketErrors = 0;
+        std::atomic<uint64_t> mRxPacketCount = 0;
+        std::atomic<uint64_t> mRxPacketCrcErrors = 0;
+        std::atomic<uint64_t> mTxTimestampCount = 0;
+        std::chrono::steady_clock::time_point mStatsTime;
+        uint64_t mStatsTxBits = 0;
+        uint64_t mStatsRxBits = 0;
     };
 
 } // multivesc
@@ -11,7 +11,13 @@
 #include <thread>
 #include <mutex>
 #include <functional>
+#include <chrono>
+#include <future>
+#include <list>
+#include <array>
+#include <atomic>
 #include <nlohmann/json.hpp>
+#include "multivesc/ControlKernel.hh"
 
 namespace multivesc
 {
@@ -19,6 +25,13 @@ namespace multivesc
 
     class Motor;
     class Manager;
+    enum class MotorValuesT;
+
+    //! Controller id given to packets when the sender isn't known.
+    constexpr uint8_t UnknownControllerId = 255;
+
+    //! Function called with a packet payload received from a controller, starting with the COMM_PACKET_ID.
+    using PacketCallbackT = std::function<void(uint8_t controllerId, const uint8_t *payload, size_t len)>;
 
     //! Abstract class for communicating with the VESC
     //! The implementation deal with can bus and serial communication
@@ -49,6 +62,9 @@ namespace multivesc
         //! Register a motor with the interface
         virtual bool register_motor(const std::shared_ptr<Motor> &motor);
 
+        //! Called by Manager::configure() once the motors on the bus are set up.  Does nothing by default.
+        virtual void motorsReady() {}
+
         //! Set the duty cycle of the motor controller. The duty cycle is a value between -1 and 1.
         virtual void setDuty(uint8_t controller_id, float duty);
 
@@ -82,6 +98,71 @@ namespace multivesc
         //! Set the handbrake current of the motor controller as a percentage of the maximum current.
         virtual void setHandbrakeRel(uint8_t controller_id, float current_rel);
 
+        //! Send a batch of drive commands produced by the update tick.
+        //! The default implementation calls the individual set functions, buses that can send several
+        //! commands at once should override this.
+        virtual void sendDriveCommands(const DriveCommand *commands, size_t count);
+
+        //! Choose the phase of the periodic updates for a controller.
+        //! The update is sent when the time since the clock epoch modulo the period equals the phase.
+        //! The default spreads controllers over the period using a golden ratio sequence.
+        virtual std::chrono::steady_clock::duration phaseOffset(uint8_t controller_id, std::chrono::steady_clock::duration period);
+
+        //! Send a packet payload, starting with a COMM_PACKET_ID, to a controller.
+        //! Any reply is passed to the packet callback.
+        //! @return False if the packet couldn't be sent or the bus doesn't support packets.
+        virtual bool sendPacket(uint8_t controller_id, const uint8_t *payload, size_t len);
+
+        //! Set a function to be called with packets received from controllers, such as replies to sendPacket().
+        //! It is called from the receive thread so should return quickly.
+        void setPacketCallback(PacketCallbackT callback);
+
+        //! Send a packet payload, starting with a COMM_PACKET_ID, to a controller and get the reply.
+        //! The reply is the next packet from the controller with the same command id.  Any number of requests
+        //! can be made at once, they are sent as soon as the bus has a free channel for them.  On CAN there is a
+        //! channel for each host id, so requests to as many controllers as there are host ids take one round trip.
+        //! If replies don't say which controller sent them only one request with each command id is sent at a
+        //! time, and after one times out no more with that command are sent for the same time again, so a late
+        //! reply isn't taken for the next one's.
+        //! @param timeout - Time in seconds from now to wait for the reply.
+        //! @return The reply payload, which is empty if the request timed out or couldn't be sent.
+        std::future<std::vector<uint8_t>> request(uint8_t controller_id, const uint8_t *payload, size_t len, float timeout = 0.5f);
+
+        //! Same as above, for a payload in a vector.
+        std::future<std::vector<uint8_t>> request(uint8_t controller_id, const std::vector<uint8_t> &payload, float timeout = 0.5f)
+        { return request(controller_id, payload.data(), payload.size(), timeout); }
+
+        //! Send a request to each of a set of controllers and wait for all the replies.
+        //! The requests are all made at once if replies say which controller they came from, otherwise one at a time.
+        //! @return The replies in the same order as the ids, empty for those that failed.
+        std::vector<std::vector<uint8_t>> requestAll(const std::vector<uint8_t> &ids, const std::vector<uint8_t> &payload, float timeout = 0.5f);
+
+        //! Same as above with a different payload for each controller.
+        std::vector<std::vector<uint8_t>> requestAll(const std::vector<uint8_t> &ids, const std::vector<std::vector<uint8_t>> &payloads, float timeout = 0.5f);
+
+        //! Find which of a set of controllers are on the bus.
+        //! All are asked at once, so this takes about one round trip.  The default asks for the firmware version.
+        //! @return The ids that replied within 'timeout' seconds.
+        virtual std::vector<uint8_t> scan(const std::vector<uint8_t> &ids, float timeout = 0.1f);
+
+        //! CAN id of the controller the bus is attached to, which passes packets on to the others, or negative
+        //! if the bus reaches all of them directly.
+        [[nodiscard]] virtual int localId() const { return -1; }
+
+        //! Check if the bus can tell which controller a reply came from.
+        //! If not, replies to requests with the same command sent to different controllers can be confused.
+        [[nodiscard]] virtual bool repliesIdentifySender() const { return true; }
+
+        //! Number of requests waiting to be sent or for their reply.
+        [[nodiscard]] size_t pendingRequests() const { return mPendingRequests; }
+
+        //! Ask for the time each drive command leaves the host to be taken by the kernel, for latency tracing.
+        //! @return False if the bus can't provide them, in which case the time the send returned is used.
+        virtual bool setTxTimestamps(bool enable) { return false; }
+
+        //! Get statistics for the bus.
+        [[nodiscard]] virtual json stats();
+
         //! Check if we are verbose
         [[nodiscard]] bool verbose() const { return mVerbose; }
 
@@ -92,8 +173,40 @@ namespace multivesc
         [[nodiscard]] std::shared_ptr<Motor> getMotor(uint8_t id);
 
     protected:
-        //! Do update
-        virtual void update();
+        //! Do update for all registered motors
+        //! @param now - Time of the update tick.
+        virtual void update(std::chrono::steady_clock::time_point now);
+
+        //! Do update for a set of motors on this bus
+        //! @param now - Time of the update tick.
+        //! @param motors - Motors that are due an update.
+        virtual void updateMotors(std::chrono::steady_clock::time_point now, const std::vector<Motor *> &motors);
+
+        //! Pass a received packet to any request waiting for it, then to the packet callback.
+        //! @param channel - Channel the packet arrived on if the bus knows, otherwise -1.
+        void packetCallback(uint8_t controllerId, const uint8_t *payload, size_t len, int channel = -1);
+
+        //! Number of requests the bus can have waiting for a reply at once.
+        [[nodiscard]] virtual size_t requestChannels() const { return 64; }
+
+        //! Stop a channel being used for requests, for example because a controller uses the id it sends from.
+        void reserveRequestChannel(size_t channel);
+
+        //! Send a request on a channel.  Buses that can tell which channel a reply arrived on override this.
+        virtual bool sendRequest(size_t channel, uint8_t controller_id, const uint8_t *payload, size_t len);
+
+        //! Send requests that are waiting, if there are free channels.
+        void dispatchRequests();
+
+        //! Give up on requests whose time is up.
+        //! This should be called regularly from the receive thread, at least every 10ms while requests are pending.
+        void expireRequests(std::chrono::steady_clock::time_point now);
+
+        //! Give up on all requests, used when the bus is stopped.
+        void cancelRequests();
+
+        //! Callback function for a single value.
+        void valueCallback(uint8_t controllerId, MotorValuesT type, float value);
 
         //! Callback function for status packets.
         void statusCallback(uint8_t controllerId, float erpm, float current, float dutyCycle);
@@ -113,9 +226,46 @@ namespace multivesc
         //! Callback function for status 6 packets.
         void status6Callback(uint8_t controllerId, float adc1, float adc2, float adc3, float ppm);
 
+        //! Called with the time the kernel sent a drive command, for buses with transmit timestamps.
+        void txTimestampCallback(uint8_t controllerId, MotorDriveT mode, std::chrono::steady_clock::time_point when);
+
         std::mutex mMutex; // Mutex for accessing the motor map
         std::vector<std::shared_ptr<Motor>> mMotors = std::vector<std::shared_ptr<Motor>>(256); // Map from motor id to motor object
+        std::vector<Motor *> mActiveMotors; // Registered motors, so the update doesn't need to scan all ids. Owned by mMotors.
+
+        // Update tick state, only used from the update thread.
+        std::vector<Motor *> mTickMotors;
+        std::vector<std::pair<Motor *, size_t>> mTickSlots;
+        ControlKernel mKernel;
         bool mVerbose = false;
+        uint32_t mPhaseCount = 0;
+
+        std::mutex mPacketMutex;
+        PacketCallbackT mPacketCallback; //!< Protected by mPacketMutex
+
+        //! A request waiting to be sent or for its reply.
+        struct RequestT
+        {
+            uint64_t serial = 0;
+            uint8_t controllerId = 0;
+            uint8_t command = 0;
+            int channel = -1; //!< Channel the request was sent on, -1 if it hasn't been sent
+            std::chrono::steady_clock::time_point deadline;
+            std::chrono::steady_clock::duration timeout {};
+            std::vector<uint8_t> payload;
+            std::promise<std::vector<uint8_t>> promise;
+        };
+
+        std::mutex mRequestMutex;
+        std::list<RequestT> mRequests; //!< In the order they were made, protected by mRequestMutex
+        std::vector<bool> mChannelBusy; //!< Protected by mRequestMutex
+        std::vector<bool> mChannelReserved; //!< Channels not to use, protected by mRequestMutex
+        std::array<std::chrono::steady_clock::time_point, 256> mCommandQuietUntil {}; //!< For buses matching replies by command, protected by mRequestMutex
+        uint64_t mRequestSerial = 0; //!< Protected by mRequestMutex
+        std::atomic<size_t> mPendingRequests = 0;
+        std::atomic<uint64_t> mRequestsSent = 0;
+        std::atomic<uint64_t> mRequestTimeouts = 0;
+        std::atomic<uint64_t> mRequestFailures = 0;
 
         friend class Manager;
     };
@@ -0,0 +1,105 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#ifndef MULTIVESC_BUSLOOPBACK_HH
+#define MULTIVESC_BUSLOOPBACK_HH
+
+#include <vector>
+#include <array>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <nlohmann/json.hpp>
+#include "multivesc/BusCan.hh"
+#include "multivesc/SimController.hh"
+#include "multivesc/SpscQueue.hh"
+
+namespace multivesc {
+
+    //! A CAN bus in memory, connected to simulated controllers in the same process.
+    //! Frames go through the same encoding and decoding as BusCan, but are passed to and from the controllers
+    //! through lock free queues rather than a socket, so there are no system calls or kernel limits.
+    //! With 'threaded' false no threads are started and nothing happens until step() is called, so runs are
+    //! repeatable and can be timed exactly.
+    //! The controllers are set up as for makeSimControllers().
+
+    class BusLoopback
+      : public BusCan
+    {
+    public:
+        //! Construct from config.
+        explicit BusLoopback(const json &config);
+
+        //! Destructor
+        ~BusLoopback() override;
+
+        //! Start passing frames.
+        bool open() override;
+
+        //! Advance the controllers to 'now' and decode what they send, all in the calling thread.
+        //! Only used when not threaded.
+        //! @return Number of frames decoded.
+        size_t step(std::chrono::steady_clock::time_point now);
+
+        //! Check if the controllers run in their own thread.
+        [[nodiscard]] bool threaded() const { return mThreaded; }
+
+        //! Number of simulated controllers.
+        [[nodiscard]] size_t controllerCount() const { return mControllers.size(); }
+
+        //! Access a simulated controller by id, null if there is none.
+        //! Only use it while the bus is stopped or not threaded.
+        [[nodiscard]] SimController *controller(uint8_t id) const { return mById[id]; }
+
+        //! State of each controller.
+        //! Only use it while the bus is stopped or not threaded.
+        [[nodiscard]] json state() const;
+
+        //! There is no kernel to timestamp frames, the time the send returns is used.
+        bool setTxTimestamps(bool enable) override { return false; }
+
+        //! Get statistics for the bus.
+        [[nodiscard]] json stats() override;
+
+    protected:
+        [[nodiscard]] bool isOpen() const override { return mOpen; }
+
+        bool openDevice() override;
+
+        void closeDevice() override;
+
+        //! Queue frames for the controllers.
+        //! BusCan only writes with mTxMutex held, so there is a single producer at a time.
+        size_t writeFrames(struct can_frame *frames, size_t count) override;
+
+        //! Take frames sent by the controllers.
+        int readFrames(struct can_frame *frames, unsigned maxFrames, float timeoutSeconds) override;
+
+        //! Pass the queued frames to the controllers they are addressed to, and advance the models.
+        //! Replies and status frames are appended to mOut.
+        //! @return When the next status frame is due.
+        std::chrono::steady_clock::time_point runControllers(std::chrono::steady_clock::time_point now);
+
+        //! Controller thread.
+        void run();
+
+        bool mThreaded = true;
+        std::atomic<bool> mOpen = false;
+        std::atomic<bool> mStopControllers = false;
+        std::thread mControllerThread;
+
+        SpscQueue<struct can_frame> mToControllers;
+        SpscQueue<struct can_frame> mFromControllers;
+
+        std::vector<std::unique_ptr<SimController>> mControllers;
+        std::array<SimController *, 256> mById {};
+        std::vector<struct can_frame> mIn; //!< Only used by the controller thread, or step()
+        std::vector<struct can_frame> mOut; //!< Only used by the controller thread, or step()
+
+        std::atomic<uint64_t> mTxDropped = 0;
+    };
+
+} // multivesc
+
+#endif //MULTIVESC_BUSLOOPBACK_HH
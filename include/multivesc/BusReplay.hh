@@ -0,0 +1,99 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#ifndef MULTIVESC_BUSREPLAY_HH
+#define MULTIVESC_BUSREPLAY_HH
+
+#include <string>
+#include <chrono>
+#include <nlohmann/json.hpp>
+#include "multivesc/BusCan.hh"
+#include "multivesc/CanCapture.hh"
+#include "multivesc/CandumpLog.hh"
+
+namespace multivesc {
+
+    //! Plays the frames received in a capture file or candump log back through the same decoding as BusCan, so a
+    //! run can be reproduced offline with the same motors and callbacks.
+    //! Frames are passed on at the times they were received, scaled by 'speed', or as fast as they can be
+    //! decoded with a speed of 0.  Motors see the time they are decoded, not the time they were captured.
+    //! Nothing is played until play() is called, as the manager opens buses before adding motors.  Manager::configure()
+    //! starts it through motorsReady() once the motors are set up.
+    //! Commands sent to the bus are counted and dropped, the ones in the capture are not replayed.
+    //! Candump logs are read a line at a time, so they can be any size.
+
+    class BusReplay
+      : public BusCan
+    {
+    public:
+        //! Construct from config.
+        explicit BusReplay(const json &config);
+
+        //! Destructor
+        ~BusReplay() override;
+
+        //! Decode all the remaining received frames in the calling thread, as fast as possible.
+        //! Use it instead of open(), not while the bus is open.  Manager::start() opens its buses, so add the bus
+        //! and its motors to a manager that isn't started.
+        //! @return Number of frames decoded.
+        size_t replayAll();
+
+        //! Start playing the frames, once the motors that should see them are set up.
+        //! It can be called before or after the bus is opened.
+        void play() { mPlaying = true; }
+
+        //! Start playing.
+        void motorsReady() override { play(); }
+
+        //! Check if play() has been called.
+        [[nodiscard]] bool playing() const { return mPlaying; }
+
+        //! Check if all the frames have been played.
+        [[nodiscard]] bool finished() const { return mFinished; }
+
+        //! There is no kernel to timestamp frames.
+        bool setTxTimestamps(bool enable) override { return false; }
+
+    protected:
+        [[nodiscard]] bool isOpen() const override { return mOpen; }
+
+        bool openDevice() override;
+
+        void closeDevice() override;
+
+        //! Drop frames sent.
+        size_t writeFrames(struct can_frame *frames, size_t count) override;
+
+        //! Take the received frames from the capture that are due.
+        int readFrames(struct can_frame *frames, unsigned maxFrames, float timeoutSeconds) override;
+
+        //! Open the capture or log if needed.
+        bool openSource();
+
+        //! Find the next received frame, leaving it in mRecord.
+        //! @return False if there are no more, for now.
+        bool nextReceived();
+
+        std::string mFilename;
+        std::string mInterface;
+        float mSpeed = 1.0f;
+        std::atomic<bool> mOpen = false;
+        std::atomic<bool> mPlaying = false;
+
+        // The source, only used from the receive thread or replayAll()
+        bool mCandump = false;
+        CaptureReader mReader;
+        size_t mNext = 0; //!< Next record in mReader
+        CandumpReader mLog;
+        CaptureRecordT mRecord; //!< Next frame to play, if mHaveRecord
+        bool mHaveRecord = false;
+        std::atomic<bool> mFinished = false;
+        bool mStarted = false;
+        int64_t mStartCaptureNs = 0;
+        std::chrono::steady_clock::time_point mStartTime;
+    };
+
+} // multivesc
+
+#endif //MULTIVESC_BUSREPLAY_HH
@@ -8,13 +8,24 @@
 #include <vector>
 #include <string>
 #include <cstdint>
+#include <atomic>
+#include <array>
+#include <deque>
 
 #include "multivesc/BusInterface.hh"
+#include "multivesc/Motor.hh"
+#include "multivesc/VescPacket.hh"
 
 
 namespace multivesc {
 
     //! Serial interface to communicate with the VESC
+    //! Commands are sent as framed packets over a UART or USB serial port. The controller doesn't send
+    //! status on its own, so values are polled with COMM_GET_VALUES_SELECTIVE and passed to the motors the same way as CAN status.
+    //! Each value is polled at the motor's telemetry rate, or 'pollRate' if none are set, and only the fields
+    //! that are due are requested. Up to 'maxInFlight' requests are kept outstanding so the link doesn't sit idle
+    //! waiting for each response.
+    //! Other controllers on the same CAN bus as the one on the port are reached with COMM_FORWARD_CAN.
     class BusSerial
        : public BusInterface
     {
@@ -28,10 +39,10 @@ namespace multivesc {
         //! Destructor
         ~BusSerial() override;
 
-        //! Open the CAN interface.
+        //! Open the serial port.
         bool open() override;
 
-        //! Stop the CAN interface and close the socket.
+        //! Stop the receive thread and close the port.
         bool stop() override;
 
         //! Set the duty cycle of the motor controller. The duty cycle is a value between -1 and 1.
@@ -59,19 +70,120 @@ namespace multivesc {
         void setCurrentRelOffDelay(uint8_t controller_id, float current_rel, float off_delay) override;
 
         //! Set brake current in Amps as a percentage of the maximum current.
+        //! There is no serial command for this, so it is not supported.
         void setCurrentBrakeRel(uint8_t controller_id, float current_rel) override;
 
         //! Set handbrake current in Amps.
         void setHandbrake(uint8_t controller_id, float current) override;
 
         //! Set handbrake current in Amps as a percentage of the maximum current.
+        //! There is no serial command for this, so it is not supported.
         void setHandbrakeRel(uint8_t controller_id, float current_rel) override;
 
+        //! Send a batch of drive commands with a single write.
+        void sendDriveCommands(const DriveCommand *commands, size_t count) override;
+
+        //! Get statistics for the port.
+        [[nodiscard]] json stats() override;
+
+        //! Send a packet payload to a controller, forwarding it over CAN if it isn't the one on the port.
+        //! Replies don't say which controller they came from, so are passed on with UnknownControllerId.
+        bool sendPacket(uint8_t controller_id, const uint8_t *payload, size_t len) override;
+
+        //! Find which of a set of controllers can be reached.
+        //! With a local id set the controller on the port is asked to ping the CAN bus with COMM_PING_CAN, which
+        //! takes it a few seconds, otherwise only the controller on the port is checked.
+        std::vector<uint8_t> scan(const std::vector<uint8_t> &ids, float timeout = 0.1f) override;
+
+        //! Replies from controllers reached over CAN come back without their id.
+        [[nodiscard]] bool repliesIdentifySender() const override { return false; }
+
+        //! Frame and send a packet payload to the controller on the port.
+        bool sendPayload(const uint8_t *payload, size_t len);
+
+        //! Frame and send a packet payload to a controller, forwarding it over CAN if it isn't the one on the port.
+        bool sendPayload(uint8_t controller_id, const uint8_t *payload, size_t len);
+
+        //! Set the CAN id of the controller on the port, commands for other ids are forwarded over CAN.
+        //! A negative id sends all commands to the controller on the port.
+        void setLocalId(int id) { mLocalId = id; }
+
+        //! Get the CAN id of the controller on the port, negative if not set.
+        [[nodiscard]] int localId() const override { return mLocalId; }
+
     protected:
+        //! Set up the port for raw non-blocking IO at the configured baud rate.
+        bool configurePort();
+
+        //! Add a framed payload to mTxBuffer, wrapped in COMM_FORWARD_CAN if it is for another controller.
+        //! Must be called with mTxMutex held.
+        void appendPayload(uint8_t controller_id, const uint8_t *payload, size_t len);
+
+        //! Send requests for the values that are due, for every motor on the bus, in a single write.
+        //! @return Time of the next value due.
+        std::chrono::steady_clock::time_point pollValues(std::chrono::steady_clock::time_point now);
+
+        //! Build the COMM_GET_VALUES_SELECTIVE mask for the values due for a motor and advance their schedule.
+        uint32_t dueMask(const Motor *motor, std::array<std::chrono::steady_clock::time_point, NumValueTypes> &due,
+                         std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point &next);
+
+        //! Write all of a buffer to the port.
+        //! Must be called with mTxMutex held.
+        bool writeAll(const uint8_t *data, size_t len);
+
+        //! Read packets from the port and call the appropriate callback functions.
+        void run_receive_thread();
+
+        //! Decode a packet and call the appropriate callback functions.
+        void decode(const PacketView &packet);
+
+        //! Decode the response to COMM_GET_VALUES.
+        void decodeValues(const PacketView &packet);
+
+        //! Decode the response to COMM_GET_VALUES_SELECTIVE.
+        void decodeSelectiveValues(const PacketView &packet);
+
+        //! Poll schedule for a controller, only used from the receive thread.
+        struct PollStateT
+        {
+            uint8_t id = 0;
+            std::array<std::chrono::steady_clock::time_point, NumValueTypes> due {};
+        };
+
         std::string mPort;
+        int mBaudRate = 115200;
+        std::atomic<int> mLocalId = -1;
+        std::chrono::steady_clock::duration mPollPeriod = std::chrono::milliseconds(50); //!< Zero disables polling
         std::thread mReceiveThread;
+        std::atomic_bool mTerminate = false;
 
         int mFd = -1;
+
+        std::mutex mTxMutex;
+        std::vector<uint8_t> mTxBuffer; //!< Reused for each batch, protected by mTxMutex
+
+        size_t mMaxInFlight = 4;
+        std::chrono::steady_clock::duration mRequestTimeout = std::chrono::milliseconds(100);
+
+        PacketParser mParser; //!< Only used from the receive thread
+        std::vector<uint8_t> mRxPacket; //!< Copy of the packet being passed on, only used from the receive thread
+        std::vector<PollStateT> mPollStates; //!< Only used from the receive thread
+        std::vector<const Motor *> mPollMotors; //!< Only used from the receive thread
+        size_t mPollStart = 0; //!< Motor to start polling from, so all get a turn when requests are limited
+        std::deque<std::chrono::steady_clock::time_point> mInFlight; //!< Send times of outstanding requests, protected by mTxMutex
+
+        // Statistics
+        std::atomic<uint64_t> mTxBytes = 0;
+        std::atomic<uint64_t> mRxBytes = 0;
+        std::atomic<uint64_t> mTxPackets = 0;
+        std::atomic<uint64_t> mForwardedPackets = 0;
+        std::atomic<uint64_t> mRxPackets = 0;
+        std::atomic<uint64_t> mCrcErrors = 0;
+        std::atomic<uint64_t> mSkippedBytes = 0;
+        std::atomic<uint64_t> mWriteErrors = 0;
+        std::atomic<uint64_t> mPollRequests = 0;
+        std::atomic<uint64_t> mPollResponses = 0;
+        std::atomic<uint64_t> mPollTimeouts = 0;
     };
 
 }
@@ -0,0 +1,170 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#ifndef MULTIVESC_CANCAPTURE_HH
+#define MULTIVESC_CANCAPTURE_HH
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <linux/can.h>
+#include "multivesc/MappedFile.hh"
+
+namespace multivesc {
+
+    //! Direction of a captured frame.
+    enum class CaptureDirectionT : uint8_t
+    {
+        RX = 0,
+        TX = 1
+    };
+
+    //! Flags on a captured frame.
+    constexpr uint8_t CaptureKernelTime = 0x01; //!< The time was taken by the kernel, not when the library saw the frame
+
+    //! A frame in a capture file.  Files are in the byte order of the machine that wrote them.
+    struct CaptureRecordT
+    {
+        int64_t timeNs = 0; //!< Nanoseconds since the epoch, CLOCK_REALTIME
+        uint32_t canId = 0; //!< As in struct can_frame, with the flags
+        uint8_t dlc = 0;
+        CaptureDirectionT direction = CaptureDirectionT::RX;
+        uint8_t flags = 0;
+        uint8_t reserved = 0;
+        uint8_t data[8] {};
+    };
+    static_assert(sizeof(CaptureRecordT) == 24, "Capture records must be 24 bytes");
+
+    //! Header at the start of a capture file.
+    struct CaptureHeaderT
+    {
+        char magic[8] {'M', 'V', 'C', 'A', 'P', 'T', 'U', 'R'};
+        uint32_t version = 1;
+        uint32_t recordSize = sizeof(CaptureRecordT);
+        int64_t startTimeNs = 0;
+        uint64_t recordCount = 0; //!< Updated as records are written, so the file can be read while it grows
+    };
+    static_assert(sizeof(CaptureHeaderT) == 32, "Capture header must be 32 bytes");
+
+    //! Make a capture record from a frame.
+    CaptureRecordT makeCaptureRecord(const struct can_frame &frame, CaptureDirectionT direction, int64_t timeNs, uint8_t flags = 0);
+
+    //! Get the frame from a capture record.
+    struct can_frame captureFrame(const CaptureRecordT &record);
+
+    //! Current CLOCK_REALTIME in nanoseconds, the time base of captures.
+    int64_t captureTimeNow();
+
+    //! Writes frames to a capture file.
+    //! Frames are added to one of two buffers, and a background thread copies each buffer into the memory mapped
+    //! file once it is full, or every 100ms, while the other is filled.  Adding a frame never waits for the disk,
+    //! if both buffers are full it is dropped and counted, unless the writer is set to block.
+
+    class CaptureWriter
+    {
+    public:
+        //! Construct with buffers of 'bufferRecords' records.
+        explicit CaptureWriter(size_t bufferRecords = 8192);
+
+        //! Destructor, closes the file.
+        ~CaptureWriter();
+
+        //! Start writing to a file, replacing any that exists.
+        bool open(const std::string &filename);
+
+        //! Write out what is buffered and close the file.
+        void close();
+
+        //! Check if a file is open.
+        [[nodiscard]] bool isOpen() const { return mOpen; }
+
+        //! Wait for room rather than dropping records, for converting files where nothing may be lost.
+        void setBlocking(bool blocking) { mBlocking = blocking; }
+
+        //! Add a record.  Safe to call from any thread.
+        void append(const CaptureRecordT &record);
+
+        //! Add a set of frames, all at the same time.
+        //! @param timesNs - Time of each frame, or null to use 'timeNs' for all.  Zero entries use 'timeNs' too.
+        //! @param kernelTimes - True if the entries of 'timesNs' are from the kernel.
+        void append(const struct can_frame *frames, size_t count, CaptureDirectionT direction, int64_t timeNs,
+                    const int64_t *timesNs = nullptr, bool kernelTimes = false);
+
+        //! Number of records written to the file.
+        [[nodiscard]] uint64_t recordCount() const { return mRecordCount; }
+
+        //! Number of records dropped because the writer fell behind.
+        [[nodiscard]] uint64_t droppedCount() const { return mDroppedCount; }
+
+    protected:
+        //! Writer thread.
+        void run();
+
+        //! Copy records to the end of the file.
+        bool write(const std::vector<CaptureRecordT> &records);
+
+        size_t mBufferRecords;
+        std::atomic<bool> mOpen = false;
+        std::mutex mMutex;
+        std::condition_variable mCondition;
+        std::vector<CaptureRecordT> mFront; //!< Being filled, protected by mMutex
+        std::vector<CaptureRecordT> mBack; //!< Waiting for or being written, owned by the writer while mBackFull
+        bool mBackFull = false; //!< Protected by mMutex
+        bool mTerminate = false; //!< Protected by mMutex
+        bool mBlocking = false;
+        std::thread mThread;
+
+        MappedFile mFile; //!< Only used by the writer thread while open
+        std::atomic<uint64_t> mRecordCount = 0;
+        std::atomic<uint64_t> mDroppedCount = 0;
+    };
+
+    //! Reads a capture file through a memory mapping.
+    //! A file still being written can be read, refresh() picks up what has been added.
+
+    class CaptureReader
+    {
+    public:
+        //! Open a capture file.
+        bool open(const std::string &filename);
+
+        //! Check if a file starts like a capture.
+        static bool isCapture(const std::string &filename);
+
+        //! Pick up records written since the file was opened or last refreshed.
+        bool refresh();
+
+        //! Close the file.
+        void close() { mFile.close(); mCount = 0; }
+
+        //! Check if a file is open.
+        [[nodiscard]] bool isOpen() const { return mFile.isOpen(); }
+
+        //! Number of records.
+        [[nodiscard]] size_t size() const { return mCount; }
+
+        //! Access a record.
+        [[nodiscard]] const CaptureRecordT &operator[](size_t index) const
+        { return records()[index]; }
+
+        //! The records.
+        [[nodiscard]] const CaptureRecordT *records() const
+        { return reinterpret_cast<const CaptureRecordT *>(mFile.data() + sizeof(CaptureHeaderT)); }
+
+        //! The file header.
+        [[nodiscard]] const CaptureHeaderT &header() const
+        { return *reinterpret_cast<const CaptureHeaderT *>(mFile.data()); }
+
+    protected:
+        MappedFile mFile;
+        size_t mCount = 0;
+    };
+
+} // multivesc
+
+#endif //MULTIVESC_CANCAPTURE_HH
@@ -0,0 +1,116 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#ifndef MULTIVESC_CANDUMPLOG_HH
+#define MULTIVESC_CANDUMPLOG_HH
+
+#include <string>
+#include <string_view>
+#include <cstdio>
+#include <cstdint>
+#include "multivesc/CanCapture.hh"
+
+namespace multivesc {
+
+    // Log files in the format written by 'candump -l' and read by canplayer, one frame per line:
+    //
+    //   (1697712345.123456) can0 00000910#0000176F00010000
+    //
+    // Standard ids have 3 hex digits, extended ids 8.  Remote frames have 'R' in place of the data.  A trailing
+    // 'T' marks a frame the logging host sent, 'R' one it received, as written by 'candump -x'.  CAN FD frames
+    // ('##') are not used by the VESC and are skipped.
+
+    //! Parse a line of a candump log into a capture record.
+    //! @param interface - Set to the interface name in the line, if not null.
+    //! @return False if the line isn't a classic CAN frame.
+    bool parseCandumpLine(const char *line, CaptureRecordT &record, std::string_view *interface = nullptr);
+
+    //! Format a capture record as a line of a candump log, with a newline.
+    //! Sent frames are marked with a trailing 'T'.
+    //! @return Length of the line, which needs at most 64 bytes plus the interface name.
+    size_t formatCandumpLine(const CaptureRecordT &record, std::string_view interface, char *buffer);
+
+    //! Reads a candump log a line at a time, so logs of any size can be streamed.
+    //! Once the end is reached more frames are returned if the file grows, so a log can be followed as it is written.
+
+    class CandumpReader
+    {
+    public:
+        CandumpReader() = default;
+
+        //! Disable copy
+        CandumpReader(const CandumpReader&) = delete;
+        CandumpReader& operator=(const CandumpReader&) = delete;
+
+        //! Destructor, closes the file.
+        ~CandumpReader();
+
+        //! Open a log, "-" for stdin.
+        bool open(const std::string &filename);
+
+        //! Only return frames from this interface, all of them if empty.
+        void setInterface(const std::string &name) { mInterface = name; }
+
+        //! Read the next frame.
+        //! @return False at the end of the file.
+        bool next(CaptureRecordT &record);
+
+        //! Close the file.
+        void close();
+
+        //! Check if a file is open.
+        [[nodiscard]] bool isOpen() const { return mFile != nullptr; }
+
+        //! Number of lines read.
+        [[nodiscard]] uint64_t lineCount() const { return mLineCount; }
+
+        //! Number of lines that were not frames that could be used, such as CAN FD frames.
+        [[nodiscard]] uint64_t skippedCount() const { return mSkippedCount; }
+
+    protected:
+        std::FILE *mFile = nullptr;
+        bool mStdin = false;
+        std::string mInterface;
+        char mLine[512] {};
+        uint64_t mLineCount = 0;
+        uint64_t mSkippedCount = 0;
+    };
+
+    //! Writes a candump log.
+
+    class CandumpWriter
+    {
+    public:
+        CandumpWriter() = default;
+
+        //! Disable copy
+        CandumpWriter(const CandumpWriter&) = delete;
+        CandumpWriter& operator=(const CandumpWriter&) = delete;
+
+        //! Destructor, closes the file.
+        ~CandumpWriter();
+
+        //! Create a log, replacing any that exists.  "-" writes to stdout.
+        //! @param interface - Interface name to put on each frame.
+        bool open(const std::string &filename, const std::string &interface = "can0");
+
+        //! Add a frame.
+        bool write(const CaptureRecordT &record);
+
+        //! Flush and close the file.
+        //! @return False if anything failed to be written.
+        bool close();
+
+        //! Check if a file is open.
+        [[nodiscard]] bool isOpen() const { return mFile != nullptr; }
+
+    protected:
+        std::FILE *mFile = nullptr;
+        bool mStdout = false;
+        std::string mInterface;
+    };
+
+} // multivesc
+
+#endif //MULTIVESC_CANDUMPLOG_HH
@@ -0,0 +1,72 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#ifndef MULTIVESC_CONTROLKERNEL_HH
+#define MULTIVESC_CONTROLKERNEL_HH
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace multivesc {
+
+    enum class MotorDriveT;
+
+    //! A drive command for a single controller, as sent by the update tick.
+    struct DriveCommand
+    {
+        uint8_t controllerId;
+        MotorDriveT mode;
+        float value; //!< Value in the units expected by the BusInterface set function for the mode.
+    };
+
+    //! Clamp and ramp the drive demands of all the motors on a bus in one pass.
+    //! The state for each motor is held in a slot of a set of contiguous arrays, so the loop in run()
+    //! has no branches or indirection and can be vectorised.
+
+    class ControlKernel
+    {
+    public:
+        //! Remove all slots, keeping the allocated memory.
+        void clear();
+
+        //! Add a slot, returning its index.
+        //! Defaults to passing the target straight through.
+        size_t add(uint8_t controllerId, MotorDriveT mode, float target);
+
+        //! Number of slots in use
+        [[nodiscard]] size_t size() const { return mSize; }
+
+        //! Set the limits for a slot.
+        //! @param last - Value sent last time, used for the rate limit.
+        //! @param maxStep - Maximum change from 'last' allowed this tick.
+        //! @param minAbs - Minimum magnitude, below half this the output is zero, otherwise it is raised to this.
+        //! @param maxAbs - Maximum magnitude.
+        //! @param scale - Scale applied to the limited value to give the command value.
+        void setLimits(size_t slot, float last, float maxStep, float minAbs, float maxAbs, float scale);
+
+        //! Compute the limited values for all slots.
+        void run();
+
+        //! The limited value for a slot before scaling, used as 'last' on the next tick.
+        [[nodiscard]] float limited(size_t slot) const { return mLast[slot]; }
+
+        //! Commands produced by the last run, one for each slot.
+        [[nodiscard]] const DriveCommand *commands() const { return mCommands.data(); }
+
+    protected:
+        size_t mSize = 0;
+        std::vector<float> mTarget;
+        std::vector<float> mLast;
+        std::vector<float> mMaxStep;
+        std::vector<float> mMinAbs;
+        std::vector<float> mMaxAbs;
+        std::vector<float> mScale;
+        std::vector<float> mOutput;
+        std::vector<DriveCommand> mCommands;
+    };
+
+} // multivesc
+
+#endif //MULTIVESC_CONTROLKERNEL_HH
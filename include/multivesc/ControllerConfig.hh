@@ -0,0 +1,157 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#ifndef MULTIVESC_CONTROLLERCONFIG_HH
+#define MULTIVESC_CONTROLLERCONFIG_HH
+
+#include <string>
+#include <vector>
+#include <array>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+#include "multivesc/BusInterface.hh"
+
+namespace multivesc {
+
+    //! Which of the controller's configurations to use.
+    enum class ControllerConfigT
+    {
+        MCCONF,
+        APPCONF
+    };
+
+    //! Convert a ControllerConfigT to a string
+    std::string to_string(ControllerConfigT type);
+
+    //! Convert a string to a ControllerConfigT
+    //! @return False if the string is not recognized.
+    bool controllerConfigFromString(const std::string &str, ControllerConfigT &type);
+
+    //! Firmware details from the reply to COMM_FW_VERSION.
+    struct FirmwareInfoT
+    {
+        int major = 0;
+        int minor = 0;
+        std::string hardware;
+        std::string uuid; //!< As hex
+    };
+
+    //! Decode the reply to COMM_FW_VERSION.
+    bool parseFirmwareVersion(const std::vector<uint8_t> &reply, FirmwareInfoT &info);
+
+    //! Which CAN status packets a controller sends, and how often, as held in its app configuration.
+    //! The firmware has two rates, each packet is sent at one of them or not at all.
+    struct CanStatusConfigT
+    {
+        uint16_t rate1 = 0; //!< Hz
+        uint16_t rate2 = 0; //!< Hz
+        uint8_t msgs1 = 0; //!< Packets sent at rate1, bit n is STATUS_(n+1)
+        uint8_t msgs2 = 0; //!< Packets sent at rate2
+    };
+
+    //! Byte offsets of the CAN settings in the serialised app configuration.
+    //! The defaults are for firmware 6.x, other versions may differ.
+    struct AppconfLayoutT
+    {
+        size_t controllerId = 4;
+        size_t statusRate1 = 13;
+        size_t statusRate2 = 15;
+        size_t statusMsgs1 = 17;
+        size_t statusMsgs2 = 18;
+    };
+
+    //! Read the layout from json, missing entries keep their defaults.
+    AppconfLayoutT appconfLayoutFromJson(const json &config);
+
+    //! Read CAN status rates given as {"status1": Hz, ...}, packets not listed aren't sent.
+    //! @return False if a packet name isn't recognized.
+    bool canStatusRatesFromJson(const json &config, std::array<float, 6> &rates);
+
+    //! Work out the settings that send each packet at the rate asked for.
+    //! Packets with a rate of zero are not sent.
+    //! @return False if more than two different rates are asked for.
+    bool canStatusFromRates(const std::array<float, 6> &rates, CanStatusConfigT &status);
+
+    //! Get the CAN status settings from a serialised app configuration.
+    bool getCanStatus(const std::vector<uint8_t> &appconf, const AppconfLayoutT &layout, CanStatusConfigT &status);
+
+    //! Change the CAN status settings in a serialised app configuration.
+    bool setCanStatus(std::vector<uint8_t> &appconf, const AppconfLayoutT &layout, const CanStatusConfigT &status);
+
+    //! A controller to read or write the configuration of.
+    struct ConfigTargetT
+    {
+        std::string name;
+        std::shared_ptr<BusInterface> bus;
+        uint8_t id = 0;
+    };
+
+    //! Reads and writes the configuration of many controllers at once, keeping a copy of each.
+    //! Configurations are kept as the serialised bytes sent by the firmware, keyed by the controller's UUID and
+    //! firmware version, along with a hash so they can be compared quickly.  The copies can be saved to a file.
+
+    class ControllerConfig
+    {
+    public:
+        ControllerConfig() = default;
+
+        //! Set the file the copies are kept in, loading it if it exists.
+        bool setCacheFile(const std::string &filename);
+
+        //! Save the copies to the cache file.
+        bool save();
+
+        //! Read the configuration of a set of controllers.
+        //! The firmware version of each is checked first, if 'useCache' is true controllers with a copy for the same
+        //! firmware aren't read again, so changes made on them since the copy was taken aren't seen.
+        //! @return An entry for each target by name, with 'ok', 'id', 'uuid', 'firmware', 'hash', 'cached',
+        //! 'verified' (read from the controller), 'changed' (the hash differs from the copy, null if not verified)
+        //! and 'data' (as hex).
+        json read(const std::vector<ConfigTargetT> &targets, ControllerConfigT type, bool useCache = true);
+
+        //! Write configurations, given as hex by target name.
+        //! Each controller is read first and only written if it differs, then read back to check it took.
+        //! @return An entry for each target by name, with 'ok', 'written' and 'hash'.
+        json write(const std::vector<ConfigTargetT> &targets, ControllerConfigT type, const json &configs);
+
+        //! Set which CAN status packets each controller sends, given by target name.
+        //! The app configurations are read, changed and written back to the controllers that need it.  The
+        //! controller id in each is checked against the target first, to catch a layout that doesn't match
+        //! the firmware.
+        //! @return An entry for each target by name, with 'ok', 'written' and 'hash'.
+        json setCanStatus(const std::vector<ConfigTargetT> &targets, const std::map<std::string, CanStatusConfigT> &settings,
+                          const AppconfLayoutT &layout = {});
+
+        //! Hash of a configuration.
+        static std::string hash(const std::vector<uint8_t> &data);
+
+    protected:
+        //! Read the targets on one bus.
+        json readBus(const std::shared_ptr<BusInterface> &bus, const std::vector<const ConfigTargetT *> &targets,
+                     ControllerConfigT type, bool useCache);
+
+        //! Write the targets on one bus.
+        json writeBus(const std::shared_ptr<BusInterface> &bus, const std::vector<const ConfigTargetT *> &targets,
+                      ControllerConfigT type, const json &configs);
+
+        //! Key for a controller's configuration in the cache.
+        static std::string cacheKey(const FirmwareInfoT &info, ControllerConfigT type);
+
+        //! Store a configuration in the cache.
+        //! @return True if it differs from the copy that was there.
+        bool store(const std::string &key, const std::vector<uint8_t> &data);
+
+        std::mutex mMutex;
+        std::string mCacheFile;
+        json mCache = json::object(); //!< Protected by mMutex
+        float mTimeout = 2.0f;
+        float mWriteTimeout = 5.0f;
+    };
+
+} // multivesc
+
+#endif //MULTIVESC_CONTROLLERCONFIG_HH
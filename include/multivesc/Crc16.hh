@@ -0,0 +1,39 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#ifndef MULTIVESC_CRC16_HH
+#define MULTIVESC_CRC16_HH
+
+#include <cstdint>
+#include <cstddef>
+
+namespace multivesc {
+
+    // CRC16 with the XMODEM parameters (polynomial 0x1021, no reflection, initial value 0) as used by VESC packets
+    // and firmware images. The tables are generated at compile time.
+    // For each function 'crc' is the value from a previous block, to calculate the CRC over several blocks.
+
+    //! Byte at a time, best for a few bytes.
+    uint16_t crc16Bytewise(const uint8_t *data, size_t len, uint16_t crc = 0);
+
+    //! Eight bytes at a time using eight tables.
+    uint16_t crc16Slice8(const uint8_t *data, size_t len, uint16_t crc = 0);
+
+    //! Check if the carry-less multiply version can be used on this CPU.
+    bool crc16ClmulSupported();
+
+    //! Fold 64 bytes at a time with carry-less multiplies, for large buffers.
+    //! Only call this if crc16ClmulSupported() returns true.
+    uint16_t crc16Clmul(const uint8_t *data, size_t len, uint16_t crc = 0);
+
+    //! Pick the fastest version for the length and CPU.
+    uint16_t crc16(const uint8_t *data, size_t len, uint16_t crc = 0);
+
+    //! Let crc16() use the carry-less multiply version when the CPU supports it, the default, or make it use the
+    //! version for CPUs without, to test it.
+    void crc16AllowClmul(bool allow);
+
+} // multivesc
+
+#endif //MULTIVESC_CRC16_HH
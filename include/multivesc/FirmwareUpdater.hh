@@ -0,0 +1,120 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#ifndef MULTIVESC_FIRMWAREUPDATER_HH
+#define MULTIVESC_FIRMWAREUPDATER_HH
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+#include "multivesc/BusInterface.hh"
+
+namespace multivesc {
+
+    //! Upload new firmware to the controllers on a bus.
+    //! The image is written to the controllers' new app area with COMM_ERASE_NEW_APP and COMM_WRITE_NEW_APP_DATA,
+    //! then COMM_JUMP_TO_BOOTLOADER has the bootloader check its CRC and install it.
+    //! All controllers are written at once, with several chunks in flight to each, so the time taken is set by
+    //! the bandwidth of the bus rather than the round trip time.  Progress can be saved to a file so an
+    //! interrupted upload carries on where it left off.
+
+    class FirmwareUpdater
+    {
+    public:
+        //! Construct for a bus, which must be open.
+        explicit FirmwareUpdater(std::shared_ptr<BusInterface> bus);
+
+        //! Load the firmware image from a file, as built for the controller.
+        bool loadImage(const std::string &filename);
+
+        //! Set the firmware image.
+        void setImage(std::vector<uint8_t> firmware);
+
+        //! Set the number of bytes written in each packet, default 384.
+        void setChunkSize(size_t size) { mChunkSize = std::max<size_t>(size, 1); }
+
+        //! Set the number of chunks that may be waiting for an acknowledgement from each controller, default 2.
+        void setPipelineDepth(size_t depth) { mPipelineDepth = std::max<size_t>(depth, 1); }
+
+        //! Set the file progress is saved to.  If it is for the same image the upload resumes from it.
+        void setResumeFile(const std::string &filename) { mResumeFile = filename; }
+
+        //! Set the time in seconds to wait for each chunk to be acknowledged, default 0.5.
+        void setTimeout(float timeout) { mTimeout = timeout; }
+
+        //! Set the time in seconds to wait for the flash to be erased, default 20.
+        void setEraseTimeout(float timeout) { mEraseTimeout = timeout; }
+
+        //! Set the number of times a chunk is written again after it fails before the controller is given up on,
+        //! default 3.
+        void setRetries(int retries) { mRetries = retries; }
+
+        //! Set a function called as chunks are acknowledged, with the controller, bytes done and the total.
+        void setProgressCallback(std::function<void(uint8_t controllerId, size_t done, size_t total)> callback)
+        { mProgressCallback = std::move(callback); }
+
+        //! Upload the image to a set of controllers.
+        //! @param jump - If true, tell each controller that got the whole image to install it.  The controller a
+        //!               bus is attached to, such as the one on a serial port, is told last.
+        //! @return True if all the controllers got the whole image.
+        bool upload(const std::vector<uint8_t> &controllerIds, bool jump = true);
+
+        //! Get the result of the last upload: 'controllers' with an entry for each by id, with 'ok', 'installed',
+        //! 'erased', 'bytes' and 'total', then 'time' in seconds and 'throughput' in bytes a second.
+        [[nodiscard]] json results() const { return mResults; }
+
+        //! The image as written, the firmware with its size and CRC in front.
+        [[nodiscard]] const std::vector<uint8_t> &image() const { return mImage; }
+
+    protected:
+        //! State of the upload to one controller.
+        struct TargetT
+        {
+            uint8_t id = 0;
+            bool erased = false;
+            bool failed = false;
+            bool installed = false; //!< Told to install the image by an earlier upload
+            std::vector<bool> done; //!< Chunks acknowledged
+            std::vector<size_t> todo; //!< Chunks to send, in reverse order
+            size_t bytesDone = 0;
+            std::vector<int> failures; //!< Failed writes of each chunk
+        };
+
+        //! Erase the new app area on the targets that need it, all at once.
+        void erase(std::vector<TargetT> &targets);
+
+        //! Write all chunks to the targets.
+        void write(std::vector<TargetT> &targets);
+
+        //! Read progress from the resume file, if it matches the image.
+        void loadProgress(std::vector<TargetT> &targets);
+
+        //! Save progress to the resume file.
+        void saveProgress(const std::vector<TargetT> &targets);
+
+        //! Check if a chunk is all 0xFF, so doesn't need writing to erased flash.
+        [[nodiscard]] bool blankChunk(size_t chunk) const;
+
+        [[nodiscard]] size_t chunkCount() const { return (mImage.size() + mChunkSize - 1) / mChunkSize; }
+
+        std::shared_ptr<BusInterface> mBus;
+        std::vector<uint8_t> mImage;
+        uint16_t mFirmwareCrc = 0;
+        size_t mChunkSize = 384;
+        size_t mPipelineDepth = 2;
+        float mTimeout = 0.5f;
+        float mEraseTimeout = 20.0f;
+        int mRetries = 3;
+        std::string mResumeFile;
+        std::function<void(uint8_t, size_t, size_t)> mProgressCallback;
+        json mResults;
+    };
+
+} // multivesc
+
+#endif //MULTIVESC_FIRMWAREUPDATER_HH
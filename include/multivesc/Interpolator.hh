@@ -0,0 +1,83 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#ifndef MULTIVESC_INTERPOLATOR_HH
+#define MULTIVESC_INTERPOLATOR_HH
+
+#include <string>
+#include <chrono>
+
+namespace multivesc {
+
+    //! Interpolation modes for setpoints
+    enum class InterpolationT
+    {
+        NONE,
+        LINEAR,
+        CUBIC
+    };
+
+    //! Convert a InterpolationT to a string
+    std::string to_string(InterpolationT type);
+
+    //! Convert a string to a InterpolationT
+    //! If the string is not recognized, InterpolationT::NONE is returned.
+    InterpolationT interpolationFromString(const std::string& str);
+
+    //! Upsample setpoints that arrive at a low rate from a client.
+    //! When a new setpoint arrives the output moves from its current value to the new one over the
+    //! estimated interval between client updates, so the output lags the client by one update but stays smooth.
+    //! Once the new value is reached the recent trend is extrapolated for up to the horizon, then held.
+
+    class SetpointInterpolator
+    {
+    public:
+        using TimePointT = std::chrono::steady_clock::time_point;
+
+        //! Set the interpolation mode
+        void setMode(InterpolationT mode) { mMode = mode; }
+
+        //! Get the interpolation mode
+        [[nodiscard]] InterpolationT mode() const { return mMode; }
+
+        //! Set the maximum time in seconds to extrapolate past the last setpoint.
+        void setHorizon(float seconds) { mHorizon = seconds; }
+
+        //! Get the extrapolation horizon in seconds.
+        [[nodiscard]] float horizon() const { return mHorizon; }
+
+        //! Jump straight to a value, forgetting any history.
+        void reset(float value, TimePointT now);
+
+        //! Add a new setpoint from the client.
+        void push(float value, TimePointT now);
+
+        //! Get the interpolated setpoint at a time.
+        [[nodiscard]] float evaluate(TimePointT now) const;
+
+    protected:
+        //! Get the slope of the output at a time.
+        [[nodiscard]] float slope(TimePointT now) const;
+
+        InterpolationT mMode = InterpolationT::NONE;
+        float mHorizon = 0.0f;
+        bool mValid = false;
+
+        // Client history
+        TimePointT mLastPushTime;
+        float mLastTarget = 0.0f;
+        float mInterval = 0.0f; //!< Smoothed interval between client updates in seconds
+
+        // Segment being followed
+        TimePointT mStartTime;
+        float mStartValue = 0.0f;
+        float mStartSlope = 0.0f;
+        float mTarget = 0.0f;
+        float mTargetSlope = 0.0f;
+        float mDuration = 0.0f;
+    };
+
+} // multivesc
+
+#endif //MULTIVESC_INTERPOLATOR_HH
@@ -0,0 +1,81 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#ifndef MULTIVESC_LATENCYHISTOGRAM_HH
+#define MULTIVESC_LATENCYHISTOGRAM_HH
+
+#include <array>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+
+namespace multivesc {
+
+    using json = nlohmann::json;
+
+    //! Histogram of latencies with logarithmically sized buckets, so percentiles can be found without keeping
+    //! every sample.  Each power of two nanoseconds is split into SubBuckets equal buckets, so a value is known to
+    //! within about 6% over the whole range from a nanosecond to about 18 minutes.  Longer times go in the last bucket.
+    //! It isn't thread safe, the owner must lock around it.
+
+    class LatencyHistogram
+    {
+    public:
+        static constexpr unsigned SubBucketBits = 4;
+        static constexpr unsigned SubBuckets = 1u << SubBucketBits;
+        static constexpr unsigned MaxBits = 40;
+        static constexpr unsigned NumBuckets = (MaxBits - SubBucketBits + 1) * SubBuckets;
+
+        //! Add a sample, negative times count as zero.
+        void record(std::chrono::steady_clock::duration latency);
+
+        //! Add the samples from another histogram.
+        void merge(const LatencyHistogram &other);
+
+        //! Remove all samples.
+        void clear();
+
+        //! Number of samples.
+        [[nodiscard]] uint64_t count() const { return mCount; }
+
+        //! Latency in seconds that fraction 'p' of the samples are at or below, 0 to 1.
+        //! The middle of the bucket is given, limited to the smallest and largest samples.  Zero if there are none.
+        [[nodiscard]] float percentile(float p) const;
+
+        //! Smallest sample in seconds, zero if there are none.
+        [[nodiscard]] float min() const;
+
+        //! Largest sample in seconds, zero if there are none.
+        [[nodiscard]] float max() const;
+
+        //! Mean of the samples in seconds, zero if there are none.
+        [[nodiscard]] float mean() const;
+
+        //! The buckets with samples in, as pairs of the upper bound of the bucket in seconds and the count.
+        [[nodiscard]] std::vector<std::pair<float, uint64_t>> buckets() const;
+
+        //! Summary with the count, min, mean, p50, p90, p99 and max, times in seconds.
+        [[nodiscard]] json summary() const;
+
+        //! Bucket a latency in nanoseconds falls in.
+        static unsigned bucketIndex(uint64_t ns);
+
+        //! Smallest latency in nanoseconds in a bucket.
+        static uint64_t bucketLower(unsigned index);
+
+        //! Width of a bucket in nanoseconds.
+        static uint64_t bucketWidth(unsigned index);
+
+    protected:
+        std::array<uint64_t, NumBuckets> mBuckets {};
+        uint64_t mCount = 0;
+        uint64_t mMinNs = 0;
+        uint64_t mMaxNs = 0;
+        double mSumNs = 0.0;
+    };
+
+} // multivesc
+
+#endif //MULTIVESC_LATENCYHISTOGRAM_HH
@@ -9,6 +9,10 @@
 #include <nlohmann/json.hpp>
 #include "multivesc/BusInterface.hh"
 #include "multivesc/Motor.hh"
+#include "multivesc/Trajectory.hh"
+#include "multivesc/TimerWheel.hh"
+#include "multivesc/ControllerConfig.hh"
+#include "multivesc/TelemetryLogger.hh"
 
 namespace multivesc {
 
@@ -40,9 +44,32 @@ namespace multivesc {
         //! Open a CAN port
         bool openCan(const std::string& port);
 
+        //! Create a bus from its config, using the 'type' entry.
+        //! @return nullptr if the type isn't known.
+        static std::shared_ptr<BusInterface> createBus(const json &config);
+
+        //! Add a bus under a name.
+        //! The bus is opened when the manager is started.
+        bool addBus(const std::string& name, std::shared_ptr<BusInterface> bus);
+
         //! Find bus
         [[nodiscard]] std::shared_ptr<BusInterface> getBus(const std::string& name);
 
+        //! Get statistics for all buses, keyed by bus name.
+        [[nodiscard]] json busStats();
+
+        //! Get the command to telemetry latency of each motor being traced, keyed by motor name.
+        [[nodiscard]] json latencyStats();
+
+        //! Log the values of all motors, including ones added later, to column files.  See TelemetryLogger.
+        bool startTelemetryLog(const json &config);
+
+        //! Stop logging values, writing out what is queued.
+        void stopTelemetryLog();
+
+        //! Get statistics for the telemetry log, empty if there isn't one.
+        [[nodiscard]] json telemetryLogStats();
+
         //! Find a motor by name
         //! Returns nullptr if the motor is not found
         [[nodiscard]] std::shared_ptr<Motor> getMotor(const std::string& name);
@@ -61,9 +88,63 @@ namespace multivesc {
         [[nodiscard]] bool verbose() const
         { return mVerbose; }
 
+        //! Set the rate at which motor setpoints are sent, in Hz.
+        void setUpdateRate(float hz);
+
+        //! Get the rate at which motor setpoints are sent, in Hz.
+        [[nodiscard]] float updateRate() const;
+
+        //! Lock motor updates to the arrival of their status frames.
+        //! When enabled each update is moved to just after the status frame expected nearest to it, so commands are
+        //! computed from the freshest data. Motors without a regular status stream keep their normal schedule.
+        //! @param enable - Enable phase locking.
+        //! @param guard - Time in seconds to wait after the predicted arrival.
+        void setPhaseLock(bool enable, float guard = 0.0005f);
+
+        //! Check if motor updates are locked to status frames.
+        [[nodiscard]] bool phaseLock() const { return mPhaseLock; }
+
         //! Get all motors
         [[nodiscard]] std::vector<std::shared_ptr<Motor>> motors() const;
 
+        //! Start a set of trajectories on named motors with a shared time base.
+        //! All trajectories start together after 'startDelay' seconds. If any motor can't follow its
+        //! trajectory none are started.
+        bool startTrajectories(const std::map<std::string, std::shared_ptr<const Trajectory>> &trajectories, float startDelay = 0.0f);
+
+        //! Stop all trajectories, the motors hold their current values.
+        void stopTrajectories();
+
+        //! Read the 'mcconf' or 'appconf' configuration of all motors at once.
+        //! Copies are kept by controller and firmware version, if 'useCache' is true controllers that have one
+        //! aren't read again, the copy is returned unverified with 'changed' null, so a configuration changed on the
+        //! controller since, by VESC Tool say, isn't seen.  See ControllerConfig::read() for the result.
+        [[nodiscard]] json readControllerConfigs(const std::string &type, bool useCache = true);
+
+        //! Write the 'mcconf' or 'appconf' configuration of motors, given as hex by motor name.
+        //! Only controllers whose configuration differs are written, each is read back to check it.
+        //! See ControllerConfig::write() for the result.
+        [[nodiscard]] json writeControllerConfigs(const std::string &type, const json &configs);
+
+        //! Check which controllers are on each bus, all buses at once.
+        //! @param allIds - Look for all ids rather than just those of the configured motors.
+        //! @param timeout - Time in seconds to wait for replies.
+        //! @return For each bus, the ids 'found', the names of 'missing' motors and the 'unknown' ids that
+        //! don't belong to a motor.
+        [[nodiscard]] json scanBuses(bool allIds = false, float timeout = 0.1f);
+
+        //! Write the CAN status rates of each enabled motor that has them to its controller.
+        //! Only controllers whose settings differ are written, and each is read back to check.
+        //! @return An entry for each motor by name, with 'ok', 'written' and 'hash', or 'error' if it failed.  Motors
+        //! asking for more rates than the firmware has are not written, and have 'ok' false.
+        [[nodiscard]] json configureCanStatus();
+
+        //! Set where the CAN settings are in the app configuration, for firmware that differs from the default.
+        void setAppconfLayout(const AppconfLayoutT &layout) { mAppconfLayout = layout; }
+
+        //! Set the file copies of controller configurations are kept in.
+        bool setConfigCacheFile(const std::string &filename) { return mControllerConfig.setCacheFile(filename); }
+
     protected:
         //! Add a motor to the manager
         bool register_motor(Motor &motor);
@@ -71,14 +152,45 @@ namespace multivesc {
         //! Update thread
         void runUpdate();
 
+        //! Update the motors that are due, and schedule their next update.
+        //! Must be called with mMutex held.
+        void updateDue(std::chrono::steady_clock::time_point now);
+
+        //! Get the controllers of all motors, to read or write their configuration.
+        [[nodiscard]] std::vector<ConfigTargetT> configTargets() const;
+
+        //! Get the update period for a motor.
+        [[nodiscard]] std::chrono::steady_clock::duration updatePeriod(const Motor &motor) const;
+
+        //! Schedule entry for a motor
+        struct ScheduleEntry
+        {
+            std::shared_ptr<Motor> motor;
+            BusInterface *bus = nullptr;
+            std::chrono::steady_clock::time_point due;
+        };
+
         std::atomic<bool> mTerminate = false;
         bool mVerbose = false;
         std::thread mUpdateThread;
+        std::atomic<std::chrono::steady_clock::duration> mUpdatePeriod = std::chrono::steady_clock::duration(std::chrono::milliseconds(50));
+        std::atomic<bool> mPhaseLock = false;
+        std::atomic<std::chrono::steady_clock::duration> mPhaseLockGuard = std::chrono::steady_clock::duration(std::chrono::microseconds(500));
         mutable std::mutex mMutex;
 
         std::map<std::string, std::shared_ptr<BusInterface>> mBusMap;
         std::vector<std::shared_ptr<Motor>> mMotors;
 
+        // Scheduling of motor updates, protected by mMutex.
+        TimerWheel mTimerWheel;
+        std::vector<ScheduleEntry> mSchedule; //!< Indexed by timer handle
+        std::vector<uint32_t> mExpired;
+        std::vector<std::pair<BusInterface *, std::vector<Motor *>>> mDueByBus;
+
+        ControllerConfig mControllerConfig;
+        std::shared_ptr<TelemetryLogger> mTelemetryLog; //!< Protected by mMutex
+        AppconfLayoutT mAppconfLayout;
+
         friend class Motor;
     };
 
@@ -0,0 +1,99 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#ifndef MULTIVESC_MAPPEDFILE_HH
+#define MULTIVESC_MAPPEDFILE_HH
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+namespace multivesc {
+
+    //! A file mapped into memory, either written by appending or read.
+    //! When writing, the file is extended in large steps so the mapping rarely has to move, and cut back to
+    //! the length used when it is closed.  Other processes can map it and read what has been written so far.
+    //! It isn't thread safe, the owner must lock around it.
+
+    class MappedFile
+    {
+    public:
+        MappedFile() = default;
+
+        //! Disable copy
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        //! Destructor, closes the file.
+        ~MappedFile();
+
+        //! Create a file for writing, replacing any that exists.
+        bool create(const std::string &filename, size_t growStep = 16 * 1024 * 1024);
+
+        //! Open an existing file to carry on writing it, mapping all of it.  Everything is taken as used until
+        //! setUsed() says otherwise.
+        bool openAppend(const std::string &filename, size_t growStep = 16 * 1024 * 1024);
+
+        //! Open an existing file for reading.
+        bool openRead(const std::string &filename);
+
+        //! Map any part of the file added since it was opened, for files written by another process.
+        //! Pointers from data() are invalid after this.
+        bool refresh();
+
+        //! Make sure there is room for 'length' bytes, extending the file if needed.
+        //! Pointers from data() are invalid after this.
+        bool reserve(size_t length);
+
+        //! Copy bytes to the end of what has been written, extending the file if needed.
+        bool append(const void *bytes, size_t length);
+
+        //! Mark bytes written directly to data() as used.
+        void setUsed(size_t used) { mUsed = used; }
+
+        //! Close the file, when writing it is cut to the length used.
+        void close();
+
+        //! Close the descriptor of a file being written, the mapping stays.  The file is opened again by name for
+        //! the moment it has to be extended or cut back, so many files can be written without holding a
+        //! descriptor each.  The file must not be renamed while it is open.
+        void releaseDescriptor();
+
+        //! Check if a file is open.
+        [[nodiscard]] bool isOpen() const { return mOpen; }
+
+        //! Start of the mapping.
+        [[nodiscard]] uint8_t *data() { return mMap; }
+        [[nodiscard]] const uint8_t *data() const { return mMap; }
+
+        //! Bytes written so far, or the length of the file when reading.
+        [[nodiscard]] size_t used() const { return mUsed; }
+
+        //! Bytes mapped.
+        [[nodiscard]] size_t mapped() const { return mMapped; }
+
+    protected:
+        //! Map the first 'length' bytes of the file, replacing any existing mapping.
+        bool map(size_t length);
+
+        //! Open the file again if its descriptor was released.
+        bool acquireDescriptor();
+
+        //! Close the descriptor again if it was released.
+        void dropDescriptor();
+
+        int mFd = -1;
+        bool mOpen = false;
+        bool mReleased = false; //!< The descriptor is only open while it is needed
+        bool mWritable = false;
+        uint8_t *mMap = nullptr;
+        size_t mMapped = 0;
+        size_t mUsed = 0;
+        size_t mGrowStep = 0;
+        std::string mFilename;
+    };
+
+} // multivesc
+
+#endif //MULTIVESC_MAPPEDFILE_HH
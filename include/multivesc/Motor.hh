@@ -6,12 +6,19 @@
 #define MUTLIVESC_MOTOR_HH
 
 #include <atomic>
+#include <array>
 #include <string>
 #include "multivesc/BusInterface.hh"
+#include "multivesc/Interpolator.hh"
+#include "multivesc/ControlKernel.hh"
+#include "multivesc/ArrivalEstimator.hh"
+#include "multivesc/LatencyHistogram.hh"
 
 namespace multivesc {
 
     class Manager;
+    class Trajectory;
+    class TelemetryStream;
 
     //! List of motor sensor value types
     enum class MotorValuesT
@@ -35,6 +42,19 @@ namespace multivesc {
         PPM
     };
 
+    //! Number of MotorValuesT values.
+    constexpr size_t NumValueTypes = size_t(MotorValuesT::PPM) + 1;
+
+    //! Rate in Hz of each CAN status packet, STATUS_1 to STATUS_6.
+    using CanStatusRatesT = std::array<float, 6>;
+
+    //! Convert a MotorValuesT to a string
+    std::string to_string(MotorValuesT type);
+
+    //! Convert a string to a MotorValuesT
+    //! @return False if the string is not recognized.
+    bool valueTypeFromString(const std::string& str, MotorValuesT &type);
+
     //! Drive modes for the motor controller
     enum class MotorDriveT
     {
@@ -96,6 +116,29 @@ namespace multivesc {
         //! The acceleration is in RPM per second. Negative values disable acceleration limiting.
         void setMaxRPMAcceleration(float rpm_per_sec);
 
+        //! Set the drive timeout in seconds.
+        //! If no new setpoint is received within this time the motor is switched to its safe command.
+        //! Values of zero or less disable the timeout.
+        void setDriveTimeout(float seconds);
+
+        //! Get the drive timeout in seconds.
+        [[nodiscard]] float driveTimeout() const;
+
+        //! Number of times the drive timeout has tripped.
+        [[nodiscard]] uint32_t driveTimeoutCount() const { return mDriveTimeoutCount; }
+
+        //! Set how setpoints are interpolated between client updates.
+        //! @param mode - Interpolation mode, InterpolationT::NONE sends setpoints as they arrive.
+        //! @param horizon - Maximum time in seconds to extrapolate the trend past the last setpoint.
+        void setInterpolation(InterpolationT mode, float horizon = 0.0f);
+
+        //! Set the rate at which setpoints are sent to this motor in Hz.
+        //! Zero or less uses the manager's update rate.
+        void setUpdateRate(float hz);
+
+        //! Get the rate at which setpoints are sent to this motor in Hz, zero if the manager's rate is used.
+        [[nodiscard]] float updateRate() const;
+
         //! Set the duty cycle of the motor controller. The duty cycle is a value between -1 and 1.
         void setDuty(float duty);
 
@@ -135,6 +178,12 @@ namespace multivesc {
         //! Access motor id as used on the bus
         [[nodiscard]] uint8_t id() const { return mId; }
 
+        //! Enable or disable the motor, a disabled motor is sent no commands.
+        void setEnabled(bool enabled) { mEnabled = enabled; }
+
+        //! Check if the motor is enabled.
+        [[nodiscard]] bool enabled() const { return mEnabled; }
+
         //! Access motor speed in RPM
         [[nodiscard]] float rpm() const { return mERpm / mNumPolePairs; }
 
@@ -186,13 +235,154 @@ namespace multivesc {
         //! Access motor PPM
         [[nodiscard]] float ppm() const { return mPPM; }
 
+        //! Follow a trajectory, starting at the given time.
+        //! The trajectory mode must match the motor's control mode. Any new setpoint from the user cancels the trajectory.
+        //! The last value is held when it finishes, without the drive timeout, until a new setpoint is set.
+        bool setTrajectory(std::shared_ptr<const Trajectory> trajectory, std::chrono::steady_clock::time_point start);
+
+        //! Stop following the current trajectory, the last value is held.
+        void clearTrajectory();
+
+        //! Check if a trajectory is being followed.
+        [[nodiscard]] bool trajectoryActive();
+
+        //! Smoothed time in seconds from a status frame arriving to the next command being sent.
+        [[nodiscard]] float statusLatency() const;
+
+        //! Largest time in seconds from a status frame arriving to the next command being sent.
+        [[nodiscard]] float statusLatencyMax() const;
+
+        //! Estimated period between status frames in seconds, zero if not known yet.
+        [[nodiscard]] float statusPeriod() const;
+
+        //! Trace the time from each change of setpoint to the first status showing the motor reacting to it.
+        //! A trace starts when the command sent has moved at least 'minStep' from the one the last trace started at,
+        //! in the units sent to the controller: ERPM, Amps, duty cycle or degrees.  Zero or less uses a default for
+        //! the mode.  It ends at the first status where the measured value has moved 'fraction' of the step from
+        //! where it was when the command was sent, or is given up after 'timeout' seconds.  Only one trace is
+        //! followed at a time.  The transmit time is taken by the kernel on buses that support it.
+        void enableLatencyTrace(float minStep = 0.0f, float fraction = 0.2f, float timeout = 1.0f);
+
+        //! Stop tracing, the histograms are kept.
+        void disableLatencyTrace();
+
+        //! Check if latency tracing is on.
+        [[nodiscard]] bool latencyTraceEnabled() const { return mTraceEnabled; }
+
+        //! Times from a command being transmitted to the first status reflecting it.
+        [[nodiscard]] LatencyHistogram responseLatency() const;
+
+        //! Times from a setpoint being given to the first status reflecting it, including any interpolation,
+        //! rate limiting and waiting for the update tick.
+        [[nodiscard]] LatencyHistogram setpointLatency() const;
+
+        //! Summary of both histograms, with the number of traces given up and how many used kernel timestamps.
+        [[nodiscard]] json latencyStats() const;
+
+        //! Clear the latency histograms and counts.
+        void clearLatencyStats();
+
+        //! Set the rate in Hz a value is wanted at, on buses where values have to be polled.
+        //! Only the values with a rate are requested. Until a rate is set for any value the bus default is used.
+        //! Zero or less stops the value being polled.
+        void setTelemetryRate(MotorValuesT type, float hz);
+
+        //! Get the rate in Hz a value is polled at, zero if it isn't.
+        [[nodiscard]] float telemetryRate(MotorValuesT type) const;
+
+        //! Check if any telemetry rates have been set.
+        [[nodiscard]] bool hasTelemetryRates() const { return mHasTelemetryRates; }
+
+        //! Set the rate in Hz the controller should send each CAN status packet at, STATUS_1 to STATUS_6.
+        //! Zero stops a packet being sent.  These are written to the controller by Manager::configureCanStatus().
+        void setCanStatusRates(const CanStatusRatesT &rates);
+
+        //! Get the CAN status rates wanted.
+        //! @return False if none have been set.
+        bool canStatusRates(CanStatusRatesT &rates) const;
+
         //! Set up a callback function to be called when the motor status is updated.
         void setCallback(std::function<void(MotorValuesT,float)> callback);
+
+        //! Pass each value to a telemetry log as well as the callback, null to stop.  See TelemetryLogger.
+        void setTelemetryStream(std::shared_ptr<TelemetryStream> stream);
+
+        //! Run a control function straight from the receive path when a value arrives, rather than waiting for the update tick.
+        //! The function returns a new setpoint in the motor's control mode which is sent immediately, with the same limits
+        //! as the update tick. Other values from the same status frame are already updated when it is called.
+        //! If the function takes longer than 'budget' seconds, or returns a value that isn't finite, the result is discarded
+        //! and counted as an overrun. After 3 overruns in a row reactive control is switched off.
+        //! @param trigger - Value whose arrival runs the function.
+        //! @param control - Function computing the new setpoint. It is called on the receive thread so must not block.
+        //! @param budget - Time allowed for the function in seconds.
+        bool setReactiveControl(MotorValuesT trigger, std::function<float(const Motor &)> control, float budget = 0.0001f);
+
+        //! Stop reactive control, the motor goes back to setpoints from the user.
+        void clearReactiveControl();
+
+        //! Check if reactive control is running.
+        [[nodiscard]] bool reactiveControlActive() const { return mReactiveActive; }
+
+        //! Number of times the reactive control function has been run.
+        [[nodiscard]] uint32_t reactiveRunCount() const { return mReactiveRunCount; }
+
+        //! Number of times the reactive control function overran its budget.
+        [[nodiscard]] uint32_t reactiveOverrunCount() const { return mReactiveOverrunCount; }
+
+        //! Longest time in seconds the reactive control function has taken.
+        [[nodiscard]] float reactiveMaxTime() const { return mReactiveMaxTime; }
     protected:
         void doCallback(MotorValuesT type, float value);
 
-        //! Do an update.
-        void update();
+        //! Run the reactive control function if 'type' is its trigger, and send the result.
+        void runReactiveControl(MotorValuesT type);
+
+        //! Held from prepareUpdate() to completeUpdate(), so the update tick and reactive control send one at a time.
+        std::mutex mSendMutex;
+
+        //! Stage the drive demand for an update tick.
+        //! The caller must hold mSendMutex until completeUpdate() has been called.
+        //! @param now - Time of the update tick, shared by all motors updated in the tick.
+        //! @param kernel - Kernel to add the demand to.
+        //! @param slot - Set to the slot used in the kernel.
+        //! @return True if there is a command to send.
+        bool prepareUpdate(std::chrono::steady_clock::time_point now, ControlKernel &kernel, size_t &slot);
+
+        //! Record the value sent after the kernel has been run.
+        //! @param now - Time of the update tick.
+        //! @param sent - Time the command was sent.
+        void completeUpdate(const ControlKernel &kernel, size_t slot, std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point sent);
+
+        //! Start a latency trace if 'value' is a big enough change from the last one traced.
+        //! @param setpoint - Time the setpoint was given.
+        //! @param sendStart - Time just before the command was sent.
+        //! @param sent - Time the send returned.
+        void traceCommand(MotorDriveT mode, float value, std::chrono::steady_clock::time_point setpoint,
+                          std::chrono::steady_clock::time_point sendStart, std::chrono::steady_clock::time_point sent);
+
+        //! The kernel sent a command in 'mode' at 'when'.
+        void traceTransmit(MotorDriveT mode, std::chrono::steady_clock::time_point when);
+
+        //! Check if the values just received end the trace being followed.
+        void traceStatus(std::chrono::steady_clock::time_point now);
+
+        //! Get the measured value a command in 'mode' controls, in the units sent to the controller.
+        //! @return False if the mode isn't traced.
+        bool measuredValue(MotorDriveT mode, float &value) const;
+
+        //! Move an update time to just after the status frame expected nearest to it.
+        //! @param nominal - Time the update would be due without alignment.
+        //! @param updatePeriod - Period between updates for this motor.
+        //! @param guard - Time to allow after the predicted arrival.
+        //! @param when - Set to the aligned time.
+        //! @return False if the status stream isn't regular enough, or is slower than the updates.
+        bool alignToStatus(std::chrono::steady_clock::time_point nominal,
+                           std::chrono::steady_clock::duration updatePeriod,
+                           std::chrono::steady_clock::duration guard,
+                           std::chrono::steady_clock::time_point &when) const;
+
+        //! Callback function for a single value.
+        void valueCallback(MotorValuesT type, float value);
 
         //! Callback function for status packets.
         void statusCallback(float erpm, float current, float dutyCycle);
@@ -215,14 +405,41 @@ namespace multivesc {
         //! Update RPM
         void updateRPM(float rpm);
 
+        //! Check the motor is enabled and in the trajectory's mode.
+        //! Must be called with mDriveMutex held.
+        bool canFollowTrajectory(const Trajectory &trajectory) const;
+
+        //! Start following a trajectory that has been checked with canFollowTrajectory().
+        //! Must be called with mDriveMutex held.
+        void beginTrajectory(std::shared_ptr<const Trajectory> trajectory, std::chrono::steady_clock::time_point start);
+
+        //! Set the drive value from the trajectory being followed.
+        //! Must be called with mDriveMutex held.
+        void applyTrajectory(std::chrono::steady_clock::time_point now);
+
+        //! Pass a new setpoint to the interpolator.
+        //! Must be called with mDriveMutex held, after the setpoint time has been updated.
+        //! @return True if the setpoint will be sent by the update tick rather than immediately.
+        bool interpolateSetpoint(float value);
+
+        //! Exempt the current setpoint from the drive timeout, until a new one is set.
+        //! Must be called with mDriveMutex held.
+        void holdSetpoint() { mDriveHoldTime = mDriveUpdateTime; }
+
+        //! Check if the last setpoint has gone stale, and if so switch to the safe command.
+        //! Must be called with mDriveMutex held.
+        //! @return True if the timeout tripped.
+        bool checkDriveTimeout(std::chrono::steady_clock::time_point now);
+
         std::shared_ptr<BusInterface> mComs;
         std::string mName;
-        std::mutex mMutex;
+        mutable std::mutex mMutex;
         std::function<void(MotorValuesT,float)> mCallback;
+        std::shared_ptr<TelemetryStream> mTelemetryStream; //!< Protected by mMutex
 
         // Drive mode
-        std::mutex mDriveMutex;
-        bool mEnabled = true;
+        mutable std::mutex mDriveMutex;
+        std::atomic<bool> mEnabled = true;
         std::atomic<bool> mVerbose = false;
         std::atomic<float> mNumPolePairs = 1.0f;
         std::atomic<float> mScaleDirection = 1.0f;
@@ -231,7 +448,70 @@ namespace multivesc {
         float mDriveValue = 0.0f;
         float mLastDriveValue = 0.0f;
         std::chrono::steady_clock::time_point mDriveUpdateTime;
-        std::chrono::steady_clock::duration mDriveTimeout = std::chrono::milliseconds(200);
+        std::chrono::steady_clock::duration mDriveTimeout = std::chrono::milliseconds(500);
+        std::chrono::steady_clock::time_point mDriveTimeoutTripTime; //!< Setpoint time of the last trip, so each setpoint trips once.
+        std::chrono::steady_clock::time_point mDriveHoldTime; //!< Setpoint time of a setpoint exempt from the timeout.
+        MotorDriveT mTimeoutDriveMode = MotorDriveT::CURRENT; //!< Safe command sent when the timeout trips.
+        float mTimeoutDriveValue = 0.0f;
+        std::atomic<uint32_t> mDriveTimeoutCount = 0;
+
+        SetpointInterpolator mInterpolator;
+
+        std::atomic<std::chrono::steady_clock::duration> mUpdatePeriod = std::chrono::steady_clock::duration::zero(); //!< Zero uses the manager's period
+
+        // Trajectory being followed
+        std::shared_ptr<const Trajectory> mTrajectory;
+        std::chrono::steady_clock::time_point mTrajectoryStart;
+        std::chrono::steady_clock::time_point mTrajectoryUpdateTime; //!< Setpoint time written by the trajectory, used to detect user changes.
+        size_t mTrajectoryHint = 0;
+
+        // Reactive control, protected by mReactiveMutex.
+        std::mutex mReactiveMutex;
+        std::function<float(const Motor &)> mReactiveControl;
+        MotorValuesT mReactiveTrigger = MotorValuesT::RPM;
+        std::chrono::steady_clock::duration mReactiveBudget = std::chrono::microseconds(100);
+        uint32_t mReactiveOverrunsInRow = 0;
+        ControlKernel mReactiveKernel; //!< Protected by mSendMutex
+        std::atomic<bool> mReactiveActive = false;
+        std::atomic<uint32_t> mReactiveRunCount = 0;
+        std::atomic<uint32_t> mReactiveOverrunCount = 0;
+        std::atomic<float> mReactiveMaxTime = 0.0f;
+
+        // Rates values are polled at in Hz, indexed by MotorValuesT.
+        std::array<std::atomic<float>, NumValueTypes> mTelemetryRates {};
+        std::atomic<bool> mHasTelemetryRates = false;
+        CanStatusRatesT mCanStatusRates {}; //!< Protected by mMutex
+        bool mHasCanStatusRates = false; //!< Protected by mMutex
+
+        // Status arrival timing, protected by mStatusMutex.
+        mutable std::mutex mStatusMutex;
+        ArrivalEstimator mStatusArrival;
+        bool mStatusSeen = false; //!< A status frame has arrived since the last command
+        float mStatusLatency = 0.0f;
+        float mStatusLatencyMax = 0.0f;
+
+        // Command to telemetry latency tracing, protected by mTraceMutex.
+        mutable std::mutex mTraceMutex;
+        std::atomic<bool> mTraceEnabled = false;
+        float mTraceMinStep = 0.0f;
+        float mTraceFraction = 0.2f;
+        std::chrono::steady_clock::duration mTraceTimeout = std::chrono::seconds(1);
+        MotorDriveT mTraceBaseMode = MotorDriveT::NONE;
+        float mTraceBase = 0.0f; //!< Command the last trace started at, the next starts when it moves far enough
+        bool mTraceActive = false;
+        bool mTraceKernelTx = false; //!< The transmit time is from the kernel
+        MotorDriveT mTraceMode = MotorDriveT::NONE;
+        float mTraceStartValue = 0.0f; //!< Measured value when the command was sent
+        float mTraceStep = 0.0f;
+        std::chrono::steady_clock::time_point mTraceSetpoint;
+        std::chrono::steady_clock::time_point mTraceSendStart;
+        std::chrono::steady_clock::time_point mTraceTx;
+        MotorDriveT mLastTxStampMode = MotorDriveT::NONE;
+        std::chrono::steady_clock::time_point mLastTxStamp; //!< Last kernel transmit time, which may arrive before the trace starts
+        LatencyHistogram mResponseLatency;
+        LatencyHistogram mSetpointLatency;
+        uint64_t mTraceTimeouts = 0;
+        uint64_t mTraceKernelCount = 0;
 
         uint8_t mId = 0; // Controller ID
 
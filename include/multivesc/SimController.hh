@@ -0,0 +1,145 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#ifndef MULTIVESC_SIMCONTROLLER_HH
+#define MULTIVESC_SIMCONTROLLER_HH
+
+#include <vector>
+#include <array>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+#include <atomic>
+#include <linux/can.h>
+#include <nlohmann/json.hpp>
+#include "multivesc/Motor.hh"
+#include "multivesc/ControllerConfig.hh"
+
+namespace multivesc {
+
+    //! Model of a VESC controller and its motor, as seen from the CAN bus.
+    //! It answers the drive commands with a first order model of the motor, sends the STATUS packets at the
+    //! rates in its app configuration, and handles the buffer transport commands the library uses: firmware
+    //! version, reading and writing configurations, firmware upload and ping.
+    //! It only deals in frames, so it can be driven by a CAN socket or directly in process.
+
+    class SimController
+    {
+    public:
+        //! Construct a controller with a CAN id.
+        explicit SimController(uint8_t id);
+
+        //! Set the model parameters and status rates.
+        bool configure(const json &config);
+
+        //! The controller's CAN id.
+        [[nodiscard]] uint8_t id() const { return mId; }
+
+        //! Set how often each status packet is sent, as it would be by the app configuration.
+        void setStatusRates(const CanStatusRatesT &rates);
+
+        //! Handle a frame addressed to this controller, appending any replies to 'out'.
+        void receive(const struct can_frame &frame, std::chrono::steady_clock::time_point now,
+                     std::vector<struct can_frame> &out);
+
+        //! Advance the model to 'now', appending the status frames that are due to 'out'.
+        //! @return When the next status frame is due.
+        std::chrono::steady_clock::time_point update(std::chrono::steady_clock::time_point now,
+                                                     std::vector<struct can_frame> &out);
+
+        //! Current state of the model.
+        [[nodiscard]] json state() const;
+
+        //! Electrical RPM of the motor.
+        [[nodiscard]] float erpm() const { return mErpm; }
+
+        //! Number of commands received.
+        [[nodiscard]] uint64_t commandCount() const { return mCommandCount; }
+
+        //! Stop or restart handling packets sent with the buffer transport, as a controller that has hung would.
+        //! Drive commands and status are unaffected.  It can be called while the controller is being run.
+        void setResponding(bool responding) { mResponding = responding; }
+
+        //! Ignore every 'count'th packet sent with the buffer transport, as a noisy bus would lose them, 0 for none.
+        void setDropEvery(unsigned count) { mDropEvery = count; }
+
+    protected:
+        //! Handle a packet received through the buffer transport.
+        void handlePacket(uint8_t sender, bool reply, const uint8_t *payload, size_t len,
+                          std::vector<struct can_frame> &out);
+
+        //! Send a reply packet to 'sender'.
+        void sendReply(uint8_t sender, const std::vector<uint8_t> &payload, std::vector<struct can_frame> &out);
+
+        //! Set a drive command.
+        void setCommand(MotorDriveT mode, float value, std::chrono::steady_clock::time_point now);
+
+        //! Append a status frame.
+        void appendStatus(int packet, std::vector<struct can_frame> &out) const;
+
+        //! Take the status rates from the app configuration.
+        void applyAppconf();
+
+        uint8_t mId;
+
+        // Model parameters
+        float mErpmPerDuty = 50000.0f; //!< Speed at full duty
+        float mErpmPerAmp = 1000.0f; //!< Steady state speed for a current
+        float mTimeConstant = 0.05f; //!< Time for the speed to reach 63% of its target, in seconds
+        float mCoastTimeConstant = 1.0f; //!< Time constant when released or braking with no current
+        float mAmpsPerErpmRate = 0.001f; //!< Current to accelerate, per erpm/s
+        float mFrictionCurrent = 0.5f;
+        float mMaxCurrent = 60.0f;
+        float mVoltage = 24.0f;
+        float mPosTimeConstant = 0.1f;
+        std::chrono::steady_clock::duration mCommandTimeout = std::chrono::seconds(1);
+
+        // Command
+        MotorDriveT mMode = MotorDriveT::NONE;
+        float mCommandValue = 0.0f;
+        std::chrono::steady_clock::time_point mCommandTime;
+        uint64_t mCommandCount = 0;
+
+        // State
+        std::chrono::steady_clock::time_point mLastUpdate;
+        float mErpm = 0.0f;
+        float mCurrent = 0.0f;
+        float mDuty = 0.0f;
+        float mPidPos = 0.0f;
+        float mTachometer = 0.0f;
+        float mAmpHours = 0.0f;
+        float mAmpHoursCharged = 0.0f;
+        float mWattHours = 0.0f;
+        float mWattHoursCharged = 0.0f;
+        float mTempFet = 25.0f;
+        float mTempMotor = 25.0f;
+
+        // Status packets, STATUS_1 to STATUS_6
+        CanStatusConfigT mStatus;
+        std::array<std::chrono::steady_clock::duration, 6> mStatusPeriod {};
+        std::array<std::chrono::steady_clock::time_point, 6> mStatusDue {};
+
+        // Configurations and firmware
+        AppconfLayoutT mLayout;
+        std::vector<uint8_t> mAppconf;
+        std::vector<uint8_t> mMcconf;
+        std::vector<uint8_t> mNewApp; //!< Firmware upload area
+        size_t mErasedSize = 0;
+        int mInstallCount = 0;
+        std::atomic<bool> mResponding = true;
+        std::atomic<unsigned> mDropEvery = 0;
+        unsigned mPacketCount = 0;
+
+        // Buffer transport receive
+        std::vector<uint8_t> mRxBuffer;
+    };
+
+    //! Make simulated controllers from config.
+    //! They are given by 'ids', or 'count' and 'firstId'.  'controller' has the model parameters for all of
+    //! them, 'controllers' has those for individual ones by id.
+    std::vector<std::unique_ptr<SimController>> makeSimControllers(const json &config);
+
+} // multivesc
+
+#endif //MULTIVESC_SIMCONTROLLER_HH
@@ -0,0 +1,133 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#ifndef MULTIVESC_SPSCQUEUE_HH
+#define MULTIVESC_SPSCQUEUE_HH
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstddef>
+#include <algorithm>
+
+namespace multivesc {
+
+    //! Bounded lock free queue for one producer thread and one consumer thread.
+    //! Pushing and popping only touch atomics.  A consumer may also wait for items, in which case the
+    //! producer takes a lock to wake it, but only while it is waiting.
+
+    template<typename DataT>
+    class SpscQueue
+    {
+    public:
+        //! Construct with room for at least 'capacity' items, rounded up to a power of two.
+        explicit SpscQueue(size_t capacity = 4096)
+        {
+            size_t size = 2;
+            while(size < capacity)
+                size *= 2;
+            mItems.resize(size);
+            mMask = size - 1;
+        }
+
+        //! Add an item.
+        //! @return False if the queue is full.
+        bool push(const DataT &item)
+        {
+            size_t head = mHead.load(std::memory_order_relaxed);
+            if(head - mCachedTail > mMask) {
+                mCachedTail = mTail.load(std::memory_order_acquire);
+                if(head - mCachedTail > mMask)
+                    return false;
+            }
+            mItems[head & mMask] = item;
+            mHead.store(head + 1, std::memory_order_release);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if(mWaiting.load(std::memory_order_relaxed))
+                wake();
+            return true;
+        }
+
+        //! Add as many of 'count' items as fit.
+        //! @return Number of items added.
+        size_t push(const DataT *items, size_t count)
+        {
+            size_t head = mHead.load(std::memory_order_relaxed);
+            if(head - mCachedTail + count > mMask + 1)
+                mCachedTail = mTail.load(std::memory_order_acquire);
+            size_t n = std::min(count, mMask + 1 - (head - mCachedTail));
+            for(size_t i = 0; i < n; i++) {
+                mItems[(head + i) & mMask] = items[i];
+            }
+            if(n == 0)
+                return 0;
+            mHead.store(head + n, std::memory_order_release);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if(mWaiting.load(std::memory_order_relaxed))
+                wake();
+            return n;
+        }
+
+        //! Take up to 'maxItems' items.
+        //! @return Number of items taken.
+        size_t pop(DataT *items, size_t maxItems)
+        {
+            size_t tail = mTail.load(std::memory_order_relaxed);
+            if(mCachedHead == tail)
+                mCachedHead = mHead.load(std::memory_order_acquire);
+            size_t n = std::min(maxItems, mCachedHead - tail);
+            for(size_t i = 0; i < n; i++) {
+                items[i] = mItems[(tail + i) & mMask];
+            }
+            if(n > 0)
+                mTail.store(tail + n, std::memory_order_release);
+            return n;
+        }
+
+        //! Check if there is nothing to pop, from the consumer.
+        [[nodiscard]] bool empty() const
+        { return mHead.load(std::memory_order_acquire) == mTail.load(std::memory_order_relaxed); }
+
+        //! Wait, from the consumer, until there is something to pop or the deadline passes.
+        //! @return True if there is something to pop.
+        bool waitUntil(std::chrono::steady_clock::time_point deadline)
+        {
+            if(!empty())
+                return true;
+            std::unique_lock lock(mWaitMutex);
+            // The fences pair with those in push(), so either the producer sees we are waiting or we see its item.
+            mWaiting.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            bool ready = mCondition.wait_until(lock, deadline, [this]() { return !empty(); });
+            mWaiting.store(false, std::memory_order_relaxed);
+            return ready;
+        }
+
+    private:
+        void wake()
+        {
+            // Taking the lock makes sure the consumer is either waiting or yet to check the queue.
+            { std::lock_guard lock(mWaitMutex); }
+            mCondition.notify_one();
+        }
+
+        std::vector<DataT> mItems;
+        size_t mMask = 0;
+
+        // Producer and consumer each have their own cache line.
+        alignas(64) std::atomic<size_t> mHead = 0;
+        size_t mCachedTail = 0; //!< Producer's copy of mTail
+        alignas(64) std::atomic<size_t> mTail = 0;
+        size_t mCachedHead = 0; //!< Consumer's copy of mHead
+
+        alignas(64) std::atomic<bool> mWaiting = false;
+        std::mutex mWaitMutex;
+        std::condition_variable mCondition;
+    };
+
+} // multivesc
+
+#endif //MULTIVESC_SPSCQUEUE_HH
@@ -0,0 +1,136 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#ifndef MULTIVESC_TELEMETRYCOLUMN_HH
+#define MULTIVESC_TELEMETRYCOLUMN_HH
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <limits>
+#include "multivesc/MappedFile.hh"
+
+namespace multivesc {
+
+    // A column file holds the samples of one value of one motor, as blocks of compressed samples.
+    // Times are in microseconds since the epoch.  Within a block each time is stored as the change in the gap
+    // from the previous sample, so a steady rate costs one bit, and each value as the XOR with the previous
+    // value's bits, so a value that doesn't change costs one bit too.  Files are in the byte order of the
+    // machine that wrote them.
+
+    //! Header at the start of a column file.
+    struct TelemetryFileHeaderT
+    {
+        char magic[8] {'M', 'V', 'T', 'E', 'L', 'E', 'M', '1'};
+        uint32_t version = 1;
+        uint32_t valueType = 0; //!< MotorValuesT of the samples
+        uint32_t blockSamples = 0; //!< Most samples in a block
+        uint32_t reserved = 0;
+        int64_t createdNs = 0;
+        uint64_t dataBytes = 0; //!< End of the data that can be read, updated as samples are written
+        uint64_t sampleCount = 0; //!< Samples that can be read
+    };
+    static_assert(sizeof(TelemetryFileHeaderT) == 48, "Telemetry file header must be 48 bytes");
+
+    //! Header at the start of each block, followed by the compressed samples.
+    struct TelemetryBlockHeaderT
+    {
+        int64_t firstTimeUs = 0;
+        int64_t lastTimeUs = 0;
+        uint32_t count = 0; //!< Samples that can be read, updated as they are written
+        uint32_t bits = 0; //!< Length of the compressed samples
+    };
+    static_assert(sizeof(TelemetryBlockHeaderT) == 24, "Telemetry block header must be 24 bytes");
+
+    //! Appends samples to a column file.  Not thread safe, it is used from a single thread.
+    //! Samples are compressed straight into the memory mapped file.  They become visible to readers, in this or
+    //! other processes, when publish() is called.  No file descriptor is held while it is open, only the mapping.
+
+    class TelemetryColumnWriter
+    {
+    public:
+        //! Open a column, carrying on from the samples in it if it exists, otherwise creating it.
+        //! @param valueType - Value stored, checked against an existing file.
+        //! @param blockSamples - Most samples in a block.
+        bool open(const std::string &filename, uint32_t valueType, uint32_t blockSamples = 4096);
+
+        //! Add a sample.
+        bool append(int64_t timeUs, float value);
+
+        //! Make the samples appended so far visible to readers.
+        void publish();
+
+        //! Publish and close the file.
+        void close();
+
+        //! Check if a file is open.
+        [[nodiscard]] bool isOpen() const { return mFile.isOpen(); }
+
+        //! Samples written, including any in the file when it was opened.
+        [[nodiscard]] uint64_t sampleCount() const { return mSampleCount; }
+
+        //! Bytes of the file used.
+        [[nodiscard]] uint64_t bytes() const;
+
+    protected:
+        //! Start a new block with a sample.
+        bool startBlock(int64_t timeUs, uint32_t valueBits);
+
+        //! Append the low 'count' bits of 'value' to the block, most significant first.
+        void writeBits(uint64_t value, int count);
+
+        [[nodiscard]] TelemetryFileHeaderT *header() { return reinterpret_cast<TelemetryFileHeaderT *>(mFile.data()); }
+
+        [[nodiscard]] TelemetryBlockHeaderT *block() { return reinterpret_cast<TelemetryBlockHeaderT *>(mFile.data() + mBlockOffset); }
+
+        MappedFile mFile;
+        uint32_t mBlockSamples = 4096;
+        uint64_t mSampleCount = 0;
+        uint64_t mBlockOffset = sizeof(TelemetryFileHeaderT); //!< Start of the block being written
+        uint32_t mBlockCount = 0; //!< Samples in the block, zero before the first
+        uint64_t mBitPos = 0; //!< Bits written in the block
+        int64_t mPrevTimeUs = 0;
+        int64_t mPrevDeltaUs = 0;
+        uint32_t mPrevValue = 0;
+        int mPrevLeading = -1; //!< Window of meaningful bits of the last XOR written with one, -1 for none
+        int mPrevTrailing = 0;
+    };
+
+    //! Reads a column file, which may still be being written.
+
+    class TelemetryColumnReader
+    {
+    public:
+        //! Open a column file.
+        bool open(const std::string &filename);
+
+        //! Pick up samples written since the file was opened or last refreshed.
+        bool refresh() { return mFile.refresh(); }
+
+        //! Close the file.
+        void close() { mFile.close(); }
+
+        //! Value stored, a MotorValuesT.
+        [[nodiscard]] uint32_t valueType() const { return header().valueType; }
+
+        //! Number of samples that can be read.
+        [[nodiscard]] uint64_t sampleCount() const;
+
+        //! Read the samples with times from 'fromUs' to 'toUs', appending them to 'timesUs' and 'values'.
+        //! Blocks outside the range are skipped without decoding them.
+        //! @return Number of samples read.
+        size_t read(std::vector<int64_t> &timesUs, std::vector<float> &values,
+                    int64_t fromUs = std::numeric_limits<int64_t>::min(),
+                    int64_t toUs = std::numeric_limits<int64_t>::max()) const;
+
+    protected:
+        [[nodiscard]] const TelemetryFileHeaderT &header() const
+        { return *reinterpret_cast<const TelemetryFileHeaderT *>(mFile.data()); }
+
+        MappedFile mFile;
+    };
+
+} // multivesc
+
+#endif //MULTIVESC_TELEMETRYCOLUMN_HH
@@ -0,0 +1,131 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#ifndef MULTIVESC_TELEMETRYLOGGER_HH
+#define MULTIVESC_TELEMETRYLOGGER_HH
+
+#include <string>
+#include <vector>
+#include <array>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <nlohmann/json.hpp>
+#include "multivesc/Motor.hh"
+#include "multivesc/SpscQueue.hh"
+#include "multivesc/TelemetryColumn.hh"
+
+namespace multivesc {
+
+    using json = nlohmann::json;
+
+    //! A value from a motor on its way to the log.
+    struct TelemetrySampleT
+    {
+        int64_t timeUs = 0;
+        float value = 0.0f;
+        MotorValuesT type = MotorValuesT::RPM;
+    };
+
+    //! Values from one motor, queued by the thread receiving them for the logger's thread.
+    //! Queueing a value is a clock read and a lock free push, nothing waits for the disk.
+
+    class TelemetryStream
+    {
+    public:
+        //! Construct with room for 'queueSize' values between flushes.
+        TelemetryStream(std::string motorName, uint32_t valueMask, size_t queueSize);
+
+        //! Queue a value if it is one being logged.  Called from the thread receiving the motor's values.
+        void record(MotorValuesT type, float value);
+
+        //! Name of the motor.
+        [[nodiscard]] const std::string &motorName() const { return mMotorName; }
+
+        //! Number of values dropped because the queue was full.
+        [[nodiscard]] uint64_t droppedCount() const { return mDropped; }
+
+    protected:
+        std::string mMotorName;
+        uint32_t mValueMask; //!< Bit for each MotorValuesT logged
+        SpscQueue<TelemetrySampleT> mQueue;
+        std::atomic<uint64_t> mDropped = 0;
+
+        friend class TelemetryLogger;
+    };
+
+    //! Logs the values of motors to a column file for each value of each motor, <directory>/<motor>/<VALUE>.tlm.
+    //! Values are queued as they arrive, and a background thread compresses them into the files every flush
+    //! period, so the files can be read with TelemetryColumnReader while they are written.  Existing files are
+    //! added to, so a log can run across restarts.
+
+    class TelemetryLogger
+    {
+    public:
+        //! Construct from config, see the README for the settings.
+        explicit TelemetryLogger(const json &config);
+
+        //! Disable copy
+        TelemetryLogger(const TelemetryLogger&) = delete;
+        TelemetryLogger& operator=(const TelemetryLogger&) = delete;
+
+        //! Destructor, stops logging.
+        ~TelemetryLogger();
+
+        //! Start logging the values of a motor.
+        bool addMotor(const std::shared_ptr<Motor> &motor);
+
+        //! Start the flush thread.
+        bool start();
+
+        //! Stop logging, write what is queued and close the files.
+        void stop();
+
+        //! Directory the files are written to.
+        [[nodiscard]] const std::string &directory() const { return mDirectory; }
+
+        //! Name of the file for a value of a motor.
+        [[nodiscard]] std::string columnFile(const std::string &motorName, MotorValuesT type) const;
+
+        //! Get the number of values written and dropped, and the bytes used.
+        [[nodiscard]] json stats();
+
+    protected:
+        //! A motor being logged.
+        struct MotorLogT
+        {
+            std::weak_ptr<Motor> motor;
+            std::shared_ptr<TelemetryStream> stream;
+            std::array<std::unique_ptr<TelemetryColumnWriter>, NumValueTypes> columns;
+        };
+
+        //! Flush thread.
+        void run();
+
+        //! Move queued values into the files and publish them.
+        //! Must be called with mMutex held.
+        void flush();
+
+        std::string mDirectory;
+        uint32_t mValueMask = 0;
+        uint32_t mBlockSamples;
+        size_t mQueueSize;
+        std::chrono::steady_clock::duration mFlushPeriod;
+
+        std::mutex mMutex;
+        std::vector<MotorLogT> mMotors; //!< Protected by mMutex
+        std::vector<TelemetrySampleT> mBatch; //!< Protected by mMutex
+
+        std::atomic<bool> mTerminate = false;
+        std::mutex mWaitMutex;
+        std::condition_variable mWaitCondition;
+        std::thread mThread;
+
+        std::atomic<uint64_t> mWriteErrors = 0;
+    };
+
+} // multivesc
+
+#endif //MULTIVESC_TELEMETRYLOGGER_HH
@@ -0,0 +1,78 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#ifndef MULTIVESC_TIMERWHEEL_HH
+#define MULTIVESC_TIMERWHEEL_HH
+
+#include <array>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+
+namespace multivesc {
+
+    //! Hierarchical timer wheel.
+    //! Timers are identified by a handle chosen by the caller. Scheduling a timer and finding the ones that
+    //! have expired only touches the slots for the current time, so the cost doesn't grow with the number of timers.
+    //! Times are rounded up to the resolution of the wheel.  Not thread safe.
+
+    class TimerWheel
+    {
+    public:
+        using TimePointT = std::chrono::steady_clock::time_point;
+        using DurationT = std::chrono::steady_clock::duration;
+
+        //! Construct a wheel with a resolution
+        explicit TimerWheel(DurationT resolution = std::chrono::milliseconds(1));
+
+        //! Reset the wheel, removing all timers, and set the current time.
+        void reset(TimePointT now);
+
+        //! Resolution of the wheel
+        [[nodiscard]] DurationT resolution() const { return mResolution; }
+
+        //! Schedule a timer to expire at a time.
+        //! Times in the past expire on the next call to advance().
+        void schedule(uint32_t handle, TimePointT when);
+
+        //! Advance the wheel to 'now', appending the handles of the timers that expired to 'expired'.
+        void advance(TimePointT now, std::vector<uint32_t> &expired);
+
+        //! Time of the next slot that may have a timer due.
+        //! This is never later than the next time timers need moving between levels, so it may return
+        //! a time when nothing actually expires.
+        [[nodiscard]] TimePointT nextEvent() const;
+
+        //! Number of timers scheduled.
+        [[nodiscard]] size_t size() const { return mSize; }
+
+    protected:
+        static constexpr int gSlotBits = 6;
+        static constexpr int gNumSlots = 1 << gSlotBits;
+        static constexpr int gNumLevels = 4;
+        static constexpr uint64_t gSlotMask = gNumSlots - 1;
+
+        struct Entry
+        {
+            uint32_t handle;
+            uint64_t tick;
+        };
+
+        //! Put an entry in the right slot for its expiry tick, treating ticks before 'minTick' as 'minTick'.
+        void insert(const Entry &entry, uint64_t minTick);
+
+        //! Convert a time to a tick, rounding up.
+        [[nodiscard]] uint64_t toTick(TimePointT when) const;
+
+        DurationT mResolution;
+        TimePointT mOrigin;
+        uint64_t mCurrentTick = 0;
+        size_t mSize = 0;
+        std::array<std::array<std::vector<Entry>, gNumSlots>, gNumLevels> mSlots;
+        std::vector<Entry> mCascade;
+    };
+
+} // multivesc
+
+#endif //MULTIVESC_TIMERWHEEL_HH
@@ -0,0 +1,101 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#ifndef MULTIVESC_TRAJECTORY_HH
+#define MULTIVESC_TRAJECTORY_HH
+
+#include <vector>
+#include <cstddef>
+#include "multivesc/Motor.hh"
+
+namespace multivesc {
+
+    //! A time parameterised profile for a single motor.
+    //! The profile is built up from segments when it is created, each segment is a cubic polynomial in time,
+    //! so evaluating it at the update rate is only a handful of multiplies.
+    //! Time is in seconds from the start of the profile.
+
+    class Trajectory
+    {
+    public:
+        //! Construct a trajectory for a drive mode, starting at the given value.
+        //! Only MotorDriveT::RPM and MotorDriveT::POS are supported.
+        explicit Trajectory(MotorDriveT mode = MotorDriveT::RPM, float startValue = 0.0f);
+
+        //! Append a jerk limited S-curve change in RPM.
+        //! @param to - Target RPM
+        //! @param maxAcceleration - Maximum acceleration in RPM per second, must be positive.
+        //! @param maxJerk - Maximum jerk in RPM per second squared, zero or less for no jerk limit.
+        bool appendSCurve(float to, float maxAcceleration, float maxJerk);
+
+        //! Append a jerk limited rest to rest move in position.
+        //! @param to - Target position
+        //! @param maxVelocity - Maximum velocity in position units per second, must be positive.
+        //! @param maxAcceleration - Maximum acceleration in position units per second squared, must be positive.
+        //! @param maxJerk - Maximum jerk in position units per second cubed, zero or less for no jerk limit.
+        bool appendMove(float to, float maxVelocity, float maxAcceleration, float maxJerk);
+
+        //! Append a linear change to a value over the given time.
+        bool appendLinear(float to, float duration);
+
+        //! Append a period where the value is held constant.
+        bool appendHold(float duration);
+
+        //! Drive mode this trajectory is for.
+        [[nodiscard]] MotorDriveT mode() const { return mMode; }
+
+        //! Total duration in seconds.
+        [[nodiscard]] double duration() const { return mDuration; }
+
+        //! Value at the start of the trajectory.
+        [[nodiscard]] float startValue() const { return mStartValue; }
+
+        //! Value at the end of the trajectory.
+        [[nodiscard]] float endValue() const { return mEndValue; }
+
+        //! Number of segments in the trajectory.
+        [[nodiscard]] size_t size() const { return mSegments.size(); }
+
+        //! Evaluate the trajectory at time t.
+        //! Times before the start give the start value, times after the end give the end value.
+        [[nodiscard]] float evaluate(double t) const;
+
+        //! Evaluate the trajectory at time t.
+        //! 'hint' is the segment index used last time, when t increases monotonically this avoids a search.
+        float evaluate(double t, size_t &hint) const;
+
+    protected:
+        //! A constant jerk phase of motion.
+        struct Phase
+        {
+            double duration;
+            double jerk;
+            double accel; //!< Acceleration at the start of the phase
+        };
+
+        //! A polynomial segment, value = c0 + c1*t + c2*t^2 + c3*t^3 with t relative to the segment start.
+        struct Segment
+        {
+            double start;
+            double duration;
+            double c0, c1, c2, c3;
+        };
+
+        //! Generate the phases needed to change velocity by 'dv'.
+        static void velocityPhases(double dv, double maxAccel, double maxJerk, std::vector<Phase> &phases);
+
+        //! Integrate a list of phases onto the end of the trajectory.
+        //! If 'position' is true the trajectory value is the integral of the velocity, otherwise it is the velocity.
+        void appendPhases(const std::vector<Phase> &phases, bool position);
+
+        MotorDriveT mMode = MotorDriveT::RPM;
+        float mStartValue = 0.0f;
+        float mEndValue = 0.0f;
+        double mDuration = 0.0;
+        std::vector<Segment> mSegments;
+    };
+
+} // multivesc
+
+#endif //MULTIVESC_TRAJECTORY_HH
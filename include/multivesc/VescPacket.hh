@@ -0,0 +1,201 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#ifndef MULTIVESC_VESCPACKET_HH
+#define MULTIVESC_VESCPACKET_HH
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <functional>
+#include <sys/types.h>
+
+namespace multivesc {
+
+    // Command ids for packets sent over UART, USB or in CAN buffers.
+    // See https://github.com/vedderb/bldc/blob/master/datatypes.h
+
+    typedef enum {
+        COMM_FW_VERSION = 0,
+        COMM_JUMP_TO_BOOTLOADER = 1,
+        COMM_ERASE_NEW_APP = 2,
+        COMM_WRITE_NEW_APP_DATA = 3,
+        COMM_GET_VALUES = 4,
+        COMM_SET_DUTY = 5,
+        COMM_SET_CURRENT = 6,
+        COMM_SET_CURRENT_BRAKE = 7,
+        COMM_SET_RPM = 8,
+        COMM_SET_POS = 9,
+        COMM_SET_HANDBRAKE = 10,
+        COMM_SET_MCCONF = 13,
+        COMM_GET_MCCONF = 14,
+        COMM_SET_APPCONF = 16,
+        COMM_GET_APPCONF = 17,
+        COMM_ALIVE = 30,
+        COMM_FORWARD_CAN = 34,
+        COMM_GET_VALUES_SELECTIVE = 50,
+        COMM_PING_CAN = 62,
+        COMM_SET_CURRENT_REL = 84
+    } COMM_PACKET_ID;
+
+    inline void buffer_append_int16(uint8_t *buffer, int16_t number, int32_t *index) {
+        buffer[(*index)++] = number >> 8;
+        buffer[(*index)++] = number;
+    }
+
+    inline void buffer_append_int32(uint8_t *buffer, int32_t number, int32_t *index) {
+        buffer[(*index)++] = number >> 24;
+        buffer[(*index)++] = number >> 16;
+        buffer[(*index)++] = number >> 8;
+        buffer[(*index)++] = number;
+    }
+
+    inline void buffer_append_float16(uint8_t *buffer, float number, float scale, int32_t *index) {
+        buffer_append_int16(buffer, (int16_t) (number * scale), index);
+    }
+
+    inline void buffer_append_float32(uint8_t *buffer, float number, float scale, int32_t *index) {
+        buffer_append_int32(buffer, (int32_t) (number * scale), index);
+    }
+
+    //! CRC16 as used by the VESC, XMODEM parameters.
+    //! 'crc' is the value from a previous block, to calculate the CRC over several blocks.
+    uint16_t vescCrc16(const uint8_t *data, size_t len, uint16_t crc = 0);
+
+    //! Number of bytes needed to frame a payload of 'len' bytes.
+    constexpr size_t packetSize(size_t len)
+    { return len + (len < 256 ? 5 : 6); }
+
+    //! Frame a payload: start byte, length, payload, CRC, stop byte.
+    //! 'out' must have room for packetSize(len) bytes.
+    //! @return Number of bytes written.
+    size_t encodePacket(const uint8_t *payload, size_t len, uint8_t *out);
+
+    //! Append a framed payload to a buffer.
+    void appendPacket(std::vector<uint8_t> &out, const uint8_t *payload, size_t len);
+
+    //! Append a framed payload made of a prefix followed by 'payload' to a buffer.
+    //! This is used to wrap a command for forwarding without copying it first.
+    void appendPacket(std::vector<uint8_t> &out, const uint8_t *prefix, size_t prefixLen, const uint8_t *payload, size_t len);
+
+    //! View of a packet payload in place in a ring buffer.
+    //! The payload may wrap around the end of the buffer so is held as two segments.
+    //! It is only valid during the parser callback.
+
+    class PacketView
+    {
+    public:
+        PacketView(const uint8_t *first, size_t firstLen, const uint8_t *second, size_t secondLen)
+         : mFirst(first), mFirstLen(firstLen), mSecond(second), mSecondLen(secondLen)
+        {}
+
+        //! Number of bytes in the payload.
+        [[nodiscard]] size_t size() const { return mFirstLen + mSecondLen; }
+
+        //! Access a byte of the payload.
+        [[nodiscard]] uint8_t operator[](size_t index) const
+        { return index < mFirstLen ? mFirst[index] : mSecond[index - mFirstLen]; }
+
+        //! Command id, the first byte of the payload.
+        [[nodiscard]] uint8_t command() const { return (*this)[0]; }
+
+        [[nodiscard]] int16_t int16At(size_t index) const
+        { return int16_t((*this)[index] << 8 | (*this)[index + 1]); }
+
+        [[nodiscard]] int32_t int32At(size_t index) const
+        { return int32_t(uint32_t((*this)[index]) << 24 | uint32_t((*this)[index + 1]) << 16 | uint32_t((*this)[index + 2]) << 8 | (*this)[index + 3]); }
+
+        [[nodiscard]] float float16At(size_t index, float scale) const
+        { return float(int16At(index)) / scale; }
+
+        [[nodiscard]] float float32At(size_t index, float scale) const
+        { return float(int32At(index)) / scale; }
+
+        //! Get a view of part of the payload.
+        [[nodiscard]] PacketView sub(size_t offset) const;
+
+        //! CRC of the payload.
+        [[nodiscard]] uint16_t crc() const;
+
+        //! Copy 'len' bytes from 'offset' out of the payload.
+        void copy(size_t offset, uint8_t *out, size_t len) const;
+
+    private:
+        const uint8_t *mFirst;
+        size_t mFirstLen;
+        const uint8_t *mSecond;
+        size_t mSecondLen;
+    };
+
+    //! Streaming parser for framed VESC packets.
+    //! Bytes are read straight into a ring buffer and packets are checked and handed on in place,
+    //! so payloads are never copied. After a bad length, stop byte or CRC the parser skips the start byte and
+    //! searches for the next one, so it recovers from corruption or joining the stream part way through a packet.
+
+    class PacketParser
+    {
+    public:
+        //! Construct with a buffer of at least 'capacity' bytes, rounded up to a power of two.
+        explicit PacketParser(size_t capacity = 8192);
+
+        //! Read whatever is available from a non-blocking file descriptor into the buffer.
+        //! @return Bytes read, 0 if nothing was available or the buffer is full, -1 on error.
+        ssize_t readFrom(int fd);
+
+        //! Add bytes to the buffer.
+        //! @return Number of bytes added, less than 'len' if the buffer is full.
+        size_t write(const uint8_t *data, size_t len);
+
+        //! Parse all complete packets in the buffer, calling 'handler' for each good one.
+        //! @return Number of packets found.
+        size_t parse(const std::function<void(const PacketView &)> &handler);
+
+        //! Discard everything in the buffer.
+        void clear() { mTail = mHead; }
+
+        //! Largest payload that can be received.
+        [[nodiscard]] size_t maxPayload() const { return mBuffer.size() - 6; }
+
+        //! Number of good packets found.
+        [[nodiscard]] uint64_t packetCount() const { return mPacketCount; }
+
+        //! Number of packets with a bad CRC.
+        [[nodiscard]] uint64_t crcErrorCount() const { return mCrcErrorCount; }
+
+        //! Number of bytes skipped while searching for the start of a packet.
+        [[nodiscard]] uint64_t skippedBytes() const { return mSkippedBytes; }
+
+    protected:
+        enum class CheckT
+        {
+            Good,
+            Incomplete,
+            BadFrame,
+            BadCrc
+        };
+
+        //! Check for a packet starting at 'pos', setting the header and payload lengths.
+        [[nodiscard]] CheckT check(uint64_t pos, size_t &header, size_t &len) const;
+
+        //! Check if there is a complete good packet starting at or after 'pos'.
+        [[nodiscard]] bool packetAhead(uint64_t pos) const;
+
+        [[nodiscard]] uint8_t at(uint64_t pos) const { return mBuffer[pos & mMask]; }
+
+        //! Get a view of 'len' bytes starting at 'pos'.
+        [[nodiscard]] PacketView view(uint64_t pos, size_t len) const;
+
+        std::vector<uint8_t> mBuffer;
+        uint64_t mMask = 0;
+        uint64_t mHead = 0; //!< Total bytes written
+        uint64_t mTail = 0; //!< Total bytes consumed
+        uint64_t mPacketCount = 0;
+        uint64_t mCrcErrorCount = 0;
+        uint64_t mSkippedBytes = 0;
+        bool mSynced = true; //!< Last bytes consumed were a good packet
+    };
+
+} // multivesc
+
+#endif //MULTIVESC_VESCPACKET_HH
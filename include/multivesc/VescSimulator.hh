@@ -0,0 +1,84 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#ifndef MULTIVESC_VESCSIMULATOR_HH
+#define MULTIVESC_VESCSIMULATOR_HH
+
+#include <string>
+#include <vector>
+#include <array>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <linux/can.h>
+#include <sys/socket.h>
+#include <nlohmann/json.hpp>
+#include "multivesc/SimController.hh"
+
+namespace multivesc {
+
+    //! Simulates a set of VESC controllers on a CAN interface, normally a vcan one.
+    //! Each controller is a SimController. A single thread receives the commands for all of them and sends
+    //! their status frames, so the library can be load tested with up to 254 controllers on any Linux machine.
+
+    class VescSimulator
+    {
+    public:
+        //! Construct for a CAN device.
+        explicit VescSimulator(std::string deviceName);
+
+        //! Construct from config.
+        //! 'device' is the CAN interface, the controllers are as for makeSimControllers().
+        explicit VescSimulator(const json &config);
+
+        //! Destructor
+        ~VescSimulator();
+
+        //! Add a controller.
+        //! @return False if there is already one with the id.
+        bool addController(uint8_t id, const json &config = json::object());
+
+        //! Open the interface and start simulating.
+        bool start();
+
+        //! Stop simulating and close the interface.
+        void stop();
+
+        //! Number of controllers.
+        [[nodiscard]] size_t controllerCount() const { return mControllers.size(); }
+
+        //! State of each controller.
+        [[nodiscard]] json state();
+
+        //! Frame counts.
+        [[nodiscard]] json stats() const;
+
+    protected:
+        //! Simulation thread.
+        void run();
+
+        //! Send the frames in 'frames', waiting briefly for room if the interface queue is full.
+        void sendFrames(std::vector<struct can_frame> &frames);
+
+        std::string mDeviceName;
+        int mSocket = -1;
+        std::thread mThread;
+        std::atomic<bool> mTerminate = false;
+
+        std::mutex mMutex; //!< Protects the controllers while the simulation is running
+        std::vector<std::unique_ptr<SimController>> mControllers;
+        std::array<SimController *, 256> mById {};
+
+        std::vector<struct mmsghdr> mTxMsgs;
+        std::vector<struct iovec> mTxIov;
+
+        std::atomic<uint64_t> mRxFrames = 0;
+        std::atomic<uint64_t> mTxFrames = 0;
+        std::atomic<uint64_t> mTxDropped = 0;
+    };
+
+} // multivesc
+
+#endif //MULTIVESC_VESCSIMULATOR_HH
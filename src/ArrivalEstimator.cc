@@ -0,0 +1,85 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#include <cmath>
+#include <algorithm>
+#include "multivesc/ArrivalEstimator.hh"
+
+namespace multivesc {
+
+    namespace {
+        // Loop gains, the period gain is kept low so the estimate settles rather than chasing jitter.
+        constexpr double gPhaseGain = 0.2;
+        constexpr double gPeriodGain = 0.02;
+        constexpr double gJitterGain = 0.1;
+        constexpr uint32_t gMinSamples = 8;
+    }
+
+    void ArrivalEstimator::reset()
+    {
+        mCount = 0;
+        mPeriod = 0.0;
+        mJitter = 0.0;
+    }
+
+    void ArrivalEstimator::sample(TimePointT when)
+    {
+        mCount++;
+        if(mCount == 1) {
+            mLastArrival = when;
+            mPredicted = when;
+            return;
+        }
+        double dt = std::chrono::duration<double>(when - mLastArrival).count();
+        mLastArrival = when;
+        if(dt <= 0.0)
+            return;
+        if(mCount == 2 || mPeriod <= 0.0) {
+            // First interval, take it as it is.
+            mPeriod = dt;
+            mPredicted = when;
+            return;
+        }
+        // Work out which arrival this is, allowing for missed messages.
+        double sincePredicted = std::chrono::duration<double>(when - mPredicted).count();
+        double cycles = std::max(std::round(sincePredicted / mPeriod), 1.0);
+        if(cycles > 16.0) {
+            // Lost track, start again from this arrival.
+            mCount = 1;
+            mPredicted = when;
+            mPeriod = 0.0;
+            mJitter = 0.0;
+            return;
+        }
+        double error = sincePredicted - cycles * mPeriod;
+        mPredicted += std::chrono::duration_cast<DurationT>(std::chrono::duration<double>(cycles * mPeriod + gPhaseGain * error));
+        mPeriod += gPeriodGain * error / cycles;
+        mJitter += gJitterGain * (std::abs(error) - mJitter);
+    }
+
+    bool ArrivalEstimator::locked() const
+    {
+        return mCount >= gMinSamples && mPeriod > 0.0 && mJitter < mPeriod / 4.0;
+    }
+
+    ArrivalEstimator::DurationT ArrivalEstimator::period() const
+    {
+        return std::chrono::duration_cast<DurationT>(std::chrono::duration<double>(mPeriod));
+    }
+
+    ArrivalEstimator::DurationT ArrivalEstimator::jitter() const
+    {
+        return std::chrono::duration_cast<DurationT>(std::chrono::duration<double>(mJitter));
+    }
+
+    ArrivalEstimator::TimePointT ArrivalEstimator::nextArrival(TimePointT after) const
+    {
+        if(mPeriod <= 0.0)
+            return after;
+        double since = std::chrono::duration<double>(after - mPredicted).count();
+        double cycles = std::floor(since / mPeriod) + 1.0;
+        return mPredicted + std::chrono::duration_cast<DurationT>(std::chrono::duration<double>(cycles * mPeriod));
+    }
+
+} // multivesc
@@ -5,36 +5,101 @@
 #include <iostream>
 #include <unistd.h>
 #include <cstring>
+#include <cerrno>
+#include <limits>
+#include <algorithm>
 #include <utility>
+#include <bitset>
 #include <net/if.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <linux/can/raw.h>
+#include <linux/net_tstamp.h>
 #include "multivesc/BusCan.hh"
+#include "multivesc/Motor.hh"
+#include "multivesc/VescPacket.hh"
+#include "multivesc/Crc16.hh"
 
 namespace multivesc
 {
     namespace {
-        void buffer_append_int16(uint8_t *buffer, int16_t number, int32_t *index) {
-            buffer[(*index)++] = number >> 8;
-            buffer[(*index)++] = number;
-        }
 
-        void buffer_append_int32(uint8_t *buffer, int32_t number, int32_t *index) {
-            buffer[(*index)++] = number >> 24;
-            buffer[(*index)++] = number >> 16;
-            buffer[(*index)++] = number >> 8;
-            buffer[(*index)++] = number;
+        //! Encode a drive command into a CAN frame, using the same scaling as the individual set functions.
+        bool encodeDriveCommand(const DriveCommand &cmd, struct can_frame &frame)
+        {
+            int32_t value = 0;
+            CAN_PACKET_ID packetId;
+            switch(cmd.mode)
+            {
+                case MotorDriveT::DUTY:
+                    packetId = CAN_PACKET_SET_DUTY;
+                    value = (int32_t) (cmd.value * 100000.0);
+                    break;
+                case MotorDriveT::CURRENT:
+                    packetId = CAN_PACKET_SET_CURRENT;
+                    value = (int32_t) (cmd.value * 1000.0);
+                    break;
+                case MotorDriveT::CURRENT_BREAK:
+                    packetId = CAN_PACKET_SET_CURRENT_BRAKE;
+                    value = (int32_t) (cmd.value * 1000.0);
+                    break;
+                case MotorDriveT::RPM:
+                    packetId = CAN_PACKET_SET_RPM;
+                    value = (int32_t) cmd.value;
+                    break;
+                case MotorDriveT::POS:
+                    packetId = CAN_PACKET_SET_POS;
+                    value = (int32_t) (cmd.value * 1000000.0);
+                    break;
+                case MotorDriveT::CURRENT_REL:
+                    packetId = CAN_PACKET_SET_CURRENT_REL;
+                    value = (int32_t) (cmd.value * 1e5f);
+                    break;
+                case MotorDriveT::CURRENT_BREAK_REL:
+                    packetId = CAN_PACKET_SET_CURRENT_BRAKE_REL;
+                    value = (int32_t) (cmd.value * 1e5f);
+                    break;
+                case MotorDriveT::HAND_BRAKE:
+                    packetId = CAN_PACKET_SET_CURRENT_HANDBRAKE;
+                    value = (int32_t) (cmd.value * 1e3f);
+                    break;
+                case MotorDriveT::HAND_BRAKE_REL:
+                    packetId = CAN_PACKET_SET_CURRENT_HANDBRAKE_REL;
+                    value = (int32_t) (cmd.value * 1e5f);
+                    break;
+                default:
+                    return false;
+            }
+            int32_t index = 0;
+            frame.can_id = cmd.controllerId | ((uint32_t) packetId << 8) | CAN_EFF_FLAG;
+            frame.can_dlc = 4;
+            buffer_append_int32(frame.data, value, &index);
+            return true;
         }
 
-        void buffer_append_float16(uint8_t *buffer, float number, float scale, int32_t *index) {
-            buffer_append_int16(buffer, (int16_t) (number * scale), index);
+        //! Find the drive mode of a command from its packet id, the reverse of encodeDriveCommand().
+        bool driveModeFromPacket(uint32_t packetId, MotorDriveT &mode)
+        {
+            switch(packetId)
+            {
+                case CAN_PACKET_SET_DUTY: mode = MotorDriveT::DUTY; return true;
+                case CAN_PACKET_SET_CURRENT: mode = MotorDriveT::CURRENT; return true;
+                case CAN_PACKET_SET_CURRENT_BRAKE: mode = MotorDriveT::CURRENT_BREAK; return true;
+                case CAN_PACKET_SET_RPM: mode = MotorDriveT::RPM; return true;
+                case CAN_PACKET_SET_POS: mode = MotorDriveT::POS; return true;
+                case CAN_PACKET_SET_CURRENT_REL: mode = MotorDriveT::CURRENT_REL; return true;
+                case CAN_PACKET_SET_CURRENT_BRAKE_REL: mode = MotorDriveT::CURRENT_BREAK_REL; return true;
+                case CAN_PACKET_SET_CURRENT_HANDBRAKE: mode = MotorDriveT::HAND_BRAKE; return true;
+                case CAN_PACKET_SET_CURRENT_HANDBRAKE_REL: mode = MotorDriveT::HAND_BRAKE_REL; return true;
+                default: return false;
+            }
         }
 
-        void buffer_append_float32(uint8_t *buffer, float number, float scale, int32_t *index) {
-            buffer_append_int32(buffer, (int32_t) (number * scale), index);
-        }
+        //! Frames of a packet sent per system call. The transmit lock is released in between so setpoints aren't held up.
+        constexpr size_t gPacketBurst = 32;
 
+        //! Frames read per system call.
+        constexpr unsigned gRxBatch = 32;
 
         float get_scaled_float16(const uint8_t *data, int32_t index, float scale) {
             return (float) ((int16_t) (data[index] << 8 | data[index + 1])) / scale;
@@ -56,6 +121,18 @@ namespace multivesc
      : BusInterface(config)
     {
         mDeviceName = config.value("device", "");
+        mBitrate = config.value("bitrate", mBitrate);
+        mTxBudget = config.value("txBudget", mTxBudget);
+        if(config.contains("hostIds")) {
+            setHostIds(config["hostIds"].get<std::vector<uint8_t>>());
+        } else if(config.contains("hostId")) {
+            setHostId(config["hostId"].get<uint8_t>());
+        }
+        mBudgetWindow = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<float>(config.value("txBudgetWindow", 0.005f)));
+        if(config.contains("capture")) {
+            startCapture(config["capture"].get<std::string>());
+        }
     }
 
     //! Destructor
@@ -69,9 +146,21 @@ namespace multivesc
     bool BusCan::open()
     {
         // Check it is not already open
-        if(mSocket >= 0) {
+        if(isOpen()) {
             return false;
         }
+        if(!openDevice())
+            return false;
+        prepareReceive();
+
+        mTerminate = false;
+        mReceiveThread = std::thread(&BusCan::run_receive_thread, this);
+
+        return true;
+    }
+
+    bool BusCan::openDevice()
+    {
         if(mDeviceName.empty()) {
             std::cerr << "Device name is empty" << std::endl;
             return false;
@@ -94,23 +183,145 @@ namespace multivesc
             mSocket = -1;
             return false;
         }
+        if(mTxTimestamps)
+            applyTxTimestamps();
+        if(mCapturing)
+            applyRxTimestamps();
+        return true;
+    }
 
-        mReceiveThread = std::thread(&BusCan::run_receive_thread, this);
+    bool BusCan::startCapture(const std::string &filename)
+    {
+        stopCapture();
+        if(!mCapture.open(filename))
+            return false;
+        mCapturing = true;
+        if(mSocket >= 0)
+            applyRxTimestamps();
+        return true;
+    }
+
+    void BusCan::stopCapture()
+    {
+        if(!mCapturing)
+            return;
+        mCapturing = false;
+        if(mSocket >= 0)
+            applyRxTimestamps();
+        mCapture.close();
+    }
 
+    bool BusCan::applyRxTimestamps()
+    {
+        int enable = mCapturing ? 1 : 0;
+        if(setsockopt(mSocket, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) < 0) {
+            perror("SO_TIMESTAMPNS");
+            return false;
+        }
         return true;
     }
 
-    //! Stop the CAN interface and close the socket.
-    bool BusCan::stop()
+    bool BusCan::setTxTimestamps(bool enable)
     {
-        mTerminate = true;
-        if(mReceiveThread.joinable())
-            mReceiveThread.join();
+        mTxTimestamps = enable;
+        if(mSocket < 0)
+            return true;
+        return applyTxTimestamps();
+    }
 
+    bool BusCan::applyTxTimestamps()
+    {
+        int flags = mTxTimestamps ? int(SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE) : 0;
+        if(setsockopt(mSocket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+            perror("SO_TIMESTAMPING");
+            return false;
+        }
+        return true;
+    }
+
+    void BusCan::readTxTimestamps()
+    {
+        // The timestamps are against the real time clock, so are converted by how long ago they were.
+        struct timespec realNow {};
+        clock_gettime(CLOCK_REALTIME, &realNow);
+        auto steadyNow = std::chrono::steady_clock::now();
+        struct can_frame frame {};
+        alignas(struct cmsghdr) char control[256];
+        // Don't let a flood of them hold up received frames.
+        for(int i = 0; i < int(gRxBatch); i++) {
+            struct iovec iov {&frame, sizeof(frame)};
+            struct msghdr msg {};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            ssize_t len = recvmsg(mSocket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+            if(len < 0)
+                break;
+            if(size_t(len) < sizeof(frame))
+                continue;
+            struct timespec stamp {};
+            for(auto *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+                    // Software timestamp first, then two that are no longer used.
+                    memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+                }
+            }
+            if(stamp.tv_sec == 0 && stamp.tv_nsec == 0)
+                continue;
+            mTxTimestampCount++;
+            MotorDriveT mode;
+            if(!(frame.can_id & CAN_EFF_FLAG) || !driveModeFromPacket((frame.can_id >> 8) & 0xFF, mode))
+                continue;
+            auto age = std::chrono::nanoseconds((int64_t(realNow.tv_sec) - int64_t(stamp.tv_sec)) * 1000000000 +
+                                                (int64_t(realNow.tv_nsec) - int64_t(stamp.tv_nsec)));
+            txTimestampCallback(uint8_t(frame.can_id & 0xFF), mode,
+                                steadyNow - std::chrono::duration_cast<std::chrono::steady_clock::duration>(age));
+        }
+    }
+
+    void BusCan::closeDevice()
+    {
         if(mSocket >= 0) {
             close(mSocket);
             mSocket = -1;
         }
+    }
+
+    bool BusCan::register_motor(const std::shared_ptr<Motor> &motor)
+    {
+        if(!BusInterface::register_motor(motor))
+            return false;
+        // The controller would take replies sent to its id as commands, so don't send requests from it.
+        if(motor->id() == mHostIds[0]) {
+            std::cerr << "Motor " << motor->name() << " uses the host id " << int(mHostIds[0]) << ", set 'hostIds' to free ones" << std::endl;
+        }
+        for(size_t i = 1; i < mHostIds.size(); i++) {
+            if(mHostIds[i] == motor->id())
+                reserveRequestChannel(i);
+        }
+        return true;
+    }
+
+    void BusCan::prepareReceive()
+    {
+        mHostChannel.fill(-1);
+        mRxBuffers.resize(mHostIds.size());
+        for(size_t i = 0; i < mHostIds.size(); i++) {
+            mHostChannel[mHostIds[i]] = int16_t(i);
+            mRxBuffers[i].resize(MaxPacketLength + 1);
+        }
+    }
+
+    //! Stop the CAN interface and close the socket.
+    bool BusCan::stop()
+    {
+        mTerminate = true;
+        if(mReceiveThread.joinable())
+            mReceiveThread.join();
+        cancelRequests();
+        closeDevice();
+        stopCapture();
         return true;
     }
 
@@ -123,9 +334,365 @@ namespace multivesc
         frame.can_id = id | CAN_EFF_FLAG;
         frame.can_dlc = len;
         memcpy(frame.data, data, len);
-        write(mSocket, &frame, sizeof(struct can_frame));
+        std::lock_guard lock(mTxMutex);
+        // Commands sent directly aren't deferred, but do use up the budget.  Not below zero, or later ticks would be
+        // held back for longer than the budget window.
+        refillBudget(std::chrono::steady_clock::now());
+        mBudgetBits = std::max(0.0, mBudgetBits - double(frameBits(frame)));
+        sendFrames(&frame, 1);
+    }
+
+
+    uint32_t BusCan::frameBits(const struct can_frame &frame)
+    {
+        uint32_t dataBits = 8u * std::min<uint32_t>(frame.can_dlc, 8);
+        // Bits from start of frame to the end of the CRC are subject to stuffing, worst case one bit in four.
+        uint32_t stuffable;
+        uint32_t total;
+        if(frame.can_id & CAN_EFF_FLAG) {
+            stuffable = 54 + dataBits;
+            total = 67 + dataBits;
+        } else {
+            stuffable = 34 + dataBits;
+            total = 47 + dataBits;
+        }
+        return total + (stuffable - 1) / 4;
+    }
+
+    std::chrono::steady_clock::duration BusCan::phaseOffset(uint8_t controller_id, std::chrono::steady_clock::duration period)
+    {
+        using namespace std::chrono;
+        constexpr int64_t numBins = 1000; // 1ms bins over a second
+        std::lock_guard lock(mTxMutex);
+        if(mPhaseLoad.empty()) {
+            mPhaseLoad.resize(numBins, 0);
+        }
+        int64_t periodBins = std::clamp<int64_t>(duration_cast<milliseconds>(period).count(), 1, numBins);
+        int64_t repeats = (numBins + periodBins - 1) / periodBins;
+        // A setpoint command with 4 bytes of data.
+        struct can_frame frame {};
+        frame.can_id = CAN_EFF_FLAG;
+        frame.can_dlc = 4;
+        uint32_t bits = frameBits(frame);
+
+        // Pick the phase where the busiest bin we'd use is least loaded.
+        int64_t bestPhase = 0;
+        uint64_t bestPeak = std::numeric_limits<uint64_t>::max();
+        uint64_t bestTotal = std::numeric_limits<uint64_t>::max();
+        for(int64_t phase = 0; phase < periodBins; phase++) {
+            uint64_t peak = 0;
+            uint64_t total = 0;
+            for(int64_t k = 0; k < repeats; k++) {
+                uint64_t load = mPhaseLoad[(phase + k * periodBins) % numBins];
+                peak = std::max(peak, load);
+                total += load;
+            }
+            if(peak < bestPeak || (peak == bestPeak && total < bestTotal)) {
+                bestPeak = peak;
+                bestTotal = total;
+                bestPhase = phase;
+            }
+        }
+        for(int64_t k = 0; k < repeats; k++) {
+            mPhaseLoad[(bestPhase + k * periodBins) % numBins] += bits;
+        }
+        if(mVerbose) {
+            std::cout << "Controller " << int(controller_id) << " phase " << bestPhase << " ms" << std::endl;
+        }
+        return duration_cast<steady_clock::duration>(milliseconds(bestPhase));
+    }
+
+    void BusCan::refillBudget(std::chrono::steady_clock::time_point now)
+    {
+        double rate = double(mBitrate) * mTxBudget;
+        double capacity = rate * std::chrono::duration<double>(mBudgetWindow).count();
+        double dt = std::chrono::duration<double>(now - mBudgetTime).count();
+        mBudgetTime = now;
+        if(dt > 0.0) {
+            mBudgetBits = std::min(mBudgetBits + rate * dt, capacity);
+        }
+    }
+
+    size_t BusCan::sendFrames(struct can_frame *frames, size_t count)
+    {
+        size_t sent = writeFrames(frames, count);
+        if(mCapturing && sent > 0)
+            mCapture.append(frames, sent, CaptureDirectionT::TX, captureTimeNow());
+        uint64_t bits = 0;
+        for(size_t i = 0; i < sent; i++) {
+            bits += frameBits(frames[i]);
+        }
+        mTxBitCount += bits;
+        mTxFrameCount += sent;
+        return sent;
+    }
+
+    size_t BusCan::writeFrames(struct can_frame *frames, size_t count)
+    {
+        if(mTxIov.size() < count) {
+            mTxIov.resize(count);
+            mTxMsgs.resize(count);
+        }
+        for(size_t i = 0; i < count; i++) {
+            mTxIov[i].iov_base = &frames[i];
+            mTxIov[i].iov_len = sizeof(struct can_frame);
+            mTxMsgs[i] = {};
+            mTxMsgs[i].msg_hdr.msg_iov = &mTxIov[i];
+            mTxMsgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        size_t sent = 0;
+        while(sent < count) {
+            int ret = sendmmsg(mSocket, &mTxMsgs[sent], unsigned(count - sent), 0);
+            if(ret <= 0) {
+                if(ret < 0 && errno == EINTR)
+                    continue;
+                if(mVerbose && errno != ENOBUFS && errno != EAGAIN) {
+                    perror("sendmmsg");
+                }
+                break;
+            }
+            sent += size_t(ret);
+        }
+        return sent;
+    }
+
+    void BusCan::flushDeferred()
+    {
+        size_t numSend = 0;
+        size_t numKeep = 0;
+        for(auto &frame : mDeferred) {
+            auto bits = double(frameBits(frame));
+            if(mBudgetBits >= bits) {
+                mBudgetBits -= bits;
+                mTxFrames[numSend++] = frame;
+            } else {
+                mDeferred[numKeep++] = frame;
+            }
+        }
+        mDeferred.resize(numKeep);
+        if(numSend > 0) {
+            sendFrames(mTxFrames.data(), numSend);
+        }
+    }
+
+    void BusCan::sendDriveCommands(const DriveCommand *commands, size_t count)
+    {
+        if(!isOpen())
+            return;
+        std::lock_guard lock(mTxMutex);
+        refillBudget(std::chrono::steady_clock::now());
+        if(mTxFrames.size() < count + mDeferred.size()) {
+            mTxFrames.resize(count + mDeferred.size());
+        }
+        // New commands replace any that are still waiting for the same controller, in one pass over the queue.
+        if(!mDeferred.empty()) {
+            std::bitset<256> commanded;
+            for(size_t i = 0; i < count; i++) {
+                commanded.set(commands[i].controllerId & 0xFF);
+            }
+            auto it = std::remove_if(mDeferred.begin(), mDeferred.end(),
+                                     [&commanded](const struct can_frame &frame) { return commanded.test(frame.can_id & 0xFF); });
+            mSupersededCount += uint64_t(std::distance(it, mDeferred.end()));
+            mDeferred.erase(it, mDeferred.end());
+        }
+        // Older commands go first.
+        flushDeferred();
+
+        size_t numSend = 0;
+        for(size_t i = 0; i < count; i++) {
+            struct can_frame frame {};
+            if(!encodeDriveCommand(commands[i], frame))
+                continue;
+            auto bits = double(frameBits(frame));
+            if(mBudgetBits >= bits && mDeferred.empty()) {
+                mBudgetBits -= bits;
+                mTxFrames[numSend++] = frame;
+            } else {
+                mDeferred.push_back(frame);
+                mDeferredCount++;
+            }
+        }
+        if(numSend > 0) {
+            sendFrames(mTxFrames.data(), numSend);
+        }
+    }
+
+    void BusCan::encodePacketFrames(uint8_t controller_id, uint8_t sender, const uint8_t *payload, size_t len,
+                                    std::vector<struct can_frame> &frames, uint8_t send)
+    {
+        frames.clear();
+        struct can_frame frame {};
+        if(len <= 6) {
+            frame.can_id = controller_id | ((uint32_t) CAN_PACKET_PROCESS_SHORT_BUFFER << 8) | CAN_EFF_FLAG;
+            frame.data[0] = sender;
+            frame.data[1] = send;
+            memcpy(frame.data + 2, payload, len);
+            frame.can_dlc = uint8_t(len + 2);
+            frames.push_back(frame);
+            return;
+        }
+        // The same layout as the firmware, 7 bytes a frame with a one byte offset while it fits, then 6 bytes
+        // a frame with a two byte offset.
+        frames.reserve(len / 6 + 2);
+        size_t offset = 0;
+        for(; offset < len && offset <= 255; offset += 7) {
+            size_t n = std::min<size_t>(7, len - offset);
+            frame.can_id = controller_id | ((uint32_t) CAN_PACKET_FILL_RX_BUFFER << 8) | CAN_EFF_FLAG;
+            frame.data[0] = uint8_t(offset);
+            memcpy(frame.data + 1, payload + offset, n);
+            frame.can_dlc = uint8_t(n + 1);
+            frames.push_back(frame);
+        }
+        for(; offset < len; offset += 6) {
+            size_t n = std::min<size_t>(6, len - offset);
+            frame.can_id = controller_id | ((uint32_t) CAN_PACKET_FILL_RX_BUFFER_LONG << 8) | CAN_EFF_FLAG;
+            frame.data[0] = uint8_t(offset >> 8);
+            frame.data[1] = uint8_t(offset);
+            memcpy(frame.data + 2, payload + offset, n);
+            frame.can_dlc = uint8_t(n + 2);
+            frames.push_back(frame);
+        }
+        uint16_t crc = crc16(payload, len);
+        frame.can_id = controller_id | ((uint32_t) CAN_PACKET_PROCESS_RX_BUFFER << 8) | CAN_EFF_FLAG;
+        frame.data[0] = sender;
+        frame.data[1] = send;
+        frame.data[2] = uint8_t(len >> 8);
+        frame.data[3] = uint8_t(len);
+        frame.data[4] = uint8_t(crc >> 8);
+        frame.data[5] = uint8_t(crc);
+        frame.can_dlc = 6;
+        frames.push_back(frame);
     }
 
+    bool BusCan::sendPacket(uint8_t controller_id, const uint8_t *payload, size_t len)
+    {
+        return sendPacketFrom(controller_id, mHostIds[0], payload, len);
+    }
+
+    bool BusCan::sendRequest(size_t channel, uint8_t controller_id, const uint8_t *payload, size_t len)
+    {
+        return sendPacketFrom(controller_id, mHostIds[channel], payload, len);
+    }
+
+    bool BusCan::sendPacketFrom(uint8_t controller_id, uint8_t sender, const uint8_t *payload, size_t len)
+    {
+        if(!isOpen())
+            return false;
+        if(len == 0 || len > MaxPacketLength) {
+            std::cerr << "Packet length " << len << " can't be sent over CAN" << std::endl;
+            return false;
+        }
+        std::lock_guard packetLock(mPacketTxMutex);
+        encodePacketFrames(controller_id, sender, payload, len, mPacketFrames);
+        if(!sendBurst(mPacketFrames.data(), mPacketFrames.size())) {
+            mTxPacketErrors++;
+            if(mVerbose) {
+                std::cerr << "Timeout sending packet to " << int(controller_id) << std::endl;
+            }
+            return false;
+        }
+        mTxPacketCount++;
+        return true;
+    }
+
+    bool BusCan::sendBurst(struct can_frame *frames, size_t count)
+    {
+        // Stream the frames in bursts, when the interface queue is full wait a little for it to drain.
+        size_t sent = 0;
+        auto lastProgress = std::chrono::steady_clock::now();
+        while(sent < count) {
+            size_t n;
+            {
+                std::lock_guard lock(mTxMutex);
+                n = sendFrames(frames + sent, std::min(count - sent, gPacketBurst));
+            }
+            auto now = std::chrono::steady_clock::now();
+            if(n > 0) {
+                sent += n;
+                lastProgress = now;
+                continue;
+            }
+            if(now - lastProgress > std::chrono::milliseconds(100)) {
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+        return true;
+    }
+
+    std::vector<uint8_t> BusCan::scan(const std::vector<uint8_t> &ids, float timeout)
+    {
+        std::vector<uint8_t> found;
+        if(!isOpen())
+            return found;
+        std::lock_guard scanLock(mScanMutex);
+        {
+            std::lock_guard lock(mPongMutex);
+            mPongSeen.fill(false);
+        }
+        std::vector<struct can_frame> frames(ids.size());
+        for(size_t i = 0; i < ids.size(); i++) {
+            frames[i] = {};
+            frames[i].can_id = ids[i] | ((uint32_t) CAN_PACKET_PING << 8) | CAN_EFF_FLAG;
+            frames[i].can_dlc = 1;
+            frames[i].data[0] = mHostIds[0];
+        }
+        if(!sendBurst(frames.data(), frames.size())) {
+            std::cerr << "Failed to send pings on " << mDeviceName << std::endl;
+        }
+        // Time queueing a long burst doesn't come out of the time the last controllers have to reply.
+        auto deadline = std::chrono::steady_clock::now() +
+                std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(timeout));
+        std::unique_lock lock(mPongMutex);
+        mPongCondition.wait_until(lock, deadline, [this, &ids]() {
+            return std::all_of(ids.begin(), ids.end(), [this](uint8_t id) { return mPongSeen[id]; });
+        });
+        for(auto id : ids) {
+            if(mPongSeen[id])
+                found.push_back(id);
+        }
+        return found;
+    }
+
+    json BusCan::stats()
+    {
+        json result = BusInterface::stats();
+        auto now = std::chrono::steady_clock::now();
+        uint64_t txBits = mTxBitCount;
+        uint64_t rxBits = mRxBitCount;
+        std::lock_guard lock(mTxMutex);
+        // Load is measured since stats were last requested.
+        double dt = std::chrono::duration<double>(now - mStatsTime).count();
+        double txLoad = 0.0;
+        double rxLoad = 0.0;
+        if(mStatsTime.time_since_epoch().count() != 0 && dt > 0.0) {
+            txLoad = double(txBits - mStatsTxBits) / (dt * mBitrate);
+            rxLoad = double(rxBits - mStatsRxBits) / (dt * mBitrate);
+        }
+        mStatsTime = now;
+        mStatsTxBits = txBits;
+        mStatsRxBits = rxBits;
+
+        result["bitrate"] = mBitrate;
+        result["txBudget"] = mTxBudget;
+        result["txFrames"] = uint64_t(mTxFrameCount);
+        result["rxFrames"] = uint64_t(mRxFrameCount);
+        result["deferredFrames"] = uint64_t(mDeferredCount);
+        result["supersededFrames"] = uint64_t(mSupersededCount);
+        result["pendingFrames"] = mDeferred.size();
+        result["txPackets"] = uint64_t(mTxPacketCount);
+        result["txPacketErrors"] = uint64_t(mTxPacketErrors);
+        result["rxPackets"] = uint64_t(mRxPacketCount);
+        result["rxPacketCrcErrors"] = uint64_t(mRxPacketCrcErrors);
+        result["txTimestamps"] = uint64_t(mTxTimestampCount);
+        result["capturedFrames"] = mCapture.recordCount();
+        result["captureDropped"] = mCapture.droppedCount();
+        result["txLoad"] = txLoad;
+        result["rxLoad"] = rxLoad;
+        result["busLoad"] = txLoad + rxLoad;
+        result["budgetUsed"] = mTxBudget > 0.0f ? txLoad / mTxBudget : 0.0;
+        return result;
+    }
 
     void BusCan::setDuty(uint8_t controller_id, float duty)
     {
@@ -247,31 +814,106 @@ namespace multivesc
     }
 
 
+    bool BusCan::sendDeferred()
+    {
+        std::lock_guard lock(mTxMutex);
+        if(!mDeferred.empty()) {
+            refillBudget(std::chrono::steady_clock::now());
+            flushDeferred();
+        }
+        return !mDeferred.empty();
+    }
+
     //! Read packets from the CAN interface and call the appropriate callback functions.
     void BusCan::run_receive_thread()
     {
-        struct can_frame frame;
+        // Frames are read in batches, so a burst such as a long reply doesn't cost a system call per frame.
+        struct can_frame frames[gRxBatch];
 
         while(!mTerminate)
         {
-            // Wait for data on the socket
-            if(!wait_for_data(0.5))
-                continue;
-            auto nbytes = read(mSocket, &frame, sizeof(struct can_frame));
-            if (nbytes < 0) {
-                perror("Read");
+            // Wait for data on the socket, waking regularly while there are deferred frames to send.
+            bool pending = sendDeferred();
+            // Requests are checked for timeouts every 10ms.
+            expireRequests(std::chrono::steady_clock::now());
+            int count = readFrames(frames, gRxBatch, pending ? 0.001f : (pendingRequests() > 0 ? 0.01f : 0.5f));
+            if(count < 0)
                 break;
+            receiveFrames(frames, size_t(count), mRxTimes.size() >= size_t(count) ? mRxTimes.data() : nullptr);
+        }
+    }
+
+    int BusCan::readFrames(struct can_frame *frames, unsigned maxFrames, float timeoutSeconds)
+    {
+        if(!wait_for_data(timeoutSeconds))
+            return 0;
+        // Timestamps in the error queue wake the select() too.
+        if(mTxTimestamps)
+            readTxTimestamps();
+        // Room for a SCM_TIMESTAMPNS message with each frame.
+        constexpr size_t controlWords = 8;
+        static_assert(CMSG_SPACE(sizeof(struct timespec)) <= controlWords * sizeof(uint64_t));
+        if(mRxMsgs.size() < maxFrames) {
+            mRxIov.resize(maxFrames);
+            mRxMsgs.resize(maxFrames);
+            mRxControl.resize(maxFrames * controlWords);
+            mRxTimes.resize(maxFrames);
+        }
+        bool capturing = mCapturing;
+        for(unsigned i = 0; i < maxFrames; i++) {
+            mRxIov[i].iov_base = &frames[i];
+            mRxIov[i].iov_len = sizeof(struct can_frame);
+            mRxMsgs[i] = {};
+            mRxMsgs[i].msg_hdr.msg_iov = &mRxIov[i];
+            mRxMsgs[i].msg_hdr.msg_iovlen = 1;
+            if(capturing) {
+                mRxMsgs[i].msg_hdr.msg_control = &mRxControl[i * controlWords];
+                mRxMsgs[i].msg_hdr.msg_controllen = controlWords * sizeof(uint64_t);
+            }
+        }
+        int count = recvmmsg(mSocket, mRxMsgs.data(), maxFrames, MSG_DONTWAIT, nullptr);
+        if (count < 0) {
+            if(errno == EINTR || errno == EAGAIN)
+                return 0;
+            perror("Read");
+            return -1;
+        }
+        for(int i = 0; i < count; i++) {
+            mRxTimes[i] = 0;
+            if(!capturing)
+                continue;
+            auto &msg = mRxMsgs[i].msg_hdr;
+            for(auto *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                    struct timespec stamp {};
+                    memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+                    mRxTimes[i] = int64_t(stamp.tv_sec) * 1000000000 + stamp.tv_nsec;
+                }
             }
+        }
+        return count;
+    }
+
+    void BusCan::receiveFrames(const struct can_frame *frames, size_t count, const int64_t *timesNs)
+    {
+        if(mCapturing)
+            mCapture.append(frames, count, CaptureDirectionT::RX, captureTimeNow(), timesNs, true);
+        uint64_t bits = 0;
+        for(size_t i = 0; i < count; i++) {
+            const auto &frame = frames[i];
+            bits += frameBits(frame);
 
             if(mVerbose) {
                 printf("0x%03X [%d] ", frame.can_id, frame.can_dlc);
-                for (int i = 0; i < frame.can_dlc; i++)
-                    printf("%02X ", frame.data[i]);
+                for (int j = 0; j < frame.can_dlc; j++)
+                    printf("%02X ", frame.data[j]);
                 printf("\n");
             }
 
             decode(frame);
         }
+        mRxFrameCount += count;
+        mRxBitCount += bits;
     }
 
     void BusCan::decode(const can_frame &frame)
@@ -291,6 +933,24 @@ namespace multivesc
             case CAN_PACKET_SET_CURRENT_HANDBRAKE_REL:
                 // Do nothing for now, these came from something else sending commands on the bus.
                 break;
+            case CAN_PACKET_FILL_RX_BUFFER:
+            case CAN_PACKET_FILL_RX_BUFFER_LONG:
+            case CAN_PACKET_PROCESS_RX_BUFFER:
+            case CAN_PACKET_PROCESS_SHORT_BUFFER:
+                decodeBuffer(frame);
+                break;
+            case CAN_PACKET_PING:
+                // Another node looking for controllers.
+                break;
+            case CAN_PACKET_PONG:
+                if(controllerId == mHostIds[0] && frame.can_dlc >= 1) {
+                    {
+                        std::lock_guard lock(mPongMutex);
+                        mPongSeen[frame.data[0]] = true;
+                    }
+                    mPongCondition.notify_all();
+                }
+                break;
             case CAN_PACKET_STATUS:
             {
                 auto erpm = get_scaled_float32(frame.data, 0, 1);
@@ -337,6 +997,58 @@ namespace multivesc
         }
     }
 
+    void BusCan::decodeBuffer(const can_frame &frame)
+    {
+        // Packets sent between other nodes are none of our business.
+        int channel = mHostChannel[frame.can_id & 0xFF];
+        if(channel < 0)
+            return;
+        auto &rxBuffer = mRxBuffers[size_t(channel)];
+        const uint8_t *data = frame.data;
+        size_t dlc = std::min<size_t>(frame.can_dlc, 8);
+        // The fill frames don't say who they are from, so replies from different controllers must not overlap.
+        // If they do the CRC check catches it.
+        switch((frame.can_id >> 8) & 0xFF) {
+            case CAN_PACKET_FILL_RX_BUFFER:
+                if(dlc >= 1) {
+                    memcpy(rxBuffer.data() + data[0], data + 1, dlc - 1);
+                }
+                break;
+            case CAN_PACKET_FILL_RX_BUFFER_LONG:
+                if(dlc >= 2) {
+                    size_t offset = size_t(data[0]) << 8 | data[1];
+                    if(offset + dlc - 2 <= rxBuffer.size())
+                        memcpy(rxBuffer.data() + offset, data + 2, dlc - 2);
+                }
+                break;
+            case CAN_PACKET_PROCESS_RX_BUFFER:
+            {
+                if(dlc < 6)
+                    break;
+                uint8_t sender = data[0];
+                size_t len = size_t(data[2]) << 8 | data[3];
+                uint16_t crc = uint16_t(data[4] << 8 | data[5]);
+                if(len == 0 || crc16(rxBuffer.data(), len) != crc) {
+                    mRxPacketCrcErrors++;
+                    if(mVerbose) {
+                        std::cerr << "Bad CRC on packet from " << int(sender) << std::endl;
+                    }
+                    break;
+                }
+                mRxPacketCount++;
+                packetCallback(sender, rxBuffer.data(), len, channel);
+            } break;
+            case CAN_PACKET_PROCESS_SHORT_BUFFER:
+                if(dlc >= 3) {
+                    mRxPacketCount++;
+                    packetCallback(data[0], data + 2, dlc - 2, channel);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
 
 
 } // multivesc
\ No newline at end of file
@@ -3,8 +3,12 @@
 //
 
 #include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <bitset>
 #include "multivesc/BusInterface.hh"
 #include "multivesc/Motor.hh"
+#include "multivesc/VescPacket.hh"
 
 namespace multivesc
 {
@@ -38,6 +42,12 @@ namespace multivesc
             std::cerr << "Motor id out of range. " << id << " >= " << mMotors.size() << std::endl;
             return false;
         }
+        if(mMotors[id] != motor) {
+            if(mMotors[id]) {
+                mActiveMotors.erase(std::remove(mActiveMotors.begin(), mActiveMotors.end(), mMotors[id].get()), mActiveMotors.end());
+            }
+            mActiveMotors.push_back(motor.get());
+        }
         mMotors[id] = motor;
         return true;
     }
@@ -52,16 +62,355 @@ namespace multivesc
         return mMotors[id];
     }
 
-    void BusInterface::update()
+    void BusInterface::update(std::chrono::steady_clock::time_point now)
+    {
+        {
+            std::lock_guard lock(mMutex);
+            mTickMotors.assign(mActiveMotors.begin(), mActiveMotors.end());
+        }
+        updateMotors(now, mTickMotors);
+    }
+
+    void BusInterface::updateMotors(std::chrono::steady_clock::time_point now, const std::vector<Motor *> &motors)
+    {
+        // Gather the demands, limit them all in one pass, then send them as a batch.
+        mKernel.clear();
+        mTickSlots.clear();
+        for(auto *motor : motors)
+        {
+            // If reactive control is sending for the motor it has just been given a fresh command, skip it this tick.
+            if(!motor->mSendMutex.try_lock())
+                continue;
+            size_t slot = 0;
+            if(motor->prepareUpdate(now, mKernel, slot)) {
+                mTickSlots.emplace_back(motor, slot);
+            } else {
+                motor->mSendMutex.unlock();
+            }
+        }
+        if(mKernel.size() == 0)
+            return;
+        mKernel.run();
+        sendDriveCommands(mKernel.commands(), mKernel.size());
+        auto sent = std::chrono::steady_clock::now();
+        for(auto &entry : mTickSlots)
+        {
+            entry.first->completeUpdate(mKernel, entry.second, now, sent);
+            entry.first->mSendMutex.unlock();
+        }
+    }
+
+    void BusInterface::sendDriveCommands(const DriveCommand *commands, size_t count)
+    {
+        for(size_t i = 0; i < count; i++)
+        {
+            const auto &cmd = commands[i];
+            switch(cmd.mode)
+            {
+                case MotorDriveT::NONE:
+                    break;
+                case MotorDriveT::DUTY:
+                    setDuty(cmd.controllerId, cmd.value);
+                    break;
+                case MotorDriveT::CURRENT:
+                    setCurrent(cmd.controllerId, cmd.value);
+                    break;
+                case MotorDriveT::RPM:
+                    setRPM(cmd.controllerId, cmd.value);
+                    break;
+                case MotorDriveT::POS:
+                    setPos(cmd.controllerId, cmd.value);
+                    break;
+                case MotorDriveT::CURRENT_REL:
+                    setCurrentRel(cmd.controllerId, cmd.value);
+                    break;
+                case MotorDriveT::CURRENT_BREAK:
+                    setCurrentBrake(cmd.controllerId, cmd.value);
+                    break;
+                case MotorDriveT::CURRENT_BREAK_REL:
+                    setCurrentBrakeRel(cmd.controllerId, cmd.value);
+                    break;
+                case MotorDriveT::HAND_BRAKE:
+                    setHandbrake(cmd.controllerId, cmd.value);
+                    break;
+                case MotorDriveT::HAND_BRAKE_REL:
+                    setHandbrakeRel(cmd.controllerId, cmd.value);
+                    break;
+            }
+        }
+    }
+
+
+    std::chrono::steady_clock::duration BusInterface::phaseOffset(uint8_t controller_id, std::chrono::steady_clock::duration period)
+    {
+        std::lock_guard lock(mMutex);
+        double phase = std::fmod(double(mPhaseCount++) * 0.6180339887498949, 1.0);
+        return std::chrono::duration_cast<std::chrono::steady_clock::duration>(period * phase);
+    }
+
+    bool BusInterface::sendPacket(uint8_t controller_id, const uint8_t *payload, size_t len)
+    {
+        std::cerr << "sendPacket not supported on this bus" << std::endl;
+        return false;
+    }
+
+    void BusInterface::setPacketCallback(PacketCallbackT callback)
+    {
+        std::lock_guard lock(mPacketMutex);
+        mPacketCallback = std::move(callback);
+    }
+
+    void BusInterface::packetCallback(uint8_t controllerId, const uint8_t *payload, size_t len, int channel)
+    {
+        if(len > 0 && mPendingRequests > 0) {
+            std::promise<std::vector<uint8_t>> promise;
+            bool matched = false;
+            {
+                std::lock_guard lock(mRequestMutex);
+                for(auto it = mRequests.begin(); it != mRequests.end(); ++it) {
+                    if(it->channel < 0 || it->command != payload[0])
+                        continue;
+                    // Use the channel if the bus knows it, otherwise take the oldest request that could match.
+                    if(channel >= 0 ? it->channel != channel :
+                       (controllerId != UnknownControllerId && it->controllerId != controllerId))
+                        continue;
+                    promise = std::move(it->promise);
+                    mChannelBusy[size_t(it->channel)] = false;
+                    mRequests.erase(it);
+                    mPendingRequests--;
+                    matched = true;
+                    break;
+                }
+            }
+            if(matched) {
+                promise.set_value(std::vector<uint8_t>(payload, payload + len));
+                dispatchRequests();
+            }
+        }
+        std::lock_guard lock(mPacketMutex);
+        if(mPacketCallback) {
+            mPacketCallback(controllerId, payload, len);
+        }
+    }
+
+    std::future<std::vector<uint8_t>> BusInterface::request(uint8_t controller_id, const uint8_t *payload, size_t len, float timeout)
+    {
+        std::future<std::vector<uint8_t>> future;
+        if(len == 0) {
+            std::promise<std::vector<uint8_t>> promise;
+            future = promise.get_future();
+            promise.set_value({});
+            mRequestFailures++;
+            return future;
+        }
+        {
+            std::lock_guard lock(mRequestMutex);
+            auto &req = mRequests.emplace_back();
+            req.serial = ++mRequestSerial;
+            req.controllerId = controller_id;
+            req.command = payload[0];
+            req.timeout = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(timeout));
+            req.deadline = std::chrono::steady_clock::now() + req.timeout;
+            req.payload.assign(payload, payload + len);
+            future = req.promise.get_future();
+            mPendingRequests++;
+        }
+        dispatchRequests();
+        return future;
+    }
+
+    std::vector<std::vector<uint8_t>> BusInterface::requestAll(const std::vector<uint8_t> &ids, const std::vector<uint8_t> &payload, float timeout)
+    {
+        return requestAll(ids, std::vector<std::vector<uint8_t>>(ids.size(), payload), timeout);
+    }
+
+    std::vector<std::vector<uint8_t>> BusInterface::requestAll(const std::vector<uint8_t> &ids, const std::vector<std::vector<uint8_t>> &payloads, float timeout)
+    {
+        std::vector<std::vector<uint8_t>> replies(ids.size());
+        if(payloads.size() != ids.size()) {
+            std::cerr << "requestAll needs a payload for each controller" << std::endl;
+            return replies;
+        }
+        if(!repliesIdentifySender()) {
+            for(size_t i = 0; i < ids.size(); i++) {
+                replies[i] = request(ids[i], payloads[i], timeout).get();
+            }
+            return replies;
+        }
+        std::vector<std::future<std::vector<uint8_t>>> futures;
+        futures.reserve(ids.size());
+        for(size_t i = 0; i < ids.size(); i++) {
+            futures.push_back(request(ids[i], payloads[i], timeout));
+        }
+        for(size_t i = 0; i < ids.size(); i++) {
+            replies[i] = futures[i].get();
+        }
+        return replies;
+    }
+
+    std::vector<uint8_t> BusInterface::scan(const std::vector<uint8_t> &ids, float timeout)
+    {
+        auto replies = requestAll(ids, std::vector<uint8_t> {COMM_FW_VERSION}, timeout);
+        std::vector<uint8_t> found;
+        for(size_t i = 0; i < ids.size(); i++) {
+            if(!replies[i].empty())
+                found.push_back(ids[i]);
+        }
+        return found;
+    }
+
+    bool BusInterface::sendRequest(size_t channel, uint8_t controller_id, const uint8_t *payload, size_t len)
+    {
+        return sendPacket(controller_id, payload, len);
+    }
+
+    void BusInterface::reserveRequestChannel(size_t channel)
+    {
+        std::lock_guard lock(mRequestMutex);
+        if(mChannelBusy.empty()) {
+            mChannelBusy.resize(std::max<size_t>(requestChannels(), 1), false);
+            mChannelReserved.resize(mChannelBusy.size(), false);
+        }
+        if(channel < mChannelReserved.size())
+            mChannelReserved[channel] = true;
+    }
+
+    void BusInterface::dispatchRequests()
+    {
+        struct SendT
+        {
+            uint64_t serial;
+            size_t channel;
+            uint8_t controllerId;
+            std::vector<uint8_t> payload;
+        };
+        std::vector<SendT> toSend;
+        // Without the sender in replies, a reply can only be matched to a request by its command.
+        bool byCommand = !repliesIdentifySender();
+        auto now = std::chrono::steady_clock::now();
+        {
+            std::lock_guard lock(mRequestMutex);
+            if(mChannelBusy.empty()) {
+                mChannelBusy.resize(std::max<size_t>(requestChannels(), 1), false);
+                mChannelReserved.resize(mChannelBusy.size(), false);
+            }
+            std::bitset<256> commandBusy;
+            if(byCommand) {
+                for(auto &req : mRequests) {
+                    if(req.channel >= 0)
+                        commandBusy.set(req.command);
+                }
+            }
+            size_t channel = 0;
+            for(auto &req : mRequests) {
+                if(req.channel >= 0)
+                    continue;
+                if(byCommand && (commandBusy.test(req.command) || now < mCommandQuietUntil[req.command]))
+                    continue;
+                while(channel < mChannelBusy.size() && (mChannelBusy[channel] || mChannelReserved[channel]))
+                    channel++;
+                if(channel >= mChannelBusy.size())
+                    break;
+                mChannelBusy[channel] = true;
+                req.channel = int(channel);
+                commandBusy.set(req.command);
+                toSend.push_back(SendT {req.serial, channel, req.controllerId, req.payload});
+            }
+        }
+        // Send without holding the lock, as replies may arrive before we're done.
+        for(auto &send : toSend) {
+            if(sendRequest(send.channel, send.controllerId, send.payload.data(), send.payload.size())) {
+                mRequestsSent++;
+                continue;
+            }
+            mRequestFailures++;
+            std::promise<std::vector<uint8_t>> promise;
+            {
+                std::lock_guard lock(mRequestMutex);
+                auto it = std::find_if(mRequests.begin(), mRequests.end(), [&send](const RequestT &req) { return req.serial == send.serial; });
+                if(it == mRequests.end())
+                    continue;
+                promise = std::move(it->promise);
+                mChannelBusy[send.channel] = false;
+                mRequests.erase(it);
+                mPendingRequests--;
+            }
+            promise.set_value({});
+        }
+    }
+
+    void BusInterface::cancelRequests()
+    {
+        expireRequests(std::chrono::steady_clock::time_point::max());
+    }
+
+    void BusInterface::expireRequests(std::chrono::steady_clock::time_point now)
+    {
+        if(mPendingRequests == 0)
+            return;
+        std::vector<std::promise<std::vector<uint8_t>>> expired;
+        bool byCommand = !repliesIdentifySender();
+        bool waiting = false;
+        {
+            std::lock_guard lock(mRequestMutex);
+            for(auto it = mRequests.begin(); it != mRequests.end();) {
+                if(it->deadline > now) {
+                    // Requests held back by command wait for a quiet period to end.
+                    waiting = waiting || (byCommand && it->channel < 0);
+                    ++it;
+                    continue;
+                }
+                expired.push_back(std::move(it->promise));
+                if(it->channel >= 0) {
+                    mChannelBusy[size_t(it->channel)] = false;
+                    // The reply may still come, don't let it be taken for the next request with the command.
+                    if(byCommand && now != std::chrono::steady_clock::time_point::max())
+                        mCommandQuietUntil[it->command] = now + it->timeout;
+                }
+                it = mRequests.erase(it);
+                mPendingRequests--;
+                mRequestTimeouts++;
+            }
+        }
+        for(auto &promise : expired) {
+            promise.set_value({});
+        }
+        if((!expired.empty() || waiting) && now != std::chrono::steady_clock::time_point::max())
+            dispatchRequests();
+    }
+
+    json BusInterface::stats()
     {
-        for(auto& motor : mMotors)
+        std::lock_guard lock(mMutex);
+        json result;
+        result["motors"] = mActiveMotors.size();
+        // Age of the status data used for each command, over the motors that report status.
+        float latencySum = 0.0f;
+        float latencyMax = 0.0f;
+        size_t latencyCount = 0;
+        for(auto *motor : mActiveMotors)
         {
-            if(motor == nullptr)
+            float latency = motor->statusLatency();
+            if(latency <= 0.0f)
                 continue;
-            motor->update();
+            latencySum += latency;
+            latencyMax = std::max(latencyMax, motor->statusLatencyMax());
+            latencyCount++;
         }
+        result["statusLatency"] = latencyCount > 0 ? latencySum / float(latencyCount) : 0.0f;
+        result["statusLatencyMax"] = latencyMax;
+        result["requestsSent"] = uint64_t(mRequestsSent);
+        result["requestTimeouts"] = uint64_t(mRequestTimeouts);
+        result["requestFailures"] = uint64_t(mRequestFailures);
+        result["pendingRequests"] = size_t(mPendingRequests);
+        return result;
     }
 
+    void BusInterface::valueCallback(uint8_t controllerId, MotorValuesT type, float value)
+    {
+        auto motor = getMotor(controllerId);
+        motor->valueCallback(type, value);
+    }
 
     void BusInterface::statusCallback(uint8_t controllerId, float erpm, float current, float dutyCycle)
     {
@@ -100,6 +449,12 @@ namespace multivesc
         motor->status6Callback(adc1, adc2, adc3, ppm);
     }
 
+    void BusInterface::txTimestampCallback(uint8_t controllerId, MotorDriveT mode, std::chrono::steady_clock::time_point when)
+    {
+        auto motor = getMotor(controllerId);
+        motor->traceTransmit(mode, when);
+    }
+
     void BusInterface::setDuty(uint8_t controller_id, float duty)
     {
         std::cerr << "setDuty not implemented" << std::endl;
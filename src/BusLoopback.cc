@@ -0,0 +1,157 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#include <iostream>
+#include "multivesc/BusLoopback.hh"
+
+namespace multivesc {
+
+    namespace {
+        constexpr size_t gBatch = 256;
+    }
+
+    BusLoopback::BusLoopback(const json &config)
+     : BusCan(config),
+       mThreaded(config.value("threaded", true)),
+       mToControllers(config.value("queueSize", size_t(65536))),
+       mFromControllers(config.value("queueSize", size_t(65536)))
+    {
+        // There is no real bus, so unless asked otherwise don't hold commands back to share it.
+        if(!config.contains("bitrate"))
+            mBitrate = 1000000000;
+        for(auto &controller : makeSimControllers(config)) {
+            mById[controller->id()] = controller.get();
+            mControllers.push_back(std::move(controller));
+        }
+        mIn.resize(gBatch);
+    }
+
+    BusLoopback::~BusLoopback()
+    {
+        stop();
+    }
+
+    bool BusLoopback::open()
+    {
+        if(mThreaded)
+            return BusCan::open();
+        // Everything happens in step().
+        if(isOpen())
+            return false;
+        openDevice();
+        prepareReceive();
+        return true;
+    }
+
+    bool BusLoopback::openDevice()
+    {
+        mOpen = true;
+        if(mThreaded) {
+            mStopControllers = false;
+            mControllerThread = std::thread(&BusLoopback::run, this);
+        }
+        return true;
+    }
+
+    void BusLoopback::closeDevice()
+    {
+        mStopControllers = true;
+        if(mControllerThread.joinable())
+            mControllerThread.join();
+        mOpen = false;
+    }
+
+    size_t BusLoopback::writeFrames(struct can_frame *frames, size_t count)
+    {
+        size_t n = mToControllers.push(frames, count);
+        // When stepped nothing will make room, so don't let the caller wait for it.
+        if(n < count && !mThreaded) {
+            mTxDropped += count - n;
+            return count;
+        }
+        return n;
+    }
+
+    int BusLoopback::readFrames(struct can_frame *frames, unsigned maxFrames, float timeoutSeconds)
+    {
+        size_t n = mFromControllers.pop(frames, maxFrames);
+        if(n > 0)
+            return int(n);
+        auto deadline = std::chrono::steady_clock::now() +
+                std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(timeoutSeconds));
+        if(!mFromControllers.waitUntil(deadline))
+            return 0;
+        return int(mFromControllers.pop(frames, maxFrames));
+    }
+
+    std::chrono::steady_clock::time_point BusLoopback::runControllers(std::chrono::steady_clock::time_point now)
+    {
+        size_t n;
+        while((n = mToControllers.pop(mIn.data(), mIn.size())) > 0) {
+            for(size_t i = 0; i < n; i++) {
+                const auto &frame = mIn[i];
+                uint8_t dest = frame.can_id & 0xFF;
+                if(dest == 255) {
+                    for(auto &controller : mControllers)
+                        controller->receive(frame, now, mOut);
+                } else if(mById[dest] != nullptr) {
+                    mById[dest]->receive(frame, now, mOut);
+                }
+            }
+        }
+        auto next = now + std::chrono::milliseconds(100);
+        for(auto &controller : mControllers) {
+            next = std::min(next, controller->update(now, mOut));
+        }
+        return next;
+    }
+
+    void BusLoopback::run()
+    {
+        while(!mStopControllers) {
+            auto next = runControllers(std::chrono::steady_clock::now());
+            // Hand everything over, waiting for the receive thread to make room if it has fallen behind.
+            size_t sent = 0;
+            while(sent < mOut.size() && !mStopControllers) {
+                size_t n = mFromControllers.push(mOut.data() + sent, mOut.size() - sent);
+                if(n == 0)
+                    std::this_thread::yield();
+                sent += n;
+            }
+            mOut.clear();
+            mToControllers.waitUntil(next);
+        }
+    }
+
+    size_t BusLoopback::step(std::chrono::steady_clock::time_point now)
+    {
+        if(mThreaded || !isOpen())
+            return 0;
+        sendDeferred();
+        runControllers(now);
+        size_t count = mOut.size();
+        receiveFrames(mOut.data(), count);
+        mOut.clear();
+        expireRequests(now);
+        return count;
+    }
+
+    json BusLoopback::state() const
+    {
+        json state = json::array();
+        for(auto &controller : mControllers) {
+            state.push_back(controller->state());
+        }
+        return state;
+    }
+
+    json BusLoopback::stats()
+    {
+        json result = BusCan::stats();
+        result["controllers"] = mControllers.size();
+        result["txDropped"] = uint64_t(mTxDropped);
+        return result;
+    }
+
+} // multivesc
@@ -0,0 +1,153 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#include <iostream>
+#include <algorithm>
+#include "multivesc/BusReplay.hh"
+
+namespace multivesc {
+
+    namespace {
+        constexpr size_t gBatch = 64;
+        constexpr auto gWaitPoll = std::chrono::milliseconds(5);
+    }
+
+    BusReplay::BusReplay(const json &config)
+     : BusCan(config),
+       mFilename(config.value("file", std::string())),
+       mInterface(config.value("interface", std::string())),
+       mSpeed(config.value("speed", 1.0f))
+    {
+        // The capture already shows how busy the bus was, don't hold commands back.
+        if(!config.contains("bitrate"))
+            mBitrate = 1000000000;
+    }
+
+    BusReplay::~BusReplay()
+    {
+        stop();
+    }
+
+    bool BusReplay::openSource()
+    {
+        if(mReader.isOpen() || mLog.isOpen())
+            return true;
+        if(mFilename.empty()) {
+            std::cerr << "No capture file given to replay" << std::endl;
+            return false;
+        }
+        // Anything that isn't a capture is taken to be a candump log.
+        mCandump = !CaptureReader::isCapture(mFilename);
+        if(!mCandump)
+            return mReader.open(mFilename);
+        mLog.setInterface(mInterface);
+        return mLog.open(mFilename);
+    }
+
+    bool BusReplay::nextReceived()
+    {
+        if(mHaveRecord)
+            return true;
+        if(mCandump) {
+            while(mLog.next(mRecord)) {
+                if(mRecord.direction == CaptureDirectionT::RX) {
+                    mHaveRecord = true;
+                    return true;
+                }
+            }
+        } else {
+            // Pick up frames added if the capture is still being written.
+            if(mNext >= mReader.size())
+                mReader.refresh();
+            for(; mNext < mReader.size(); mNext++) {
+                if(mReader[mNext].direction == CaptureDirectionT::RX) {
+                    mRecord = mReader[mNext++];
+                    mHaveRecord = true;
+                    return true;
+                }
+            }
+        }
+        mFinished = true;
+        return false;
+    }
+
+    bool BusReplay::openDevice()
+    {
+        if(!openSource())
+            return false;
+        mStarted = false;
+        mOpen = true;
+        return true;
+    }
+
+    void BusReplay::closeDevice()
+    {
+        mOpen = false;
+    }
+
+    size_t BusReplay::writeFrames(struct can_frame *frames, size_t count)
+    {
+        return count;
+    }
+
+    int BusReplay::readFrames(struct can_frame *frames, unsigned maxFrames, float timeoutSeconds)
+    {
+        auto now = std::chrono::steady_clock::now();
+        auto deadline = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(timeoutSeconds));
+        if(!mPlaying) {
+            // Check again soon, so playing starts promptly once it is asked for.
+            std::this_thread::sleep_until(std::min(now + gWaitPoll, deadline));
+            return 0;
+        }
+        unsigned count = 0;
+        while(count < maxFrames && nextReceived()) {
+            mFinished = false;
+            if(!mStarted) {
+                mStarted = true;
+                mStartCaptureNs = mRecord.timeNs;
+                mStartTime = now;
+            }
+            if(mSpeed > 0.0f) {
+                auto due = mStartTime + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double, std::nano>(double(mRecord.timeNs - mStartCaptureNs) / mSpeed));
+                if(due > now) {
+                    if(count == 0)
+                        std::this_thread::sleep_until(std::min(due, deadline));
+                    break;
+                }
+            }
+            frames[count++] = captureFrame(mRecord);
+            mHaveRecord = false;
+        }
+        if(count == 0 && mFinished)
+            std::this_thread::sleep_until(deadline);
+        return int(count);
+    }
+
+    size_t BusReplay::replayAll()
+    {
+        if(isOpen()) {
+            std::cerr << "Can't replay all the frames while the bus is open" << std::endl;
+            return 0;
+        }
+        if(!openSource())
+            return 0;
+        prepareReceive();
+        struct can_frame frames[gBatch];
+        size_t total = 0;
+        while(true) {
+            size_t count = 0;
+            while(count < gBatch && nextReceived()) {
+                frames[count++] = captureFrame(mRecord);
+                mHaveRecord = false;
+            }
+            if(count == 0)
+                break;
+            receiveFrames(frames, count);
+            total += count;
+        }
+        return total;
+    }
+
+} // multivesc
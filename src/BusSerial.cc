@@ -3,76 +3,670 @@
 //
 
 #include "multivesc/BusSerial.hh"
+#include "multivesc/Motor.hh"
 
 #include <iostream>
+#include <utility>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
 
 namespace multivesc
 {
+    namespace {
+
+        //! Map a baud rate to a termios speed.
+        speed_t baudToSpeed(int baud)
+        {
+            switch(baud)
+            {
+                case 9600: return B9600;
+                case 19200: return B19200;
+                case 38400: return B38400;
+                case 57600: return B57600;
+                case 115200: return B115200;
+                case 230400: return B230400;
+                case 460800: return B460800;
+                case 500000: return B500000;
+                case 921600: return B921600;
+                case 1000000: return B1000000;
+                case 2000000: return B2000000;
+                default: return B0;
+            }
+        }
+
+        //! A field of the COMM_GET_VALUES_SELECTIVE response, indexed by its bit in the mask.
+        struct SelectiveFieldT
+        {
+            uint8_t size;      //!< Bytes in the response
+            float scale;       //!< Divide the raw value by this
+            int valueType;     //!< MotorValuesT it is passed on as, -1 for none
+        };
+
+        constexpr int gSelectiveControllerIdBit = 17;
+
+        constexpr SelectiveFieldT gSelectiveFields[] = {
+            {2, 10, int(MotorValuesT::TEMP_FET)},
+            {2, 10, int(MotorValuesT::TEMP_MOTOR)},
+            {4, 100, int(MotorValuesT::CURRENT)},
+            {4, 100, int(MotorValuesT::CURRENT_IN)},
+            {4, 100, -1},                                  // Id
+            {4, 100, -1},                                  // Iq
+            {2, 1000, int(MotorValuesT::DUTY)},
+            {4, 1, int(MotorValuesT::RPM)},
+            {2, 10, int(MotorValuesT::VIN)},
+            {4, 10000, int(MotorValuesT::AMPHOURS)},
+            {4, 10000, int(MotorValuesT::AMPHOURSCHARGED)},
+            {4, 10000, int(MotorValuesT::WATTHOURS)},
+            {4, 10000, int(MotorValuesT::WATTHOURSCHARGED)},
+            {4, 6, int(MotorValuesT::TACHOMETER)},          // Scaled to match CAN status
+            {4, 6, -1},                                    // Absolute tachometer
+            {1, 1, -1},                                    // Fault code
+            {4, 1000000, int(MotorValuesT::PID_POS)},
+            {1, 1, -1},                                    // Controller id
+            {6, 10, -1},                                   // MOSFET temperatures
+            {4, 1000, -1},                                 // Vd
+            {4, 1000, -1},                                 // Vq
+        };
+
+        constexpr size_t gNumSelectiveFields = sizeof(gSelectiveFields) / sizeof(gSelectiveFields[0]);
+
+        //! Bit in the selective mask for each MotorValuesT, -1 if it can't be polled.
+        constexpr int selectiveBit(MotorValuesT type)
+        {
+            for(size_t i = 0; i < gNumSelectiveFields; i++) {
+                if(gSelectiveFields[i].valueType == int(type))
+                    return int(i);
+            }
+            return -1;
+        }
+
+        //! Values polled when a motor hasn't set any telemetry rates, those carried by the CAN status messages.
+        constexpr MotorValuesT gDefaultPollValues[] = {
+            MotorValuesT::RPM, MotorValuesT::CURRENT, MotorValuesT::DUTY,
+            MotorValuesT::AMPHOURS, MotorValuesT::AMPHOURSCHARGED,
+            MotorValuesT::WATTHOURS, MotorValuesT::WATTHOURSCHARGED,
+            MotorValuesT::TEMP_FET, MotorValuesT::TEMP_MOTOR, MotorValuesT::CURRENT_IN, MotorValuesT::PID_POS,
+            MotorValuesT::TACHOMETER, MotorValuesT::VIN
+        };
+
+        //! Encode a drive command as a packet payload, using the same scaling as CAN.
+        //! @return Payload length, 0 if the command can't be sent over serial.
+        int32_t encodeCommand(MotorDriveT mode, float value, uint8_t *payload)
+        {
+            int32_t index = 0;
+            switch(mode)
+            {
+                case MotorDriveT::DUTY:
+                    payload[index++] = COMM_SET_DUTY;
+                    buffer_append_int32(payload, (int32_t) (value * 100000.0), &index);
+                    break;
+                case MotorDriveT::CURRENT:
+                    payload[index++] = COMM_SET_CURRENT;
+                    buffer_append_int32(payload, (int32_t) (value * 1000.0), &index);
+                    break;
+                case MotorDriveT::CURRENT_BREAK:
+                    payload[index++] = COMM_SET_CURRENT_BRAKE;
+                    buffer_append_int32(payload, (int32_t) (value * 1000.0), &index);
+                    break;
+                case MotorDriveT::RPM:
+                    payload[index++] = COMM_SET_RPM;
+                    buffer_append_int32(payload, (int32_t) value, &index);
+                    break;
+                case MotorDriveT::POS:
+                    payload[index++] = COMM_SET_POS;
+                    buffer_append_int32(payload, (int32_t) (value * 1000000.0), &index);
+                    break;
+                case MotorDriveT::CURRENT_REL:
+                    payload[index++] = COMM_SET_CURRENT_REL;
+                    buffer_append_float32(payload, value, 1e5, &index);
+                    break;
+                case MotorDriveT::HAND_BRAKE:
+                    payload[index++] = COMM_SET_HANDBRAKE;
+                    buffer_append_float32(payload, value, 1e3, &index);
+                    break;
+                case MotorDriveT::NONE:
+                case MotorDriveT::CURRENT_BREAK_REL:
+                case MotorDriveT::HAND_BRAKE_REL:
+                    return 0;
+            }
+            return index;
+        }
+    }
 
     //! Const from port
     BusSerial::BusSerial(std::string port)
+     : mPort(std::move(port))
     {
-
     }
 
     BusSerial::BusSerial(json config)
         : BusInterface(config)
     {
+        mPort = config.value("device", config.value("port", ""));
+        mBaudRate = config.value("baudrate", mBaudRate);
+        mLocalId = config.value("localId", -1);
+        float pollRate = config.value("pollRate", 20.0f);
+        if(pollRate > 0.0f) {
+            mPollPeriod = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(1.0f / pollRate));
+        } else {
+            mPollPeriod = std::chrono::steady_clock::duration::zero();
+        }
+        mMaxInFlight = std::max(config.value("maxInFlight", int(mMaxInFlight)), 1);
+        mRequestTimeout = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<float>(config.value("requestTimeout", 0.1f)));
     }
 
     BusSerial::~BusSerial()
     {
+        stop();
     }
 
     bool BusSerial::open() {
-        return BusInterface::open();
+        if(mFd >= 0) {
+            return false;
+        }
+        if(mPort.empty()) {
+            std::cerr << "Serial device name is empty" << std::endl;
+            return false;
+        }
+        mFd = ::open(mPort.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+        if(mFd < 0) {
+            std::cerr << "Failed to open " << mPort << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        if(!configurePort()) {
+            ::close(mFd);
+            mFd = -1;
+            return false;
+        }
+        mTerminate = false;
+        mReceiveThread = std::thread(&BusSerial::run_receive_thread, this);
+        return true;
+    }
+
+    bool BusSerial::configurePort()
+    {
+        // Pseudo terminals and some adapters aren't real ttys, so only set up what we can.
+        if(!isatty(mFd))
+            return true;
+        struct termios tty {};
+        if(tcgetattr(mFd, &tty) != 0) {
+            std::cerr << "Failed to get attributes for " << mPort << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        cfmakeraw(&tty);
+        tty.c_cflag |= CLOCAL | CREAD;
+        tty.c_cflag &= ~CRTSCTS;
+        tty.c_cc[VMIN] = 0;
+        tty.c_cc[VTIME] = 0;
+        speed_t speed = baudToSpeed(mBaudRate);
+        if(speed == B0) {
+            std::cerr << "Unsupported baud rate " << mBaudRate << std::endl;
+            return false;
+        }
+        cfsetispeed(&tty, speed);
+        cfsetospeed(&tty, speed);
+        if(tcsetattr(mFd, TCSANOW, &tty) != 0) {
+            std::cerr << "Failed to set attributes for " << mPort << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        tcflush(mFd, TCIOFLUSH);
+        return true;
     }
 
     bool BusSerial::stop() {
-        return BusInterface::stop();
+        mTerminate = true;
+        if(mReceiveThread.joinable())
+            mReceiveThread.join();
+        cancelRequests();
+        std::lock_guard lock(mTxMutex);
+        if(mFd >= 0) {
+            ::close(mFd);
+            mFd = -1;
+        }
+        return true;
+    }
+
+    bool BusSerial::writeAll(const uint8_t *data, size_t len)
+    {
+        if(mFd < 0)
+            return false;
+        size_t done = 0;
+        while(done < len)
+        {
+            ssize_t n = ::write(mFd, data + done, len - done);
+            if(n > 0) {
+                done += size_t(n);
+                continue;
+            }
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                // The port is full, wait a little for it to drain rather than blocking the caller indefinitely.
+                struct pollfd pfd {mFd, POLLOUT, 0};
+                if(poll(&pfd, 1, 100) > 0)
+                    continue;
+            }
+            mWriteErrors++;
+            if(mVerbose) {
+                std::cerr << "Write to " << mPort << " failed: " << strerror(errno) << std::endl;
+            }
+            mTxBytes += done;
+            return false;
+        }
+        mTxBytes += len;
+        return true;
+    }
+
+    void BusSerial::appendPayload(uint8_t controller_id, const uint8_t *payload, size_t len)
+    {
+        int localId = mLocalId;
+        if(localId < 0 || controller_id == localId) {
+            appendPacket(mTxBuffer, payload, len);
+        } else {
+            const uint8_t forward[2] = {COMM_FORWARD_CAN, controller_id};
+            appendPacket(mTxBuffer, forward, sizeof(forward), payload, len);
+            mForwardedPackets++;
+        }
+        mTxPackets++;
+    }
+
+    bool BusSerial::sendPayload(const uint8_t *payload, size_t len)
+    {
+        std::lock_guard lock(mTxMutex);
+        mTxBuffer.clear();
+        appendPacket(mTxBuffer, payload, len);
+        mTxPackets++;
+        return writeAll(mTxBuffer.data(), mTxBuffer.size());
+    }
+
+    bool BusSerial::sendPayload(uint8_t controller_id, const uint8_t *payload, size_t len)
+    {
+        std::lock_guard lock(mTxMutex);
+        mTxBuffer.clear();
+        appendPayload(controller_id, payload, len);
+        return writeAll(mTxBuffer.data(), mTxBuffer.size());
+    }
+
+    bool BusSerial::sendPacket(uint8_t controller_id, const uint8_t *payload, size_t len)
+    {
+        return sendPayload(controller_id, payload, len);
+    }
+
+    std::vector<uint8_t> BusSerial::scan(const std::vector<uint8_t> &ids, float timeout)
+    {
+        int localId = mLocalId;
+        if(localId < 0)
+            return BusInterface::scan(ids, timeout);
+        // The controller pings each id in turn, so give it time to get through them all.
+        auto reply = request(uint8_t(localId), std::vector<uint8_t> {COMM_PING_CAN}, std::max(timeout, 5.0f)).get();
+        std::vector<uint8_t> found;
+        if(reply.empty())
+            return found;
+        for(auto id : ids) {
+            if(id == localId || std::find(reply.begin() + 1, reply.end(), id) != reply.end())
+                found.push_back(id);
+        }
+        return found;
+    }
+
+    void BusSerial::sendDriveCommands(const DriveCommand *commands, size_t count)
+    {
+        // Pack the commands for all controllers into one write.
+        std::lock_guard lock(mTxMutex);
+        mTxBuffer.clear();
+        uint8_t payload[8];
+        for(size_t i = 0; i < count; i++)
+        {
+            auto len = encodeCommand(commands[i].mode, commands[i].value, payload);
+            if(len == 0)
+                continue;
+            appendPayload(commands[i].controllerId, payload, size_t(len));
+        }
+        if(!mTxBuffer.empty()) {
+            writeAll(mTxBuffer.data(), mTxBuffer.size());
+        }
+    }
+
+    uint32_t BusSerial::dueMask(const Motor *motor, std::array<std::chrono::steady_clock::time_point, NumValueTypes> &due,
+                                std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point &next)
+    {
+        bool useRates = motor != nullptr && motor->hasTelemetryRates();
+        uint32_t mask = 0;
+        for(size_t i = 0; i < NumValueTypes; i++)
+        {
+            auto type = MotorValuesT(i);
+            int bit = selectiveBit(type);
+            if(bit < 0)
+                continue;
+            std::chrono::steady_clock::duration period;
+            if(useRates) {
+                float rate = motor->telemetryRate(type);
+                if(rate <= 0.0f)
+                    continue;
+                period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(1.0f / rate));
+            } else {
+                if(mPollPeriod <= std::chrono::steady_clock::duration::zero() ||
+                   std::find(std::begin(gDefaultPollValues), std::end(gDefaultPollValues), type) == std::end(gDefaultPollValues))
+                    continue;
+                period = mPollPeriod;
+            }
+            // Anything due within a quarter of its period goes in this request, so values with similar
+            // rates share requests rather than each getting their own.
+            if(due[i] <= now + period / 4) {
+                mask |= 1u << bit;
+                due[i] += period;
+                if(due[i] <= now)
+                    due[i] = now + period;
+            }
+            next = std::min(next, due[i]);
+        }
+        if(mask != 0)
+            mask |= 1u << gSelectiveControllerIdBit;
+        return mask;
+    }
+
+    std::chrono::steady_clock::time_point BusSerial::pollValues(std::chrono::steady_clock::time_point now)
+    {
+        auto next = now + std::chrono::milliseconds(500);
+        auto &motors = mPollMotors;
+        motors.clear();
+        {
+            std::lock_guard lock(mMutex);
+            for(auto *motor : mActiveMotors)
+            {
+                motors.push_back(motor);
+            }
+        }
+        // Without a local id we can only talk to the controller on the port.
+        if(mLocalId < 0 && motors.size() > 1)
+            motors.resize(1);
+        if(motors.empty())
+            motors.push_back(nullptr);
+
+        // Keep the schedules in step with the motors.
+        if(mPollStates.size() != motors.size())
+            mPollStates.resize(motors.size());
+        for(size_t i = 0; i < motors.size(); i++)
+        {
+            uint8_t id = motors[i] != nullptr ? motors[i]->id() : 0;
+            if(mPollStates[i].id != id) {
+                mPollStates[i] = PollStateT {id, {}};
+            }
+        }
+
+        std::lock_guard lock(mTxMutex);
+        // Forget requests that have had no response, lost or corrupted packets would otherwise block polling.
+        while(!mInFlight.empty() && now - mInFlight.front() > mRequestTimeout)
+        {
+            mInFlight.pop_front();
+            mPollTimeouts++;
+        }
+        mTxBuffer.clear();
+        size_t count = mPollStates.size();
+        size_t i = 0;
+        for(; i < count && mInFlight.size() < mMaxInFlight; i++)
+        {
+            size_t index = (mPollStart + i) % count;
+            auto &state = mPollStates[index];
+            uint32_t mask = dueMask(motors[index], state.due, now, next);
+            if(mask == 0)
+                continue;
+            uint8_t payload[5];
+            int32_t len = 0;
+            payload[len++] = COMM_GET_VALUES_SELECTIVE;
+            buffer_append_int32(payload, int32_t(mask), &len);
+            if(motors[index] == nullptr) {
+                appendPacket(mTxBuffer, payload, size_t(len));
+                mTxPackets++;
+            } else {
+                appendPayload(state.id, payload, size_t(len));
+            }
+            mInFlight.push_back(now);
+            mPollRequests++;
+        }
+        mPollStart = (mPollStart + i) % count;
+        if(mInFlight.size() >= mMaxInFlight) {
+            // Requests are waiting for a slot, one frees up when a response arrives or the oldest times out.
+            next = std::min(next, mInFlight.front() + mRequestTimeout);
+        }
+        if(!mTxBuffer.empty())
+            writeAll(mTxBuffer.data(), mTxBuffer.size());
+        return next;
+    }
+
+    void BusSerial::run_receive_thread()
+    {
+        auto nextPoll = std::chrono::steady_clock::now();
+        while(!mTerminate)
+        {
+            auto now = std::chrono::steady_clock::now();
+            if(now >= nextPoll) {
+                nextPoll = pollValues(now);
+            }
+            int timeoutMs = int(std::chrono::duration_cast<std::chrono::milliseconds>(nextPoll - now).count()) + 1;
+            timeoutMs = std::clamp(timeoutMs, 0, pendingRequests() > 0 ? 10 : 500);
+            // Requests are checked for timeouts every 10ms.
+            expireRequests(now);
+
+            struct pollfd pfd {mFd, POLLIN, 0};
+            int ret = poll(&pfd, 1, timeoutMs);
+            if(ret < 0) {
+                if(errno == EINTR)
+                    continue;
+                perror("poll");
+                break;
+            }
+            if(ret == 0)
+                continue;
+            // Drain the port, parsing as we go so a burst bigger than the buffer doesn't stall.
+            ssize_t n;
+            uint64_t received = 0;
+            while((n = mParser.readFrom(mFd)) > 0)
+            {
+                received += uint64_t(n);
+                mParser.parse([this](const PacketView &packet) { decode(packet); });
+            }
+            mRxBytes += received;
+            // A response may have freed a slot for a request that was waiting.
+            if(received > 0)
+                nextPoll = std::min(nextPoll, std::chrono::steady_clock::now());
+            if(received == 0 && (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))) {
+                std::cerr << "Serial port " << mPort << " closed" << std::endl;
+                break;
+            }
+            mRxPackets = mParser.packetCount();
+            mCrcErrors = mParser.crcErrorCount();
+            mSkippedBytes = mParser.skippedBytes();
+            if(n < 0) {
+                std::cerr << "Read from " << mPort << " failed: " << strerror(errno) << std::endl;
+                break;
+            }
+        }
+    }
+
+    void BusSerial::decode(const PacketView &packet)
+    {
+        if(mVerbose) {
+            printf("Serial [%zu] ", packet.size());
+            for(size_t i = 0; i < packet.size() && i < 16; i++)
+                printf("%02X ", packet[i]);
+            printf("\n");
+        }
+        switch(packet.command())
+        {
+            case COMM_GET_VALUES:
+                decodeValues(packet);
+                break;
+            case COMM_GET_VALUES_SELECTIVE:
+                decodeSelectiveValues(packet);
+                break;
+            default:
+                break;
+        }
+        // The payload may wrap around the end of the parser's buffer, so copy it out to pass on.
+        mRxPacket.resize(packet.size());
+        packet.copy(0, mRxPacket.data(), mRxPacket.size());
+        packetCallback(UnknownControllerId, mRxPacket.data(), mRxPacket.size());
+    }
+
+    void BusSerial::decodeValues(const PacketView &packet)
+    {
+        // Offsets include the command byte, the controller id was added in firmware 3.x.
+        if(packet.size() < 59) {
+            if(mVerbose) {
+                std::cerr << "GET_VALUES response too short " << packet.size() << std::endl;
+            }
+            return;
+        }
+        auto tempFet = packet.float16At(1, 10);
+        auto tempMotor = packet.float16At(3, 10);
+        auto current = packet.float32At(5, 100);
+        auto currentIn = packet.float32At(9, 100);
+        auto duty = packet.float16At(21, 1000);
+        auto erpm = packet.float32At(23, 1);
+        auto vIn = packet.float16At(27, 10);
+        auto ampHours = packet.float32At(29, 10000);
+        auto ampHoursCharged = packet.float32At(33, 10000);
+        auto wattHours = packet.float32At(37, 10000);
+        auto wattHoursCharged = packet.float32At(41, 10000);
+        auto tachometer = packet.float32At(45, 6);
+        auto pidPos = packet.float32At(54, 1000000);
+        uint8_t controllerId = packet[58];
+
+        statusCallback(controllerId, erpm, current, duty);
+        status2Callback(controllerId, ampHours, ampHoursCharged);
+        status3Callback(controllerId, wattHours, wattHoursCharged);
+        status4Callback(controllerId, tempFet, tempMotor, currentIn, pidPos);
+        status5Callback(controllerId, tachometer, vIn);
+    }
+
+    void BusSerial::decodeSelectiveValues(const PacketView &packet)
+    {
+        {
+            std::lock_guard lock(mTxMutex);
+            if(!mInFlight.empty())
+                mInFlight.pop_front();
+        }
+        mPollResponses++;
+        if(packet.size() < 5)
+            return;
+        auto mask = uint32_t(packet.int32At(1));
+        std::array<float, gNumSelectiveFields> values {};
+        size_t at = 5;
+        for(size_t bit = 0; bit < gNumSelectiveFields; bit++)
+        {
+            if(!(mask & (1u << bit)))
+                continue;
+            const auto &field = gSelectiveFields[bit];
+            if(at + field.size > packet.size()) {
+                if(mVerbose) {
+                    std::cerr << "GET_VALUES_SELECTIVE response too short " << packet.size() << std::endl;
+                }
+                return;
+            }
+            switch(field.size)
+            {
+                case 1: values[bit] = float(packet[at]); break;
+                case 2: values[bit] = packet.float16At(at, field.scale); break;
+                case 4: values[bit] = packet.float32At(at, field.scale); break;
+                default: break;
+            }
+            at += field.size;
+        }
+        // The controller id is always requested, without it we can't tell which motor the values are for.
+        if(!(mask & (1u << gSelectiveControllerIdBit)))
+            return;
+        auto controllerId = uint8_t(values[gSelectiveControllerIdBit]);
+        for(size_t bit = 0; bit < gNumSelectiveFields; bit++)
+        {
+            if((mask & (1u << bit)) && gSelectiveFields[bit].valueType >= 0)
+                valueCallback(controllerId, MotorValuesT(gSelectiveFields[bit].valueType), values[bit]);
+        }
+    }
+
+    json BusSerial::stats()
+    {
+        json result = BusInterface::stats();
+        result["baudrate"] = mBaudRate;
+        result["txBytes"] = uint64_t(mTxBytes);
+        result["rxBytes"] = uint64_t(mRxBytes);
+        result["txPackets"] = uint64_t(mTxPackets);
+        result["forwardedPackets"] = uint64_t(mForwardedPackets);
+        result["rxPackets"] = uint64_t(mRxPackets);
+        result["crcErrors"] = uint64_t(mCrcErrors);
+        result["skippedBytes"] = uint64_t(mSkippedBytes);
+        result["writeErrors"] = uint64_t(mWriteErrors);
+        result["pollRequests"] = uint64_t(mPollRequests);
+        result["pollResponses"] = uint64_t(mPollResponses);
+        result["pollTimeouts"] = uint64_t(mPollTimeouts);
+        return result;
     }
 
     void BusSerial::setDuty(uint8_t controller_id, float duty)
     {
+        DriveCommand cmd {controller_id, MotorDriveT::DUTY, duty};
+        sendDriveCommands(&cmd, 1);
     }
 
     void BusSerial::setCurrent(uint8_t controller_id, float current) {
-        BusInterface::setCurrent(controller_id, current);
+        DriveCommand cmd {controller_id, MotorDriveT::CURRENT, current};
+        sendDriveCommands(&cmd, 1);
     }
 
     void BusSerial::setCurrentOffDelay(uint8_t controller_id, float current, float off_delay) {
-        BusInterface::setCurrentOffDelay(controller_id, current, off_delay);
+        int32_t index = 0;
+        uint8_t payload[7];
+        payload[index++] = COMM_SET_CURRENT;
+        buffer_append_int32(payload, (int32_t) (current * 1000.0), &index);
+        buffer_append_float16(payload, off_delay, 1e3, &index);
+        sendPayload(controller_id, payload, size_t(index));
     }
 
     void BusSerial::setCurrentBrake(uint8_t controller_id, float current) {
-        BusInterface::setCurrentBrake(controller_id, current);
+        DriveCommand cmd {controller_id, MotorDriveT::CURRENT_BREAK, current};
+        sendDriveCommands(&cmd, 1);
     }
 
     void BusSerial::setRPM(uint8_t controller_id, float rpm) {
-        BusInterface::setRPM(controller_id, rpm);
+        DriveCommand cmd {controller_id, MotorDriveT::RPM, rpm};
+        sendDriveCommands(&cmd, 1);
     }
 
     void BusSerial::setPos(uint8_t controller_id, float pos) {
-        BusInterface::setPos(controller_id, pos);
+        DriveCommand cmd {controller_id, MotorDriveT::POS, pos};
+        sendDriveCommands(&cmd, 1);
     }
 
     void BusSerial::setCurrentRel(uint8_t controller_id, float current_rel) {
-        BusInterface::setCurrentRel(controller_id, current_rel);
+        DriveCommand cmd {controller_id, MotorDriveT::CURRENT_REL, current_rel};
+        sendDriveCommands(&cmd, 1);
     }
 
     void BusSerial::setCurrentRelOffDelay(uint8_t controller_id, float current_rel, float off_delay) {
-        BusInterface::setCurrentRelOffDelay(controller_id, current_rel, off_delay);
+        int32_t index = 0;
+        uint8_t payload[7];
+        payload[index++] = COMM_SET_CURRENT_REL;
+        buffer_append_float32(payload, current_rel, 1e5, &index);
+        buffer_append_float16(payload, off_delay, 1e3, &index);
+        sendPayload(controller_id, payload, size_t(index));
     }
 
     void BusSerial::setCurrentBrakeRel(uint8_t controller_id, float current_rel) {
-        BusInterface::setCurrentBrakeRel(controller_id, current_rel);
+        std::cerr << "setCurrentBrakeRel not supported over serial" << std::endl;
     }
 
     void BusSerial::setHandbrake(uint8_t controller_id, float current) {
-        BusInterface::setHandbrake(controller_id, current);
+        DriveCommand cmd {controller_id, MotorDriveT::HAND_BRAKE, current};
+        sendDriveCommands(&cmd, 1);
     }
 
     void BusSerial::setHandbrakeRel(uint8_t controller_id, float current_rel) {
-        BusInterface::setHandbrakeRel(controller_id, current_rel);
+        std::cerr << "setHandbrakeRel not supported over serial" << std::endl;
     }
 }
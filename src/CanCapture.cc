@@ -0,0 +1,201 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include "multivesc/CanCapture.hh"
+
+namespace multivesc {
+
+    CaptureRecordT makeCaptureRecord(const struct can_frame &frame, CaptureDirectionT direction, int64_t timeNs, uint8_t flags)
+    {
+        CaptureRecordT record;
+        record.timeNs = timeNs;
+        record.canId = frame.can_id;
+        record.dlc = std::min<uint8_t>(frame.can_dlc, 8);
+        record.direction = direction;
+        record.flags = flags;
+        memcpy(record.data, frame.data, 8);
+        return record;
+    }
+
+    struct can_frame captureFrame(const CaptureRecordT &record)
+    {
+        struct can_frame frame {};
+        frame.can_id = record.canId;
+        frame.can_dlc = std::min<uint8_t>(record.dlc, 8);
+        memcpy(frame.data, record.data, 8);
+        return frame;
+    }
+
+    int64_t captureTimeNow()
+    {
+        struct timespec now {};
+        clock_gettime(CLOCK_REALTIME, &now);
+        return int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+    }
+
+    CaptureWriter::CaptureWriter(size_t bufferRecords)
+     : mBufferRecords(std::max<size_t>(bufferRecords, 1))
+    {}
+
+    CaptureWriter::~CaptureWriter()
+    {
+        close();
+    }
+
+    bool CaptureWriter::open(const std::string &filename)
+    {
+        close();
+        if(!mFile.create(filename))
+            return false;
+        CaptureHeaderT header;
+        header.startTimeNs = captureTimeNow();
+        if(!mFile.append(&header, sizeof(header))) {
+            mFile.close();
+            return false;
+        }
+        mFront.reserve(mBufferRecords);
+        mBack.reserve(mBufferRecords);
+        mRecordCount = 0;
+        mDroppedCount = 0;
+        {
+            std::lock_guard lock(mMutex);
+            mTerminate = false;
+            mBackFull = false;
+            mFront.clear();
+            mOpen = true;
+        }
+        mThread = std::thread(&CaptureWriter::run, this);
+        return true;
+    }
+
+    void CaptureWriter::close()
+    {
+        {
+            std::lock_guard lock(mMutex);
+            if(!mOpen)
+                return;
+            mOpen = false;
+            mTerminate = true;
+        }
+        mCondition.notify_all();
+        if(mThread.joinable())
+            mThread.join();
+        mFile.close();
+    }
+
+    void CaptureWriter::append(const CaptureRecordT &record)
+    {
+        std::unique_lock lock(mMutex);
+        if(!mOpen)
+            return;
+        if(mFront.size() >= mBufferRecords) {
+            if(mBackFull && mBlocking)
+                mCondition.wait(lock, [this] { return !mBackFull; });
+            if(mBackFull) {
+                mDroppedCount++;
+                return;
+            }
+            std::swap(mFront, mBack);
+            mBackFull = true;
+            mCondition.notify_all();
+        }
+        mFront.push_back(record);
+    }
+
+    void CaptureWriter::append(const struct can_frame *frames, size_t count, CaptureDirectionT direction, int64_t timeNs,
+                               const int64_t *timesNs, bool kernelTimes)
+    {
+        for(size_t i = 0; i < count; i++) {
+            bool haveTime = timesNs != nullptr && timesNs[i] != 0;
+            append(makeCaptureRecord(frames[i], direction, haveTime ? timesNs[i] : timeNs,
+                                     haveTime && kernelTimes ? CaptureKernelTime : 0));
+        }
+    }
+
+    void CaptureWriter::run()
+    {
+        std::unique_lock lock(mMutex);
+        while(true) {
+            mCondition.wait_for(lock, std::chrono::milliseconds(100), [this] { return mBackFull || mTerminate; });
+            // Write out partly filled buffers too, so readers see the frames soon after they arrive.
+            if(!mBackFull && !mFront.empty()) {
+                std::swap(mFront, mBack);
+                mBackFull = true;
+            }
+            if(mBackFull) {
+                lock.unlock();
+                write(mBack);
+                mBack.clear();
+                lock.lock();
+                mBackFull = false;
+                // Wake anything blocked waiting for room.
+                mCondition.notify_all();
+                continue;
+            }
+            if(mTerminate)
+                break;
+        }
+    }
+
+    bool CaptureWriter::write(const std::vector<CaptureRecordT> &records)
+    {
+        if(records.empty())
+            return true;
+        if(!mFile.append(records.data(), records.size() * sizeof(CaptureRecordT))) {
+            mDroppedCount += records.size();
+            return false;
+        }
+        mRecordCount += records.size();
+        // Publish the count after the records, for readers mapping the file as it is written.
+        auto *header = reinterpret_cast<CaptureHeaderT *>(mFile.data());
+        __atomic_store_n(&header->recordCount, uint64_t(mRecordCount), __ATOMIC_RELEASE);
+        return true;
+    }
+
+    bool CaptureReader::open(const std::string &filename)
+    {
+        mCount = 0;
+        if(!mFile.openRead(filename))
+            return false;
+        if(mFile.used() < sizeof(CaptureHeaderT)) {
+            std::cerr << filename << " is too short to be a capture" << std::endl;
+            mFile.close();
+            return false;
+        }
+        CaptureHeaderT expected;
+        if(memcmp(header().magic, expected.magic, sizeof(expected.magic)) != 0 ||
+           header().recordSize != sizeof(CaptureRecordT)) {
+            std::cerr << filename << " is not a capture file" << std::endl;
+            mFile.close();
+            return false;
+        }
+        return refresh();
+    }
+
+    bool CaptureReader::isCapture(const std::string &filename)
+    {
+        std::ifstream file(filename, std::ios::binary);
+        CaptureHeaderT expected;
+        char magic[sizeof(expected.magic)] {};
+        file.read(magic, sizeof(magic));
+        return file && memcmp(magic, expected.magic, sizeof(magic)) == 0;
+    }
+
+    bool CaptureReader::refresh()
+    {
+        if(!mFile.isOpen() || !mFile.refresh())
+            return false;
+        // The file may have been extended ahead of the records, so take the count from the header.
+        uint64_t count = __atomic_load_n(&header().recordCount, __ATOMIC_ACQUIRE);
+        size_t inFile = (mFile.used() - sizeof(CaptureHeaderT)) / sizeof(CaptureRecordT);
+        mCount = size_t(std::min<uint64_t>(count, inFile));
+        return true;
+    }
+
+} // multivesc
@@ -0,0 +1,305 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <net/if.h>
+#include "multivesc/CandumpLog.hh"
+
+namespace multivesc {
+
+    namespace {
+
+        //! Value of a hex digit, -1 if it isn't one.
+        int hexValue(char c)
+        {
+            if(c >= '0' && c <= '9')
+                return c - '0';
+            if(c >= 'A' && c <= 'F')
+                return c - 'A' + 10;
+            if(c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+            return -1;
+        }
+
+        //! Parse decimal digits, at most 'maxDigits' of them.
+        //! @return Number of digits read.
+        int parseDecimal(const char *&at, int maxDigits, int64_t &value)
+        {
+            int digits = 0;
+            value = 0;
+            while(*at >= '0' && *at <= '9' && digits < maxDigits) {
+                value = value * 10 + (*at - '0');
+                at++;
+                digits++;
+            }
+            return digits;
+        }
+
+        constexpr char gHexDigits[] = "0123456789ABCDEF";
+
+        char *appendHex(char *at, uint32_t value, int digits)
+        {
+            for(int i = digits - 1; i >= 0; i--) {
+                at[i] = gHexDigits[value & 0xF];
+                value >>= 4;
+            }
+            return at + digits;
+        }
+
+        char *appendDecimal(char *at, uint64_t value, int digits)
+        {
+            for(int i = digits - 1; i >= 0; i--) {
+                at[i] = char('0' + value % 10);
+                value /= 10;
+            }
+            return at + digits;
+        }
+    }
+
+    bool parseCandumpLine(const char *line, CaptureRecordT &record, std::string_view *interface)
+    {
+        const char *at = line;
+        // Timestamp, seconds and a fraction, normally microseconds.
+        if(*at++ != '(')
+            return false;
+        int64_t seconds = 0;
+        if(parseDecimal(at, 18, seconds) == 0 || *at++ != '.')
+            return false;
+        int64_t fraction = 0;
+        int fractionDigits = parseDecimal(at, 9, fraction);
+        while(*at >= '0' && *at <= '9')
+            at++;
+        if(fractionDigits == 0 || *at++ != ')' || *at++ != ' ')
+            return false;
+        for(int i = fractionDigits; i < 9; i++)
+            fraction *= 10;
+
+        // Interface
+        const char *name = at;
+        while(*at != ' ' && *at != '\0')
+            at++;
+        if(*at != ' ' || at == name)
+            return false;
+        if(interface != nullptr)
+            *interface = std::string_view(name, size_t(at - name));
+        at++;
+
+        // Id
+        uint32_t id = 0;
+        int idDigits = 0;
+        for(int digit; (digit = hexValue(*at)) >= 0; at++, idDigits++)
+            id = (id << 4) | uint32_t(digit);
+        if(*at++ != '#')
+            return false;
+        if(idDigits == 3) {
+            if(id > CAN_SFF_MASK)
+                return false;
+        } else if(idDigits == 8) {
+            // Error frames are logged with the error flag and no extended flag.
+            if(!(id & CAN_ERR_FLAG))
+                id = (id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+        } else {
+            return false;
+        }
+
+        CaptureRecordT result;
+        result.canId = id;
+        if(*at == '#') {
+            // CAN FD
+            return false;
+        }
+        if(*at == 'R') {
+            result.canId |= CAN_RTR_FLAG;
+            at++;
+            // The length of a remote frame request may follow.
+            if(*at >= '0' && *at <= '8')
+                result.dlc = uint8_t(*at++ - '0');
+        } else {
+            while(true) {
+                if(*at == '.') {
+                    at++;
+                    continue;
+                }
+                int high = hexValue(at[0]);
+                if(high < 0)
+                    break;
+                int low = hexValue(at[1]);
+                if(low < 0 || result.dlc >= 8)
+                    return false;
+                result.data[result.dlc++] = uint8_t(high << 4 | low);
+                at += 2;
+            }
+        }
+        // Classic CAN frames may have a raw DLC of 9 to 15 after an underscore, it makes no difference here.
+        if(*at == '_' && hexValue(at[1]) >= 0)
+            at += 2;
+        result.direction = CaptureDirectionT::RX;
+        if(*at == ' ') {
+            at++;
+            if(*at == 'T')
+                result.direction = CaptureDirectionT::TX;
+            else if(*at != 'R')
+                return false;
+            at++;
+        }
+        if(*at != '\0' && *at != '\n' && *at != '\r')
+            return false;
+        result.timeNs = seconds * 1000000000 + fraction;
+        record = result;
+        return true;
+    }
+
+    size_t formatCandumpLine(const CaptureRecordT &record, std::string_view interface, char *buffer)
+    {
+        char *at = buffer;
+        int64_t timeNs = std::max<int64_t>(record.timeNs, 0);
+        *at++ = '(';
+        uint64_t seconds = uint64_t(timeNs / 1000000000);
+        // At least 10 digits as candump does, more if needed.
+        int digits = 10;
+        for(uint64_t limit = 10000000000ULL; seconds >= limit && digits < 19; limit *= 10)
+            digits++;
+        at = appendDecimal(at, seconds, digits);
+        *at++ = '.';
+        at = appendDecimal(at, uint64_t(timeNs % 1000000000) / 1000, 6);
+        *at++ = ')';
+        *at++ = ' ';
+        memcpy(at, interface.data(), interface.size());
+        at += interface.size();
+        *at++ = ' ';
+        if(record.canId & CAN_ERR_FLAG) {
+            at = appendHex(at, record.canId & (CAN_ERR_MASK | CAN_ERR_FLAG), 8);
+        } else if(record.canId & CAN_EFF_FLAG) {
+            at = appendHex(at, record.canId & CAN_EFF_MASK, 8);
+        } else {
+            at = appendHex(at, record.canId & CAN_SFF_MASK, 3);
+        }
+        *at++ = '#';
+        uint8_t dlc = std::min<uint8_t>(record.dlc, 8);
+        if(record.canId & CAN_RTR_FLAG) {
+            *at++ = 'R';
+            if(dlc > 0)
+                *at++ = char('0' + dlc);
+        } else {
+            for(uint8_t i = 0; i < dlc; i++)
+                at = appendHex(at, record.data[i], 2);
+        }
+        if(record.direction == CaptureDirectionT::TX) {
+            *at++ = ' ';
+            *at++ = 'T';
+        }
+        *at++ = '\n';
+        return size_t(at - buffer);
+    }
+
+    CandumpReader::~CandumpReader()
+    {
+        close();
+    }
+
+    bool CandumpReader::open(const std::string &filename)
+    {
+        close();
+        mStdin = filename == "-";
+        mFile = mStdin ? stdin : std::fopen(filename.c_str(), "r");
+        if(mFile == nullptr) {
+            std::cerr << "Failed to open " << filename << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        // Large reads, a log is read from one end to the other.
+        setvbuf(mFile, nullptr, _IOFBF, 1 << 20);
+        mLineCount = 0;
+        mSkippedCount = 0;
+        return true;
+    }
+
+    bool CandumpReader::next(CaptureRecordT &record)
+    {
+        if(mFile == nullptr)
+            return false;
+        // Clear any end of file, so lines added since are read.
+        clearerr(mFile);
+        while(true) {
+            long start = mStdin ? -1 : std::ftell(mFile);
+            if(std::fgets(mLine, sizeof(mLine), mFile) == nullptr)
+                return false;
+            size_t len = strlen(mLine);
+            if(len == 0 || mLine[len - 1] != '\n') {
+                if(std::feof(mFile)) {
+                    // A line still being written, read it again when it is complete.
+                    if(start >= 0)
+                        std::fseek(mFile, start, SEEK_SET);
+                    return false;
+                }
+                // Far too long for a frame, skip the rest of it.
+                int c;
+                while((c = std::fgetc(mFile)) != EOF && c != '\n') {}
+                mLineCount++;
+                mSkippedCount++;
+                continue;
+            }
+            mLineCount++;
+            std::string_view interface;
+            if(!parseCandumpLine(mLine, record, &interface)) {
+                mSkippedCount++;
+                continue;
+            }
+            if(!mInterface.empty() && interface != mInterface)
+                continue;
+            return true;
+        }
+    }
+
+    void CandumpReader::close()
+    {
+        if(mFile != nullptr && !mStdin)
+            std::fclose(mFile);
+        mFile = nullptr;
+    }
+
+    CandumpWriter::~CandumpWriter()
+    {
+        close();
+    }
+
+    bool CandumpWriter::open(const std::string &filename, const std::string &interface)
+    {
+        close();
+        mStdout = filename == "-";
+        mFile = mStdout ? stdout : std::fopen(filename.c_str(), "w");
+        if(mFile == nullptr) {
+            std::cerr << "Failed to create " << filename << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        setvbuf(mFile, nullptr, _IOFBF, 1 << 20);
+        mInterface = interface;
+        return true;
+    }
+
+    bool CandumpWriter::write(const CaptureRecordT &record)
+    {
+        if(mFile == nullptr)
+            return false;
+        char line[80 + IFNAMSIZ];
+        // Interface names are limited by the kernel, but the name here could be anything.
+        std::string_view interface(mInterface.data(), std::min<size_t>(mInterface.size(), IFNAMSIZ));
+        size_t len = formatCandumpLine(record, interface, line);
+        return std::fwrite(line, 1, len, mFile) == len;
+    }
+
+    bool CandumpWriter::close()
+    {
+        if(mFile == nullptr)
+            return true;
+        bool ok = std::fflush(mFile) == 0 && !std::ferror(mFile);
+        if(!mStdout && std::fclose(mFile) != 0)
+            ok = false;
+        mFile = nullptr;
+        return ok;
+    }
+
+} // multivesc
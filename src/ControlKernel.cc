@@ -0,0 +1,92 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include "multivesc/ControlKernel.hh"
+#include "multivesc/Motor.hh"
+
+namespace multivesc {
+
+    void ControlKernel::clear()
+    {
+        mSize = 0;
+    }
+
+    size_t ControlKernel::add(uint8_t controllerId, MotorDriveT mode, float target)
+    {
+        size_t slot = mSize++;
+        if(mSize > mTarget.size()) {
+            mTarget.resize(mSize);
+            mLast.resize(mSize);
+            mMaxStep.resize(mSize);
+            mMinAbs.resize(mSize);
+            mMaxAbs.resize(mSize);
+            mScale.resize(mSize);
+            mCommands.resize(mSize);
+        }
+        constexpr float inf = std::numeric_limits<float>::infinity();
+        mTarget[slot] = target;
+        mLast[slot] = target;
+        mMaxStep[slot] = inf;
+        mMinAbs[slot] = 0.0f;
+        mMaxAbs[slot] = inf;
+        mScale[slot] = 1.0f;
+        mCommands[slot] = DriveCommand {controllerId, mode, target};
+        return slot;
+    }
+
+    void ControlKernel::setLimits(size_t slot, float last, float maxStep, float minAbs, float maxAbs, float scale)
+    {
+        mLast[slot] = last;
+        mMaxStep[slot] = maxStep;
+        mMinAbs[slot] = minAbs;
+        mMaxAbs[slot] = maxAbs;
+        mScale[slot] = scale;
+    }
+
+    namespace {
+        // Kept as a separate function taking restrict pointers, as the arrays never overlap this lets the
+        // compiler vectorise the loop.
+        void limitDemands(size_t n,
+                          const float *__restrict target,
+                          const float *__restrict maxStep,
+                          const float *__restrict minAbs,
+                          const float *__restrict maxAbs,
+                          const float *__restrict scale,
+                          float *__restrict last,
+                          float *__restrict out)
+        {
+            for(size_t i = 0; i < n; i++) {
+                float t = target[i];
+                float a = std::abs(t);
+                float m = minAbs[i];
+                // Same as Motor::updateRPM, below half the minimum goes to zero, otherwise raise it to the minimum
+                // keeping its direction.
+                float raised = a < m ? std::copysign(m, t) : t;
+                t = a < m * 0.5f ? 0.0f : raised;
+                float step = maxStep[i];
+                float l = last[i];
+                float v = l + std::min(std::max(t - l, -step), step);
+                float limit = maxAbs[i];
+                v = std::min(std::max(v, -limit), limit);
+                last[i] = v;
+                out[i] = v * scale[i];
+            }
+        }
+    }
+
+    void ControlKernel::run()
+    {
+        const size_t n = mSize;
+        mOutput.resize(std::max(mOutput.size(), n));
+        limitDemands(n, mTarget.data(), mMaxStep.data(), mMinAbs.data(), mMaxAbs.data(), mScale.data(),
+                     mLast.data(), mOutput.data());
+        for(size_t i = 0; i < n; i++) {
+            mCommands[i].value = mOutput[i];
+        }
+    }
+
+} // multivesc
@@ -0,0 +1,458 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#include <iostream>
+#include <fstream>
+#include <future>
+#include <map>
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include "multivesc/ControllerConfig.hh"
+#include "multivesc/VescPacket.hh"
+
+namespace multivesc {
+
+    namespace {
+
+        std::string toHex(const uint8_t *data, size_t len)
+        {
+            static const char digits[] = "0123456789abcdef";
+            std::string str(len * 2, '0');
+            for(size_t i = 0; i < len; i++) {
+                str[i * 2] = digits[data[i] >> 4];
+                str[i * 2 + 1] = digits[data[i] & 0xF];
+            }
+            return str;
+        }
+
+        bool fromHex(const std::string &str, std::vector<uint8_t> &data)
+        {
+            if(str.size() % 2 != 0)
+                return false;
+            data.resize(str.size() / 2);
+            for(size_t i = 0; i < data.size(); i++) {
+                int value = 0;
+                for(size_t j = 0; j < 2; j++) {
+                    char c = str[i * 2 + j];
+                    int digit;
+                    if(c >= '0' && c <= '9') digit = c - '0';
+                    else if(c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+                    else if(c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+                    else return false;
+                    value = value * 16 + digit;
+                }
+                data[i] = uint8_t(value);
+            }
+            return true;
+        }
+
+        uint8_t getCommand(ControllerConfigT type)
+        {
+            return type == ControllerConfigT::MCCONF ? COMM_GET_MCCONF : COMM_GET_APPCONF;
+        }
+
+        uint8_t setCommand(ControllerConfigT type)
+        {
+            return type == ControllerConfigT::MCCONF ? COMM_SET_MCCONF : COMM_SET_APPCONF;
+        }
+
+        //! Group targets by the bus they are on.
+        std::map<std::shared_ptr<BusInterface>, std::vector<const ConfigTargetT *>> byBus(const std::vector<ConfigTargetT> &targets)
+        {
+            std::map<std::shared_ptr<BusInterface>, std::vector<const ConfigTargetT *>> buses;
+            for(auto &target : targets) {
+                if(target.bus)
+                    buses[target.bus].push_back(&target);
+            }
+            return buses;
+        }
+    }
+
+    std::string to_string(ControllerConfigT type)
+    {
+        switch(type) {
+            case ControllerConfigT::MCCONF: return "mcconf";
+            case ControllerConfigT::APPCONF: return "appconf";
+        }
+        return "unknown";
+    }
+
+    bool controllerConfigFromString(const std::string &str, ControllerConfigT &type)
+    {
+        if(str == "mcconf") {
+            type = ControllerConfigT::MCCONF;
+            return true;
+        }
+        if(str == "appconf") {
+            type = ControllerConfigT::APPCONF;
+            return true;
+        }
+        return false;
+    }
+
+    bool parseFirmwareVersion(const std::vector<uint8_t> &reply, FirmwareInfoT &info)
+    {
+        // [COMM_FW_VERSION][major][minor][hardware name, null terminated][uuid, 12 bytes]...
+        if(reply.size() < 3 || reply[0] != COMM_FW_VERSION)
+            return false;
+        info.major = reply[1];
+        info.minor = reply[2];
+        size_t at = 3;
+        info.hardware.clear();
+        while(at < reply.size() && reply[at] != 0) {
+            info.hardware.push_back(char(reply[at++]));
+        }
+        at++;
+        if(at + 12 > reply.size())
+            return false;
+        info.uuid = toHex(reply.data() + at, 12);
+        return true;
+    }
+
+    bool ControllerConfig::setCacheFile(const std::string &filename)
+    {
+        std::lock_guard lock(mMutex);
+        mCacheFile = filename;
+        std::ifstream file(filename);
+        if(!file.is_open())
+            return true;
+        json cache = json::parse(file, nullptr, false);
+        if(cache.is_discarded() || !cache.is_object()) {
+            std::cerr << "Ignoring unreadable config cache " << filename << std::endl;
+            return false;
+        }
+        mCache = cache;
+        return true;
+    }
+
+    bool ControllerConfig::save()
+    {
+        std::lock_guard lock(mMutex);
+        if(mCacheFile.empty())
+            return false;
+        std::string tmpName = mCacheFile + ".tmp";
+        {
+            std::ofstream file(tmpName);
+            if(!file.is_open()) {
+                std::cerr << "Failed to write config cache " << tmpName << std::endl;
+                return false;
+            }
+            file << mCache.dump(1);
+        }
+        return std::rename(tmpName.c_str(), mCacheFile.c_str()) == 0;
+    }
+
+    std::string ControllerConfig::hash(const std::vector<uint8_t> &data)
+    {
+        // 64 bit FNV-1a, only used to tell configurations apart.
+        uint64_t value = 0xcbf29ce484222325ULL;
+        for(auto b : data) {
+            value ^= b;
+            value *= 0x100000001b3ULL;
+        }
+        uint8_t bytes[8];
+        for(int i = 0; i < 8; i++) {
+            bytes[i] = uint8_t(value >> (56 - 8 * i));
+        }
+        return toHex(bytes, sizeof(bytes));
+    }
+
+    std::string ControllerConfig::cacheKey(const FirmwareInfoT &info, ControllerConfigT type)
+    {
+        return info.uuid + "/" + std::to_string(info.major) + "." + std::to_string(info.minor) + "/" + to_string(type);
+    }
+
+    bool ControllerConfig::store(const std::string &key, const std::vector<uint8_t> &data)
+    {
+        auto dataHash = hash(data);
+        std::lock_guard lock(mMutex);
+        bool changed = !mCache.contains(key) || mCache[key].value("hash", std::string()) != dataHash;
+        json entry;
+        entry["hash"] = dataHash;
+        entry["data"] = toHex(data.data(), data.size());
+        entry["time"] = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+        mCache[key] = entry;
+        return changed;
+    }
+
+    json ControllerConfig::read(const std::vector<ConfigTargetT> &targets, ControllerConfigT type, bool useCache)
+    {
+        // Each bus is independent, so they are all read at once.
+        std::vector<std::future<json>> replies;
+        for(auto &[bus, busTargets] : byBus(targets)) {
+            replies.push_back(std::async(std::launch::async, [this, bus = bus, busTargets = busTargets, type, useCache]() {
+                return readBus(bus, busTargets, type, useCache);
+            }));
+        }
+        json result = json::object();
+        for(auto &reply : replies) {
+            result.update(reply.get());
+        }
+        if(!mCacheFile.empty())
+            save();
+        return result;
+    }
+
+    json ControllerConfig::readBus(const std::shared_ptr<BusInterface> &bus, const std::vector<const ConfigTargetT *> &targets,
+                                   ControllerConfigT type, bool useCache)
+    {
+        json result = json::object();
+        std::vector<uint8_t> ids;
+        for(auto *target : targets) {
+            ids.push_back(target->id);
+        }
+        // Firmware versions first, they are short and tell us if we have a usable copy.
+        auto versions = bus->requestAll(ids, std::vector<uint8_t> {COMM_FW_VERSION}, mTimeout);
+        std::vector<std::string> keys(targets.size());
+        std::vector<size_t> toRead;
+        for(size_t i = 0; i < targets.size(); i++) {
+            json entry;
+            entry["id"] = targets[i]->id;
+            FirmwareInfoT info;
+            if(!parseFirmwareVersion(versions[i], info)) {
+                entry["ok"] = false;
+                entry["error"] = "No firmware version";
+                result[targets[i]->name] = entry;
+                continue;
+            }
+            keys[i] = cacheKey(info, type);
+            entry["uuid"] = info.uuid;
+            entry["hardware"] = info.hardware;
+            entry["firmware"] = std::to_string(info.major) + "." + std::to_string(info.minor);
+            result[targets[i]->name] = entry;
+            if(useCache) {
+                std::lock_guard lock(mMutex);
+                if(mCache.contains(keys[i])) {
+                    auto &cached = result[targets[i]->name];
+                    cached["ok"] = true;
+                    cached["cached"] = true;
+                    // Not read from the controller, so it may have been changed since the copy was taken.
+                    cached["verified"] = false;
+                    cached["changed"] = nullptr;
+                    cached["hash"] = mCache[keys[i]]["hash"];
+                    cached["data"] = mCache[keys[i]]["data"];
+                    continue;
+                }
+            }
+            toRead.push_back(i);
+        }
+
+        std::vector<uint8_t> readIds;
+        for(auto i : toRead) {
+            readIds.push_back(ids[i]);
+        }
+        auto configs = bus->requestAll(readIds, std::vector<uint8_t> {getCommand(type)}, mTimeout);
+        for(size_t j = 0; j < toRead.size(); j++) {
+            auto &entry = result[targets[toRead[j]]->name];
+            const auto &reply = configs[j];
+            if(reply.size() < 2 || reply[0] != getCommand(type)) {
+                entry["ok"] = false;
+                entry["error"] = "No " + to_string(type);
+                continue;
+            }
+            std::vector<uint8_t> data(reply.begin() + 1, reply.end());
+            entry["ok"] = true;
+            entry["cached"] = false;
+            entry["verified"] = true;
+            entry["changed"] = store(keys[toRead[j]], data);
+            entry["hash"] = hash(data);
+            entry["data"] = toHex(data.data(), data.size());
+        }
+        return result;
+    }
+
+    AppconfLayoutT appconfLayoutFromJson(const json &config)
+    {
+        AppconfLayoutT layout;
+        layout.controllerId = config.value("controllerId", layout.controllerId);
+        layout.statusRate1 = config.value("statusRate1", layout.statusRate1);
+        layout.statusRate2 = config.value("statusRate2", layout.statusRate2);
+        layout.statusMsgs1 = config.value("statusMsgs1", layout.statusMsgs1);
+        layout.statusMsgs2 = config.value("statusMsgs2", layout.statusMsgs2);
+        return layout;
+    }
+
+    bool canStatusRatesFromJson(const json &config, std::array<float, 6> &rates)
+    {
+        rates.fill(0.0f);
+        for(auto &item : config.items())
+        {
+            // Packets are named "status1" to "status6".
+            const std::string &key = item.key();
+            if(key.size() != 7 || key.compare(0, 6, "status") != 0 || key[6] < '1' || key[6] > '6') {
+                std::cerr << "Invalid CAN status packet " << key << std::endl;
+                return false;
+            }
+            rates[size_t(key[6] - '1')] = item.value().get<float>();
+        }
+        return true;
+    }
+
+    bool canStatusFromRates(const std::array<float, 6> &rates, CanStatusConfigT &status)
+    {
+        status = CanStatusConfigT {};
+        for(size_t i = 0; i < rates.size(); i++) {
+            auto rate = uint16_t(std::clamp(std::lround(rates[i]), 0L, 0xFFFFL));
+            if(rate == 0)
+                continue;
+            auto bit = uint8_t(1u << i);
+            if(status.msgs1 == 0 || status.rate1 == rate) {
+                status.rate1 = rate;
+                status.msgs1 |= bit;
+            } else if(status.msgs2 == 0 || status.rate2 == rate) {
+                status.rate2 = rate;
+                status.msgs2 |= bit;
+            } else {
+                return false;
+            }
+        }
+        // Keep the faster rate first, as the tool shows them.
+        if(status.msgs2 != 0 && status.rate2 > status.rate1) {
+            std::swap(status.rate1, status.rate2);
+            std::swap(status.msgs1, status.msgs2);
+        }
+        return true;
+    }
+
+    bool getCanStatus(const std::vector<uint8_t> &appconf, const AppconfLayoutT &layout, CanStatusConfigT &status)
+    {
+        size_t end = std::max({layout.statusRate1 + 2, layout.statusRate2 + 2, layout.statusMsgs1 + 1, layout.statusMsgs2 + 1});
+        if(appconf.size() < end)
+            return false;
+        status.rate1 = uint16_t(appconf[layout.statusRate1] << 8 | appconf[layout.statusRate1 + 1]);
+        status.rate2 = uint16_t(appconf[layout.statusRate2] << 8 | appconf[layout.statusRate2 + 1]);
+        status.msgs1 = appconf[layout.statusMsgs1];
+        status.msgs2 = appconf[layout.statusMsgs2];
+        return true;
+    }
+
+    bool setCanStatus(std::vector<uint8_t> &appconf, const AppconfLayoutT &layout, const CanStatusConfigT &status)
+    {
+        size_t end = std::max({layout.statusRate1 + 2, layout.statusRate2 + 2, layout.statusMsgs1 + 1, layout.statusMsgs2 + 1});
+        if(appconf.size() < end)
+            return false;
+        appconf[layout.statusRate1] = uint8_t(status.rate1 >> 8);
+        appconf[layout.statusRate1 + 1] = uint8_t(status.rate1);
+        appconf[layout.statusRate2] = uint8_t(status.rate2 >> 8);
+        appconf[layout.statusRate2 + 1] = uint8_t(status.rate2);
+        appconf[layout.statusMsgs1] = status.msgs1;
+        appconf[layout.statusMsgs2] = status.msgs2;
+        return true;
+    }
+
+    json ControllerConfig::setCanStatus(const std::vector<ConfigTargetT> &targets, const std::map<std::string, CanStatusConfigT> &settings,
+                                        const AppconfLayoutT &layout)
+    {
+        std::vector<ConfigTargetT> wanted;
+        for(auto &target : targets) {
+            if(settings.count(target.name) != 0)
+                wanted.push_back(target);
+        }
+        json result = json::object();
+        json configs = json::object();
+        auto current = read(wanted, ControllerConfigT::APPCONF, false);
+        for(auto &target : wanted) {
+            auto &now = current[target.name];
+            std::vector<uint8_t> data;
+            json entry;
+            entry["written"] = false;
+            entry["ok"] = false;
+            if(!now.value("ok", false) || !fromHex(now["data"].get<std::string>(), data)) {
+                entry["error"] = now.value("error", std::string("Read failed"));
+            } else if(data.size() <= layout.controllerId || data[layout.controllerId] != target.id) {
+                entry["error"] = "Controller id doesn't match, the app configuration layout may be wrong for firmware " +
+                                 now.value("firmware", std::string("?"));
+            } else if(!multivesc::setCanStatus(data, layout, settings.at(target.name))) {
+                entry["error"] = "App configuration too short";
+            } else {
+                configs[target.name] = toHex(data.data(), data.size());
+                continue;
+            }
+            result[target.name] = entry;
+        }
+        result.update(write(wanted, ControllerConfigT::APPCONF, configs));
+        return result;
+    }
+
+    json ControllerConfig::write(const std::vector<ConfigTargetT> &targets, ControllerConfigT type, const json &configs)
+    {
+        std::vector<std::future<json>> replies;
+        for(auto &[bus, busTargets] : byBus(targets)) {
+            replies.push_back(std::async(std::launch::async, [this, bus = bus, busTargets = busTargets, type, &configs]() {
+                return writeBus(bus, busTargets, type, configs);
+            }));
+        }
+        json result = json::object();
+        for(auto &reply : replies) {
+            result.update(reply.get());
+        }
+        if(!mCacheFile.empty())
+            save();
+        return result;
+    }
+
+    json ControllerConfig::writeBus(const std::shared_ptr<BusInterface> &bus, const std::vector<const ConfigTargetT *> &targets,
+                                    ControllerConfigT type, const json &configs)
+    {
+        json result = json::object();
+        std::vector<const ConfigTargetT *> wanted;
+        std::map<std::string, std::vector<uint8_t>> desired;
+        for(auto *target : targets) {
+            if(!configs.contains(target->name))
+                continue;
+            json entry;
+            std::vector<uint8_t> data;
+            if(!configs[target->name].is_string() || !fromHex(configs[target->name].get<std::string>(), data) || data.empty()) {
+                entry["ok"] = false;
+                entry["error"] = "Bad configuration data";
+                result[target->name] = entry;
+                continue;
+            }
+            desired[target->name] = std::move(data);
+            wanted.push_back(target);
+        }
+
+        // Only write the controllers that differ.
+        auto current = readBus(bus, wanted, type, false);
+        std::vector<const ConfigTargetT *> toWrite;
+        std::vector<uint8_t> writeIds;
+        std::vector<std::vector<uint8_t>> payloads;
+        for(auto *target : wanted) {
+            auto &now = current[target->name];
+            auto &data = desired[target->name];
+            json entry;
+            entry["hash"] = hash(data);
+            entry["written"] = false;
+            if(!now.value("ok", false)) {
+                entry["ok"] = false;
+                entry["error"] = now.value("error", std::string("Read failed"));
+            } else if(now["hash"] == entry["hash"]) {
+                entry["ok"] = true;
+            } else {
+                std::vector<uint8_t> payload;
+                payload.reserve(data.size() + 1);
+                payload.push_back(setCommand(type));
+                payload.insert(payload.end(), data.begin(), data.end());
+                payloads.push_back(std::move(payload));
+                writeIds.push_back(target->id);
+                toWrite.push_back(target);
+            }
+            result[target->name] = entry;
+        }
+        auto acks = bus->requestAll(writeIds, payloads, mWriteTimeout);
+
+        // Read back what was written to check it took.
+        auto check = readBus(bus, toWrite, type, false);
+        for(size_t i = 0; i < toWrite.size(); i++) {
+            auto &entry = result[toWrite[i]->name];
+            entry["written"] = !acks[i].empty();
+            entry["ok"] = !acks[i].empty() && check[toWrite[i]->name].value("hash", std::string()) == entry["hash"];
+            if(!entry["ok"])
+                entry["error"] = acks[i].empty() ? "No acknowledgement" : "Read back differs";
+        }
+        return result;
+    }
+
+} // multivesc
@@ -0,0 +1,179 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#include <array>
+#include <atomic>
+#include "multivesc/Crc16.hh"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MULTIVESC_CRC16_CLMUL 1
+#include <immintrin.h>
+#endif
+
+namespace multivesc {
+
+    namespace {
+        constexpr uint16_t gPolynomial = 0x1021;
+
+        std::atomic<bool> gClmulAllowed = true;
+
+        //! Tables for slice-by-8, table k is the CRC of a byte followed by k zero bytes.
+        constexpr std::array<std::array<uint16_t, 256>, 8> makeTables()
+        {
+            std::array<std::array<uint16_t, 256>, 8> tables {};
+            for(unsigned b = 0; b < 256; b++) {
+                uint16_t crc = uint16_t(b << 8);
+                for(int bit = 0; bit < 8; bit++) {
+                    crc = uint16_t((crc & 0x8000) ? (crc << 1) ^ gPolynomial : (crc << 1));
+                }
+                tables[0][b] = crc;
+            }
+            for(size_t k = 1; k < 8; k++) {
+                for(unsigned b = 0; b < 256; b++) {
+                    uint16_t prev = tables[k - 1][b];
+                    tables[k][b] = uint16_t((prev << 8) ^ tables[0][prev >> 8]);
+                }
+            }
+            return tables;
+        }
+
+        constexpr auto gTables = makeTables();
+
+        static_assert(gTables[0][1] == 0x1021, "CRC table generation is wrong");
+
+#ifdef MULTIVESC_CRC16_CLMUL
+        //! x^n mod P, as the coefficients of a polynomial of degree less than 16.
+        constexpr uint64_t xPowMod(unsigned n)
+        {
+            // Multiply by x one step at a time, reducing as we go.
+            uint32_t value = 1;
+            for(unsigned i = 0; i < n; i++) {
+                value <<= 1;
+                if(value & 0x10000)
+                    value ^= 0x10000 | gPolynomial;
+            }
+            return value;
+        }
+
+        // Folding a 128 bit block 'X = Xh*x^64 + Xl' forward by n bits gives Xh*(x^(n+64) mod P) + Xl*(x^n mod P).
+        constexpr uint64_t gFold128Hi = xPowMod(128 + 64);
+        constexpr uint64_t gFold128Lo = xPowMod(128);
+        constexpr uint64_t gFold512Hi = xPowMod(512 + 64);
+        constexpr uint64_t gFold512Lo = xPowMod(512);
+
+        __attribute__((target("pclmul,ssse3")))
+        inline __m128i loadBlock(const uint8_t *data, __m128i reverse)
+        {
+            // Byte reverse so the first byte holds the highest powers, as the CRC is not reflected.
+            return _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data)), reverse);
+        }
+
+        __attribute__((target("pclmul,ssse3")))
+        inline __m128i fold(__m128i x, __m128i k)
+        {
+            return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11), _mm_clmulepi64_si128(x, k, 0x00));
+        }
+#endif
+    }
+
+    uint16_t crc16Bytewise(const uint8_t *data, size_t len, uint16_t crc)
+    {
+        for(size_t i = 0; i < len; i++) {
+            crc = uint16_t((crc << 8) ^ gTables[0][(crc >> 8) ^ data[i]]);
+        }
+        return crc;
+    }
+
+    uint16_t crc16Slice8(const uint8_t *data, size_t len, uint16_t crc)
+    {
+        while(len >= 8) {
+            // The CRC so far is absorbed into the first two bytes, the rest are looked up independently.
+            uint8_t b0 = uint8_t(data[0] ^ (crc >> 8));
+            uint8_t b1 = uint8_t(data[1] ^ (crc & 0xFF));
+            crc = uint16_t(gTables[7][b0] ^ gTables[6][b1] ^ gTables[5][data[2]] ^ gTables[4][data[3]] ^
+                           gTables[3][data[4]] ^ gTables[2][data[5]] ^ gTables[1][data[6]] ^ gTables[0][data[7]]);
+            data += 8;
+            len -= 8;
+        }
+        return crc16Bytewise(data, len, crc);
+    }
+
+    bool crc16ClmulSupported()
+    {
+#ifdef MULTIVESC_CRC16_CLMUL
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+#else
+        return false;
+#endif
+    }
+
+#ifdef MULTIVESC_CRC16_CLMUL
+    __attribute__((target("pclmul,ssse3")))
+    uint16_t crc16Clmul(const uint8_t *data, size_t len, uint16_t crc)
+    {
+        if(len < 64)
+            return crc16Slice8(data, len, crc);
+        const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+        const __m128i k512 = _mm_set_epi64x(int64_t(gFold512Hi), int64_t(gFold512Lo));
+        const __m128i k128 = _mm_set_epi64x(int64_t(gFold128Hi), int64_t(gFold128Lo));
+
+        // The initial CRC is equivalent to xor'ing it into the first two bytes of the message.
+        __m128i x0 = loadBlock(data, reverse);
+        x0 = _mm_xor_si128(x0, _mm_set_epi64x(int64_t(uint64_t(crc) << 48), 0));
+        __m128i x1 = loadBlock(data + 16, reverse);
+        __m128i x2 = loadBlock(data + 32, reverse);
+        __m128i x3 = loadBlock(data + 48, reverse);
+        data += 64;
+        len -= 64;
+
+        // Four independent streams, each folded forward 512 bits at a time.
+        while(len >= 64) {
+            x0 = _mm_xor_si128(fold(x0, k512), loadBlock(data, reverse));
+            x1 = _mm_xor_si128(fold(x1, k512), loadBlock(data + 16, reverse));
+            x2 = _mm_xor_si128(fold(x2, k512), loadBlock(data + 32, reverse));
+            x3 = _mm_xor_si128(fold(x3, k512), loadBlock(data + 48, reverse));
+            data += 64;
+            len -= 64;
+        }
+        // Combine them into one, then fold in any remaining whole blocks.
+        x1 = _mm_xor_si128(x1, fold(x0, k128));
+        x2 = _mm_xor_si128(x2, fold(x1, k128));
+        __m128i x = _mm_xor_si128(x3, fold(x2, k128));
+        while(len >= 16) {
+            x = _mm_xor_si128(fold(x, k128), loadBlock(data, reverse));
+            data += 16;
+            len -= 16;
+        }
+        // What's left is congruent to the message so far, so finish off with the tables.
+        alignas(16) uint8_t block[16];
+        _mm_store_si128(reinterpret_cast<__m128i *>(block), _mm_shuffle_epi8(x, reverse));
+        crc = crc16Slice8(block, sizeof(block), 0);
+        return crc16Slice8(data, len, crc);
+    }
+#else
+    uint16_t crc16Clmul(const uint8_t *data, size_t len, uint16_t crc)
+    {
+        return crc16Slice8(data, len, crc);
+    }
+#endif
+
+    void crc16AllowClmul(bool allow)
+    {
+        gClmulAllowed = allow;
+    }
+
+    uint16_t crc16(const uint8_t *data, size_t len, uint16_t crc)
+    {
+        if(len < 16)
+            return crc16Bytewise(data, len, crc);
+        if(len >= 256) {
+            static const bool hasClmul = crc16ClmulSupported();
+            if(hasClmul && gClmulAllowed.load(std::memory_order_relaxed))
+                return crc16Clmul(data, len, crc);
+        }
+        return crc16Slice8(data, len, crc);
+    }
+
+} // multivesc
@@ -0,0 +1,349 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#include <iostream>
+#include <fstream>
+#include <deque>
+#include <future>
+#include <cstdio>
+#include <thread>
+#include "multivesc/FirmwareUpdater.hh"
+#include "multivesc/VescPacket.hh"
+#include "multivesc/Crc16.hh"
+
+namespace multivesc {
+
+    FirmwareUpdater::FirmwareUpdater(std::shared_ptr<BusInterface> bus)
+     : mBus(std::move(bus))
+    {}
+
+    bool FirmwareUpdater::loadImage(const std::string &filename)
+    {
+        std::ifstream file(filename, std::ios::binary);
+        if(!file.is_open()) {
+            std::cerr << "Failed to open firmware image " << filename << std::endl;
+            return false;
+        }
+        std::vector<uint8_t> firmware((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if(firmware.empty()) {
+            std::cerr << "Firmware image " << filename << " is empty" << std::endl;
+            return false;
+        }
+        setImage(std::move(firmware));
+        return true;
+    }
+
+    void FirmwareUpdater::setImage(std::vector<uint8_t> firmware)
+    {
+        // The bootloader expects the size and CRC of the firmware in front of it, and checks them before installing.
+        mFirmwareCrc = crc16(firmware.data(), firmware.size());
+        int32_t index = 0;
+        uint8_t header[6];
+        buffer_append_int32(header, int32_t(firmware.size()), &index);
+        buffer_append_int16(header, int16_t(mFirmwareCrc), &index);
+        mImage.clear();
+        mImage.reserve(firmware.size() + sizeof(header));
+        mImage.insert(mImage.end(), header, header + sizeof(header));
+        mImage.insert(mImage.end(), firmware.begin(), firmware.end());
+    }
+
+    bool FirmwareUpdater::blankChunk(size_t chunk) const
+    {
+        size_t start = chunk * mChunkSize;
+        size_t end = std::min(start + mChunkSize, mImage.size());
+        return std::all_of(mImage.begin() + long(start), mImage.begin() + long(end), [](uint8_t b) { return b == 0xFF; });
+    }
+
+    bool FirmwareUpdater::upload(const std::vector<uint8_t> &controllerIds, bool jump)
+    {
+        mResults = json::object();
+        mResults["controllers"] = json::object();
+        if(mImage.empty()) {
+            std::cerr << "No firmware image to upload" << std::endl;
+            return false;
+        }
+        if(!mBus) {
+            std::cerr << "No bus to upload firmware on" << std::endl;
+            return false;
+        }
+        auto start = std::chrono::steady_clock::now();
+        std::vector<TargetT> targets(controllerIds.size());
+        for(size_t i = 0; i < targets.size(); i++) {
+            targets[i].id = controllerIds[i];
+            targets[i].done.assign(chunkCount(), false);
+        }
+        loadProgress(targets);
+
+        erase(targets);
+        saveProgress(targets);
+        write(targets);
+        saveProgress(targets);
+
+        bool allOk = true;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::vector<bool> targetOk(targets.size());
+        for(size_t i = 0; i < targets.size(); i++) {
+            auto &target = targets[i];
+            bool ok = !target.failed && target.erased && std::all_of(target.done.begin(), target.done.end(), [](bool d) { return d; });
+            targetOk[i] = ok || target.installed;
+            allOk = allOk && targetOk[i];
+        }
+        if(jump) {
+            // The controller the bus is attached to resets as soon as it handles its own jump, losing any
+            // forwarded ones queued behind it, so it is told last.
+            const uint8_t jumpCmd[1] = {COMM_JUMP_TO_BOOTLOADER};
+            TargetT *local = nullptr;
+            bool forwarded = false;
+            for(size_t i = 0; i < targets.size(); i++) {
+                auto &target = targets[i];
+                if(!targetOk[i] || target.installed)
+                    continue;
+                if(int(target.id) == mBus->localId()) {
+                    local = &target;
+                    continue;
+                }
+                target.installed = mBus->sendPacket(target.id, jumpCmd, sizeof(jumpCmd));
+                forwarded = forwarded || target.installed;
+            }
+            if(local != nullptr) {
+                if(forwarded)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                local->installed = mBus->sendPacket(local->id, jumpCmd, sizeof(jumpCmd));
+            }
+        }
+        for(size_t i = 0; i < targets.size(); i++) {
+            auto &target = targets[i];
+            bool ok = targetOk[i];
+            json result;
+            result["ok"] = ok;
+            result["installed"] = target.installed;
+            result["erased"] = target.erased;
+            result["bytes"] = target.bytesDone;
+            result["total"] = mImage.size();
+            mResults["controllers"][std::to_string(target.id)] = result;
+        }
+        mResults["time"] = seconds;
+        mResults["throughput"] = seconds > 0.0 ? double(mImage.size() * targets.size()) / seconds : 0.0;
+        if(allOk && jump && !mResumeFile.empty()) {
+            std::remove(mResumeFile.c_str());
+        } else {
+            // Remember which were installed so they aren't done again.
+            saveProgress(targets);
+        }
+        return allOk;
+    }
+
+    void FirmwareUpdater::erase(std::vector<TargetT> &targets)
+    {
+        // Erasing takes a while, so do all of them at once.
+        uint8_t payload[5];
+        int32_t len = 0;
+        payload[len++] = COMM_ERASE_NEW_APP;
+        buffer_append_int32(payload, int32_t(mImage.size()), &len);
+        // If replies don't say who they are from, a controller that fails could be mistaken for one that
+        // succeeded, so then they are done one at a time.
+        bool parallel = mBus->repliesIdentifySender();
+        std::vector<std::pair<TargetT *, std::future<std::vector<uint8_t>>>> replies;
+        for(auto &target : targets) {
+            if(target.erased || target.installed)
+                continue;
+            replies.emplace_back(&target, parallel ? mBus->request(target.id, payload, size_t(len), mEraseTimeout) :
+                                                     std::future<std::vector<uint8_t>>());
+        }
+        for(auto &[target, future] : replies) {
+            if(!future.valid()) {
+                future = mBus->request(target->id, payload, size_t(len), mEraseTimeout);
+            }
+            auto reply = future.get();
+            if(reply.size() >= 2 && reply[1] == 1) {
+                target->erased = true;
+                // Anything written before was erased too.
+                target->done.assign(chunkCount(), false);
+            } else {
+                std::cerr << "Controller " << int(target->id) << " failed to erase " << (reply.empty() ? "(no reply)" : "") << std::endl;
+                target->failed = true;
+            }
+        }
+    }
+
+    void FirmwareUpdater::write(std::vector<TargetT> &targets)
+    {
+        struct InFlightT
+        {
+            size_t chunk;
+            std::future<std::vector<uint8_t>> reply;
+        };
+        std::vector<std::deque<InFlightT>> inFlight(targets.size());
+        size_t numChunks = chunkCount();
+
+        // Blank chunks are already there after the erase, the rest are sent in order.
+        for(auto &target : targets) {
+            target.todo.clear();
+            target.failures.assign(numChunks, 0);
+            target.bytesDone = 0;
+            for(size_t chunk = numChunks; chunk-- > 0;) {
+                size_t chunkLen = std::min(mChunkSize, mImage.size() - chunk * mChunkSize);
+                if(!target.done[chunk] && blankChunk(chunk))
+                    target.done[chunk] = true;
+                if(target.done[chunk]) {
+                    target.bytesDone += chunkLen;
+                } else {
+                    target.todo.push_back(chunk);
+                }
+            }
+            if(!target.erased || target.failed || target.installed)
+                target.todo.clear();
+        }
+
+        // If replies don't say who they are from, chunks for one controller could be mistaken for another's,
+        // so then the controllers are written one after the other.  The link is shared so this costs little.
+        bool parallel = mBus->repliesIdentifySender();
+        std::vector<uint8_t> payload;
+        auto lastSave = std::chrono::steady_clock::now();
+        while(true) {
+            // Keep the pipeline to each controller full.
+            for(size_t i = 0; i < targets.size(); i++) {
+                auto &target = targets[i];
+                if(!parallel && i > 0 && (!inFlight[i - 1].empty() || !targets[i - 1].todo.empty()))
+                    break;
+                while(inFlight[i].size() < mPipelineDepth && !target.todo.empty()) {
+                    size_t chunk = target.todo.back();
+                    target.todo.pop_back();
+                    size_t offset = chunk * mChunkSize;
+                    size_t chunkLen = std::min(mChunkSize, mImage.size() - offset);
+                    payload.resize(5 + chunkLen);
+                    int32_t index = 0;
+                    payload[index++] = COMM_WRITE_NEW_APP_DATA;
+                    buffer_append_int32(payload.data(), int32_t(offset), &index);
+                    std::copy(mImage.begin() + long(offset), mImage.begin() + long(offset + chunkLen), payload.begin() + index);
+                    inFlight[i].push_back(InFlightT {chunk, mBus->request(target.id, payload, mTimeout)});
+                }
+            }
+
+            // Collect the replies that have come in.
+            bool progress = false;
+            bool waiting = false;
+            for(size_t i = 0; i < targets.size(); i++) {
+                auto &target = targets[i];
+                auto &queue = inFlight[i];
+                while(!queue.empty() && queue.front().reply.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+                    auto reply = queue.front().reply.get();
+                    size_t chunk = queue.front().chunk;
+                    queue.pop_front();
+                    progress = true;
+                    size_t offset = chunk * mChunkSize;
+                    // Newer firmware echoes the offset, which catches a reply matched to the wrong request.
+                    bool ok = reply.size() >= 2 && reply[1] == 1;
+                    if(ok && reply.size() >= 6) {
+                        auto echoed = uint32_t(reply[2]) << 24 | uint32_t(reply[3]) << 16 | uint32_t(reply[4]) << 8 | reply[5];
+                        ok = echoed == offset;
+                    }
+                    if(ok) {
+                        target.done[chunk] = true;
+                        target.bytesDone += std::min(mChunkSize, mImage.size() - offset);
+                        if(mProgressCallback)
+                            mProgressCallback(target.id, target.bytesDone, mImage.size());
+                        continue;
+                    }
+                    if(target.failed)
+                        continue;
+                    // Retries are counted for each chunk, a long image on a noisy bus can see many bad chunks.
+                    if(++target.failures[chunk] > mRetries) {
+                        std::cerr << "Controller " << int(target.id) << " failed to write at offset " << offset << std::endl;
+                        target.failed = true;
+                        target.todo.clear();
+                    } else {
+                        target.todo.push_back(chunk);
+                    }
+                }
+                waiting = waiting || !queue.empty() || !target.todo.empty();
+            }
+            if(!waiting)
+                break;
+
+            auto now = std::chrono::steady_clock::now();
+            if(now - lastSave > std::chrono::milliseconds(500)) {
+                saveProgress(targets);
+                lastSave = now;
+            }
+            if(!progress) {
+                // Nothing came in, wait for the oldest outstanding chunk.
+                for(auto &queue : inFlight) {
+                    if(!queue.empty()) {
+                        queue.front().reply.wait_for(std::chrono::milliseconds(1));
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    void FirmwareUpdater::loadProgress(std::vector<TargetT> &targets)
+    {
+        if(mResumeFile.empty())
+            return;
+        std::ifstream file(mResumeFile);
+        if(!file.is_open())
+            return;
+        json progress = json::parse(file, nullptr, false);
+        if(progress.is_discarded()) {
+            std::cerr << "Ignoring unreadable resume file " << mResumeFile << std::endl;
+            return;
+        }
+        if(progress.value("size", size_t(0)) != mImage.size() || progress.value("crc", 0) != mFirmwareCrc ||
+           progress.value("chunkSize", size_t(0)) != mChunkSize) {
+            std::cerr << "Resume file " << mResumeFile << " is for a different image, starting again" << std::endl;
+            return;
+        }
+        auto &controllers = progress["controllers"];
+        for(auto &target : targets) {
+            auto key = std::to_string(target.id);
+            if(!controllers.contains(key))
+                continue;
+            auto &entry = controllers[key];
+            target.erased = entry.value("erased", false);
+            target.installed = entry.value("installed", false);
+            auto done = entry.value("done", std::string());
+            for(size_t i = 0; i < done.size() && i < target.done.size(); i++) {
+                target.done[i] = done[i] == '1';
+            }
+        }
+    }
+
+    void FirmwareUpdater::saveProgress(const std::vector<TargetT> &targets)
+    {
+        if(mResumeFile.empty())
+            return;
+        json progress;
+        progress["size"] = mImage.size();
+        progress["crc"] = mFirmwareCrc;
+        progress["chunkSize"] = mChunkSize;
+        json controllers = json::object();
+        for(auto &target : targets) {
+            json entry;
+            entry["erased"] = target.erased;
+            entry["installed"] = target.installed;
+            std::string done(target.done.size(), '0');
+            for(size_t i = 0; i < target.done.size(); i++) {
+                if(target.done[i])
+                    done[i] = '1';
+            }
+            entry["done"] = done;
+            controllers[std::to_string(target.id)] = entry;
+        }
+        progress["controllers"] = controllers;
+        // Write then rename, so an interruption doesn't leave a half written file.
+        std::string tmpName = mResumeFile + ".tmp";
+        {
+            std::ofstream file(tmpName);
+            if(!file.is_open()) {
+                std::cerr << "Failed to write resume file " << tmpName << std::endl;
+                return;
+            }
+            file << progress.dump();
+        }
+        std::rename(tmpName.c_str(), mResumeFile.c_str());
+    }
+
+} // multivesc
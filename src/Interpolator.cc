@@ -0,0 +1,117 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#include <algorithm>
+#include "multivesc/Interpolator.hh"
+
+namespace multivesc {
+
+    std::string to_string(InterpolationT type)
+    {
+        switch (type)
+        {
+            case InterpolationT::NONE: return "NONE";
+            case InterpolationT::LINEAR: return "LINEAR";
+            case InterpolationT::CUBIC: return "CUBIC";
+        }
+        return "UNKNOWN";
+    }
+
+    InterpolationT interpolationFromString(const std::string& str)
+    {
+        std::string upper = str;
+        std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+        for(int i = 0; i <= (int)InterpolationT::CUBIC; i++)
+        {
+            if(upper == to_string((InterpolationT)i))
+            {
+                return (InterpolationT)i;
+            }
+        }
+        return InterpolationT::NONE;
+    }
+
+    void SetpointInterpolator::reset(float value, TimePointT now)
+    {
+        mValid = true;
+        mLastPushTime = now;
+        mLastTarget = value;
+        mStartTime = now;
+        mStartValue = value;
+        mStartSlope = 0.0f;
+        mTarget = value;
+        mTargetSlope = 0.0f;
+        mDuration = 0.0f;
+    }
+
+    void SetpointInterpolator::push(float value, TimePointT now)
+    {
+        if(!mValid || mMode == InterpolationT::NONE) {
+            reset(value, now);
+            return;
+        }
+        float dt = std::chrono::duration<float>(now - mLastPushTime).count();
+        if(dt <= 0.0f) {
+            // Several updates at once, just retarget the current segment.
+            mTarget = value;
+            mLastTarget = value;
+            return;
+        }
+        // Track the client update interval, ignoring pauses so one gap doesn't make us sluggish.
+        if(mInterval <= 0.0f) {
+            mInterval = dt;
+        } else if(dt < mInterval * 4.0f) {
+            mInterval = mInterval * 0.7f + dt * 0.3f;
+        }
+
+        mStartValue = evaluate(now);
+        mStartSlope = slope(now);
+        mStartTime = now;
+        mTargetSlope = (value - mLastTarget) / dt;
+        mTarget = value;
+        mDuration = mInterval;
+
+        mLastTarget = value;
+        mLastPushTime = now;
+    }
+
+    float SetpointInterpolator::evaluate(TimePointT now) const
+    {
+        float s = std::max(std::chrono::duration<float>(now - mStartTime).count(), 0.0f);
+        if(s < mDuration) {
+            float u = s / mDuration;
+            if(mMode == InterpolationT::CUBIC) {
+                // Cubic Hermite between the current output and the target, matching slopes at both ends.
+                float u2 = u * u;
+                float u3 = u2 * u;
+                return (2*u3 - 3*u2 + 1) * mStartValue
+                     + (u3 - 2*u2 + u) * mDuration * mStartSlope
+                     + (-2*u3 + 3*u2) * mTarget
+                     + (u3 - u2) * mDuration * mTargetSlope;
+            }
+            return mStartValue + (mTarget - mStartValue) * u;
+        }
+        float extrapolate = std::min(s - mDuration, mHorizon);
+        return mTarget + mTargetSlope * extrapolate;
+    }
+
+    float SetpointInterpolator::slope(TimePointT now) const
+    {
+        float s = std::max(std::chrono::duration<float>(now - mStartTime).count(), 0.0f);
+        if(s < mDuration) {
+            if(mMode == InterpolationT::CUBIC) {
+                float u = s / mDuration;
+                float u2 = u * u;
+                return ((6*u2 - 6*u) * mStartValue + (-6*u2 + 6*u) * mTarget) / mDuration
+                     + (3*u2 - 4*u + 1) * mStartSlope
+                     + (3*u2 - 2*u) * mTargetSlope;
+            }
+            return (mTarget - mStartValue) / mDuration;
+        }
+        if(s - mDuration < mHorizon)
+            return mTargetSlope;
+        return 0.0f;
+    }
+
+} // multivesc
@@ -0,0 +1,128 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#include <algorithm>
+#include <cmath>
+#include "multivesc/LatencyHistogram.hh"
+
+namespace multivesc {
+
+    unsigned LatencyHistogram::bucketIndex(uint64_t ns)
+    {
+        if(ns < SubBuckets)
+            return unsigned(ns);
+        if(ns >> MaxBits)
+            return NumBuckets - 1;
+        // The leading bit picks the power of two, the bits after it the bucket within it.
+        unsigned top = 63u - unsigned(__builtin_clzll(ns));
+        unsigned shift = top - SubBucketBits;
+        return (shift + 1) * SubBuckets + unsigned((ns >> shift) & (SubBuckets - 1));
+    }
+
+    uint64_t LatencyHistogram::bucketLower(unsigned index)
+    {
+        if(index < SubBuckets)
+            return index;
+        unsigned shift = index / SubBuckets - 1;
+        return uint64_t(SubBuckets + index % SubBuckets) << shift;
+    }
+
+    uint64_t LatencyHistogram::bucketWidth(unsigned index)
+    {
+        if(index < SubBuckets)
+            return 1;
+        return uint64_t(1) << (index / SubBuckets - 1);
+    }
+
+    void LatencyHistogram::record(std::chrono::steady_clock::duration latency)
+    {
+        auto ns = uint64_t(std::max<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count(), 0));
+        mBuckets[bucketIndex(ns)]++;
+        if(mCount == 0 || ns < mMinNs)
+            mMinNs = ns;
+        mMaxNs = std::max(mMaxNs, ns);
+        mSumNs += double(ns);
+        mCount++;
+    }
+
+    void LatencyHistogram::merge(const LatencyHistogram &other)
+    {
+        if(other.mCount == 0)
+            return;
+        for(unsigned i = 0; i < NumBuckets; i++) {
+            mBuckets[i] += other.mBuckets[i];
+        }
+        mMinNs = mCount == 0 ? other.mMinNs : std::min(mMinNs, other.mMinNs);
+        mMaxNs = std::max(mMaxNs, other.mMaxNs);
+        mSumNs += other.mSumNs;
+        mCount += other.mCount;
+    }
+
+    void LatencyHistogram::clear()
+    {
+        mBuckets.fill(0);
+        mCount = 0;
+        mMinNs = 0;
+        mMaxNs = 0;
+        mSumNs = 0.0;
+    }
+
+    float LatencyHistogram::percentile(float p) const
+    {
+        if(mCount == 0)
+            return 0.0f;
+        auto rank = uint64_t(std::ceil(double(std::clamp(p, 0.0f, 1.0f)) * double(mCount)));
+        rank = std::max<uint64_t>(rank, 1);
+        uint64_t seen = 0;
+        for(unsigned i = 0; i < NumBuckets; i++) {
+            seen += mBuckets[i];
+            if(seen >= rank) {
+                double mid = double(bucketLower(i)) + double(bucketWidth(i) - 1) / 2.0;
+                return float(std::clamp(mid, double(mMinNs), double(mMaxNs)) * 1e-9);
+            }
+        }
+        return max();
+    }
+
+    float LatencyHistogram::min() const
+    {
+        return float(double(mMinNs) * 1e-9);
+    }
+
+    float LatencyHistogram::max() const
+    {
+        return float(double(mMaxNs) * 1e-9);
+    }
+
+    float LatencyHistogram::mean() const
+    {
+        if(mCount == 0)
+            return 0.0f;
+        return float(mSumNs / double(mCount) * 1e-9);
+    }
+
+    std::vector<std::pair<float, uint64_t>> LatencyHistogram::buckets() const
+    {
+        std::vector<std::pair<float, uint64_t>> result;
+        for(unsigned i = 0; i < NumBuckets; i++) {
+            if(mBuckets[i] != 0)
+                result.emplace_back(float(double(bucketLower(i) + bucketWidth(i)) * 1e-9), mBuckets[i]);
+        }
+        return result;
+    }
+
+    json LatencyHistogram::summary() const
+    {
+        json result;
+        result["count"] = mCount;
+        result["min"] = min();
+        result["mean"] = mean();
+        result["p50"] = percentile(0.5f);
+        result["p90"] = percentile(0.9f);
+        result["p99"] = percentile(0.99f);
+        result["max"] = max();
+        return result;
+    }
+
+} // multivesc
@@ -3,9 +3,12 @@
 //
 
 #include <iostream>
+#include <algorithm>
 #include "multivesc/Manager.hh"
 #include "multivesc/BusCan.hh"
 #include "multivesc/BusSerial.hh"
+#include "multivesc/BusLoopback.hh"
+#include "multivesc/BusReplay.hh"
 
 namespace multivesc
 {
@@ -25,23 +28,35 @@ namespace multivesc
 
     bool Manager::configure(json config)
     {
+        if(config.contains("updateRate")) {
+            setUpdateRate(config["updateRate"].get<float>());
+        }
+        if(config.contains("phaseLock")) {
+            setPhaseLock(config["phaseLock"].get<bool>(), config.value("phaseLockGuard", 0.0005f));
+        }
+        if(config.contains("timerResolution")) {
+            std::lock_guard lock(mMutex);
+            if(!mSchedule.empty()) {
+                std::cerr << "Timer resolution must be set before motors are added" << std::endl;
+            } else {
+                auto resolution = std::chrono::duration<float>(config["timerResolution"].get<float>());
+                mTimerWheel = TimerWheel(std::chrono::duration_cast<std::chrono::steady_clock::duration>(resolution));
+                mTimerWheel.reset(std::chrono::steady_clock::now());
+            }
+        }
+
+        if(config.contains("configCache")) {
+            setConfigCacheFile(config["configCache"].get<std::string>());
+        }
+        if(config.contains("appconfLayout")) {
+            setAppconfLayout(appconfLayoutFromJson(config["appconfLayout"]));
+        }
+
         for(auto& item : config["buses"].items())
         {
-            auto entry = item.value();
-            auto busType = entry["type"].get<std::string>();
-            std::shared_ptr<BusInterface> bus;
-            if(busType == "can")
-            {
-                bus = std::make_shared<BusCan>(entry);
-            } else if(busType == "serial")
-            {
-                bus = std::make_shared<BusSerial>(entry);
-            }
-            else
-            {
-                std::cout << "Unknown bus type " << busType << std::endl;
+            auto bus = createBus(item.value());
+            if(!bus)
                 return false;
-            }
             mBusMap[item.key()] = bus;
         }
 
@@ -55,9 +70,66 @@ namespace multivesc
             motor->configure(*this, item.value());
         }
 
+        if(config.contains("telemetryLog")) {
+            if(!startTelemetryLog(config["telemetryLog"]))
+                std::cerr << "Failed to start the telemetry log" << std::endl;
+        }
+
+        // Check the motors are there, and don't drive those that aren't.
+        if(config.value("scanOnStart", false)) {
+            auto scan = scanBuses(false, config.value("scanTimeout", 0.1f));
+            for(auto &busScan : scan) {
+                for(auto &name : busScan["missing"]) {
+                    std::cerr << "Motor " << name.get<std::string>() << " not found, disabling it" << std::endl;
+                    if(auto motor = getMotor(name.get<std::string>()))
+                        motor->setEnabled(false);
+                }
+            }
+        }
+
+        // Match the status traffic to what each motor needs.
+        auto statusResult = configureCanStatus();
+        for(auto &item : statusResult.items()) {
+            if(!item.value().value("ok", false)) {
+                std::cerr << "Failed to set CAN status rates for " << item.key() << ": "
+                          << item.value().value("error", std::string("unknown error")) << std::endl;
+            }
+        }
+
+        // Let the buses know the motors are ready, a replay starts playing.
+        {
+            std::lock_guard lock(mMutex);
+            for(auto &item : mBusMap) {
+                item.second->motorsReady();
+            }
+        }
+
         return true;
     }
 
+    std::shared_ptr<BusInterface> Manager::createBus(const json &config)
+    {
+        auto busType = config.value("type", std::string());
+        if(busType == "can")
+        {
+            return std::make_shared<BusCan>(config);
+        }
+        if(busType == "serial")
+        {
+            return std::make_shared<BusSerial>(config);
+        }
+        if(busType == "loopback")
+        {
+            return std::make_shared<BusLoopback>(config);
+        }
+        if(busType == "replay")
+        {
+            return std::make_shared<BusReplay>(config);
+        }
+        std::cout << "Unknown bus type " << busType << std::endl;
+        return nullptr;
+    }
+
     bool Manager::openCan(const std::string& port)
     {
         auto bus = std::make_shared<BusCan>(port);
@@ -70,6 +142,19 @@ namespace multivesc
         return true;
     }
 
+    bool Manager::addBus(const std::string &name, std::shared_ptr<BusInterface> bus)
+    {
+        if(!bus)
+            return false;
+        std::lock_guard lock(mMutex);
+        if(mBusMap.count(name) != 0) {
+            std::cerr << "Bus " << name << " already exists" << std::endl;
+            return false;
+        }
+        mBusMap[name] = std::move(bus);
+        return true;
+    }
+
     std::shared_ptr<BusInterface> Manager::getBus(const std::string &name)
     {
         std::lock_guard lock(mMutex);
@@ -104,6 +189,7 @@ namespace multivesc
 
     bool Manager::stop()
     {
+        stopTelemetryLog();
         mTerminate = true;
         // Shutdown all buses
         {
@@ -141,23 +227,236 @@ namespace multivesc
             }
         }
         mMotors.push_back(motor.shared_from_this());
+        if(mTelemetryLog)
+            mTelemetryLog->addMotor(motor.shared_from_this());
+
+        // Let the bus pick the phase so motors aren't all sent at once.
+        auto handle = uint32_t(mSchedule.size());
+        auto period = updatePeriod(motor);
+        ScheduleEntry entry;
+        entry.motor = motor.shared_from_this();
+        entry.bus = motor.mComs.get();
+        auto phase = entry.bus != nullptr ? entry.bus->phaseOffset(motor.id(), period) : std::chrono::steady_clock::duration::zero();
+        auto now = std::chrono::steady_clock::now();
+        auto into = (now.time_since_epoch() - phase) % period;
+        if(into < std::chrono::steady_clock::duration::zero())
+            into += period;
+        entry.due = now - into + period;
+        mTimerWheel.schedule(handle, entry.due);
+        mSchedule.push_back(std::move(entry));
+        return true;
+    }
+
+    bool Manager::startTrajectories(const std::map<std::string, std::shared_ptr<const Trajectory>> &trajectories, float startDelay)
+    {
+        std::vector<std::pair<std::shared_ptr<Motor>, std::shared_ptr<const Trajectory>>> targets;
+        for(const auto &item : trajectories)
+        {
+            auto motor = getMotor(item.first);
+            if(!motor) {
+                std::cerr << "Motor " << item.first << " not found" << std::endl;
+                return false;
+            }
+            if(!item.second) {
+                std::cerr << "No trajectory for motor " << item.first << std::endl;
+                return false;
+            }
+            targets.emplace_back(motor, item.second);
+        }
+        // Hold every motor's drive lock while checking and starting, so none can be disabled or change mode
+        // part way through.  Locks are taken in address order so two callers can't deadlock.
+        std::sort(targets.begin(), targets.end(),
+                  [](const auto &a, const auto &b) { return a.first.get() < b.first.get(); });
+        std::vector<std::unique_lock<std::mutex>> locks;
+        locks.reserve(targets.size());
+        for(auto &target : targets)
+        {
+            locks.emplace_back(target.first->mDriveMutex);
+        }
+        for(auto &target : targets)
+        {
+            if(!target.first->canFollowTrajectory(*target.second))
+                return false;
+        }
+        auto start = std::chrono::steady_clock::now() +
+                     std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(startDelay));
+        for(auto &target : targets)
+        {
+            target.first->beginTrajectory(target.second, start);
+        }
         return true;
     }
 
+    void Manager::stopTrajectories()
+    {
+        for(auto &motor : motors())
+        {
+            motor->clearTrajectory();
+        }
+    }
+
+    void Manager::setUpdateRate(float hz)
+    {
+        if(hz <= 0.0f) {
+            std::cerr << "Invalid update rate " << hz << std::endl;
+            return;
+        }
+        mUpdatePeriod = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(1.0f / hz));
+    }
+
+    float Manager::updateRate() const
+    {
+        return 1.0f / std::chrono::duration<float>(mUpdatePeriod.load()).count();
+    }
+
+    void Manager::setPhaseLock(bool enable, float guard)
+    {
+        if(guard < 0.0f) {
+            std::cerr << "Invalid phase lock guard " << guard << std::endl;
+            return;
+        }
+        mPhaseLockGuard = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(guard));
+        mPhaseLock = enable;
+    }
+
+    std::chrono::steady_clock::duration Manager::updatePeriod(const Motor &motor) const
+    {
+        auto period = motor.mUpdatePeriod.load();
+        if(period <= std::chrono::steady_clock::duration::zero()) {
+            period = mUpdatePeriod.load();
+        }
+        return std::max(period, mTimerWheel.resolution());
+    }
+
     void Manager::runUpdate()
     {
         while(!mTerminate)
         {
-            std::this_thread::sleep_for(50ms);
+            // Sleep until something may be due, checking regularly so new motors and termination are noticed.
+            std::chrono::steady_clock::time_point wake;
+            {
+                std::lock_guard lock(mMutex);
+                wake = std::min(mTimerWheel.nextEvent(), std::chrono::steady_clock::now() + 20ms);
+            }
+            std::this_thread::sleep_until(wake);
 
             std::lock_guard lock(mMutex);
-            for(auto& bus : mBusMap)
-            {
-                bus.second->update();
+            // Use the same time for all motors so trajectories share a time base.
+            updateDue(std::chrono::steady_clock::now());
+        }
+
+    }
+
+    void Manager::updateDue(std::chrono::steady_clock::time_point now)
+    {
+        mExpired.clear();
+        mTimerWheel.advance(now, mExpired);
+        if(mExpired.empty())
+            return;
+
+        for(auto &entry : mDueByBus)
+        {
+            entry.second.clear();
+        }
+        for(auto handle : mExpired)
+        {
+            auto &entry = mSchedule[handle];
+            auto it = std::find_if(mDueByBus.begin(), mDueByBus.end(),
+                                   [&entry](const auto &item) { return item.first == entry.bus; });
+            if(it == mDueByBus.end()) {
+                mDueByBus.emplace_back(entry.bus, std::vector<Motor *>());
+                it = mDueByBus.end() - 1;
             }
+            it->second.push_back(entry.motor.get());
 
+            // Keep the phase, skipping any updates we've missed.
+            auto period = updatePeriod(*entry.motor);
+            entry.due += period;
+            std::chrono::steady_clock::time_point aligned;
+            if(mPhaseLock && entry.motor->alignToStatus(entry.due, period, mPhaseLockGuard, aligned) && aligned > now) {
+                entry.due = aligned;
+            }
+            if(entry.due <= now) {
+                entry.due += period * ((now - entry.due) / period + 1);
+            }
+            mTimerWheel.schedule(handle, entry.due);
+        }
+        for(auto &entry : mDueByBus)
+        {
+            if(entry.first != nullptr && !entry.second.empty()) {
+                entry.first->updateMotors(now, entry.second);
+            }
         }
+    }
 
+    json Manager::busStats()
+    {
+        std::map<std::string, std::shared_ptr<BusInterface>> buses;
+        {
+            std::lock_guard lock(mMutex);
+            buses = mBusMap;
+        }
+        json result;
+        for(auto &bus : buses)
+        {
+            result[bus.first] = bus.second->stats();
+        }
+        return result;
+    }
+
+    json Manager::latencyStats()
+    {
+        std::vector<std::shared_ptr<Motor>> motors;
+        {
+            std::lock_guard lock(mMutex);
+            motors = mMotors;
+        }
+        json result = json::object();
+        for(auto &motor : motors)
+        {
+            if(motor->latencyTraceEnabled())
+                result[motor->name()] = motor->latencyStats();
+        }
+        return result;
+    }
+
+    bool Manager::startTelemetryLog(const json &config)
+    {
+        stopTelemetryLog();
+        auto log = std::make_shared<TelemetryLogger>(config);
+        std::lock_guard lock(mMutex);
+        for(auto &motor : mMotors) {
+            if(!log->addMotor(motor))
+                return false;
+        }
+        if(!log->start())
+            return false;
+        mTelemetryLog = log;
+        return true;
+    }
+
+    void Manager::stopTelemetryLog()
+    {
+        std::shared_ptr<TelemetryLogger> log;
+        {
+            std::lock_guard lock(mMutex);
+            log = std::move(mTelemetryLog);
+            mTelemetryLog.reset();
+        }
+        if(log)
+            log->stop();
+    }
+
+    json Manager::telemetryLogStats()
+    {
+        std::shared_ptr<TelemetryLogger> log;
+        {
+            std::lock_guard lock(mMutex);
+            log = mTelemetryLog;
+        }
+        if(!log)
+            return json::object();
+        return log->stats();
     }
 
     std::shared_ptr<Motor> Manager::getMotor(const std::string &name)
@@ -172,4 +471,116 @@ namespace multivesc
         }
         return {};
     }
+    std::vector<ConfigTargetT> Manager::configTargets() const
+    {
+        std::lock_guard lock(mMutex);
+        std::vector<ConfigTargetT> targets;
+        for(auto &motor : mMotors) {
+            if(motor->mComs)
+                targets.push_back(ConfigTargetT {motor->name(), motor->mComs, motor->id()});
+        }
+        return targets;
+    }
+
+    json Manager::readControllerConfigs(const std::string &type, bool useCache)
+    {
+        ControllerConfigT configType;
+        if(!controllerConfigFromString(type, configType)) {
+            std::cerr << "Unknown configuration type " << type << std::endl;
+            return {};
+        }
+        return mControllerConfig.read(configTargets(), configType, useCache);
+    }
+
+    json Manager::writeControllerConfigs(const std::string &type, const json &configs)
+    {
+        ControllerConfigT configType;
+        if(!controllerConfigFromString(type, configType)) {
+            std::cerr << "Unknown configuration type " << type << std::endl;
+            return {};
+        }
+        return mControllerConfig.write(configTargets(), configType, configs);
+    }
+
+    json Manager::configureCanStatus()
+    {
+        std::vector<ConfigTargetT> targets;
+        std::map<std::string, CanStatusConfigT> settings;
+        json skipped = json::object();
+        {
+            std::lock_guard lock(mMutex);
+            for(auto &motor : mMotors) {
+                CanStatusRatesT rates;
+                if(!motor->mComs || !motor->enabled() || !motor->canStatusRates(rates))
+                    continue;
+                CanStatusConfigT status;
+                if(!canStatusFromRates(rates, status)) {
+                    json entry;
+                    entry["ok"] = false;
+                    entry["written"] = false;
+                    entry["error"] = "More than two CAN status rates asked for, the firmware has two";
+                    skipped[motor->name()] = entry;
+                    continue;
+                }
+                settings[motor->name()] = status;
+                targets.push_back(ConfigTargetT {motor->name(), motor->mComs, motor->id()});
+            }
+        }
+        if(targets.empty())
+            return skipped;
+        auto result = mControllerConfig.setCanStatus(targets, settings, mAppconfLayout);
+        result.update(skipped);
+        return result;
+    }
+
+    json Manager::scanBuses(bool allIds, float timeout)
+    {
+        std::map<std::string, std::vector<std::shared_ptr<Motor>>> motorsByBus;
+        std::map<std::string, std::shared_ptr<BusInterface>> buses;
+        {
+            std::lock_guard lock(mMutex);
+            buses = mBusMap;
+            for(auto &[name, bus] : mBusMap) {
+                for(auto &motor : mMotors) {
+                    if(motor->mComs == bus)
+                        motorsByBus[name].push_back(motor);
+                }
+            }
+        }
+        // Scan every bus at once.
+        std::map<std::string, std::future<std::vector<uint8_t>>> found;
+        for(auto &[name, bus] : buses) {
+            std::vector<uint8_t> ids;
+            if(allIds) {
+                for(int id = 0; id < 255; id++)
+                    ids.push_back(uint8_t(id));
+            } else {
+                for(auto &motor : motorsByBus[name])
+                    ids.push_back(motor->id());
+            }
+            found[name] = std::async(std::launch::async, [bus = bus, ids, timeout]() { return bus->scan(ids, timeout); });
+        }
+        json result = json::object();
+        for(auto &[name, future] : found) {
+            auto ids = future.get();
+            json entry;
+            entry["found"] = ids;
+            json missing = json::array();
+            for(auto &motor : motorsByBus[name]) {
+                if(std::find(ids.begin(), ids.end(), motor->id()) == ids.end())
+                    missing.push_back(motor->name());
+            }
+            entry["missing"] = missing;
+            json unknown = json::array();
+            for(auto id : ids) {
+                auto &motors = motorsByBus[name];
+                if(std::none_of(motors.begin(), motors.end(), [id](const std::shared_ptr<Motor> &motor) { return motor->id() == id; }))
+                    unknown.push_back(id);
+            }
+            entry["unknown"] = unknown;
+            result[name] = entry;
+        }
+        return result;
+    }
+
 } // multivesc
\ No newline at end of file
@@ -0,0 +1,184 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "multivesc/MappedFile.hh"
+
+namespace multivesc {
+
+    MappedFile::~MappedFile()
+    {
+        close();
+    }
+
+    bool MappedFile::create(const std::string &filename, size_t growStep)
+    {
+        close();
+        mFd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(mFd < 0) {
+            std::cerr << "Failed to create " << filename << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        mFilename = filename;
+        mOpen = true;
+        mWritable = true;
+        mGrowStep = std::max<size_t>(growStep, size_t(sysconf(_SC_PAGESIZE)));
+        mUsed = 0;
+        return true;
+    }
+
+    bool MappedFile::openAppend(const std::string &filename, size_t growStep)
+    {
+        close();
+        mFd = ::open(filename.c_str(), O_RDWR | O_CLOEXEC);
+        if(mFd < 0) {
+            std::cerr << "Failed to open " << filename << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        mFilename = filename;
+        mOpen = true;
+        mWritable = true;
+        mGrowStep = std::max<size_t>(growStep, size_t(sysconf(_SC_PAGESIZE)));
+        struct stat info {};
+        if(fstat(mFd, &info) < 0 || !map(size_t(info.st_size))) {
+            // Leave the file as it was.
+            mWritable = false;
+            close();
+            return false;
+        }
+        mUsed = mMapped;
+        return true;
+    }
+
+    bool MappedFile::openRead(const std::string &filename)
+    {
+        close();
+        mFd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if(mFd < 0) {
+            std::cerr << "Failed to open " << filename << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        mFilename = filename;
+        mOpen = true;
+        mWritable = false;
+        return refresh();
+    }
+
+    bool MappedFile::refresh()
+    {
+        if(mFd < 0 || mWritable)
+            return false;
+        struct stat info {};
+        if(fstat(mFd, &info) < 0)
+            return false;
+        mUsed = size_t(info.st_size);
+        if(mUsed == mMapped)
+            return true;
+        return map(mUsed);
+    }
+
+    bool MappedFile::map(size_t length)
+    {
+        if(mMap != nullptr) {
+            munmap(mMap, mMapped);
+            mMap = nullptr;
+            mMapped = 0;
+        }
+        if(length == 0)
+            return true;
+        void *map = mmap(nullptr, length, mWritable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, mFd, 0);
+        if(map == MAP_FAILED) {
+            std::cerr << "Failed to map " << mFilename << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        mMap = static_cast<uint8_t *>(map);
+        mMapped = length;
+        return true;
+    }
+
+    bool MappedFile::reserve(size_t length)
+    {
+        if(!mWritable)
+            return false;
+        if(length <= mMapped)
+            return true;
+        size_t newSize = (length + mGrowStep - 1) / mGrowStep * mGrowStep;
+        if(!acquireDescriptor())
+            return false;
+        bool ok = true;
+        if(ftruncate(mFd, off_t(newSize)) < 0) {
+            std::cerr << "Failed to extend " << mFilename << ": " << strerror(errno) << std::endl;
+            ok = false;
+        }
+        ok = ok && map(newSize);
+        dropDescriptor();
+        return ok;
+    }
+
+    bool MappedFile::append(const void *bytes, size_t length)
+    {
+        if(!reserve(mUsed + length))
+            return false;
+        memcpy(mMap + mUsed, bytes, length);
+        mUsed += length;
+        return true;
+    }
+
+    void MappedFile::close()
+    {
+        if(mMap != nullptr) {
+            munmap(mMap, mMapped);
+            mMap = nullptr;
+        }
+        mMapped = 0;
+        if(mOpen && mWritable && acquireDescriptor()) {
+            if(ftruncate(mFd, off_t(mUsed)) < 0) {
+                std::cerr << "Failed to truncate " << mFilename << ": " << strerror(errno) << std::endl;
+            }
+        }
+        if(mFd >= 0) {
+            ::close(mFd);
+            mFd = -1;
+        }
+        mOpen = false;
+        mReleased = false;
+        mUsed = 0;
+    }
+
+    void MappedFile::releaseDescriptor()
+    {
+        if(!mOpen || !mWritable)
+            return;
+        mReleased = true;
+        dropDescriptor();
+    }
+
+    bool MappedFile::acquireDescriptor()
+    {
+        if(mFd >= 0)
+            return true;
+        mFd = ::open(mFilename.c_str(), O_RDWR | O_CLOEXEC);
+        if(mFd < 0) {
+            std::cerr << "Failed to open " << mFilename << " again: " << strerror(errno) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    void MappedFile::dropDescriptor()
+    {
+        if(mReleased && mFd >= 0) {
+            ::close(mFd);
+            mFd = -1;
+        }
+    }
+
+} // multivesc
@@ -4,9 +4,15 @@
 
 #include <iostream>
 #include <utility>
+#include <algorithm>
+#include <limits>
+#include <cmath>
 
 #include "multivesc/Motor.hh"
 #include "multivesc/Manager.hh"
+#include "multivesc/Trajectory.hh"
+#include "multivesc/ControllerConfig.hh"
+#include "multivesc/TelemetryLogger.hh"
 
 namespace multivesc {
 
@@ -43,6 +49,46 @@ namespace multivesc {
     }
 
 
+    std::string to_string(MotorValuesT type)
+    {
+        switch (type)
+        {
+            case MotorValuesT::RPM: return "RPM";
+            case MotorValuesT::CURRENT: return "CURRENT";
+            case MotorValuesT::DUTY: return "DUTY";
+            case MotorValuesT::AMPHOURS: return "AMPHOURS";
+            case MotorValuesT::AMPHOURSCHARGED: return "AMPHOURSCHARGED";
+            case MotorValuesT::WATTHOURS: return "WATTHOURS";
+            case MotorValuesT::WATTHOURSCHARGED: return "WATTHOURSCHARGED";
+            case MotorValuesT::TEMP_FET: return "TEMP_FET";
+            case MotorValuesT::TEMP_MOTOR: return "TEMP_MOTOR";
+            case MotorValuesT::CURRENT_IN: return "CURRENT_IN";
+            case MotorValuesT::PID_POS: return "PID_POS";
+            case MotorValuesT::TACHOMETER: return "TACHOMETER";
+            case MotorValuesT::VIN: return "VIN";
+            case MotorValuesT::ADC1: return "ADC1";
+            case MotorValuesT::ADC2: return "ADC2";
+            case MotorValuesT::ADC3: return "ADC3";
+            case MotorValuesT::PPM: return "PPM";
+        }
+        return "UNKNOWN";
+    }
+
+    bool valueTypeFromString(const std::string& str, MotorValuesT &type)
+    {
+        std::string upper = str;
+        std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+        for(int i = 0; i <= (int)MotorValuesT::PPM; i++)
+        {
+            if(upper == to_string((MotorValuesT)i))
+            {
+                type = (MotorValuesT)i;
+                return true;
+            }
+        }
+        return false;
+    }
+
     Motor::Motor(std::string name)
      : mName(std::move(name))
     {}
@@ -79,9 +125,61 @@ namespace multivesc {
         if(config.value("reverse_direction",false))
             mScaleDirection = mScaleDirection * -1.0;
 
+        std::string interpolation = config.value("interpolation","none");
+        mInterpolator.setMode(interpolationFromString(interpolation));
+        if(mInterpolator.mode() == InterpolationT::NONE && interpolation != "none") {
+            std::cerr << "Invalid interpolation mode " << interpolation << std::endl;
+            return false;
+        }
+        mInterpolator.setHorizon(config.value("extrapolationHorizon",0.0f));
+        setUpdateRate(config.value("updateRate",0.0f));
+        if(config.contains("telemetryRates")) {
+            for(auto &item : config["telemetryRates"].items())
+            {
+                MotorValuesT type;
+                if(!valueTypeFromString(item.key(), type)) {
+                    std::cerr << "Invalid telemetry value " << item.key() << std::endl;
+                    return false;
+                }
+                setTelemetryRate(type, item.value().get<float>());
+            }
+        }
+        if(config.contains("latencyTrace")) {
+            const auto &trace = config["latencyTrace"];
+            if(trace.is_object()) {
+                enableLatencyTrace(trace.value("minStep", 0.0f), trace.value("fraction", 0.2f), trace.value("timeout", 1.0f));
+            } else if(trace.is_boolean() && trace.get<bool>()) {
+                enableLatencyTrace();
+            }
+        }
+        if(config.contains("canStatusRates")) {
+            CanStatusRatesT rates {};
+            if(!canStatusRatesFromJson(config["canStatusRates"], rates))
+                return false;
+            setCanStatusRates(rates);
+        }
+        setDriveTimeout(config.value("driveTimeout",0.5f));
+        std::string timeoutAction = config.value("timeoutAction","release");
+        if(timeoutAction == "brake") {
+            mTimeoutDriveMode = MotorDriveT::CURRENT_BREAK;
+            mTimeoutDriveValue = config.value("timeoutBrakeCurrent",0.0f);
+            // A brake current of zero lets the motor coast, which isn't what was asked for.
+            if(!(mTimeoutDriveValue > 0.0f)) {
+                std::cerr << "Motor " << mName << " timeout action 'brake' needs a positive 'timeoutBrakeCurrent'" << std::endl;
+                return false;
+            }
+        } else if(timeoutAction == "release") {
+            mTimeoutDriveMode = MotorDriveT::CURRENT;
+            mTimeoutDriveValue = 0.0f;
+        } else {
+            std::cerr << "Invalid timeout action " << timeoutAction << std::endl;
+            return false;
+        }
+
         if(mVerbose) {
             std::cout << " Min RPM: " << mMinRPM << "   Max RPM Acceleration: " << mMaxRPMAcceleration << std::endl;
             std::cout << " Number of poles: " << (mNumPolePairs*2.0f) << std::endl;
+            std::cout << " Drive timeout: " << driveTimeout() << " Action: " << timeoutAction << std::endl;
         }
         if(!mComs->register_motor(shared_from_this())) {
             return false;
@@ -157,6 +255,9 @@ namespace multivesc {
                 case MotorDriveT::HAND_BRAKE_REL:
                     break;
             }
+            // A setpoint from the config file has no client to refresh it, so it is held until one sets a new one.
+            std::lock_guard lock(mDriveMutex);
+            holdSetpoint();
         }
 
         return true;
@@ -173,62 +274,544 @@ namespace multivesc {
         mCallback = std::move(callback);
     };
 
-    void Motor::doCallback(MotorValuesT type, float value) {
+    void Motor::setTelemetryStream(std::shared_ptr<TelemetryStream> stream)
+    {
         std::lock_guard lock(mMutex);
-        if(mCallback) {
-            mCallback(type, value);
+        mTelemetryStream = std::move(stream);
+    }
+
+    void Motor::doCallback(MotorValuesT type, float value) {
+        {
+            std::lock_guard lock(mMutex);
+            if(mTelemetryStream) {
+                mTelemetryStream->record(type, value);
+            }
+            if(mCallback) {
+                mCallback(type, value);
+            }
+        }
+        if(mReactiveActive) {
+            runReactiveControl(type);
+        }
+    }
+
+    bool Motor::setReactiveControl(MotorValuesT trigger, std::function<float(const Motor &)> control, float budget)
+    {
+        if(!control || budget <= 0.0f) {
+            std::cerr << "Motor " << mName << " reactive control needs a function and a positive budget" << std::endl;
+            return false;
         }
+        {
+            std::lock_guard lock(mDriveMutex);
+            if(mPrimaryDriveMode == MotorDriveT::NONE) {
+                std::cerr << "Motor " << mName << " has no control mode for reactive control" << std::endl;
+                return false;
+            }
+        }
+        std::lock_guard lock(mReactiveMutex);
+        mReactiveControl = std::move(control);
+        mReactiveTrigger = trigger;
+        mReactiveBudget = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(budget));
+        mReactiveOverrunsInRow = 0;
+        mReactiveActive = true;
+        return true;
+    }
+
+    void Motor::clearReactiveControl()
+    {
+        std::lock_guard lock(mReactiveMutex);
+        mReactiveActive = false;
+        mReactiveControl = nullptr;
+    }
+
+    void Motor::runReactiveControl(MotorValuesT type)
+    {
+        float value = 0.0f;
+        std::chrono::steady_clock::time_point end;
+        {
+            std::lock_guard lock(mReactiveMutex);
+            if(!mReactiveControl || type != mReactiveTrigger)
+                return;
+            auto start = std::chrono::steady_clock::now();
+            value = mReactiveControl(*this);
+            end = std::chrono::steady_clock::now();
+            mReactiveRunCount++;
+            float elapsed = std::chrono::duration<float>(end - start).count();
+            if(elapsed > mReactiveMaxTime) {
+                mReactiveMaxTime = elapsed;
+            }
+            if(end - start > mReactiveBudget || !std::isfinite(value)) {
+                mReactiveOverrunCount++;
+                if(++mReactiveOverrunsInRow >= 3) {
+                    std::cerr << "Motor " << mName << " reactive control overran " << mReactiveOverrunsInRow << " times in a row, disabling" << std::endl;
+                    mReactiveActive = false;
+                    mReactiveControl = nullptr;
+                }
+                return;
+            }
+            mReactiveOverrunsInRow = 0;
+        }
+
+        // Hold the send lock from staging to completion, so the update tick can't interleave with it and ramp from
+        // the same last demand, or send an older command after this one.
+        std::lock_guard sendLock(mSendMutex);
+        {
+            std::lock_guard driveLock(mDriveMutex);
+            if(!mEnabled)
+                return;
+            mDriveUpdateTime = end;
+            mDriveMode = mPrimaryDriveMode;
+            mDriveValue = value;
+            mInterpolator.reset(value, end);
+        }
+        // Send it now, with the same limits as the update tick.
+        mReactiveKernel.clear();
+        size_t slot = 0;
+        if(!prepareUpdate(end, mReactiveKernel, slot))
+            return;
+        mReactiveKernel.run();
+        mComs->sendDriveCommands(mReactiveKernel.commands(), mReactiveKernel.size());
+        completeUpdate(mReactiveKernel, slot, end, std::chrono::steady_clock::now());
     }
 
-    void Motor::update()
+    bool Motor::setTrajectory(std::shared_ptr<const Trajectory> trajectory, std::chrono::steady_clock::time_point start)
     {
+        if(!trajectory)
+            return false;
         std::lock_guard lock(mDriveMutex);
-        auto now = std::chrono::steady_clock::now();
-        mDriveUpdateTime = now;
+        if(!canFollowTrajectory(*trajectory))
+            return false;
+        beginTrajectory(std::move(trajectory), start);
+        return true;
+    }
+
+    bool Motor::canFollowTrajectory(const Trajectory &trajectory) const
+    {
         if(!mEnabled) {
+            std::cerr << "Motor " << mName << " is disabled, can't follow a trajectory" << std::endl;
+            return false;
+        }
+        if(trajectory.mode() != mPrimaryDriveMode) {
+            std::cerr << "Motor " << mName << " is in " << to_string(mPrimaryDriveMode) << " mode, can't follow a "
+                      << to_string(trajectory.mode()) << " trajectory" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    void Motor::beginTrajectory(std::shared_ptr<const Trajectory> trajectory, std::chrono::steady_clock::time_point start)
+    {
+        mTrajectory = std::move(trajectory);
+        mTrajectoryStart = start;
+        mTrajectoryHint = 0;
+        mDriveMode = mPrimaryDriveMode;
+        mDriveUpdateTime = std::chrono::steady_clock::now();
+        mTrajectoryUpdateTime = mDriveUpdateTime;
+    }
+
+    void Motor::clearTrajectory()
+    {
+        std::lock_guard lock(mDriveMutex);
+        mTrajectory.reset();
+    }
+
+    bool Motor::trajectoryActive()
+    {
+        std::lock_guard lock(mDriveMutex);
+        return mTrajectory != nullptr;
+    }
+
+    void Motor::applyTrajectory(std::chrono::steady_clock::time_point now)
+    {
+        if(mDriveUpdateTime != mTrajectoryUpdateTime) {
+            // The user has set a new value, they take priority.
+            mTrajectory.reset();
             return;
         }
+        double t = std::chrono::duration<double>(now - mTrajectoryStart).count();
+        mDriveMode = mTrajectory->mode();
+        mDriveValue = mTrajectory->evaluate(t, mTrajectoryHint);
+        mInterpolator.reset(mDriveValue, now);
+        if(t >= mTrajectory->duration()) {
+            // Finished, hold the last value as if it was set by the user at the end of the trajectory.  The profile
+            // was uploaded so the client doesn't have to keep streaming, so the hold doesn't time out.
+            mDriveUpdateTime = mTrajectoryStart + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(mTrajectory->duration()));
+            holdSetpoint();
+            mTrajectory.reset();
+            return;
+        }
+        mDriveUpdateTime = now;
+        mTrajectoryUpdateTime = now;
+    }
+
+    bool Motor::prepareUpdate(std::chrono::steady_clock::time_point now, ControlKernel &kernel, size_t &slot)
+    {
+        std::lock_guard lock(mDriveMutex);
+        if(!mEnabled || !mComs) {
+            return false;
+        }
+        if(mTrajectory) {
+            applyTrajectory(now);
+        }
+        checkDriveTimeout(now);
+        float value = mDriveValue;
+        if(mInterpolator.mode() != InterpolationT::NONE) {
+            if(mDriveMode == mPrimaryDriveMode) {
+                value = mInterpolator.evaluate(now);
+            } else {
+                // Start from the current command when the client takes control again.
+                mInterpolator.reset(value, now);
+            }
+        }
+        constexpr float inf = std::numeric_limits<float>::infinity();
         switch(mDriveMode)
         {
             case MotorDriveT::NONE:
-                break;
+                return false;
             case MotorDriveT::DUTY:
-                mComs->setDuty(mId, mDriveValue * mScaleDirection);
+                slot = kernel.add(mId, mDriveMode, value);
+                kernel.setLimits(slot, value, inf, 0.0f, 1.0f, mScaleDirection);
                 break;
             case MotorDriveT::CURRENT:
-                mComs->setCurrent(mId, mDriveValue * mScaleDirection);
-                break;
-            case MotorDriveT::RPM:
-                updateRPM(mDriveValue);
-                break;
             case MotorDriveT::POS:
-                mComs->setPos(mId,mDriveValue * mScaleDirection);
-                break;
             case MotorDriveT::CURRENT_REL:
-                mComs->setCurrentRel(mId,mDriveValue * mScaleDirection);
+                slot = kernel.add(mId, mDriveMode, value);
+                kernel.setLimits(slot, value, inf, 0.0f, inf, mScaleDirection);
                 break;
+            case MotorDriveT::RPM: {
+                float maxStep = inf;
+                float dt = std::chrono::duration<float>(now - mLastRPMDemandChange).count();
+                if(mMaxRPMAcceleration >= 0.0f && dt >= 0.0f) {
+                    maxStep = mMaxRPMAcceleration * dt;
+                }
+                slot = kernel.add(mId, mDriveMode, value);
+                kernel.setLimits(slot, mLastRPMDemand, maxStep, mMinRPM, mMaxRPM, mNumPolePairs * mScaleDirection);
+            } break;
             case MotorDriveT::CURRENT_BREAK:
-                mComs->setCurrentBrake(mId,mDriveValue);
-                break;
             case MotorDriveT::CURRENT_BREAK_REL:
-                mComs->setCurrentBrakeRel(mId,mDriveValue);
-                break;
             case MotorDriveT::HAND_BRAKE:
-                mComs->setHandbrake(mId,mDriveValue);
-                break;
             case MotorDriveT::HAND_BRAKE_REL:
-                mComs->setHandbrakeRel(mId,mDriveValue);
+                slot = kernel.add(mId, mDriveMode, value);
                 break;
         }
+        return true;
+    }
 
+    void Motor::completeUpdate(const ControlKernel &kernel, size_t slot, std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point sent)
+    {
+        std::chrono::steady_clock::time_point setpoint;
+        {
+            std::lock_guard lock(mDriveMutex);
+            if(mDriveMode == MotorDriveT::RPM) {
+                mLastRPMDemandChange = now;
+                mLastRPMDemand = kernel.limited(slot);
+            }
+            setpoint = mDriveUpdateTime;
+        }
+        if(mTraceEnabled) {
+            const auto &command = kernel.commands()[slot];
+            traceCommand(command.mode, command.value, setpoint, now, sent);
+        }
+        // Only the first command after each status frame measures how fresh the data was.
+        std::lock_guard lock(mStatusMutex);
+        if(mStatusSeen) {
+            mStatusSeen = false;
+            float latency = std::chrono::duration<float>(sent - mStatusArrival.lastArrival()).count();
+            mStatusLatency = mStatusLatency <= 0.0f ? latency : mStatusLatency * 0.9f + latency * 0.1f;
+            mStatusLatencyMax = std::max(mStatusLatencyMax, latency);
+        }
     }
 
+    bool Motor::alignToStatus(std::chrono::steady_clock::time_point nominal,
+                              std::chrono::steady_clock::duration updatePeriod,
+                              std::chrono::steady_clock::duration guard,
+                              std::chrono::steady_clock::time_point &when) const
+    {
+        std::lock_guard lock(mStatusMutex);
+        if(!mStatusArrival.locked())
+            return false;
+        auto statusPeriod = mStatusArrival.period();
+        if(statusPeriod > updatePeriod)
+            return false;
+        when = mStatusArrival.nextArrival(nominal - guard - statusPeriod / 2) + guard;
+        return true;
+    }
+
+    float Motor::statusLatency() const
+    {
+        std::lock_guard lock(mStatusMutex);
+        return mStatusLatency;
+    }
+
+    float Motor::statusLatencyMax() const
+    {
+        std::lock_guard lock(mStatusMutex);
+        return mStatusLatencyMax;
+    }
+
+    float Motor::statusPeriod() const
+    {
+        std::lock_guard lock(mStatusMutex);
+        return std::chrono::duration<float>(mStatusArrival.period()).count();
+    }
+
+    namespace {
+        //! Smallest change in command worth tracing by default, in the units sent to the controller.
+        float defaultTraceStep(MotorDriveT mode)
+        {
+            switch(mode) {
+                case MotorDriveT::DUTY: return 0.02f;
+                case MotorDriveT::CURRENT: return 0.5f;
+                case MotorDriveT::RPM: return 200.0f;
+                case MotorDriveT::POS: return 2.0f;
+                default: return 0.0f;
+            }
+        }
+    }
+
+    void Motor::enableLatencyTrace(float minStep, float fraction, float timeout)
+    {
+        std::lock_guard lock(mTraceMutex);
+        mTraceMinStep = minStep;
+        mTraceFraction = std::clamp(fraction, 0.0f, 1.0f);
+        mTraceTimeout = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(timeout));
+        mTraceBaseMode = MotorDriveT::NONE;
+        mTraceActive = false;
+        mTraceEnabled = true;
+        if(mComs)
+            mComs->setTxTimestamps(true);
+    }
+
+    void Motor::disableLatencyTrace()
+    {
+        std::lock_guard lock(mTraceMutex);
+        mTraceEnabled = false;
+        mTraceActive = false;
+    }
+
+    LatencyHistogram Motor::responseLatency() const
+    {
+        std::lock_guard lock(mTraceMutex);
+        return mResponseLatency;
+    }
+
+    LatencyHistogram Motor::setpointLatency() const
+    {
+        std::lock_guard lock(mTraceMutex);
+        return mSetpointLatency;
+    }
+
+    json Motor::latencyStats() const
+    {
+        std::lock_guard lock(mTraceMutex);
+        json result;
+        result["response"] = mResponseLatency.summary();
+        result["setpoint"] = mSetpointLatency.summary();
+        result["timeouts"] = mTraceTimeouts;
+        result["kernelTimestamps"] = mTraceKernelCount;
+        return result;
+    }
+
+    void Motor::clearLatencyStats()
+    {
+        std::lock_guard lock(mTraceMutex);
+        mResponseLatency.clear();
+        mSetpointLatency.clear();
+        mTraceTimeouts = 0;
+        mTraceKernelCount = 0;
+    }
+
+    bool Motor::measuredValue(MotorDriveT mode, float &value) const
+    {
+        switch(mode) {
+            case MotorDriveT::DUTY: value = mDuty; return true;
+            case MotorDriveT::CURRENT: value = mECurrent; return true;
+            case MotorDriveT::RPM: value = mERpm; return true;
+            case MotorDriveT::POS: value = mPidPos; return true;
+            default: return false;
+        }
+    }
+
+    void Motor::traceCommand(MotorDriveT mode, float value, std::chrono::steady_clock::time_point setpoint,
+                             std::chrono::steady_clock::time_point sendStart, std::chrono::steady_clock::time_point sent)
+    {
+        float measured = 0.0f;
+        if(!measuredValue(mode, measured))
+            return;
+        std::lock_guard lock(mTraceMutex);
+        if(!mTraceEnabled)
+            return;
+        if(mTraceActive) {
+            if(sendStart - mTraceSendStart < mTraceTimeout)
+                return;
+            mTraceTimeouts++;
+            mTraceActive = false;
+        }
+        // The first command, or the first in a new mode, is where changes are measured from.
+        if(mTraceBaseMode != mode) {
+            mTraceBaseMode = mode;
+            mTraceBase = value;
+            return;
+        }
+        float step = value - mTraceBase;
+        float minStep = mTraceMinStep > 0.0f ? mTraceMinStep : defaultTraceStep(mode);
+        if(std::abs(step) < minStep || !std::isfinite(step))
+            return;
+        mTraceBase = value;
+        mTraceActive = true;
+        mTraceMode = mode;
+        mTraceStartValue = measured;
+        mTraceStep = step;
+        mTraceSetpoint = setpoint;
+        mTraceSendStart = sendStart;
+        mTraceTx = sent;
+        mTraceKernelTx = false;
+        // The kernel may have reported the transmission before the send returned.
+        if(mLastTxStampMode == mode && mLastTxStamp >= sendStart) {
+            mTraceTx = mLastTxStamp;
+            mTraceKernelTx = true;
+        }
+    }
+
+    void Motor::traceTransmit(MotorDriveT mode, std::chrono::steady_clock::time_point when)
+    {
+        std::lock_guard lock(mTraceMutex);
+        if(!mTraceEnabled)
+            return;
+        mLastTxStampMode = mode;
+        mLastTxStamp = when;
+        // The first transmission after the trace's command was handed over is the one carrying it.
+        if(mTraceActive && !mTraceKernelTx && mTraceMode == mode && when >= mTraceSendStart) {
+            mTraceTx = when;
+            mTraceKernelTx = true;
+        }
+    }
+
+    void Motor::traceStatus(std::chrono::steady_clock::time_point now)
+    {
+        std::lock_guard lock(mTraceMutex);
+        if(!mTraceActive)
+            return;
+        float measured = 0.0f;
+        measuredValue(mTraceMode, measured);
+        float moved = (measured - mTraceStartValue) * (mTraceStep < 0.0f ? -1.0f : 1.0f);
+        if(moved >= mTraceFraction * std::abs(mTraceStep)) {
+            mResponseLatency.record(now - mTraceTx);
+            mSetpointLatency.record(now - mTraceSetpoint);
+            if(mTraceKernelTx)
+                mTraceKernelCount++;
+            mTraceActive = false;
+        } else if(now - mTraceSendStart >= mTraceTimeout) {
+            mTraceTimeouts++;
+            mTraceActive = false;
+        }
+    }
+
+    bool Motor::checkDriveTimeout(std::chrono::steady_clock::time_point now)
+    {
+        if(mDriveTimeout <= std::chrono::steady_clock::duration::zero() || mDriveMode == MotorDriveT::NONE) {
+            return false;
+        }
+        // Only trip once for each setpoint, the safe command is then held until a new one arrives.
+        if(mDriveUpdateTime == mDriveTimeoutTripTime || mDriveUpdateTime == mDriveHoldTime ||
+           (now - mDriveUpdateTime) < mDriveTimeout) {
+            return false;
+        }
+        mDriveTimeoutTripTime = mDriveUpdateTime;
+        mDriveTimeoutCount++;
+        if(mVerbose) {
+            std::cerr << "Motor " << mName << " drive timeout, was " << to_string(mDriveMode) << " " << mDriveValue << std::endl;
+        }
+        mDriveMode = mTimeoutDriveMode;
+        mDriveValue = mTimeoutDriveValue;
+        mInterpolator.reset(mDriveValue, now);
+        // Restart any acceleration ramp from stationary.
+        mLastRPMDemand = 0.0f;
+        mLastRPMDemandChange = now;
+        return true;
+    }
+
+    bool Motor::interpolateSetpoint(float value)
+    {
+        if(mInterpolator.mode() == InterpolationT::NONE)
+            return false;
+        mInterpolator.push(value, mDriveUpdateTime);
+        return true;
+    }
+
+    void Motor::setCanStatusRates(const CanStatusRatesT &rates)
+    {
+        std::lock_guard lock(mMutex);
+        mCanStatusRates = rates;
+        mHasCanStatusRates = true;
+    }
+
+    bool Motor::canStatusRates(CanStatusRatesT &rates) const
+    {
+        std::lock_guard lock(mMutex);
+        rates = mCanStatusRates;
+        return mHasCanStatusRates;
+    }
+
+    void Motor::setTelemetryRate(MotorValuesT type, float hz)
+    {
+        mTelemetryRates[size_t(type)] = std::max(hz, 0.0f);
+        mHasTelemetryRates = true;
+    }
+
+    float Motor::telemetryRate(MotorValuesT type) const
+    {
+        return mTelemetryRates[size_t(type)];
+    }
+
+    void Motor::valueCallback(MotorValuesT type, float value)
+    {
+        switch(type)
+        {
+            case MotorValuesT::RPM:
+            {
+                std::lock_guard lock(mStatusMutex);
+                mStatusArrival.sample(std::chrono::steady_clock::now());
+                mStatusSeen = true;
+            }
+                mERpm = value;
+                break;
+            case MotorValuesT::CURRENT: mECurrent = value; break;
+            case MotorValuesT::DUTY: mDuty = value; break;
+            case MotorValuesT::AMPHOURS: mAmpHours = value; break;
+            case MotorValuesT::AMPHOURSCHARGED: mAmpHoursCharged = value; break;
+            case MotorValuesT::WATTHOURS: mWattHours = value; break;
+            case MotorValuesT::WATTHOURSCHARGED: mWattHoursCharged = value; break;
+            case MotorValuesT::TEMP_FET: mTempFet = value; break;
+            case MotorValuesT::TEMP_MOTOR: mTempMotor = value; break;
+            case MotorValuesT::CURRENT_IN: mCurrentIn = value; break;
+            case MotorValuesT::PID_POS: mPidPos = value; break;
+            case MotorValuesT::TACHOMETER: mTachometer = value; break;
+            case MotorValuesT::VIN: mVIn = value; break;
+            case MotorValuesT::ADC1: mADC1 = value; break;
+            case MotorValuesT::ADC2: mADC2 = value; break;
+            case MotorValuesT::ADC3: mADC3 = value; break;
+            case MotorValuesT::PPM: mPPM = value; break;
+        }
+        if(mTraceEnabled)
+            traceStatus(std::chrono::steady_clock::now());
+        doCallback(type, value);
+    }
 
     void Motor::statusCallback(float erpm, float current, float dutyCycle)
     {
+        auto now = std::chrono::steady_clock::now();
+        {
+            std::lock_guard lock(mStatusMutex);
+            mStatusArrival.sample(now);
+            mStatusSeen = true;
+        }
         mERpm = erpm;
         mECurrent = current;
         mDuty = dutyCycle;
+        if(mTraceEnabled)
+            traceStatus(now);
         doCallback(MotorValuesT::RPM, mERpm);
         doCallback(MotorValuesT::CURRENT, mECurrent);
         doCallback(MotorValuesT::DUTY, mDuty);
@@ -256,6 +839,8 @@ namespace multivesc {
         mTempMotor = tempMotor;
         mCurrentIn = currentIn;
         mPidPos = PIDPos;
+        if(mTraceEnabled)
+            traceStatus(std::chrono::steady_clock::now());
         doCallback(MotorValuesT::TEMP_FET, mTempFet);
         doCallback(MotorValuesT::TEMP_MOTOR, mTempMotor);
         doCallback(MotorValuesT::CURRENT_IN, mCurrentIn);
@@ -300,9 +885,11 @@ namespace multivesc {
         mDriveMode = MotorDriveT::DUTY;
         mDriveUpdateTime = std::chrono::steady_clock::now();
         mDriveValue = duty;
-        if(!mComs)
+        if(!mComs || interpolateSetpoint(duty))
             return ;
         mComs->setDuty(mId, duty * mScaleDirection);
+        if(mTraceEnabled)
+            traceCommand(MotorDriveT::DUTY, duty * mScaleDirection, mDriveUpdateTime, mDriveUpdateTime, std::chrono::steady_clock::now());
     }
 
     void Motor::setCurrent(float current)
@@ -317,9 +904,11 @@ namespace multivesc {
         mDriveMode = MotorDriveT::CURRENT;
         mDriveUpdateTime = std::chrono::steady_clock::now();
         mDriveValue = current;
-        if(!mComs)
+        if(!mComs || interpolateSetpoint(current))
             return ;
         mComs->setCurrent(mId, current * mScaleDirection);
+        if(mTraceEnabled)
+            traceCommand(MotorDriveT::CURRENT, current * mScaleDirection, mDriveUpdateTime, mDriveUpdateTime, std::chrono::steady_clock::now());
     }
 
     void Motor::setCurrentOffDelay(float current, float off_delay)
@@ -334,6 +923,7 @@ namespace multivesc {
         mDriveMode = MotorDriveT::CURRENT;
         mDriveUpdateTime = std::chrono::steady_clock::now();
         mDriveValue = current;
+        mInterpolator.reset(current, mDriveUpdateTime);
         if(!mComs)
             return ;
         mComs->setCurrentOffDelay(mId, current * mScaleDirection, off_delay);
@@ -365,14 +955,14 @@ namespace multivesc {
                 rpm = -mMaxRPM;
             }
         }
-        mDriveUpdateTime = std::chrono::steady_clock::now();
         if(mPrimaryDriveMode != MotorDriveT::RPM) {
             std::cerr << "Motor " << mName << " is not in RPM mode" << std::endl;
             return;
         }
+        mDriveUpdateTime = std::chrono::steady_clock::now();
         mDriveMode = MotorDriveT::RPM;
         mDriveValue = rpm;
-        if(!mComs)
+        if(!mComs || interpolateSetpoint(rpm))
             return ;
         updateRPM(rpm);
     }
@@ -386,7 +976,7 @@ namespace multivesc {
             if(std::abs(rpm) < mMinRPM/2) {
                 rpm = 0.0;
             } else {
-                rpm = std::abs(mMinRPM);
+                rpm = std::copysign(std::abs(mMinRPM), rpm);
             }
         }
         if(mMaxRPMAcceleration >= 0.0) {
@@ -414,6 +1004,8 @@ namespace multivesc {
         mLastRPMDemandChange = now;
         mLastRPMDemand = rpm;
         mComs->setRPM(mId, rpm * mNumPolePairs * mScaleDirection);
+        if(mTraceEnabled)
+            traceCommand(MotorDriveT::RPM, rpm * mNumPolePairs * mScaleDirection, mDriveUpdateTime, now, std::chrono::steady_clock::now());
     }
 
     void Motor::setPos(float pos)
@@ -430,7 +1022,11 @@ namespace multivesc {
         mDriveMode = MotorDriveT::POS;
         mDriveUpdateTime = std::chrono::steady_clock::now();
         mDriveValue = pos;
+        if(interpolateSetpoint(pos))
+            return ;
         mComs->setPos(mId, pos * mScaleDirection);
+        if(mTraceEnabled)
+            traceCommand(MotorDriveT::POS, pos * mScaleDirection, mDriveUpdateTime, mDriveUpdateTime, std::chrono::steady_clock::now());
     }
 
     void Motor::setCurrentRel(float current_rel)
@@ -445,7 +1041,7 @@ namespace multivesc {
         mDriveUpdateTime = std::chrono::steady_clock::now();
         mDriveMode = MotorDriveT::CURRENT_REL;
         mDriveValue = current_rel;
-        if(!mComs)
+        if(!mComs || interpolateSetpoint(current_rel))
             return ;
         mComs->setCurrentRel(mId, current_rel  * mScaleDirection);
     }
@@ -462,6 +1058,7 @@ namespace multivesc {
         mDriveUpdateTime = std::chrono::steady_clock::now();
         mDriveMode = MotorDriveT::CURRENT_REL;
         mDriveValue = current_rel;
+        mInterpolator.reset(current_rel, mDriveUpdateTime);
         if(!mComs)
             return ;
         mComs->setCurrentRelOffDelay(mId, current_rel  * mScaleDirection, off_delay);
@@ -506,6 +1103,43 @@ namespace multivesc {
         mComs->setHandbrakeRel(mId, current_rel);
     }
 
+    void Motor::setDriveTimeout(float seconds)
+    {
+        std::lock_guard lock(mDriveMutex);
+        mDriveTimeout = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(seconds));
+    }
+
+    float Motor::driveTimeout() const
+    {
+        std::lock_guard lock(mDriveMutex);
+        return std::chrono::duration<float>(mDriveTimeout).count();
+    }
+
+    void Motor::setInterpolation(InterpolationT mode, float horizon)
+    {
+        std::lock_guard lock(mDriveMutex);
+        mInterpolator.setMode(mode);
+        mInterpolator.setHorizon(horizon);
+        mInterpolator.reset(mDriveValue, std::chrono::steady_clock::now());
+    }
+
+    void Motor::setUpdateRate(float hz)
+    {
+        if(hz <= 0.0f) {
+            mUpdatePeriod = std::chrono::steady_clock::duration::zero();
+            return;
+        }
+        mUpdatePeriod = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(1.0f / hz));
+    }
+
+    float Motor::updateRate() const
+    {
+        auto period = mUpdatePeriod.load();
+        if(period <= std::chrono::steady_clock::duration::zero())
+            return 0.0f;
+        return 1.0f / std::chrono::duration<float>(period).count();
+    }
+
     void Motor::setMinRPM(float rpm)
     {
         mMinRPM = rpm;
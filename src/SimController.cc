@@ -0,0 +1,481 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#include <iostream>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include "multivesc/SimController.hh"
+#include "multivesc/BusCan.hh"
+#include "multivesc/VescPacket.hh"
+#include "multivesc/Crc16.hh"
+
+namespace multivesc {
+
+    namespace {
+        int32_t getInt32(const uint8_t *data)
+        {
+            return int32_t(uint32_t(data[0]) << 24 | uint32_t(data[1]) << 16 | uint32_t(data[2]) << 8 | data[3]);
+        }
+
+        uint32_t getUint32(const uint8_t *data)
+        {
+            return uint32_t(getInt32(data));
+        }
+
+        void appendUint32(std::vector<uint8_t> &out, uint32_t value)
+        {
+            out.push_back(uint8_t(value >> 24));
+            out.push_back(uint8_t(value >> 16));
+            out.push_back(uint8_t(value >> 8));
+            out.push_back(uint8_t(value));
+        }
+
+        constexpr size_t gAppconfSize = 300;
+        constexpr size_t gMcconfSize = 600;
+        constexpr size_t gMaxNewAppSize = 1 << 20;
+
+        //! Status packets in the order of the bits in the app configuration.
+        constexpr CAN_PACKET_ID gStatusPackets[6] = {
+            CAN_PACKET_STATUS, CAN_PACKET_STATUS_2, CAN_PACKET_STATUS_3,
+            CAN_PACKET_STATUS_4, CAN_PACKET_STATUS_5, CAN_PACKET_STATUS_6
+        };
+    }
+
+    SimController::SimController(uint8_t id)
+     : mId(id),
+       mAppconf(gAppconfSize, 0),
+       mMcconf(gMcconfSize, 0)
+    {
+        // A signature and the controller id, so the layout checks pass.
+        mAppconf[0] = 0xAF;
+        mAppconf[1] = 0x5E;
+        mAppconf[2] = 0x51;
+        mAppconf[3] = 0x4D;
+        mAppconf[mLayout.controllerId] = id;
+        mMcconf[0] = 0x3C;
+        mMcconf[1] = 0x5E;
+        mMcconf[2] = 0x51;
+        mMcconf[3] = 0x4D;
+        setStatusRates({50.0f, 10.0f, 10.0f, 10.0f, 10.0f, 0.0f});
+    }
+
+    bool SimController::configure(const json &config)
+    {
+        mErpmPerDuty = config.value("erpmPerDuty", mErpmPerDuty);
+        mErpmPerAmp = config.value("erpmPerAmp", mErpmPerAmp);
+        mTimeConstant = std::max(config.value("timeConstant", mTimeConstant), 1e-4f);
+        mCoastTimeConstant = std::max(config.value("coastTimeConstant", mCoastTimeConstant), 1e-4f);
+        mPosTimeConstant = std::max(config.value("posTimeConstant", mPosTimeConstant), 1e-4f);
+        mAmpsPerErpmRate = config.value("ampsPerErpmRate", mAmpsPerErpmRate);
+        mFrictionCurrent = config.value("frictionCurrent", mFrictionCurrent);
+        mMaxCurrent = config.value("maxCurrent", mMaxCurrent);
+        mVoltage = config.value("voltage", mVoltage);
+        if(config.contains("commandTimeout")) {
+            mCommandTimeout = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<float>(config["commandTimeout"].get<float>()));
+        }
+        if(config.contains("statusRates")) {
+            CanStatusRatesT rates {};
+            if(!canStatusRatesFromJson(config["statusRates"], rates))
+                return false;
+            CanStatusConfigT status;
+            if(!canStatusFromRates(rates, status)) {
+                std::cerr << "Simulated controller " << int(mId) << " has more than two status rates" << std::endl;
+                return false;
+            }
+            setStatusRates(rates);
+        }
+        return true;
+    }
+
+    void SimController::setStatusRates(const CanStatusRatesT &rates)
+    {
+        CanStatusConfigT status;
+        if(!canStatusFromRates(rates, status))
+            return;
+        setCanStatus(mAppconf, mLayout, status);
+        applyAppconf();
+    }
+
+    void SimController::applyAppconf()
+    {
+        if(!getCanStatus(mAppconf, mLayout, mStatus))
+            return;
+        for(size_t i = 0; i < mStatusPeriod.size(); i++) {
+            uint16_t rate = 0;
+            if(mStatus.msgs1 & (1u << i))
+                rate = mStatus.rate1;
+            else if(mStatus.msgs2 & (1u << i))
+                rate = mStatus.rate2;
+            mStatusPeriod[i] = rate == 0 ? std::chrono::steady_clock::duration::zero() :
+                               std::chrono::steady_clock::duration(std::chrono::steady_clock::period::den /
+                                                                   (std::chrono::steady_clock::period::num * rate));
+        }
+    }
+
+    void SimController::setCommand(MotorDriveT mode, float value, std::chrono::steady_clock::time_point now)
+    {
+        mMode = mode;
+        mCommandValue = value;
+        mCommandTime = now;
+        mCommandCount++;
+    }
+
+    void SimController::receive(const struct can_frame &frame, std::chrono::steady_clock::time_point now,
+                                std::vector<struct can_frame> &out)
+    {
+        if(!(frame.can_id & CAN_EFF_FLAG))
+            return;
+        const uint8_t *data = frame.data;
+        size_t dlc = std::min<size_t>(frame.can_dlc, 8);
+        auto packet = CAN_PACKET_ID((frame.can_id >> 8) & 0xFF);
+        switch(packet) {
+            case CAN_PACKET_SET_DUTY:
+                if(dlc >= 4) setCommand(MotorDriveT::DUTY, float(getInt32(data)) / 1e5f, now);
+                break;
+            case CAN_PACKET_SET_CURRENT:
+                if(dlc >= 4) setCommand(MotorDriveT::CURRENT, float(getInt32(data)) / 1e3f, now);
+                break;
+            case CAN_PACKET_SET_CURRENT_BRAKE:
+                if(dlc >= 4) setCommand(MotorDriveT::CURRENT_BREAK, float(getInt32(data)) / 1e3f, now);
+                break;
+            case CAN_PACKET_SET_RPM:
+                if(dlc >= 4) setCommand(MotorDriveT::RPM, float(getInt32(data)), now);
+                break;
+            case CAN_PACKET_SET_POS:
+                if(dlc >= 4) setCommand(MotorDriveT::POS, float(getInt32(data)) / 1e6f, now);
+                break;
+            case CAN_PACKET_SET_CURRENT_REL:
+                if(dlc >= 4) setCommand(MotorDriveT::CURRENT_REL, float(getInt32(data)) / 1e5f, now);
+                break;
+            case CAN_PACKET_SET_CURRENT_BRAKE_REL:
+                if(dlc >= 4) setCommand(MotorDriveT::CURRENT_BREAK_REL, float(getInt32(data)) / 1e5f, now);
+                break;
+            case CAN_PACKET_SET_CURRENT_HANDBRAKE:
+                if(dlc >= 4) setCommand(MotorDriveT::HAND_BRAKE, float(getInt32(data)) / 1e3f, now);
+                break;
+            case CAN_PACKET_SET_CURRENT_HANDBRAKE_REL:
+                if(dlc >= 4) setCommand(MotorDriveT::HAND_BRAKE_REL, float(getInt32(data)) / 1e5f, now);
+                break;
+            case CAN_PACKET_FILL_RX_BUFFER:
+                if(dlc >= 1) {
+                    mRxBuffer.resize(BusCan::MaxPacketLength + 1);
+                    memcpy(mRxBuffer.data() + data[0], data + 1, dlc - 1);
+                }
+                break;
+            case CAN_PACKET_FILL_RX_BUFFER_LONG:
+                if(dlc >= 2) {
+                    mRxBuffer.resize(BusCan::MaxPacketLength + 1);
+                    size_t offset = size_t(data[0]) << 8 | data[1];
+                    if(offset + dlc - 2 <= mRxBuffer.size())
+                        memcpy(mRxBuffer.data() + offset, data + 2, dlc - 2);
+                }
+                break;
+            case CAN_PACKET_PROCESS_RX_BUFFER:
+            {
+                if(dlc < 6 || mRxBuffer.empty())
+                    break;
+                size_t len = size_t(data[2]) << 8 | data[3];
+                uint16_t crc = uint16_t(data[4] << 8 | data[5]);
+                if(len == 0 || crc16(mRxBuffer.data(), len) != crc)
+                    break;
+                handlePacket(data[0], data[1] == 0, mRxBuffer.data(), len, out);
+            } break;
+            case CAN_PACKET_PROCESS_SHORT_BUFFER:
+                if(dlc >= 3)
+                    handlePacket(data[0], data[1] == 0, data + 2, dlc - 2, out);
+                break;
+            case CAN_PACKET_PING:
+                if(dlc >= 1) {
+                    struct can_frame pong {};
+                    pong.can_id = data[0] | ((uint32_t) CAN_PACKET_PONG << 8) | CAN_EFF_FLAG;
+                    pong.data[0] = mId;
+                    pong.data[1] = 0; // Hardware type, a motor controller
+                    pong.can_dlc = 2;
+                    out.push_back(pong);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    void SimController::handlePacket(uint8_t sender, bool reply, const uint8_t *payload, size_t len,
+                                     std::vector<struct can_frame> &out)
+    {
+        if(len == 0 || !mResponding)
+            return;
+        unsigned dropEvery = mDropEvery;
+        if(dropEvery > 0 && ++mPacketCount % dropEvery == 0)
+            return;
+        std::vector<uint8_t> response;
+        switch(payload[0]) {
+            case COMM_FW_VERSION:
+            {
+                response = {COMM_FW_VERSION, 6, 2};
+                const char *hardware = "VESC SIM";
+                response.insert(response.end(), hardware, hardware + strlen(hardware) + 1);
+                // The uuid only needs to be different for each controller.
+                for(int i = 0; i < 12; i++) {
+                    response.push_back(i == 11 ? mId : uint8_t(0x51 + i));
+                }
+                response.push_back(0); // Pairing done
+                response.push_back(0); // Test version
+                response.push_back(0); // Hardware type
+                response.push_back(1); // Custom configurations
+            } break;
+            case COMM_GET_MCCONF:
+                response.push_back(COMM_GET_MCCONF);
+                response.insert(response.end(), mMcconf.begin(), mMcconf.end());
+                break;
+            case COMM_GET_APPCONF:
+                response.push_back(COMM_GET_APPCONF);
+                response.insert(response.end(), mAppconf.begin(), mAppconf.end());
+                break;
+            case COMM_SET_MCCONF:
+                mMcconf.assign(payload + 1, payload + len);
+                response.push_back(COMM_SET_MCCONF);
+                break;
+            case COMM_SET_APPCONF:
+                mAppconf.assign(payload + 1, payload + len);
+                applyAppconf();
+                response.push_back(COMM_SET_APPCONF);
+                break;
+            case COMM_ERASE_NEW_APP:
+            {
+                if(len < 5)
+                    return;
+                size_t size = getUint32(payload + 1);
+                bool ok = size <= gMaxNewAppSize;
+                if(ok) {
+                    mErasedSize = size;
+                    mNewApp.assign(size, 0xFF);
+                }
+                response = {COMM_ERASE_NEW_APP, uint8_t(ok)};
+            } break;
+            case COMM_WRITE_NEW_APP_DATA:
+            {
+                if(len < 5)
+                    return;
+                uint32_t offset = getUint32(payload + 1);
+                size_t n = len - 5;
+                bool ok = offset + n <= mErasedSize;
+                if(ok)
+                    memcpy(mNewApp.data() + offset, payload + 5, n);
+                response = {COMM_WRITE_NEW_APP_DATA, uint8_t(ok)};
+                appendUint32(response, offset);
+            } break;
+            case COMM_JUMP_TO_BOOTLOADER:
+            {
+                // The bootloader checks the image before installing it.
+                if(mNewApp.size() >= 6) {
+                    size_t size = getUint32(mNewApp.data());
+                    uint16_t crc = uint16_t(mNewApp[4] << 8 | mNewApp[5]);
+                    if(size + 6 <= mNewApp.size() && crc16(mNewApp.data() + 6, size) == crc) {
+                        mInstallCount++;
+                    } else {
+                        std::cerr << "Simulated controller " << int(mId) << " got a bad firmware image" << std::endl;
+                    }
+                }
+            } return;
+            case COMM_ALIVE:
+                mCommandTime = mLastUpdate;
+                return;
+            default:
+                return;
+        }
+        if(reply)
+            sendReply(sender, response, out);
+    }
+
+    void SimController::sendReply(uint8_t sender, const std::vector<uint8_t> &payload, std::vector<struct can_frame> &out)
+    {
+        std::vector<struct can_frame> frames;
+        BusCan::encodePacketFrames(sender, mId, payload.data(), payload.size(), frames, 1);
+        out.insert(out.end(), frames.begin(), frames.end());
+    }
+
+    std::chrono::steady_clock::time_point SimController::update(std::chrono::steady_clock::time_point now,
+                                                                std::vector<struct can_frame> &out)
+    {
+        if(mLastUpdate == std::chrono::steady_clock::time_point()) {
+            mLastUpdate = now;
+            // Spread the first status frames of each controller out a little, as real ones start at different times.
+            for(size_t i = 0; i < mStatusDue.size(); i++) {
+                mStatusDue[i] = now + mStatusPeriod[i] * mId / 256;
+            }
+        }
+        float dt = std::chrono::duration<float>(now - mLastUpdate).count();
+        mLastUpdate = now;
+        if(dt > 0) {
+            // The controller stops driving when commands stop arriving.
+            MotorDriveT mode = mMode;
+            if(mode != MotorDriveT::NONE && now - mCommandTime > mCommandTimeout)
+                mode = MotorDriveT::NONE;
+
+            float target = 0.0f;
+            float timeConstant = mTimeConstant;
+            bool driven = true;
+            float prevPos = mPidPos;
+            switch(mode) {
+                case MotorDriveT::DUTY:
+                    target = mCommandValue * mErpmPerDuty;
+                    break;
+                case MotorDriveT::CURRENT:
+                    target = mCommandValue * mErpmPerAmp;
+                    driven = mCommandValue != 0.0f;
+                    break;
+                case MotorDriveT::CURRENT_REL:
+                    target = mCommandValue * mMaxCurrent * mErpmPerAmp;
+                    driven = mCommandValue != 0.0f;
+                    break;
+                case MotorDriveT::RPM:
+                    target = mCommandValue;
+                    break;
+                case MotorDriveT::POS:
+                    mPidPos += (mCommandValue - mPidPos) * (1.0f - std::exp(-dt / mPosTimeConstant));
+                    break;
+                case MotorDriveT::CURRENT_BREAK:
+                case MotorDriveT::CURRENT_BREAK_REL:
+                case MotorDriveT::HAND_BRAKE:
+                case MotorDriveT::HAND_BRAKE_REL:
+                    if(mCommandValue == 0.0f)
+                        timeConstant = mCoastTimeConstant;
+                    break;
+                case MotorDriveT::NONE:
+                    timeConstant = mCoastTimeConstant;
+                    driven = false;
+                    break;
+            }
+            float prevErpm = mErpm;
+            if(mode == MotorDriveT::POS) {
+                // Degrees per second to RPM.
+                mErpm = (mPidPos - prevPos) / dt / 6.0f;
+            } else {
+                mErpm += (target - mErpm) * (1.0f - std::exp(-dt / timeConstant));
+            }
+            float acceleration = (mErpm - prevErpm) / dt;
+            float friction = mErpm > 0.0f ? mFrictionCurrent : (mErpm < 0.0f ? -mFrictionCurrent : 0.0f);
+            mCurrent = driven ? std::clamp(acceleration * mAmpsPerErpmRate + friction, -mMaxCurrent, mMaxCurrent) : 0.0f;
+            mDuty = std::clamp(mErpm / mErpmPerDuty, -1.0f, 1.0f);
+            mTachometer += mErpm / 60.0f * 6.0f * dt;
+
+            float currentIn = mCurrent * mDuty;
+            if(currentIn >= 0.0f) {
+                mAmpHours += currentIn * dt / 3600.0f;
+                mWattHours += currentIn * mVoltage * dt / 3600.0f;
+            } else {
+                mAmpHoursCharged -= currentIn * dt / 3600.0f;
+                mWattHoursCharged -= currentIn * mVoltage * dt / 3600.0f;
+            }
+            mTempFet += (25.0f + std::abs(mCurrent) * 0.5f - mTempFet) * (1.0f - std::exp(-dt / 30.0f));
+            mTempMotor += (25.0f + std::abs(mCurrent) * 0.8f - mTempMotor) * (1.0f - std::exp(-dt / 60.0f));
+        }
+
+        auto next = now + std::chrono::seconds(1);
+        for(size_t i = 0; i < mStatusDue.size(); i++) {
+            if(mStatusPeriod[i] == std::chrono::steady_clock::duration::zero())
+                continue;
+            if(now >= mStatusDue[i]) {
+                appendStatus(int(i), out);
+                mStatusDue[i] += mStatusPeriod[i];
+                // Don't try to catch up if we've fallen behind.
+                if(mStatusDue[i] <= now)
+                    mStatusDue[i] = now + mStatusPeriod[i];
+            }
+            next = std::min(next, mStatusDue[i]);
+        }
+        return next;
+    }
+
+    void SimController::appendStatus(int packet, std::vector<struct can_frame> &out) const
+    {
+        struct can_frame frame {};
+        frame.can_id = mId | ((uint32_t) gStatusPackets[packet] << 8) | CAN_EFF_FLAG;
+        int32_t index = 0;
+        // The same scaling as BusCan::decode.
+        switch(packet) {
+            case 0:
+                buffer_append_float32(frame.data, mErpm, 1, &index);
+                buffer_append_float16(frame.data, mCurrent, 10, &index);
+                buffer_append_float16(frame.data, mDuty, 1000, &index);
+                break;
+            case 1:
+                buffer_append_float32(frame.data, mAmpHours, 10000, &index);
+                buffer_append_float32(frame.data, mAmpHoursCharged, 10000, &index);
+                break;
+            case 2:
+                buffer_append_float32(frame.data, mWattHours, 10000, &index);
+                buffer_append_float32(frame.data, mWattHoursCharged, 10000, &index);
+                break;
+            case 3:
+                buffer_append_float16(frame.data, mTempFet, 10, &index);
+                buffer_append_float16(frame.data, mTempMotor, 10, &index);
+                buffer_append_float16(frame.data, mCurrent * mDuty, 10, &index);
+                buffer_append_float16(frame.data, mPidPos, 50, &index);
+                break;
+            case 4:
+                buffer_append_float32(frame.data, mTachometer, 6, &index);
+                buffer_append_float16(frame.data, mVoltage, 10, &index);
+                buffer_append_int16(frame.data, 0, &index);
+                break;
+            default:
+                // No ADC or PPM inputs.
+                index = 8;
+                break;
+        }
+        frame.can_dlc = uint8_t(index);
+        out.push_back(frame);
+    }
+
+    std::vector<std::unique_ptr<SimController>> makeSimControllers(const json &config)
+    {
+        std::vector<std::unique_ptr<SimController>> controllers;
+        json common = config.value("controller", json::object());
+        json individual = config.value("controllers", json::object());
+        std::vector<int> ids;
+        if(config.contains("ids")) {
+            ids = config["ids"].get<std::vector<int>>();
+        } else {
+            int first = config.value("firstId", 1);
+            int count = config.value("count", 1);
+            for(int i = 0; i < count; i++)
+                ids.push_back(first + i);
+        }
+        std::array<bool, 256> used {};
+        for(auto id : ids) {
+            if(id < 0 || id > 253 || used[size_t(id)]) {
+                std::cerr << "Invalid simulated controller id " << id << std::endl;
+                continue;
+            }
+            used[size_t(id)] = true;
+            json controllerConfig = common;
+            auto key = std::to_string(id);
+            if(individual.contains(key))
+                controllerConfig.update(individual[key]);
+            auto controller = std::make_unique<SimController>(uint8_t(id));
+            if(controller->configure(controllerConfig))
+                controllers.push_back(std::move(controller));
+        }
+        return controllers;
+    }
+
+    json SimController::state() const
+    {
+        json state;
+        state["id"] = mId;
+        state["mode"] = to_string(mMode);
+        state["command"] = mCommandValue;
+        state["commands"] = mCommandCount;
+        state["erpm"] = mErpm;
+        state["current"] = mCurrent;
+        state["duty"] = mDuty;
+        state["pidPos"] = mPidPos;
+        state["tachometer"] = mTachometer;
+        state["installs"] = mInstallCount;
+        return state;
+    }
+
+} // multivesc
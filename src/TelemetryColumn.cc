@@ -0,0 +1,342 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#include <iostream>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <unistd.h>
+#include "multivesc/TelemetryColumn.hh"
+
+namespace multivesc {
+
+    namespace {
+
+        //! Files grow a megabyte at a time, there may be thousands of them open.
+        constexpr size_t gGrowStep = 1024 * 1024;
+
+        //! Most bits a sample can take: a 32 bit time change and a value with a new window, plus the prefixes.
+        constexpr uint64_t gMaxSampleBits = 4 + 32 + 2 + 5 + 5 + 32;
+
+        uint64_t align8(uint64_t offset)
+        {
+            return (offset + 7) & ~uint64_t(7);
+        }
+
+        uint32_t floatBits(float value)
+        {
+            uint32_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            return bits;
+        }
+
+        float bitsFloat(uint32_t bits)
+        {
+            float value;
+            memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+
+        //! Reads bits written by TelemetryColumnWriter::writeBits(), stopping at a limit.
+        class BitReader
+        {
+        public:
+            BitReader(const uint8_t *data, uint64_t limitBits)
+             : mData(data), mLimit(limitBits)
+            {}
+
+            uint64_t read(int count)
+            {
+                if(mPos + uint64_t(count) > mLimit) {
+                    mOk = false;
+                    return 0;
+                }
+                uint64_t value = 0;
+                while(count > 0) {
+                    int used = int(mPos & 7);
+                    int take = std::min(8 - used, count);
+                    uint8_t byte = mData[mPos >> 3];
+                    value = (value << take) | ((byte >> (8 - used - take)) & ((1u << take) - 1));
+                    mPos += uint64_t(take);
+                    count -= take;
+                }
+                return value;
+            }
+
+            [[nodiscard]] bool ok() const { return mOk; }
+
+        private:
+            const uint8_t *mData;
+            uint64_t mLimit;
+            uint64_t mPos = 0;
+            bool mOk = true;
+        };
+    }
+
+    bool TelemetryColumnWriter::open(const std::string &filename, uint32_t valueType, uint32_t blockSamples)
+    {
+        close();
+        mBlockSamples = std::max<uint32_t>(blockSamples, 2);
+        mBlockCount = 0;
+        mBitPos = 0;
+        if(access(filename.c_str(), F_OK) == 0) {
+            // Carry on after the samples already there, in a new block.
+            if(!mFile.openAppend(filename, gGrowStep))
+                return false;
+            TelemetryFileHeaderT expected;
+            if(mFile.used() < sizeof(TelemetryFileHeaderT) ||
+               memcmp(header()->magic, expected.magic, sizeof(expected.magic)) != 0 ||
+               header()->valueType != valueType || header()->dataBytes > mFile.used()) {
+                std::cerr << filename << " is not a telemetry column for the same value, leaving it alone" << std::endl;
+                mFile.setUsed(mFile.mapped());
+                mFile.close();
+                return false;
+            }
+            uint64_t dataBytes = header()->dataBytes;
+            // Anything after the data is from a write that was never published.
+            memset(mFile.data() + dataBytes, 0, mFile.mapped() - dataBytes);
+            mFile.setUsed(dataBytes);
+            mSampleCount = header()->sampleCount;
+            mBlockOffset = align8(dataBytes);
+            mFile.releaseDescriptor();
+            return true;
+        }
+        if(!mFile.create(filename, gGrowStep))
+            return false;
+        TelemetryFileHeaderT fileHeader;
+        fileHeader.valueType = valueType;
+        fileHeader.blockSamples = mBlockSamples;
+        struct timespec now {};
+        clock_gettime(CLOCK_REALTIME, &now);
+        fileHeader.createdNs = int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+        fileHeader.dataBytes = sizeof(TelemetryFileHeaderT);
+        if(!mFile.append(&fileHeader, sizeof(fileHeader))) {
+            mFile.close();
+            return false;
+        }
+        mSampleCount = 0;
+        mBlockOffset = sizeof(TelemetryFileHeaderT);
+        // A logger can have thousands of columns open, they only need a descriptor to grow.
+        mFile.releaseDescriptor();
+        return true;
+    }
+
+    void TelemetryColumnWriter::writeBits(uint64_t value, int count)
+    {
+        uint8_t *data = mFile.data() + mBlockOffset + sizeof(TelemetryBlockHeaderT);
+        // The file is zero past what has been written, so bits can be ORed in.
+        while(count > 0) {
+            int used = int(mBitPos & 7);
+            int take = std::min(8 - used, count);
+            auto bits = uint8_t((value >> (count - take)) & ((1u << take) - 1));
+            data[mBitPos >> 3] |= uint8_t(bits << (8 - used - take));
+            mBitPos += uint64_t(take);
+            count -= take;
+        }
+    }
+
+    bool TelemetryColumnWriter::startBlock(int64_t timeUs, uint32_t valueBits)
+    {
+        if(mBlockCount > 0) {
+            publish();
+            mBlockOffset = align8(mBlockOffset + sizeof(TelemetryBlockHeaderT) + (mBitPos + 7) / 8);
+        }
+        if(!mFile.reserve(mBlockOffset + sizeof(TelemetryBlockHeaderT) + gMaxSampleBits / 8 + 1))
+            return false;
+        TelemetryBlockHeaderT blockHeader;
+        blockHeader.firstTimeUs = timeUs;
+        blockHeader.lastTimeUs = timeUs;
+        memcpy(block(), &blockHeader, sizeof(blockHeader));
+        mBitPos = 0;
+        writeBits(valueBits, 32);
+        mBlockCount = 1;
+        mSampleCount++;
+        mPrevTimeUs = timeUs;
+        mPrevDeltaUs = 0;
+        mPrevValue = valueBits;
+        mPrevLeading = -1;
+        return true;
+    }
+
+    bool TelemetryColumnWriter::append(int64_t timeUs, float value)
+    {
+        if(!mFile.isOpen())
+            return false;
+        uint32_t valueBits = floatBits(value);
+        if(mBlockCount == 0 || mBlockCount >= mBlockSamples)
+            return startBlock(timeUs, valueBits);
+        int64_t delta = timeUs - mPrevTimeUs;
+        int64_t dod = delta - mPrevDeltaUs;
+        // A jump in time too big to encode starts a new block.
+        if(dod < std::numeric_limits<int32_t>::min() || dod > std::numeric_limits<int32_t>::max())
+            return startBlock(timeUs, valueBits);
+        if(!mFile.reserve(mBlockOffset + sizeof(TelemetryBlockHeaderT) + (mBitPos + gMaxSampleBits) / 8 + 1))
+            return false;
+
+        // Change in the time between samples.
+        if(dod == 0) {
+            writeBits(0, 1);
+        } else if(dod >= -63 && dod <= 64) {
+            writeBits(0b10, 2);
+            writeBits(uint64_t(dod + 63), 7);
+        } else if(dod >= -255 && dod <= 256) {
+            writeBits(0b110, 3);
+            writeBits(uint64_t(dod + 255), 9);
+        } else if(dod >= -2047 && dod <= 2048) {
+            writeBits(0b1110, 4);
+            writeBits(uint64_t(dod + 2047), 12);
+        } else {
+            writeBits(0b1111, 4);
+            writeBits(uint32_t(int32_t(dod)), 32);
+        }
+
+        // Bits that changed in the value.
+        uint32_t x = valueBits ^ mPrevValue;
+        if(x == 0) {
+            writeBits(0, 1);
+        } else {
+            int leading = __builtin_clz(x);
+            int trailing = __builtin_ctz(x);
+            if(mPrevLeading >= 0 && leading >= mPrevLeading && trailing >= mPrevTrailing) {
+                // Fits in the window of the last one.
+                writeBits(0b10, 2);
+                writeBits(x >> mPrevTrailing, 32 - mPrevLeading - mPrevTrailing);
+            } else {
+                int meaningful = 32 - leading - trailing;
+                writeBits(0b11, 2);
+                writeBits(uint64_t(leading), 5);
+                writeBits(uint64_t(meaningful - 1), 5);
+                writeBits(x >> trailing, meaningful);
+                mPrevLeading = leading;
+                mPrevTrailing = trailing;
+            }
+        }
+        mBlockCount++;
+        mSampleCount++;
+        mPrevDeltaUs = delta;
+        mPrevTimeUs = timeUs;
+        mPrevValue = valueBits;
+        return true;
+    }
+
+    void TelemetryColumnWriter::publish()
+    {
+        if(!mFile.isOpen() || mBlockCount == 0)
+            return;
+        // The samples are written, then the block says how many there are, then the file says where its data ends.
+        auto *blockHeader = block();
+        __atomic_store_n(&blockHeader->bits, uint32_t(mBitPos), __ATOMIC_RELAXED);
+        __atomic_store_n(&blockHeader->lastTimeUs, mPrevTimeUs, __ATOMIC_RELAXED);
+        __atomic_store_n(&blockHeader->count, mBlockCount, __ATOMIC_RELEASE);
+        uint64_t dataBytes = mBlockOffset + sizeof(TelemetryBlockHeaderT) + (mBitPos + 7) / 8;
+        __atomic_store_n(&header()->sampleCount, mSampleCount, __ATOMIC_RELAXED);
+        __atomic_store_n(&header()->dataBytes, dataBytes, __ATOMIC_RELEASE);
+        mFile.setUsed(dataBytes);
+    }
+
+    uint64_t TelemetryColumnWriter::bytes() const
+    {
+        if(mBlockCount == 0)
+            return mFile.used();
+        return mBlockOffset + sizeof(TelemetryBlockHeaderT) + (mBitPos + 7) / 8;
+    }
+
+    void TelemetryColumnWriter::close()
+    {
+        publish();
+        mFile.close();
+        mBlockCount = 0;
+    }
+
+    bool TelemetryColumnReader::open(const std::string &filename)
+    {
+        if(!mFile.openRead(filename))
+            return false;
+        TelemetryFileHeaderT expected;
+        if(mFile.used() < sizeof(TelemetryFileHeaderT) ||
+           memcmp(header().magic, expected.magic, sizeof(expected.magic)) != 0) {
+            std::cerr << filename << " is not a telemetry column" << std::endl;
+            mFile.close();
+            return false;
+        }
+        return true;
+    }
+
+    uint64_t TelemetryColumnReader::sampleCount() const
+    {
+        if(!mFile.isOpen())
+            return 0;
+        return __atomic_load_n(&header().sampleCount, __ATOMIC_ACQUIRE);
+    }
+
+    size_t TelemetryColumnReader::read(std::vector<int64_t> &timesUs, std::vector<float> &values,
+                                       int64_t fromUs, int64_t toUs) const
+    {
+        if(!mFile.isOpen())
+            return 0;
+        const uint8_t *data = mFile.data();
+        uint64_t end = std::min<uint64_t>(__atomic_load_n(&header().dataBytes, __ATOMIC_ACQUIRE), mFile.used());
+        size_t found = 0;
+        uint64_t offset = sizeof(TelemetryFileHeaderT);
+        while(offset + sizeof(TelemetryBlockHeaderT) <= end) {
+            const auto *blockHeader = reinterpret_cast<const TelemetryBlockHeaderT *>(data + offset);
+            uint32_t count = __atomic_load_n(&blockHeader->count, __ATOMIC_ACQUIRE);
+            uint32_t bits = __atomic_load_n(&blockHeader->bits, __ATOMIC_RELAXED);
+            int64_t lastTimeUs = __atomic_load_n(&blockHeader->lastTimeUs, __ATOMIC_RELAXED);
+            uint64_t dataStart = offset + sizeof(TelemetryBlockHeaderT);
+            // The last block may be ahead of the end read above, so don't go past it.
+            uint64_t limitBits = std::min<uint64_t>(bits, (end - dataStart) * 8);
+            offset = align8(dataStart + (uint64_t(bits) + 7) / 8);
+            if(count == 0 || lastTimeUs < fromUs)
+                continue;
+            if(blockHeader->firstTimeUs > toUs)
+                break;
+
+            BitReader reader(data + dataStart, limitBits);
+            int64_t timeUs = blockHeader->firstTimeUs;
+            int64_t delta = 0;
+            auto value = uint32_t(reader.read(32));
+            int leading = 0;
+            int trailing = 0;
+            for(uint32_t i = 0; i < count && reader.ok(); i++) {
+                if(i > 0) {
+                    int64_t dod;
+                    if(reader.read(1) == 0)
+                        dod = 0;
+                    else if(reader.read(1) == 0)
+                        dod = int64_t(reader.read(7)) - 63;
+                    else if(reader.read(1) == 0)
+                        dod = int64_t(reader.read(9)) - 255;
+                    else if(reader.read(1) == 0)
+                        dod = int64_t(reader.read(12)) - 2047;
+                    else
+                        dod = int32_t(uint32_t(reader.read(32)));
+                    delta += dod;
+                    timeUs += delta;
+                    if(reader.read(1) != 0) {
+                        if(reader.read(1) != 0) {
+                            leading = int(reader.read(5));
+                            int meaningful = int(reader.read(5)) + 1;
+                            trailing = 32 - leading - meaningful;
+                            if(trailing < 0)
+                                break;
+                        }
+                        value ^= uint32_t(reader.read(32 - leading - trailing)) << trailing;
+                    }
+                    if(!reader.ok())
+                        break;
+                }
+                if(timeUs > toUs)
+                    return found;
+                if(timeUs >= fromUs) {
+                    timesUs.push_back(timeUs);
+                    values.push_back(bitsFloat(value));
+                    found++;
+                }
+            }
+        }
+        return found;
+    }
+
+} // multivesc
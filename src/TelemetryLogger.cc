@@ -0,0 +1,203 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#include <iostream>
+#include <filesystem>
+#include <ctime>
+#include "multivesc/TelemetryLogger.hh"
+
+namespace multivesc {
+
+    namespace {
+        constexpr size_t gBatch = 1024;
+
+        constexpr uint32_t gAllValues = (1u << NumValueTypes) - 1;
+    }
+
+    TelemetryStream::TelemetryStream(std::string motorName, uint32_t valueMask, size_t queueSize)
+     : mMotorName(std::move(motorName)),
+       mValueMask(valueMask),
+       mQueue(queueSize)
+    {}
+
+    void TelemetryStream::record(MotorValuesT type, float value)
+    {
+        if(!(mValueMask & (1u << unsigned(type))))
+            return;
+        struct timespec now {};
+        clock_gettime(CLOCK_REALTIME, &now);
+        TelemetrySampleT sample;
+        sample.timeUs = int64_t(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+        sample.value = value;
+        sample.type = type;
+        if(!mQueue.push(sample))
+            mDropped++;
+    }
+
+    TelemetryLogger::TelemetryLogger(const json &config)
+     : mDirectory(config.value("directory", std::string("telemetry"))),
+       mBlockSamples(config.value("blockSamples", uint32_t(4096))),
+       mQueueSize(config.value("queueSize", size_t(8192))),
+       mFlushPeriod(std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+               std::chrono::duration<float>(config.value("flushPeriod", 0.25f))))
+    {
+        if(!config.contains("values")) {
+            mValueMask = gAllValues;
+        }
+        for(const auto &name : config.value("values", json::array())) {
+            MotorValuesT type;
+            if(!valueTypeFromString(name.get<std::string>(), type)) {
+                std::cerr << "Unknown telemetry value " << name.get<std::string>() << std::endl;
+                continue;
+            }
+            mValueMask |= 1u << unsigned(type);
+        }
+    }
+
+    TelemetryLogger::~TelemetryLogger()
+    {
+        stop();
+    }
+
+    std::string TelemetryLogger::columnFile(const std::string &motorName, MotorValuesT type) const
+    {
+        // Keep motor names from reaching outside the directory.
+        std::string dirName = motorName;
+        for(auto &c : dirName) {
+            if(c == '/')
+                c = '_';
+        }
+        if(dirName.empty() || dirName == "." || dirName == "..")
+            dirName = "_" + dirName;
+        return mDirectory + "/" + dirName + "/" + to_string(type) + ".tlm";
+    }
+
+    bool TelemetryLogger::addMotor(const std::shared_ptr<Motor> &motor)
+    {
+        if(!motor)
+            return false;
+        std::lock_guard lock(mMutex);
+        for(auto &entry : mMotors) {
+            if(entry.stream->motorName() == motor->name())
+                return true;
+        }
+        std::error_code error;
+        auto dir = std::filesystem::path(columnFile(motor->name(), MotorValuesT::RPM)).parent_path();
+        std::filesystem::create_directories(dir, error);
+        if(error) {
+            std::cerr << "Failed to create " << dir.string() << ": " << error.message() << std::endl;
+            return false;
+        }
+        MotorLogT entry;
+        entry.motor = motor;
+        entry.stream = std::make_shared<TelemetryStream>(motor->name(), mValueMask, mQueueSize);
+        motor->setTelemetryStream(entry.stream);
+        mMotors.push_back(std::move(entry));
+        return true;
+    }
+
+    bool TelemetryLogger::start()
+    {
+        if(mThread.joinable())
+            return false;
+        mTerminate = false;
+        mThread = std::thread(&TelemetryLogger::run, this);
+        return true;
+    }
+
+    void TelemetryLogger::stop()
+    {
+        {
+            std::lock_guard lock(mWaitMutex);
+            mTerminate = true;
+        }
+        mWaitCondition.notify_all();
+        if(mThread.joinable())
+            mThread.join();
+        std::lock_guard lock(mMutex);
+        // Stop the motors queueing values, then write out what they already have.
+        for(auto &entry : mMotors) {
+            if(auto motor = entry.motor.lock())
+                motor->setTelemetryStream(nullptr);
+        }
+        flush();
+        for(auto &entry : mMotors) {
+            for(auto &column : entry.columns) {
+                if(column)
+                    column->close();
+            }
+        }
+        mMotors.clear();
+    }
+
+    void TelemetryLogger::run()
+    {
+        while(true) {
+            {
+                std::unique_lock lock(mWaitMutex);
+                mWaitCondition.wait_for(lock, mFlushPeriod, [this] { return bool(mTerminate); });
+            }
+            if(mTerminate)
+                break;
+            std::lock_guard lock(mMutex);
+            flush();
+        }
+    }
+
+    void TelemetryLogger::flush()
+    {
+        mBatch.resize(gBatch);
+        for(auto &entry : mMotors) {
+            size_t count;
+            while((count = entry.stream->mQueue.pop(mBatch.data(), gBatch)) > 0) {
+                for(size_t i = 0; i < count; i++) {
+                    const auto &sample = mBatch[i];
+                    auto &column = entry.columns[size_t(sample.type)];
+                    // Files are only made for values that arrive, not every motor sends all of them.
+                    if(!column) {
+                        column = std::make_unique<TelemetryColumnWriter>();
+                        if(!column->open(columnFile(entry.stream->motorName(), sample.type), uint32_t(sample.type), mBlockSamples))
+                            mWriteErrors++;
+                    }
+                    if(column->isOpen() && !column->append(sample.timeUs, sample.value))
+                        mWriteErrors++;
+                }
+            }
+            for(auto &column : entry.columns) {
+                if(column)
+                    column->publish();
+            }
+        }
+    }
+
+    json TelemetryLogger::stats()
+    {
+        std::lock_guard lock(mMutex);
+        uint64_t samples = 0;
+        uint64_t bytes = 0;
+        uint64_t dropped = 0;
+        size_t columns = 0;
+        for(auto &entry : mMotors) {
+            dropped += entry.stream->droppedCount();
+            for(auto &column : entry.columns) {
+                if(!column || !column->isOpen())
+                    continue;
+                columns++;
+                samples += column->sampleCount();
+                bytes += column->bytes();
+            }
+        }
+        json result;
+        result["directory"] = mDirectory;
+        result["motors"] = mMotors.size();
+        result["columns"] = columns;
+        result["samples"] = samples;
+        result["bytes"] = bytes;
+        result["bytesPerSample"] = samples > 0 ? double(bytes) / double(samples) : 0.0;
+        result["dropped"] = dropped;
+        result["writeErrors"] = uint64_t(mWriteErrors);
+        return result;
+    }
+
+} // multivesc
@@ -0,0 +1,108 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#include "multivesc/TimerWheel.hh"
+
+namespace multivesc {
+
+    TimerWheel::TimerWheel(DurationT resolution)
+     : mResolution(resolution),
+       mOrigin(std::chrono::steady_clock::now())
+    {
+        if(mResolution <= DurationT::zero()) {
+            mResolution = std::chrono::milliseconds(1);
+        }
+    }
+
+    void TimerWheel::reset(TimePointT now)
+    {
+        for(auto &level : mSlots) {
+            for(auto &slot : level) {
+                slot.clear();
+            }
+        }
+        mOrigin = now;
+        mCurrentTick = 0;
+        mSize = 0;
+    }
+
+    uint64_t TimerWheel::toTick(TimePointT when) const
+    {
+        if(when <= mOrigin)
+            return 0;
+        auto delta = when - mOrigin;
+        return uint64_t((delta + mResolution - DurationT(1)) / mResolution);
+    }
+
+    void TimerWheel::insert(const Entry &entry, uint64_t minTick)
+    {
+        uint64_t tick = entry.tick;
+        if(tick < minTick)
+            tick = minTick;
+        uint64_t delta = tick - mCurrentTick;
+        int level = 0;
+        while(level < gNumLevels - 1 && delta >= (uint64_t(1) << (gSlotBits * (level + 1)))) {
+            level++;
+        }
+        // Anything beyond the top level waits in its last slot and is re-inserted when it cascades.
+        uint64_t maxDelta = (uint64_t(1) << (gSlotBits * gNumLevels)) - 1;
+        if(delta > maxDelta)
+            tick = mCurrentTick + maxDelta;
+        size_t slot = (tick >> (gSlotBits * level)) & gSlotMask;
+        mSlots[level][slot].push_back({entry.handle, entry.tick});
+    }
+
+    void TimerWheel::schedule(uint32_t handle, TimePointT when)
+    {
+        // Anything due now or in the past goes in the next slot, the current one has already been processed.
+        insert({handle, toTick(when)}, mCurrentTick + 1);
+        mSize++;
+    }
+
+    void TimerWheel::advance(TimePointT now, std::vector<uint32_t> &expired)
+    {
+        // Only process ticks that have fully passed.
+        uint64_t target = now <= mOrigin ? 0 : uint64_t((now - mOrigin) / mResolution);
+        while(mCurrentTick < target) {
+            mCurrentTick++;
+            // Move timers down from the higher levels when the lower ones wrap.
+            for(int level = 1; level < gNumLevels; level++) {
+                if((mCurrentTick & ((uint64_t(1) << (gSlotBits * level)) - 1)) != 0)
+                    break;
+                auto &slot = mSlots[level][(mCurrentTick >> (gSlotBits * level)) & gSlotMask];
+                mCascade.swap(slot);
+                for(const auto &entry : mCascade) {
+                    insert(entry, mCurrentTick);
+                }
+                mCascade.clear();
+            }
+            auto &slot = mSlots[0][mCurrentTick & gSlotMask];
+            for(const auto &entry : slot) {
+                if(entry.tick <= mCurrentTick) {
+                    expired.push_back(entry.handle);
+                    mSize--;
+                } else {
+                    // Parked beyond the range of the wheel, put it back.
+                    mCascade.push_back(entry);
+                }
+            }
+            slot.clear();
+            for(const auto &entry : mCascade) {
+                insert(entry, mCurrentTick + 1);
+            }
+            mCascade.clear();
+        }
+    }
+
+    TimerWheel::TimePointT TimerWheel::nextEvent() const
+    {
+        uint64_t tick = mCurrentTick + 1;
+        for(; ; tick++) {
+            if(!mSlots[0][tick & gSlotMask].empty() || (tick & gSlotMask) == 0)
+                break;
+        }
+        return mOrigin + mResolution * int64_t(tick);
+    }
+
+} // multivesc
@@ -0,0 +1,197 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+#include "multivesc/Trajectory.hh"
+
+namespace multivesc {
+
+    Trajectory::Trajectory(MotorDriveT mode, float startValue)
+     : mMode(mode),
+       mStartValue(startValue),
+       mEndValue(startValue)
+    {
+        if(mMode != MotorDriveT::RPM && mMode != MotorDriveT::POS) {
+            std::cerr << "Trajectory mode " << to_string(mMode) << " not supported, using RPM" << std::endl;
+            mMode = MotorDriveT::RPM;
+        }
+    }
+
+    void Trajectory::velocityPhases(double dv, double maxAccel, double maxJerk, std::vector<Phase> &phases)
+    {
+        double sign = dv < 0 ? -1.0 : 1.0;
+        dv = std::abs(dv);
+        if(dv <= 0.0)
+            return;
+        if(maxJerk <= 0.0) {
+            // No jerk limit, a simple trapezoid.
+            phases.push_back({dv / maxAccel, 0.0, sign * maxAccel});
+            return;
+        }
+        double tj = maxAccel / maxJerk;
+        double peakAccel = maxAccel;
+        double ta = 0.0;
+        if(dv >= maxAccel * tj) {
+            ta = dv / maxAccel - tj;
+        } else {
+            // Never reach the maximum acceleration.
+            tj = std::sqrt(dv / maxJerk);
+            peakAccel = maxJerk * tj;
+        }
+        phases.push_back({tj, sign * maxJerk, 0.0});
+        if(ta > 0.0)
+            phases.push_back({ta, 0.0, sign * peakAccel});
+        phases.push_back({tj, -sign * maxJerk, sign * peakAccel});
+    }
+
+    void Trajectory::appendPhases(const std::vector<Phase> &phases, bool position)
+    {
+        // Motion always starts and ends at rest for position moves, velocity profiles start at the current value.
+        double p = mEndValue;
+        double v = position ? 0.0 : mEndValue;
+        for(const auto &phase : phases) {
+            if(phase.duration <= 0.0)
+                continue;
+            double a = phase.accel;
+            double j = phase.jerk;
+            double t = phase.duration;
+            Segment seg {};
+            seg.start = mDuration;
+            seg.duration = t;
+            if(position) {
+                seg.c0 = p;
+                seg.c1 = v;
+                seg.c2 = a / 2.0;
+                seg.c3 = j / 6.0;
+            } else {
+                seg.c0 = v;
+                seg.c1 = a;
+                seg.c2 = j / 2.0;
+                seg.c3 = 0.0;
+            }
+            mSegments.push_back(seg);
+            p += v * t + a * t * t / 2.0 + j * t * t * t / 6.0;
+            v += a * t + j * t * t / 2.0;
+            mDuration += t;
+        }
+    }
+
+    bool Trajectory::appendSCurve(float to, float maxAcceleration, float maxJerk)
+    {
+        if(mMode != MotorDriveT::RPM) {
+            std::cerr << "S-curves are only supported for RPM trajectories" << std::endl;
+            return false;
+        }
+        if(maxAcceleration <= 0.0f) {
+            std::cerr << "Maximum acceleration must be positive" << std::endl;
+            return false;
+        }
+        std::vector<Phase> phases;
+        velocityPhases(double(to) - mEndValue, maxAcceleration, maxJerk, phases);
+        appendPhases(phases, false);
+        mEndValue = to;
+        return true;
+    }
+
+    bool Trajectory::appendMove(float to, float maxVelocity, float maxAcceleration, float maxJerk)
+    {
+        if(mMode != MotorDriveT::POS) {
+            std::cerr << "Moves are only supported for position trajectories" << std::endl;
+            return false;
+        }
+        if(maxVelocity <= 0.0f || maxAcceleration <= 0.0f) {
+            std::cerr << "Maximum velocity and acceleration must be positive" << std::endl;
+            return false;
+        }
+        double distance = std::abs(double(to) - mEndValue);
+        double sign = to < mEndValue ? -1.0 : 1.0;
+        if(distance <= 0.0)
+            return true;
+
+        // Time taken to reach a velocity from rest, the distance covered is half v times this.
+        auto accelTime = [maxAcceleration, maxJerk](double v) {
+            if(maxJerk <= 0.0f)
+                return v / maxAcceleration;
+            if(v >= double(maxAcceleration) * maxAcceleration / maxJerk)
+                return v / maxAcceleration + double(maxAcceleration) / maxJerk;
+            return 2.0 * std::sqrt(v / maxJerk);
+        };
+        double peakVelocity = maxVelocity;
+        double cruiseTime = 0.0;
+        if(peakVelocity * accelTime(peakVelocity) <= distance) {
+            cruiseTime = (distance - peakVelocity * accelTime(peakVelocity)) / peakVelocity;
+        } else {
+            // Too short to reach the maximum velocity, find the peak we can reach.
+            double low = 0.0;
+            double high = peakVelocity;
+            for(int i = 0; i < 60; i++) {
+                double mid = (low + high) / 2.0;
+                if(mid * accelTime(mid) > distance)
+                    high = mid;
+                else
+                    low = mid;
+            }
+            peakVelocity = low;
+        }
+
+        std::vector<Phase> phases;
+        velocityPhases(sign * peakVelocity, maxAcceleration, maxJerk, phases);
+        if(cruiseTime > 0.0)
+            phases.push_back({cruiseTime, 0.0, 0.0});
+        velocityPhases(-sign * peakVelocity, maxAcceleration, maxJerk, phases);
+        appendPhases(phases, true);
+        mEndValue = to;
+        return true;
+    }
+
+    bool Trajectory::appendLinear(float to, float duration)
+    {
+        if(duration <= 0.0f) {
+            std::cerr << "Duration must be positive" << std::endl;
+            return false;
+        }
+        Segment seg {};
+        seg.start = mDuration;
+        seg.duration = duration;
+        seg.c0 = mEndValue;
+        seg.c1 = (double(to) - mEndValue) / duration;
+        mSegments.push_back(seg);
+        mDuration += duration;
+        mEndValue = to;
+        return true;
+    }
+
+    bool Trajectory::appendHold(float duration)
+    {
+        return appendLinear(mEndValue, duration);
+    }
+
+    float Trajectory::evaluate(double t) const
+    {
+        size_t hint = 0;
+        return evaluate(t, hint);
+    }
+
+    float Trajectory::evaluate(double t, size_t &hint) const
+    {
+        if(t <= 0.0 || mSegments.empty())
+            return mStartValue;
+        if(t >= mDuration)
+            return mEndValue;
+        if(hint >= mSegments.size() || mSegments[hint].start > t) {
+            // Out of order, so search for the segment.
+            auto it = std::upper_bound(mSegments.begin(), mSegments.end(), t,
+                                       [](double value, const Segment &seg) { return value < seg.start; });
+            hint = size_t(std::distance(mSegments.begin(), it)) - 1;
+        }
+        while(hint + 1 < mSegments.size() && mSegments[hint + 1].start <= t)
+            hint++;
+        const auto &seg = mSegments[hint];
+        double dt = t - seg.start;
+        return float(seg.c0 + dt * (seg.c1 + dt * (seg.c2 + dt * seg.c3)));
+    }
+
+} // multivesc
@@ -0,0 +1,230 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "multivesc/VescPacket.hh"
+#include "multivesc/Crc16.hh"
+
+namespace multivesc {
+
+    uint16_t vescCrc16(const uint8_t *data, size_t len, uint16_t crc)
+    {
+        return crc16(data, len, crc);
+    }
+
+    size_t encodePacket(const uint8_t *payload, size_t len, uint8_t *out)
+    {
+        size_t index = 0;
+        if(len < 256) {
+            out[index++] = 2;
+            out[index++] = uint8_t(len);
+        } else {
+            out[index++] = 3;
+            out[index++] = uint8_t(len >> 8);
+            out[index++] = uint8_t(len);
+        }
+        memcpy(out + index, payload, len);
+        index += len;
+        uint16_t crc = vescCrc16(payload, len);
+        out[index++] = uint8_t(crc >> 8);
+        out[index++] = uint8_t(crc);
+        out[index++] = 3;
+        return index;
+    }
+
+    void appendPacket(std::vector<uint8_t> &out, const uint8_t *payload, size_t len)
+    {
+        size_t start = out.size();
+        out.resize(start + packetSize(len));
+        encodePacket(payload, len, out.data() + start);
+    }
+
+    void appendPacket(std::vector<uint8_t> &out, const uint8_t *prefix, size_t prefixLen, const uint8_t *payload, size_t len)
+    {
+        size_t total = prefixLen + len;
+        size_t index = out.size();
+        out.resize(index + packetSize(total));
+        uint8_t *data = out.data();
+        if(total < 256) {
+            data[index++] = 2;
+            data[index++] = uint8_t(total);
+        } else {
+            data[index++] = 3;
+            data[index++] = uint8_t(total >> 8);
+            data[index++] = uint8_t(total);
+        }
+        memcpy(data + index, prefix, prefixLen);
+        index += prefixLen;
+        memcpy(data + index, payload, len);
+        index += len;
+        uint16_t crc = vescCrc16(payload, len, vescCrc16(prefix, prefixLen));
+        data[index++] = uint8_t(crc >> 8);
+        data[index++] = uint8_t(crc);
+        data[index++] = 3;
+    }
+
+    PacketView PacketView::sub(size_t offset) const
+    {
+        if(offset >= size())
+            return {nullptr, 0, nullptr, 0};
+        if(offset < mFirstLen)
+            return {mFirst + offset, mFirstLen - offset, mSecond, mSecondLen};
+        return {mSecond + (offset - mFirstLen), mSecondLen - (offset - mFirstLen), nullptr, 0};
+    }
+
+    uint16_t PacketView::crc() const
+    {
+        return vescCrc16(mSecond, mSecondLen, vescCrc16(mFirst, mFirstLen));
+    }
+
+    void PacketView::copy(size_t offset, uint8_t *out, size_t len) const
+    {
+        if(offset < mFirstLen) {
+            size_t n = std::min(len, mFirstLen - offset);
+            memcpy(out, mFirst + offset, n);
+            out += n;
+            len -= n;
+            offset = 0;
+        } else {
+            offset -= mFirstLen;
+        }
+        if(len > 0) {
+            memcpy(out, mSecond + offset, len);
+        }
+    }
+
+    PacketParser::PacketParser(size_t capacity)
+    {
+        size_t size = 64;
+        while(size < capacity)
+            size *= 2;
+        mBuffer.resize(size);
+        mMask = size - 1;
+    }
+
+    ssize_t PacketParser::readFrom(int fd)
+    {
+        size_t space = mBuffer.size() - size_t(mHead - mTail);
+        if(space == 0)
+            return 0;
+        // Read into the free space, which may wrap around the end of the buffer.
+        size_t start = size_t(mHead & mMask);
+        size_t first = std::min(space, mBuffer.size() - start);
+        struct iovec iov[2];
+        iov[0].iov_base = mBuffer.data() + start;
+        iov[0].iov_len = first;
+        iov[1].iov_base = mBuffer.data();
+        iov[1].iov_len = space - first;
+        ssize_t n = readv(fd, iov, space > first ? 2 : 1);
+        if(n < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return 0;
+            return -1;
+        }
+        mHead += uint64_t(n);
+        return n;
+    }
+
+    size_t PacketParser::write(const uint8_t *data, size_t len)
+    {
+        size_t space = mBuffer.size() - size_t(mHead - mTail);
+        len = std::min(len, space);
+        size_t start = size_t(mHead & mMask);
+        size_t first = std::min(len, mBuffer.size() - start);
+        memcpy(mBuffer.data() + start, data, first);
+        memcpy(mBuffer.data(), data + first, len - first);
+        mHead += len;
+        return len;
+    }
+
+    PacketView PacketParser::view(uint64_t pos, size_t len) const
+    {
+        size_t start = size_t(pos & mMask);
+        size_t first = std::min(len, mBuffer.size() - start);
+        return {mBuffer.data() + start, first, mBuffer.data(), len - first};
+    }
+
+    PacketParser::CheckT PacketParser::check(uint64_t pos, size_t &header, size_t &len) const
+    {
+        uint64_t available = mHead - pos;
+        uint8_t start = at(pos);
+        if(start == 2) {
+            if(available < 2)
+                return CheckT::Incomplete;
+            header = 2;
+            len = at(pos + 1);
+        } else if(start == 3) {
+            if(available < 3)
+                return CheckT::Incomplete;
+            header = 3;
+            len = size_t(at(pos + 1)) << 8 | at(pos + 2);
+            // Short payloads always use the one byte length.
+            if(len < 256)
+                return CheckT::BadFrame;
+        } else {
+            return CheckT::BadFrame;
+        }
+        if(len == 0 || len > maxPayload())
+            return CheckT::BadFrame;
+        if(available < header + len + 3)
+            return CheckT::Incomplete;
+        uint64_t payload = pos + header;
+        if(at(payload + len + 2) != 3)
+            return CheckT::BadFrame;
+        uint16_t crc = uint16_t(at(payload + len) << 8 | at(payload + len + 1));
+        if(view(payload, len).crc() != crc)
+            return CheckT::BadCrc;
+        return CheckT::Good;
+    }
+
+    bool PacketParser::packetAhead(uint64_t pos) const
+    {
+        for(; pos < mHead; pos++)
+        {
+            size_t header = 0;
+            size_t len = 0;
+            if(check(pos, header, len) == CheckT::Good)
+                return true;
+        }
+        return false;
+    }
+
+    size_t PacketParser::parse(const std::function<void(const PacketView &)> &handler)
+    {
+        size_t found = 0;
+        while(mHead != mTail)
+        {
+            size_t header = 0;
+            size_t len = 0;
+            auto result = check(mTail, header, len);
+            if(result == CheckT::Incomplete) {
+                // After corruption a stray start byte can look like the header of a long packet, and we'd wait for
+                // it to fill. If there's a good packet after it then it wasn't real.
+                if(mSynced || !packetAhead(mTail + 1))
+                    break;
+                result = CheckT::BadFrame;
+            }
+            if(result != CheckT::Good) {
+                if(result == CheckT::BadCrc)
+                    mCrcErrorCount++;
+                else
+                    mSkippedBytes++;
+                mTail++;
+                mSynced = false;
+                continue;
+            }
+            handler(view(mTail + header, len));
+            mTail += header + len + 3;
+            mPacketCount++;
+            mSynced = true;
+            found++;
+        }
+        return found;
+    }
+
+} // multivesc
@@ -0,0 +1,209 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <linux/can/raw.h>
+#include "multivesc/VescSimulator.hh"
+
+namespace multivesc {
+
+    namespace {
+        constexpr unsigned gRxBatch = 64;
+    }
+
+    VescSimulator::VescSimulator(std::string deviceName)
+     : mDeviceName(std::move(deviceName))
+    {}
+
+    VescSimulator::VescSimulator(const json &config)
+     : mDeviceName(config.value("device", std::string("vcan0")))
+    {
+        for(auto &controller : makeSimControllers(config)) {
+            mById[controller->id()] = controller.get();
+            mControllers.push_back(std::move(controller));
+        }
+    }
+
+    VescSimulator::~VescSimulator()
+    {
+        stop();
+    }
+
+    bool VescSimulator::addController(uint8_t id, const json &config)
+    {
+        std::lock_guard lock(mMutex);
+        if(mById[id] != nullptr) {
+            std::cerr << "Simulated controller " << int(id) << " already exists" << std::endl;
+            return false;
+        }
+        auto controller = std::make_unique<SimController>(id);
+        if(!controller->configure(config))
+            return false;
+        mById[id] = controller.get();
+        mControllers.push_back(std::move(controller));
+        return true;
+    }
+
+    bool VescSimulator::start()
+    {
+        if(mSocket >= 0)
+            return false;
+        mSocket = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+        if(mSocket < 0) {
+            perror("socket");
+            return false;
+        }
+        struct ifreq ifr {};
+        strncpy(ifr.ifr_name, mDeviceName.c_str(), IFNAMSIZ - 1);
+        if(ioctl(mSocket, SIOCGIFINDEX, &ifr) < 0) {
+            std::cerr << "No CAN interface " << mDeviceName << std::endl;
+            close(mSocket);
+            mSocket = -1;
+            return false;
+        }
+        struct sockaddr_can addr {};
+        addr.can_family = AF_CAN;
+        addr.can_ifindex = ifr.ifr_ifindex;
+        if(bind(mSocket, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            perror("bind");
+            close(mSocket);
+            mSocket = -1;
+            return false;
+        }
+        mTerminate = false;
+        mThread = std::thread(&VescSimulator::run, this);
+        return true;
+    }
+
+    void VescSimulator::stop()
+    {
+        mTerminate = true;
+        if(mThread.joinable())
+            mThread.join();
+        if(mSocket >= 0) {
+            close(mSocket);
+            mSocket = -1;
+        }
+    }
+
+    void VescSimulator::sendFrames(std::vector<struct can_frame> &frames)
+    {
+        if(mTxIov.size() < frames.size()) {
+            mTxIov.resize(frames.size());
+            mTxMsgs.resize(frames.size());
+        }
+        for(size_t i = 0; i < frames.size(); i++) {
+            mTxIov[i].iov_base = &frames[i];
+            mTxIov[i].iov_len = sizeof(struct can_frame);
+            mTxMsgs[i] = {};
+            mTxMsgs[i].msg_hdr.msg_iov = &mTxIov[i];
+            mTxMsgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        size_t sent = 0;
+        int retries = 0;
+        while(sent < frames.size()) {
+            int ret = sendmmsg(mSocket, &mTxMsgs[sent], unsigned(frames.size() - sent), MSG_DONTWAIT);
+            if(ret > 0) {
+                sent += size_t(ret);
+                retries = 0;
+                continue;
+            }
+            if(ret < 0 && errno == EINTR)
+                continue;
+            // The interface queue is full, give it a moment to drain before giving up on the rest.
+            if(ret < 0 && (errno == ENOBUFS || errno == EAGAIN) && retries++ < 20) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                continue;
+            }
+            break;
+        }
+        mTxFrames += sent;
+        mTxDropped += frames.size() - sent;
+        frames.clear();
+    }
+
+    void VescSimulator::run()
+    {
+        struct can_frame rxFrames[gRxBatch];
+        struct iovec iov[gRxBatch];
+        struct mmsghdr msgs[gRxBatch];
+        for(unsigned i = 0; i < gRxBatch; i++) {
+            iov[i].iov_base = &rxFrames[i];
+            iov[i].iov_len = sizeof(struct can_frame);
+            msgs[i] = {};
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        std::vector<struct can_frame> out;
+        while(!mTerminate) {
+            auto now = std::chrono::steady_clock::now();
+            auto next = now + std::chrono::milliseconds(100);
+            {
+                std::lock_guard lock(mMutex);
+                for(auto &controller : mControllers) {
+                    next = std::min(next, controller->update(now, out));
+                }
+            }
+            sendFrames(out);
+
+            // Wait for commands until the next status frame is due.
+            auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(next - std::chrono::steady_clock::now());
+            struct timespec timeout {};
+            if(wait.count() > 0) {
+                timeout.tv_sec = time_t(wait.count() / 1000000000);
+                timeout.tv_nsec = long(wait.count() % 1000000000);
+            }
+            struct pollfd pfd {mSocket, POLLIN, 0};
+            int ret = ppoll(&pfd, 1, &timeout, nullptr);
+            if(ret <= 0)
+                continue;
+            int count = recvmmsg(mSocket, msgs, gRxBatch, MSG_DONTWAIT, nullptr);
+            if(count <= 0)
+                continue;
+            mRxFrames += uint64_t(count);
+            now = std::chrono::steady_clock::now();
+            {
+                std::lock_guard lock(mMutex);
+                for(int i = 0; i < count; i++) {
+                    const auto &frame = rxFrames[i];
+                    uint8_t dest = frame.can_id & 0xFF;
+                    if(dest == 255) {
+                        for(auto &controller : mControllers)
+                            controller->receive(frame, now, out);
+                    } else if(mById[dest] != nullptr) {
+                        mById[dest]->receive(frame, now, out);
+                    }
+                }
+            }
+            sendFrames(out);
+        }
+    }
+
+    json VescSimulator::state()
+    {
+        std::lock_guard lock(mMutex);
+        json state = json::array();
+        for(auto &controller : mControllers) {
+            state.push_back(controller->state());
+        }
+        return state;
+    }
+
+    json VescSimulator::stats() const
+    {
+        json stats;
+        stats["controllers"] = mControllers.size();
+        stats["rxFrames"] = mRxFrames.load();
+        stats["txFrames"] = mTxFrames.load();
+        stats["txDropped"] = mTxDropped.load();
+        return stats;
+    }
+
+} // multivesc
@@ -0,0 +1,528 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <algorithm>
+#include <nlohmann/json.hpp>
+#include "cxxopts.hpp"
+#include "multivesc/Manager.hh"
+#include "multivesc/BusCan.hh"
+#include "multivesc/VescPacket.hh"
+#include "multivesc/Crc16.hh"
+#include "multivesc/CanCapture.hh"
+#include "multivesc/CandumpLog.hh"
+#include "multivesc/crc.hh"
+
+using json = nlohmann::json;
+
+// Count every allocation made by the process, so each benchmark can report allocations per operation.
+// Nothing else runs while the benchmarks do, so a single counter is enough.
+
+namespace {
+    std::atomic<uint64_t> gAllocations {0};
+
+    void *countedAlloc(std::size_t size, std::size_t align)
+    {
+        gAllocations.fetch_add(1, std::memory_order_relaxed);
+        if(size == 0)
+            size = 1;
+        void *ptr = align <= alignof(std::max_align_t) ? std::malloc(size)
+                                                        : std::aligned_alloc(align, (size + align - 1) / align * align);
+        if(ptr == nullptr)
+            throw std::bad_alloc();
+        return ptr;
+    }
+}
+
+void *operator new(std::size_t size)
+{ return countedAlloc(size, 0); }
+
+void *operator new(std::size_t size, std::align_val_t align)
+{ return countedAlloc(size, std::size_t(align)); }
+
+void operator delete(void *ptr) noexcept
+{ std::free(ptr); }
+
+void operator delete(void *ptr, std::size_t) noexcept
+{ std::free(ptr); }
+
+void operator delete(void *ptr, std::align_val_t) noexcept
+{ std::free(ptr); }
+
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept
+{ std::free(ptr); }
+
+namespace {
+
+    //! CAN bus that encodes and decodes as normal but doesn't touch a socket, with the internals the benchmarks
+    //! drive made public.
+    class BenchCan
+        : public multivesc::BusCan
+    {
+    public:
+        explicit BenchCan(const json &config)
+            : BusCan(config)
+        { prepareReceive(); }
+
+        using BusCan::decode;
+        using BusInterface::statusCallback;
+        using BusInterface::status2Callback;
+        using BusInterface::status3Callback;
+        using BusInterface::status4Callback;
+        using BusInterface::status5Callback;
+        using BusInterface::status6Callback;
+
+        size_t mSent = 0;
+
+    protected:
+        [[nodiscard]] bool isOpen() const override
+        { return true; }
+
+        size_t writeFrames(struct can_frame *frames, size_t count) override
+        {
+            mSent += count;
+            return count;
+        }
+    };
+
+    //! Manager with the update tick exposed, so it can be run without the update thread.
+    class BenchManager
+        : public multivesc::Manager
+    {
+    public:
+        void tick(std::chrono::steady_clock::time_point now)
+        {
+            std::lock_guard lock(mMutex);
+            updateDue(now);
+        }
+
+        [[nodiscard]] std::chrono::steady_clock::duration period() const
+        { return mUpdatePeriod; }
+    };
+
+    //! Make a bus with no limit on the rate commands are sent at.
+    std::shared_ptr<BenchCan> makeBus()
+    {
+        return std::make_shared<BenchCan>(json {{"bitrate", 1000000000}, {"txBudget", 1000.0}});
+    }
+
+    //! Add 'numMotors' motors in RPM mode on 'bus', with ids from 1.
+    void addMotors(BenchManager &manager, const std::string &busName, int numMotors)
+    {
+        for(int i = 0; i < numMotors; i++) {
+            auto motor = std::make_shared<multivesc::Motor>("motor" + std::to_string(i));
+            json config = {
+                {"bus", busName},
+                {"id", i + 1},
+                {"controlMode", "rpm"},
+                {"maxRPMAcceleration", 1000.0},
+                {"minRPM", 500.0},
+                {"driveTimeout", 0.0}
+            };
+            motor->configure(manager, config);
+            motor->setRPM(3000.0f);
+        }
+    }
+
+    struct can_frame makeFrame(uint8_t controllerId, multivesc::CAN_PACKET_ID packet)
+    {
+        struct can_frame frame {};
+        frame.can_id = controllerId | ((uint32_t) packet << 8) | CAN_EFF_FLAG;
+        frame.can_dlc = 8;
+        return frame;
+    }
+
+    //! A status frame of each type, with the values a running motor might send.
+    std::vector<std::pair<std::string, struct can_frame>> statusFrames(uint8_t controllerId)
+    {
+        using namespace multivesc;
+        std::vector<std::pair<std::string, struct can_frame>> frames;
+        int32_t index = 0;
+        auto frame = makeFrame(controllerId, CAN_PACKET_STATUS);
+        buffer_append_float32(frame.data, 3000.0f, 1, &index);
+        buffer_append_float16(frame.data, 1.5f, 10, &index);
+        buffer_append_float16(frame.data, 0.25f, 1000, &index);
+        frames.emplace_back("status1", frame);
+
+        index = 0;
+        frame = makeFrame(controllerId, CAN_PACKET_STATUS_2);
+        buffer_append_float32(frame.data, 1.25f, 10000, &index);
+        buffer_append_float32(frame.data, 0.5f, 10000, &index);
+        frames.emplace_back("status2", frame);
+
+        index = 0;
+        frame = makeFrame(controllerId, CAN_PACKET_STATUS_3);
+        buffer_append_float32(frame.data, 30.0f, 10000, &index);
+        buffer_append_float32(frame.data, 12.0f, 10000, &index);
+        frames.emplace_back("status3", frame);
+
+        index = 0;
+        frame = makeFrame(controllerId, CAN_PACKET_STATUS_4);
+        buffer_append_float16(frame.data, 35.0f, 10, &index);
+        buffer_append_float16(frame.data, 40.0f, 10, &index);
+        buffer_append_float16(frame.data, 1.0f, 10, &index);
+        buffer_append_float16(frame.data, 90.0f, 50, &index);
+        frames.emplace_back("status4", frame);
+
+        index = 0;
+        frame = makeFrame(controllerId, CAN_PACKET_STATUS_5);
+        buffer_append_float32(frame.data, 123456.0f, 6, &index);
+        buffer_append_float16(frame.data, 24.0f, 10, &index);
+        frame.can_dlc = 6;
+        frames.emplace_back("status5", frame);
+
+        index = 0;
+        frame = makeFrame(controllerId, CAN_PACKET_STATUS_6);
+        buffer_append_float16(frame.data, 0.5f, 1000, &index);
+        buffer_append_float16(frame.data, 1.0f, 1000, &index);
+        buffer_append_float16(frame.data, 1.5f, 1000, &index);
+        buffer_append_float16(frame.data, 0.75f, 1000, &index);
+        frames.emplace_back("status6", frame);
+        return frames;
+    }
+
+    //! Runs the benchmarks and collects the results.
+    class Suite
+    {
+    public:
+        Suite(int iterations, std::string filter)
+            : mIterations(iterations),
+              mFilter(std::move(filter))
+        {}
+
+        //! Check if a benchmark is to be run.
+        [[nodiscard]] bool selected(const std::string &name) const
+        { return mFilter.empty() || name.find(mFilter) != std::string::npos; }
+
+        //! Time 'op', called with the operation number, adding the result under 'name'.
+        //! 'opsPerCall' is the number of operations each call does, 'extra' is added to the result.
+        template<typename FuncT>
+        void run(const std::string &name, FuncT op, int iterations = 0, int opsPerCall = 1, json extra = json::object())
+        {
+            if(!selected(name))
+                return;
+            if(iterations <= 0)
+                iterations = mIterations;
+            // Warm up so buffers are allocated and caches are hot.
+            for(int i = 0; i < std::max(iterations / 10, 1); i++) {
+                op(i);
+            }
+            uint64_t allocations = gAllocations.load(std::memory_order_relaxed);
+            auto start = std::chrono::steady_clock::now();
+            for(int i = 0; i < iterations; i++) {
+                op(i);
+            }
+            auto end = std::chrono::steady_clock::now();
+            allocations = gAllocations.load(std::memory_order_relaxed) - allocations;
+
+            double ops = double(iterations) * opsPerCall;
+            add(name, std::chrono::duration<double, std::nano>(end - start).count() / ops,
+                double(allocations) / ops, uint64_t(ops), std::move(extra));
+        }
+
+        //! Add a result timed elsewhere.
+        void add(const std::string &name, double nsPerOp, double allocsPerOp, uint64_t ops, json extra = json::object())
+        {
+            extra["name"] = name;
+            extra["ops"] = ops;
+            extra["nsPerOp"] = nsPerOp;
+            extra["allocsPerOp"] = allocsPerOp;
+            mResults.push_back(std::move(extra));
+        }
+
+        [[nodiscard]] const json &results() const
+        { return mResults; }
+
+        [[nodiscard]] int iterations() const
+        { return mIterations; }
+
+    private:
+        int mIterations;
+        std::string mFilter;
+        json mResults = json::array();
+    };
+
+    //! Decoding of each packet type a host receives, and the motor callbacks status frames lead to.
+    void benchDecode(Suite &suite)
+    {
+        BenchManager manager;
+        auto bus = makeBus();
+        manager.addBus("bench", bus);
+        addMotors(manager, "bench", 2);
+        // The motor with id 1 has no callback, the one with id 2 has one that does as little as possible.
+        uint64_t calls = 0;
+        manager.getMotor("motor1")->setCallback([&calls](multivesc::MotorValuesT, float) { calls++; });
+
+        for(auto &item : statusFrames(1)) {
+            const auto &frame = item.second;
+            suite.run("decode." + item.first, [&](int) { bus->decode(frame); });
+        }
+        auto pong = makeFrame(254, multivesc::CAN_PACKET_PONG);
+        pong.data[0] = 1;
+        pong.can_dlc = 1;
+        suite.run("decode.pong", [&](int) { bus->decode(pong); });
+
+        // Replies with no request waiting for them, so only the transport is timed.
+        for(size_t len : {5, 100, 1000}) {
+            std::vector<uint8_t> payload(len);
+            payload[0] = multivesc::COMM_GET_MCCONF;
+            for(size_t i = 1; i < len; i++) {
+                payload[i] = uint8_t(i * 7);
+            }
+            std::vector<struct can_frame> frames;
+            multivesc::BusCan::encodePacketFrames(254, 1, payload.data(), payload.size(), frames, 1);
+            suite.run("decode.packet" + std::to_string(len), [&](int) {
+                for(const auto &frame : frames) {
+                    bus->decode(frame);
+                }
+            }, std::max(suite.iterations() / int(frames.size()), 10), 1, {{"frames", frames.size()}});
+        }
+
+        auto noMotor = statusFrames(100)[0].second;
+        suite.run("decode.status1.noMotor", [&](int) { bus->decode(noMotor); });
+
+        for(uint8_t id : {1, 2}) {
+            std::string suffix = id == 1 ? "" : ".callback";
+            suite.run("status1Callback" + suffix, [&](int i) { bus->statusCallback(id, float(i), 1.5f, 0.25f); });
+            suite.run("status2Callback" + suffix, [&](int i) { bus->status2Callback(id, float(i), 0.5f); });
+            suite.run("status3Callback" + suffix, [&](int i) { bus->status3Callback(id, float(i), 12.0f); });
+            suite.run("status4Callback" + suffix, [&](int i) { bus->status4Callback(id, 35.0f, 40.0f, float(i), 90.0f); });
+            suite.run("status5Callback" + suffix, [&](int i) { bus->status5Callback(id, float(i), 24.0f); });
+            suite.run("status6Callback" + suffix, [&](int i) { bus->status6Callback(id, float(i), 1.0f, 1.5f, 0.75f); });
+        }
+    }
+
+    //! Encoding commands, as frames on CAN and as serial packets.
+    void benchEncode(Suite &suite)
+    {
+        auto bus = makeBus();
+        suite.run("encode.setRPM", [&](int i) { bus->setRPM(1, float(i)); });
+        suite.run("encode.setCurrent", [&](int i) { bus->setCurrent(1, float(i & 0xFF)); });
+
+        for(size_t count : {16, 254}) {
+            std::vector<multivesc::DriveCommand> commands(count);
+            for(size_t i = 0; i < count; i++) {
+                commands[i] = {uint8_t(i + 1), multivesc::MotorDriveT::RPM, 3000.0f};
+            }
+            suite.run("encode.driveCommands" + std::to_string(count), [&](int i) {
+                commands[0].value = float(i);
+                bus->sendDriveCommands(commands.data(), commands.size());
+            }, std::max(suite.iterations() / int(count), 10), int(count));
+        }
+
+        std::vector<uint8_t> payload(400);
+        std::vector<struct can_frame> frames;
+        suite.run("encode.packetFrames400", [&](int i) {
+            payload[0] = uint8_t(i);
+            multivesc::BusCan::encodePacketFrames(1, 254, payload.data(), payload.size(), frames);
+        });
+
+        uint8_t command[5] = {multivesc::COMM_SET_RPM, 0, 0, 0x0B, 0xB8};
+        uint8_t out[multivesc::packetSize(sizeof(command))];
+        suite.run("encode.serialSetRPM", [&](int i) {
+            command[4] = uint8_t(i);
+            multivesc::encodePacket(command, sizeof(command), out);
+        });
+    }
+
+    //! Decoding the frames received in a capture or candump log, for a real mix of traffic.
+    bool benchCapture(Suite &suite, const std::string &filename)
+    {
+        std::vector<struct can_frame> frames;
+        int maxId = 0;
+        auto add = [&](const multivesc::CaptureRecordT &record) {
+            if(record.direction != multivesc::CaptureDirectionT::RX)
+                return;
+            frames.push_back(multivesc::captureFrame(record));
+            maxId = std::max(maxId, int(frames.back().can_id & 0xFF));
+        };
+        if(multivesc::CaptureReader::isCapture(filename)) {
+            multivesc::CaptureReader reader;
+            if(!reader.open(filename))
+                return false;
+            for(size_t i = 0; i < reader.size(); i++)
+                add(reader[i]);
+        } else {
+            multivesc::CandumpReader log;
+            if(!log.open(filename))
+                return false;
+            multivesc::CaptureRecordT record;
+            while(log.next(record))
+                add(record);
+        }
+        if(frames.empty()) {
+            std::cerr << filename << " has no received frames" << std::endl;
+            return false;
+        }
+        BenchManager manager;
+        auto bus = makeBus();
+        manager.addBus("bench", bus);
+        addMotors(manager, "bench", std::min(maxId, 254));
+        int numFrames = int(frames.size());
+        suite.run("decode.capture", [&](int) {
+            for(const auto &frame : frames)
+                bus->decode(frame);
+        }, std::max(suite.iterations() / numFrames, 10), numFrames, {{"file", filename}, {"frames", frames.size()}});
+        return true;
+    }
+
+    //! Looking up motors on a bus by id and in the manager by name.
+    void benchLookup(Suite &suite)
+    {
+        BenchManager manager;
+        auto bus = makeBus();
+        manager.addBus("bench", bus);
+        addMotors(manager, "bench", 254);
+        suite.run("bus.getMotor", [&](int i) { (void) bus->getMotor(uint8_t(i % 254 + 1)); });
+        suite.run("manager.getMotor.first", [&](int) { (void) manager.getMotor("motor0"); });
+        suite.run("manager.getMotor.last", [&](int) { (void) manager.getMotor("motor253"); });
+        suite.run("manager.getMotor.missing", [&](int) { (void) manager.getMotor("nothing"); });
+    }
+
+    //! A manager update tick with 'numMotors' motors in RPM mode, all due each tick.
+    void benchTick(Suite &suite, int numMotors)
+    {
+        std::string name = "manager.tick" + std::to_string(numMotors);
+        if(!suite.selected(name))
+            return;
+        BenchManager manager;
+        auto bus = makeBus();
+        manager.addBus("bench", bus);
+        addMotors(manager, "bench", numMotors);
+        auto period = manager.period();
+        auto now = std::chrono::steady_clock::now();
+        size_t sentBefore = 0;
+        suite.run(name, [&](int i) {
+            if(i == 0)
+                sentBefore = bus->mSent;
+            now += period;
+            manager.tick(now);
+        }, std::max(suite.iterations() / numMotors, 100), 1, {{"motors", numMotors}});
+        if(bus->mSent == sentBefore) {
+            std::cerr << "No commands sent by " << name << std::endl;
+        }
+    }
+
+    //! Time a CRC function over a buffer.
+    //! @return Time per call in nanoseconds.
+    template<typename FuncT>
+    double benchCrc(const std::vector<uint8_t> &data, int iterations, FuncT func, uint16_t &result)
+    {
+        uint16_t sum = 0;
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < iterations; i++) {
+            // Chain the results and hide the buffer contents from the optimiser so the calls can't be hoisted.
+            sum ^= func(data.data(), data.size(), sum);
+            asm volatile("" : "+r"(sum) : : "memory");
+        }
+        auto end = std::chrono::steady_clock::now();
+        result = func(data.data(), data.size(), 0);
+        return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+    }
+
+    //! Compare the CRC implementations on a buffer of 'size' bytes.
+    void benchCrcSize(Suite &suite, size_t size, int iterations)
+    {
+        std::vector<uint8_t> data(size);
+        for(size_t i = 0; i < size; i++) {
+            data[i] = uint8_t(i * 131 + (i >> 8));
+        }
+        static const CRC::Table<crcpp_uint16, 16> table(CRC::CRC_16_XMODEM());
+        uint16_t reference = CRC::Calculate(data.data(), data.size(), table, uint16_t(0));
+
+        auto report = [&](const char *impl, auto func) {
+            std::string name = std::string("crc.") + impl + "." + std::to_string(size);
+            if(!suite.selected(name))
+                return;
+            uint16_t result = 0;
+            uint64_t allocations = gAllocations.load(std::memory_order_relaxed);
+            double ns = benchCrc(data, iterations, func, result);
+            allocations = gAllocations.load(std::memory_order_relaxed) - allocations;
+            suite.add(name, ns, double(allocations) / iterations, uint64_t(iterations), {
+                {"bytes", size},
+                {"gbPerSecond", double(size) / ns},
+                {"match", result == reference}
+            });
+        };
+        report("crc++", [](const uint8_t *d, size_t len, uint16_t crc) {
+            return CRC::Calculate(d, len, table, crc);
+        });
+        report("bytewise", multivesc::crc16Bytewise);
+        report("slice8", multivesc::crc16Slice8);
+        if(multivesc::crc16ClmulSupported()) {
+            report("clmul", multivesc::crc16Clmul);
+        }
+        report("auto", multivesc::crc16);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = 100000;
+    std::string filter;
+    std::string output;
+    std::string label;
+    std::string capture;
+    try {
+        cxxopts::Options options(argv[0], " - benchmarks, results are written as JSON");
+
+        options.add_options()
+            ("h,help", "Print help")
+            ("i,iterations", "Iterations per benchmark", cxxopts::value<int>(iterations)->default_value("100000"))
+            ("f,filter", "Only run benchmarks with names containing this", cxxopts::value<std::string>(filter))
+            ("o,output", "File to write the results to, otherwise stdout", cxxopts::value<std::string>(output))
+            ("l,label", "Label for the results, such as the library version", cxxopts::value<std::string>(label))
+            ("c,capture", "Also time decoding the frames received in this capture file", cxxopts::value<std::string>(capture))
+            ;
+
+        auto result = options.parse(argc, argv);
+
+        if (result.count("help")) {
+            std::cout << options.help() << std::endl;
+            exit(0);
+        }
+
+    } catch (const std::exception& e)
+    {
+        std::cout << "error parsing options: " << e.what() << std::endl;
+        exit(1);
+    }
+
+    Suite suite(std::max(iterations, 1), filter);
+    benchDecode(suite);
+    if(!capture.empty() && !benchCapture(suite, capture))
+        return 1;
+    benchEncode(suite);
+    benchLookup(suite);
+    for(int numMotors : {1, 16, 64, 254}) {
+        benchTick(suite, numMotors);
+    }
+    // A short command packet and a firmware image.
+    benchCrcSize(suite, 5, iterations * 10);
+    benchCrcSize(suite, 400 * 1024, std::max(iterations / 1000, 10));
+
+    json report;
+    report["label"] = label;
+    report["iterations"] = iterations;
+    report["compiler"] = __VERSION__;
+    report["results"] = suite.results();
+    if(output.empty()) {
+        std::cout << report.dump(2) << std::endl;
+        return 0;
+    }
+    std::ofstream file(output);
+    file << report.dump(2) << std::endl;
+    if(!file) {
+        std::cerr << "Failed to write " << output << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -1,6 +1,8 @@
 #include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
 #include <pybind11_json/pybind11_json.hpp>
 #include "multivesc/Manager.hh"
+#include "multivesc/TelemetryColumn.hh"
 
 #define STRINGIFY(x) #x
 #define MACRO_STRINGIFY(x) STRINGIFY(x)
@@ -29,6 +31,63 @@ PYBIND11_MODULE(pymultivesc, m) {
      .def("verbose", &multivesc::Manager::verbose)
      .def("motor", &multivesc::Manager::getMotor)
      .def("motors", &multivesc::Manager::motors)
+     .def("set_update_rate", &multivesc::Manager::setUpdateRate)
+     .def("update_rate", &multivesc::Manager::updateRate)
+     .def("start_trajectories", [](multivesc::Manager &manager, const std::map<std::string, std::shared_ptr<multivesc::Trajectory>> &trajectories, float startDelay) {
+            std::map<std::string, std::shared_ptr<const multivesc::Trajectory>> constTrajectories(trajectories.begin(), trajectories.end());
+            return manager.startTrajectories(constTrajectories, startDelay);
+        }, py::arg("trajectories"), py::arg("start_delay") = 0.0f)
+     .def("stop_trajectories", &multivesc::Manager::stopTrajectories)
+     .def("bus_stats", &multivesc::Manager::busStats)
+     .def("latency_stats", &multivesc::Manager::latencyStats)
+     .def("start_telemetry_log", &multivesc::Manager::startTelemetryLog)
+     .def("stop_telemetry_log", &multivesc::Manager::stopTelemetryLog)
+     .def("telemetry_log_stats", &multivesc::Manager::telemetryLogStats)
+     .def("set_phase_lock", &multivesc::Manager::setPhaseLock, py::arg("enable"), py::arg("guard") = 0.0005f)
+     .def("phase_lock", &multivesc::Manager::phaseLock)
+     .def("read_controller_configs", &multivesc::Manager::readControllerConfigs, py::arg("type") = "mcconf", py::arg("use_cache") = true)
+     .def("write_controller_configs", &multivesc::Manager::writeControllerConfigs, py::arg("type"), py::arg("configs"))
+     .def("set_config_cache_file", &multivesc::Manager::setConfigCacheFile)
+     .def("configure_can_status", &multivesc::Manager::configureCanStatus)
+     .def("scan_buses", &multivesc::Manager::scanBuses, py::arg("all_ids") = false, py::arg("timeout") = 0.1f)
+    ;
+
+    py::class_<multivesc::Trajectory, std::shared_ptr<multivesc::Trajectory>>(m, "Trajectory")
+    .def(py::init([](const std::string &mode, float startValue) {
+            return std::make_shared<multivesc::Trajectory>(multivesc::driveTypeFromString(mode), startValue);
+        }), py::arg("mode") = "rpm", py::arg("start_value") = 0.0f)
+    .def("append_s_curve", &multivesc::Trajectory::appendSCurve)
+    .def("append_move", &multivesc::Trajectory::appendMove)
+    .def("append_linear", &multivesc::Trajectory::appendLinear)
+    .def("append_hold", &multivesc::Trajectory::appendHold)
+    .def("duration", &multivesc::Trajectory::duration)
+    .def("evaluate", py::overload_cast<double>(&multivesc::Trajectory::evaluate, py::const_))
+    ;
+
+    py::class_<multivesc::LatencyHistogram>(m, "LatencyHistogram")
+    .def(py::init<>())
+    .def("count", &multivesc::LatencyHistogram::count)
+    .def("percentile", &multivesc::LatencyHistogram::percentile)
+    .def("min", &multivesc::LatencyHistogram::min)
+    .def("max", &multivesc::LatencyHistogram::max)
+    .def("mean", &multivesc::LatencyHistogram::mean)
+    .def("buckets", &multivesc::LatencyHistogram::buckets)
+    .def("summary", &multivesc::LatencyHistogram::summary)
+    ;
+
+    py::class_<multivesc::TelemetryColumnReader>(m, "TelemetryColumnReader")
+    .def(py::init<>())
+    .def("open", &multivesc::TelemetryColumnReader::open)
+    .def("refresh", &multivesc::TelemetryColumnReader::refresh)
+    .def("close", &multivesc::TelemetryColumnReader::close)
+    .def("value_type", &multivesc::TelemetryColumnReader::valueType)
+    .def("sample_count", &multivesc::TelemetryColumnReader::sampleCount)
+    .def("read", [](const multivesc::TelemetryColumnReader &reader, int64_t fromUs, int64_t toUs) {
+            std::vector<int64_t> timesUs;
+            std::vector<float> values;
+            reader.read(timesUs, values, fromUs, toUs);
+            return std::make_pair(timesUs, values);
+        }, py::arg("from_us") = std::numeric_limits<int64_t>::min(), py::arg("to_us") = std::numeric_limits<int64_t>::max())
     ;
 
     py::class_<multivesc::Motor, std::shared_ptr<multivesc::Motor>>(m, "Motor")
@@ -52,6 +111,46 @@ PYBIND11_MODULE(pymultivesc, m) {
     .def("temp_motor", &multivesc::Motor::tempMotor)
     .def("vin", &multivesc::Motor::vIn)
     .def("tachometer", &multivesc::Motor::tachometer)
+    .def("trajectory_active", &multivesc::Motor::trajectoryActive)
+    .def("clear_trajectory", &multivesc::Motor::clearTrajectory)
+    .def("set_interpolation", [](multivesc::Motor &motor, const std::string &mode, float horizon) {
+            motor.setInterpolation(multivesc::interpolationFromString(mode), horizon);
+        }, py::arg("mode"), py::arg("horizon") = 0.0f)
+    .def("set_update_rate", &multivesc::Motor::setUpdateRate)
+    .def("update_rate", &multivesc::Motor::updateRate)
+    .def("set_drive_timeout", &multivesc::Motor::setDriveTimeout)
+    .def("drive_timeout", &multivesc::Motor::driveTimeout)
+    .def("drive_timeout_count", &multivesc::Motor::driveTimeoutCount)
+    .def("status_latency", &multivesc::Motor::statusLatency)
+    .def("status_latency_max", &multivesc::Motor::statusLatencyMax)
+    .def("enable_latency_trace", &multivesc::Motor::enableLatencyTrace,
+         py::arg("min_step") = 0.0f, py::arg("fraction") = 0.2f, py::arg("timeout") = 1.0f)
+    .def("disable_latency_trace", &multivesc::Motor::disableLatencyTrace)
+    .def("latency_trace_enabled", &multivesc::Motor::latencyTraceEnabled)
+    .def("response_latency", &multivesc::Motor::responseLatency)
+    .def("setpoint_latency", &multivesc::Motor::setpointLatency)
+    .def("latency_stats", &multivesc::Motor::latencyStats)
+    .def("clear_latency_stats", &multivesc::Motor::clearLatencyStats)
+    .def("status_period", &multivesc::Motor::statusPeriod)
+    .def("clear_reactive_control", &multivesc::Motor::clearReactiveControl)
+    .def("reactive_control_active", &multivesc::Motor::reactiveControlActive)
+    .def("reactive_run_count", &multivesc::Motor::reactiveRunCount)
+    .def("reactive_overrun_count", &multivesc::Motor::reactiveOverrunCount)
+    .def("reactive_max_time", &multivesc::Motor::reactiveMaxTime)
+    .def("set_enabled", &multivesc::Motor::setEnabled)
+    .def("enabled", &multivesc::Motor::enabled)
+    .def("set_telemetry_rate", [](multivesc::Motor &motor, const std::string &value, float hz) {
+            multivesc::MotorValuesT type;
+            if(!multivesc::valueTypeFromString(value, type))
+                throw std::invalid_argument("Unknown value " + value);
+            motor.setTelemetryRate(type, hz);
+        })
+    .def("telemetry_rate", [](multivesc::Motor &motor, const std::string &value) {
+            multivesc::MotorValuesT type;
+            if(!multivesc::valueTypeFromString(value, type))
+                throw std::invalid_argument("Unknown value " + value);
+            return motor.telemetryRate(type);
+        })
     ;
 
 
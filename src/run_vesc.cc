@@ -10,6 +10,9 @@
 #include <csignal>
 #include "cxxopts.hpp"
 #include "multivesc/Manager.hh"
+#include "multivesc/FirmwareUpdater.hh"
+#include "multivesc/CanCapture.hh"
+#include "multivesc/CandumpLog.hh"
 
 using json = nlohmann::json;
 
@@ -21,6 +24,142 @@ void signalHandler(int signum)
 }
 
 
+//! Find the config for a bus by name, or the only bus if no name is given.
+bool findBusConfig(const json &config, const std::string &busName, json &busConfig)
+{
+    if(!config.contains("buses") || config["buses"].empty()) {
+        std::cerr << "No buses in config" << std::endl;
+        return false;
+    }
+    if(busName.empty()) {
+        if(config["buses"].size() != 1) {
+            std::cerr << "Config has more than one bus, choose one with --bus" << std::endl;
+            return false;
+        }
+        busConfig = config["buses"].begin().value();
+        return true;
+    }
+    if(!config["buses"].contains(busName)) {
+        std::cerr << "No bus " << busName << " in config" << std::endl;
+        return false;
+    }
+    busConfig = config["buses"][busName];
+    return true;
+}
+
+//! Upload firmware to controllers, without setting up any motors.
+int runFirmware(const json &config, const std::string &busName, const std::vector<int> &ids,
+                const std::string &imageFile, const std::string &resumeFile, bool jump, bool verbose)
+{
+    json busConfig;
+    if(!findBusConfig(config, busName, busConfig))
+        return 1;
+    if(ids.empty()) {
+        std::cerr << "No controller ids given, use --ids" << std::endl;
+        return 1;
+    }
+    auto bus = multivesc::Manager::createBus(busConfig);
+    if(!bus || !bus->open()) {
+        std::cerr << "Failed to open bus" << std::endl;
+        return 1;
+    }
+    bus->setVerbose(verbose);
+    multivesc::FirmwareUpdater updater(bus);
+    if(!updater.loadImage(imageFile))
+        return 1;
+    updater.setResumeFile(resumeFile);
+    size_t lastPercent = 0;
+    updater.setProgressCallback([&lastPercent, &ids](uint8_t id, size_t done, size_t total) {
+        // Report the progress of the first controller, they all go at about the same rate.
+        size_t percent = done * 100 / total;
+        if(id == ids.front() && percent >= lastPercent + 10) {
+            lastPercent = percent;
+            std::cout << percent << "%" << std::endl;
+        }
+    });
+    std::vector<uint8_t> controllerIds(ids.begin(), ids.end());
+    bool ok = updater.upload(controllerIds, jump);
+    std::cout << updater.results().dump(2) << std::endl;
+    bus->stop();
+    return ok ? 0 : 1;
+}
+
+//! Convert between candump logs and capture files.
+//! The input format is found from the file, the output is the other one unless 'format' is given.
+int runConvert(const std::string &inputFile, const std::string &outputFile, std::string format,
+               const std::string &interface)
+{
+    if(inputFile.empty() || outputFile.empty()) {
+        std::cerr << "Give the files to convert with --input and --output" << std::endl;
+        return 1;
+    }
+    bool fromCapture = inputFile != "-" && multivesc::CaptureReader::isCapture(inputFile);
+    if(format.empty())
+        format = fromCapture ? "candump" : "capture";
+    if(format != "candump" && format != "capture") {
+        std::cerr << "Unknown format " << format << ", use 'candump' or 'capture'" << std::endl;
+        return 1;
+    }
+
+    // Both formats are streamed, so files of any size can be converted.
+    multivesc::CaptureReader capture;
+    multivesc::CandumpReader log;
+    size_t next = 0;
+    if(fromCapture) {
+        if(!capture.open(inputFile))
+            return 1;
+    } else {
+        // When reading a log the interface picks which frames to keep.
+        log.setInterface(interface);
+        if(!log.open(inputFile))
+            return 1;
+    }
+    auto read = [&](multivesc::CaptureRecordT &record) {
+        if(!fromCapture)
+            return log.next(record);
+        if(next >= capture.size())
+            return false;
+        record = capture[next++];
+        return true;
+    };
+
+    multivesc::CaptureRecordT record;
+    uint64_t count = 0;
+    if(format == "capture") {
+        multivesc::CaptureWriter writer;
+        writer.setBlocking(true);
+        if(!writer.open(outputFile))
+            return 1;
+        while(read(record)) {
+            writer.append(record);
+            count++;
+        }
+        writer.close();
+        if(writer.recordCount() != count) {
+            std::cerr << "Only " << writer.recordCount() << " of " << count << " frames were written" << std::endl;
+            return 1;
+        }
+    } else {
+        multivesc::CandumpWriter writer;
+        if(!writer.open(outputFile, interface.empty() ? "can0" : interface))
+            return 1;
+        bool ok = true;
+        while(ok && read(record)) {
+            ok = writer.write(record);
+            count++;
+        }
+        if(!writer.close() || !ok) {
+            std::cerr << "Failed to write " << outputFile << std::endl;
+            return 1;
+        }
+    }
+    std::cerr << "Converted " << count << " frames";
+    if(!fromCapture && log.skippedCount() > 0)
+        std::cerr << ", skipped " << log.skippedCount() << " lines";
+    std::cerr << std::endl;
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     using namespace std::chrono_literals;
@@ -30,11 +169,21 @@ int main(int argc, char *argv[])
     std::string deviceName = "can0";
     std::string configFileName = "config.json";
     bool verbose = false;
+    std::string command = "run";
+    std::string busName;
+    std::string imageFile;
+    std::string resumeFile;
+    std::vector<int> ids;
+    bool noJump = false;
+    std::string inputFile;
+    std::string outputFile;
+    std::string format;
+    std::string interface;
     try {
         cxxopts::Options options(argv[0], " - command line options");
 
         options
-            .positional_help("[optional args]")
+            .positional_help("[run|firmware|convert]")
             .show_positional_help();
 
         options.add_options()
@@ -42,7 +191,18 @@ int main(int argc, char *argv[])
             ("d,device", "CAN device name", cxxopts::value<std::string>(deviceName)->default_value("can0"))
             ("c,config", "Config file", cxxopts::value<std::string>(configFileName)->default_value("config.json"))
             ("v,verbose", "Verbose output", cxxopts::value<bool>(verbose))
+            ("command", "Command, 'run' to drive the motors, 'firmware' to upload firmware or 'convert' to convert bus logs", cxxopts::value<std::string>(command)->default_value("run"))
+            ("b,bus", "Bus from the config to use for firmware upload", cxxopts::value<std::string>(busName))
+            ("i,ids", "Controller ids for firmware upload", cxxopts::value<std::vector<int>>(ids))
+            ("f,image", "Firmware image file", cxxopts::value<std::string>(imageFile))
+            ("r,resume", "File to save upload progress to, so it can be resumed", cxxopts::value<std::string>(resumeFile))
+            ("no-jump", "Don't install the firmware after uploading it", cxxopts::value<bool>(noJump))
+            ("input", "Capture file or candump log to convert, '-' for stdin", cxxopts::value<std::string>(inputFile))
+            ("output", "File to convert to, '-' for stdout", cxxopts::value<std::string>(outputFile))
+            ("format", "Format to convert to, 'candump' or 'capture'", cxxopts::value<std::string>(format))
+            ("interface", "CAN interface name to write in candump logs, or to keep when reading them", cxxopts::value<std::string>(interface))
             ;
+        options.parse_positional({"command"});
 
         auto result = options.parse(argc, argv);
 
@@ -57,6 +217,11 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    // Converting doesn't need a config.
+    if(command == "convert") {
+        return runConvert(inputFile, outputFile, format, interface);
+    }
+
     // Open config file
     std::ifstream configFile(configFileName);
     if(!configFile.is_open()) {
@@ -67,6 +232,14 @@ int main(int argc, char *argv[])
     // Load config file, throw exception if invalid but allow comments
     json config = json::parse(configFile, nullptr, true, true);
 
+    if(command == "firmware") {
+        return runFirmware(config, busName, ids, imageFile, resumeFile, !noJump, verbose);
+    }
+    if(command != "run") {
+        std::cerr << "Unknown command " << command << std::endl;
+        return 1;
+    }
+
     std::cout << "deviceName: " << deviceName << std::endl;
     std::cout << "verbose: " << verbose << std::endl;
 
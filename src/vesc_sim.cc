@@ -0,0 +1,108 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <csignal>
+#include <nlohmann/json.hpp>
+#include "cxxopts.hpp"
+#include "multivesc/VescSimulator.hh"
+
+using json = nlohmann::json;
+
+bool gTerminate = false;
+
+void signalHandler(int signum)
+{
+    gTerminate = true;
+}
+
+int main(int argc, char *argv[])
+{
+    signal(SIGINT, signalHandler);
+
+    std::string deviceName = "vcan0";
+    std::string configFileName;
+    int count = 1;
+    int firstId = 1;
+    std::vector<int> ids;
+    float statsPeriod = 1.0f;
+    bool showState = false;
+    json config = json::object();
+    try {
+        cxxopts::Options options(argv[0], " - simulate VESC controllers on a CAN interface");
+
+        options.add_options()
+            ("h,help", "Print help")
+            ("d,device", "CAN device name", cxxopts::value<std::string>(deviceName)->default_value("vcan0"))
+            ("c,config", "Simulator config file", cxxopts::value<std::string>(configFileName))
+            ("n,count", "Number of controllers", cxxopts::value<int>(count)->default_value("1"))
+            ("first-id", "Id of the first controller", cxxopts::value<int>(firstId)->default_value("1"))
+            ("i,ids", "Controller ids, instead of count and first id", cxxopts::value<std::vector<int>>(ids))
+            ("s,stats", "Seconds between printing statistics, 0 for none", cxxopts::value<float>(statsPeriod)->default_value("1"))
+            ("state", "Print the state of each controller with the statistics", cxxopts::value<bool>(showState))
+            ;
+
+        auto result = options.parse(argc, argv);
+
+        if (result.count("help")) {
+            std::cout << options.help() << std::endl;
+            exit(0);
+        }
+
+        if(!configFileName.empty()) {
+            std::ifstream configFile(configFileName);
+            if(!configFile.is_open()) {
+                std::cerr << "Failed to open config file" << std::endl;
+                return 1;
+            }
+            config = json::parse(configFile, nullptr, true, true);
+        }
+        // The command line overrides the config file.
+        if(result.count("device") || !config.contains("device"))
+            config["device"] = deviceName;
+        if(!ids.empty()) {
+            config["ids"] = ids;
+        } else if(result.count("count") || result.count("first-id") || !config.contains("ids")) {
+            config.erase("ids");
+            config["count"] = count;
+            config["firstId"] = firstId;
+        }
+    } catch (const std::exception& e)
+    {
+        std::cout << "error parsing options: " << e.what() << std::endl;
+        exit(1);
+    }
+
+    multivesc::VescSimulator simulator(config);
+    if(simulator.controllerCount() == 0) {
+        std::cerr << "No controllers to simulate" << std::endl;
+        return 1;
+    }
+    if(!simulator.start()) {
+        std::cerr << "Failed to start simulator on " << config["device"].get<std::string>() << std::endl;
+        return 1;
+    }
+    std::cout << "Simulating " << simulator.controllerCount() << " controllers on " << config["device"].get<std::string>() << std::endl;
+
+    auto nextStats = std::chrono::steady_clock::now();
+    while(!gTerminate) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if(statsPeriod <= 0)
+            continue;
+        auto now = std::chrono::steady_clock::now();
+        if(now < nextStats)
+            continue;
+        nextStats = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(statsPeriod));
+        std::cout << simulator.stats().dump() << std::endl;
+        if(showState)
+            std::cout << simulator.state().dump() << std::endl;
+    }
+
+    std::cout << "Exiting..." << std::endl;
+    simulator.stop();
+    return 0;
+}
@@ -0,0 +1,39 @@
+//
+// Created by charles on 18/10/26.
+//
+
+#ifndef MULTIVESC_TESTCHECK_HH
+#define MULTIVESC_TESTCHECK_HH
+
+#include <iostream>
+#include <string>
+
+namespace multivesc::test {
+
+    //! Number of checks that have failed.
+    inline int gFailures = 0;
+
+    //! Report a check that failed, and carry on so all the failures are seen.
+    inline void check(bool ok, const std::string &what)
+    {
+        if(!ok) {
+            std::cerr << "FAILED: " << what << std::endl;
+            gFailures++;
+        }
+    }
+
+    //! Report how the checks went.
+    //! @return Exit code for main().
+    inline int checkSummary()
+    {
+        if(gFailures > 0) {
+            std::cerr << gFailures << " checks failed" << std::endl;
+            return 1;
+        }
+        std::cout << "All checks passed" << std::endl;
+        return 0;
+    }
+
+} // multivesc::test
+
+#endif //MULTIVESC_TESTCHECK_HH
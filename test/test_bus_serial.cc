@@ -0,0 +1,322 @@
+//
+// Created by charles on 18/10/26.
+//
+
+// Tests the packet parser, and BusSerial against a stand-in controller on a pseudo-terminal.
+
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include "multivesc/Manager.hh"
+#include "multivesc/BusSerial.hh"
+#include "multivesc/VescPacket.hh"
+#include "multivesc/FirmwareUpdater.hh"
+#include "TestCheck.hh"
+
+using namespace multivesc;
+using namespace multivesc::test;
+
+namespace {
+    std::vector<uint8_t> framed(const std::vector<uint8_t> &payload)
+    {
+        std::vector<uint8_t> out;
+        appendPacket(out, payload.data(), payload.size());
+        return out;
+    }
+
+    //! Payload long enough to need the two byte length.
+    std::vector<uint8_t> longPayload()
+    {
+        std::vector<uint8_t> payload(300);
+        payload[0] = COMM_GET_MCCONF;
+        for(size_t i = 1; i < payload.size(); i++)
+            payload[i] = uint8_t(i * 7);
+        return payload;
+    }
+
+    void testParser()
+    {
+        PacketParser parser(1024);
+        std::vector<std::vector<uint8_t>> found;
+        auto handler = [&](const PacketView &packet) {
+            std::vector<uint8_t> payload(packet.size());
+            packet.copy(0, payload.data(), payload.size());
+            found.push_back(std::move(payload));
+        };
+        std::vector<uint8_t> alive {COMM_ALIVE};
+
+        // Garbage, including bytes that look like start bytes, before a good packet.
+        std::vector<uint8_t> stream {0x55, 0x02, 0xff, 0x03, 0x00, 0x03};
+        auto good = framed(alive);
+        stream.insert(stream.end(), good.begin(), good.end());
+        parser.write(stream.data(), stream.size());
+        parser.parse(handler);
+        check(found.size() == 1 && found[0] == alive, "packet after garbage");
+        check(parser.skippedBytes() > 0, "garbage skipped");
+
+        // A packet with a bad CRC is dropped and the next one found.
+        found.clear();
+        std::vector<uint8_t> values {COMM_GET_VALUES, 1, 2, 3, 4};
+        auto bad = framed(values);
+        bad[3] ^= 0x10;
+        stream = bad;
+        good = framed(values);
+        stream.insert(stream.end(), good.begin(), good.end());
+        parser.write(stream.data(), stream.size());
+        parser.parse(handler);
+        check(found.size() == 1 && found[0] == values, "packet after bad CRC");
+        check(parser.crcErrorCount() == 1, "bad CRC counted");
+
+        // A stray start byte in front of a long packet, delivered a few bytes at a time so it wraps the buffer.
+        found.clear();
+        auto payload = longPayload();
+        stream = {0x02};
+        good = framed(payload);
+        stream.insert(stream.end(), good.begin(), good.end());
+        for(int pass = 0; pass < 5; pass++) {
+            for(size_t at = 0; at < stream.size(); at += 13) {
+                parser.write(stream.data() + at, std::min<size_t>(13, stream.size() - at));
+                parser.parse(handler);
+            }
+        }
+        check(found.size() == 5, "long packets after stray start byte");
+        for(auto &packet : found)
+            check(packet == payload, "long packet payload");
+    }
+
+    //! Stand-in for a controller on the far end of a pseudo-terminal, with others forwarded over its CAN bus.
+    //! It answers COMM_GET_VALUES_SELECTIVE, putting garbage, a corrupt copy or a stray start byte in front of
+    //! the replies, and records the commands it is sent.  COMM_FW_VERSION is answered with the controller's id,
+    //! controllers 11 and up answering late.  Firmware writes are acknowledged, and the controllers told to
+    //! install firmware recorded, stopping at the one on the port as it would reset.
+
+    class ControllerStandIn
+    {
+    public:
+        explicit ControllerStandIn(int fd)
+         : mFd(fd)
+        {
+            mThread = std::thread(&ControllerStandIn::run, this);
+        }
+
+        ~ControllerStandIn()
+        {
+            mTerminate = true;
+            mThread.join();
+        }
+
+        std::atomic<int> mPolls = 0;
+        std::atomic<int> mRpmCommands = 0;
+        std::atomic<int> mForwarded = 0;
+        std::atomic<float> mLastErpm = 0.0f;
+
+        std::mutex mJumpMutex;
+        std::vector<uint8_t> mJumped; //!< Protected by mJumpMutex
+
+    protected:
+        void run()
+        {
+            PacketParser parser;
+            while(!mTerminate) {
+                parser.readFrom(mFd);
+                parser.parse([this](const PacketView &packet) { handle(packet); });
+                auto now = std::chrono::steady_clock::now();
+                for(auto it = mDelayed.begin(); it != mDelayed.end();) {
+                    if(it->first > now) {
+                        ++it;
+                        continue;
+                    }
+                    send(it->second);
+                    it = mDelayed.erase(it);
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+
+        void send(const std::vector<uint8_t> &out)
+        {
+            if(write(mFd, out.data(), out.size()) != ssize_t(out.size()))
+                std::cerr << "Stand-in write failed" << std::endl;
+        }
+
+        void handle(const PacketView &received)
+        {
+            uint8_t id = mLocalId;
+            PacketView packet = received;
+            if(packet.command() == COMM_FORWARD_CAN) {
+                id = packet[1];
+                packet = received.sub(2);
+                mForwarded++;
+            }
+            if(packet.command() == COMM_ERASE_NEW_APP || packet.command() == COMM_WRITE_NEW_APP_DATA) {
+                uint8_t ack[6] = {packet.command(), 1};
+                if(packet.command() == COMM_WRITE_NEW_APP_DATA)
+                    packet.copy(1, ack + 2, 4);
+                std::vector<uint8_t> out;
+                appendPacket(out, ack, packet.command() == COMM_WRITE_NEW_APP_DATA ? 6 : 2);
+                send(out);
+                return;
+            }
+            if(packet.command() == COMM_JUMP_TO_BOOTLOADER) {
+                std::lock_guard lock(mJumpMutex);
+                if(std::find(mJumped.begin(), mJumped.end(), mLocalId) == mJumped.end())
+                    mJumped.push_back(id);
+                return;
+            }
+            if(packet.command() == COMM_SET_RPM) {
+                mRpmCommands++;
+                mLastErpm = float(packet.int32At(1));
+                return;
+            }
+            if(packet.command() == COMM_FW_VERSION) {
+                uint8_t version[3] = {COMM_FW_VERSION, 6, id};
+                std::vector<uint8_t> out;
+                appendPacket(out, version, sizeof(version));
+                auto delay = std::chrono::milliseconds(id >= 13 ? 300 : id >= 11 ? 150 : 0);
+                mDelayed.emplace_back(std::chrono::steady_clock::now() + delay, out);
+                return;
+            }
+            if(packet.command() != COMM_GET_VALUES_SELECTIVE)
+                return;
+            uint32_t mask = uint32_t(packet.int32At(1));
+            uint8_t payload[100];
+            int32_t index = 0;
+            payload[index++] = COMM_GET_VALUES_SELECTIVE;
+            buffer_append_int32(payload, int32_t(mask), &index);
+            const int sizes[] = {2, 2, 4, 4, 4, 4, 2, 4, 2, 4, 4, 4, 4, 4, 4, 1, 4, 1, 6, 4, 4};
+            for(int bit = 0; bit < 21; bit++) {
+                if(!(mask & (1u << bit)))
+                    continue;
+                if(bit == 0) {
+                    buffer_append_float16(payload, 20.0f + float(id), 10, &index); // FET temperature
+                } else if(bit == 7) {
+                    buffer_append_int32(payload, 1000 * id, &index); // ERPM
+                } else if(bit == 17) {
+                    payload[index++] = id;
+                } else {
+                    for(int i = 0; i < sizes[bit]; i++)
+                        payload[index++] = 0;
+                }
+            }
+            std::vector<uint8_t> out;
+            switch(mPolls++ % 4) {
+                case 0: out = {0x55, 0xaa, 0x02, 0x00}; break;
+                case 1: {
+                    appendPacket(out, payload, size_t(index));
+                    out[4] ^= 0x01;
+                } break;
+                case 2: {
+                    // A stray start byte in front of a long packet, then the reply.
+                    out.push_back(0x02);
+                    auto lng = longPayload();
+                    appendPacket(out, lng.data(), lng.size());
+                } break;
+                default: break;
+            }
+            appendPacket(out, payload, size_t(index));
+            send(out);
+        }
+
+        int mFd;
+        uint8_t mLocalId = 7;
+        std::vector<std::pair<std::chrono::steady_clock::time_point, std::vector<uint8_t>>> mDelayed;
+        std::atomic<bool> mTerminate = false;
+        std::thread mThread;
+    };
+
+    void testBusSerial()
+    {
+        int master = posix_openpt(O_RDWR | O_NOCTTY);
+        if(master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+            check(false, "open pseudo-terminal");
+            return;
+        }
+        struct termios tio {};
+        tcgetattr(master, &tio);
+        cfmakeraw(&tio);
+        tcsetattr(master, TCSANOW, &tio);
+        fcntl(master, F_SETFL, O_NONBLOCK);
+
+        {
+            ControllerStandIn controller(master);
+            Manager manager;
+            auto bus = std::make_shared<BusSerial>(json {{"device", ptsname(master)}, {"pollRate", 50}, {"localId", 7}});
+            check(manager.addBus("serial", bus), "add bus");
+            manager.setUpdateRate(50);
+            std::mutex longMutex;
+            int longPackets = 0;
+            bool longGood = true;
+            auto expected = longPayload();
+            bus->setPacketCallback([&](uint8_t, const uint8_t *payload, size_t len) {
+                if(len == 0 || payload[0] != COMM_GET_MCCONF)
+                    return;
+                std::lock_guard lock(longMutex);
+                longPackets++;
+                longGood = longGood && std::vector<uint8_t>(payload, payload + len) == expected;
+            });
+            std::vector<std::shared_ptr<Motor>> motors;
+            for(int id : {7, 9}) {
+                auto motor = std::make_shared<Motor>("m" + std::to_string(id));
+                json config = {{"bus", "serial"}, {"id", id}, {"controlMode", "rpm"}, {"numPoles", 2}, {"minRPM", 0},
+                               {"driveTimeout", 0}};
+                check(motor->configure(manager, config), "configure motor");
+                motor->setRPM(100.0f);
+                motors.push_back(motor);
+            }
+            check(manager.start(), "start manager");
+            std::this_thread::sleep_for(std::chrono::milliseconds(600));
+
+            // Replies don't say who sent them, so requests with the same command must not get each other's.
+            std::vector<uint8_t> version {COMM_FW_VERSION};
+            auto reply7 = bus->request(7, version);
+            auto reply9 = bus->request(9, version);
+            auto got = reply7.get();
+            check(got.size() == 3 && got[2] == 7, "reply from the controller on the port");
+            got = reply9.get();
+            check(got.size() == 3 && got[2] == 9, "reply from the forwarded controller");
+            // A reply arriving after its request timed out must not be taken for the next one's.
+            check(bus->request(11, version, 0.1f).get().empty(), "slow reply times out");
+            got = bus->request(13, version, 1.0f).get();
+            check(got.size() == 3 && got[2] == 13, "late reply not taken for the next request");
+
+            // The controller on the port must be told to install last, or it drops the jumps forwarded behind it.
+            FirmwareUpdater updater(bus);
+            std::vector<uint8_t> firmware(2000);
+            for(size_t i = 0; i < firmware.size(); i++)
+                firmware[i] = uint8_t(i * 13);
+            updater.setImage(firmware);
+            check(updater.upload({7, 9, 11}), "firmware upload");
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            {
+                std::lock_guard lock(controller.mJumpMutex);
+                check(controller.mJumped == std::vector<uint8_t>({9, 11, 7}), "controller on the port installs last");
+            }
+            manager.stop();
+
+            auto stats = bus->stats();
+            check(controller.mPolls >= 8, "polls answered");
+            check(controller.mRpmCommands > 0 && controller.mLastErpm == 100.0f, "RPM commands received");
+            check(controller.mForwarded > 0, "commands forwarded over CAN");
+            check(motors[0]->rpm() == 7000.0f && motors[0]->tempFet() == 27.0f, "values of the controller on the port");
+            check(motors[1]->rpm() == 9000.0f && motors[1]->tempFet() == 29.0f, "values of the forwarded controller");
+            check(stats["crcErrors"].get<uint64_t>() > 0, "bad CRC counted");
+            check(stats["skippedBytes"].get<uint64_t>() > 0, "garbage skipped");
+            check(stats["pollResponses"].get<uint64_t>() > 0, "poll responses counted");
+            std::lock_guard lock(longMutex);
+            check(longPackets > 0 && longGood, "long packets after stray start byte");
+        }
+        close(master);
+    }
+}
+
+int main()
+{
+    testParser();
+    testBusSerial();
+    return checkSummary();
+}
@@ -0,0 +1,79 @@
+//
+// Created by charles on 18/10/26.
+//
+
+// Tests the CRC16 versions agree with the byte at a time one, over many lengths, start offsets and initial values,
+// with and without the carry-less multiply version the CPU may have.
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include "multivesc/Crc16.hh"
+#include "TestCheck.hh"
+
+using namespace multivesc;
+using namespace multivesc::test;
+
+namespace {
+    //! A bit at a time straight from the definition, to check the tables.
+    uint16_t crc16Bitwise(const uint8_t *data, size_t len, uint16_t crc)
+    {
+        for(size_t i = 0; i < len; i++) {
+            crc ^= uint16_t(data[i] << 8);
+            for(int bit = 0; bit < 8; bit++)
+                crc = uint16_t((crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1));
+        }
+        return crc;
+    }
+
+    //! Compare a version to the byte at a time one.
+    //! @return Number of lengths, offsets and initial values where they differ.
+    template<typename FuncT>
+    int compare(const std::vector<uint8_t> &buffer, FuncT func)
+    {
+        int differ = 0;
+        for(uint16_t init : {uint16_t(0), uint16_t(0xFFFF), uint16_t(0x1D0F)}) {
+            for(size_t offset : {0, 1, 3, 7}) {
+                for(size_t len = 0; len <= 3000; len++) {
+                    const uint8_t *data = buffer.data() + offset;
+                    if(func(data, len, init) != crc16Bytewise(data, len, init))
+                        differ++;
+                }
+            }
+        }
+        return differ;
+    }
+}
+
+int main()
+{
+    const char *checkString = "123456789";
+    auto checkData = reinterpret_cast<const uint8_t *>(checkString);
+    check(crc16Bytewise(checkData, strlen(checkString)) == 0x31C3, "XMODEM check value");
+
+    std::vector<uint8_t> buffer(3100);
+    uint32_t state = 12345;
+    for(auto &byte : buffer) {
+        state = state * 1103515245 + 12345;
+        byte = uint8_t(state >> 16);
+    }
+    check(crc16Bytewise(buffer.data(), buffer.size(), 0x1D0F) == crc16Bitwise(buffer.data(), buffer.size(), 0x1D0F),
+          "bytewise matches bitwise");
+
+    // Split blocks carry on from each other.
+    uint16_t split = crc16Slice8(buffer.data() + 1000, buffer.size() - 1000, crc16Bytewise(buffer.data(), 1000));
+    check(split == crc16Bytewise(buffer.data(), buffer.size()), "CRC carried across blocks");
+
+    check(compare(buffer, crc16Slice8) == 0, "slice-by-8 matches bytewise");
+    if(crc16ClmulSupported()) {
+        check(compare(buffer, crc16Clmul) == 0, "carry-less multiply matches bytewise");
+    } else {
+        std::cout << "No carry-less multiply on this CPU, only the fallback is tested" << std::endl;
+    }
+    check(compare(buffer, crc16) == 0, "crc16 matches bytewise");
+    crc16AllowClmul(false);
+    check(compare(buffer, crc16) == 0, "crc16 without carry-less multiply matches bytewise");
+    crc16AllowClmul(true);
+    return checkSummary();
+}
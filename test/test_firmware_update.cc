@@ -0,0 +1,101 @@
+//
+// Created by charles on 18/10/26.
+//
+
+// Tests FirmwareUpdater against simulated controllers on the loopback bus, including resuming an upload to a
+// controller that stopped acknowledging part way through.
+
+#include <iostream>
+#include <cstdio>
+#include <thread>
+#include <unistd.h>
+#include "multivesc/BusLoopback.hh"
+#include "multivesc/FirmwareUpdater.hh"
+#include "TestCheck.hh"
+
+using namespace multivesc;
+using namespace multivesc::test;
+
+namespace {
+    int installs(const BusLoopback &bus, uint8_t id)
+    {
+        return bus.controller(id)->state().value("installs", -1);
+    }
+}
+
+int main()
+{
+    std::vector<uint8_t> firmware(100000);
+    for(size_t i = 0; i < firmware.size(); i++)
+        firmware[i] = uint8_t(i * 7 + i / 251);
+    std::string resumeFile = "test_firmware_update_" + std::to_string(getpid()) + ".json";
+
+    auto bus = std::make_shared<BusLoopback>(json {{"count", 3}, {"firstId", 1}});
+    if(!bus->open()) {
+        std::cerr << "Failed to open the loopback bus" << std::endl;
+        return 1;
+    }
+
+    // Upload to all three, with controller 3 hanging half way through.
+    FirmwareUpdater updater(bus);
+    updater.setImage(firmware);
+    updater.setResumeFile(resumeFile);
+    updater.setTimeout(0.1f);
+    updater.setRetries(1);
+    size_t total = updater.image().size();
+    updater.setProgressCallback([&](uint8_t id, size_t done, size_t) {
+        if(id == 3 && done > total / 2)
+            bus->controller(3)->setResponding(false);
+    });
+    check(!updater.upload({1, 2, 3}), "upload fails when a controller stops acknowledging");
+    auto results = updater.results();
+    check(results["controllers"]["1"]["ok"] && results["controllers"]["1"]["installed"], "controller 1 told to install");
+    check(results["controllers"]["2"]["ok"] && results["controllers"]["2"]["installed"], "controller 2 told to install");
+    check(!results["controllers"]["3"]["ok"] && !results["controllers"]["3"]["installed"], "controller 3 not told to install");
+    size_t firstBytes = results["controllers"]["3"]["bytes"];
+    check(firstBytes > total / 2 && firstBytes < total, "controller 3 part written");
+
+    // Carry on once it answers again, only the rest of controller 3's image is sent.
+    bus->controller(3)->setResponding(true);
+    FirmwareUpdater resumed(bus);
+    resumed.setImage(firmware);
+    resumed.setResumeFile(resumeFile);
+    size_t resentBytes = 0;
+    size_t otherBytes = 0;
+    resumed.setProgressCallback([&](uint8_t id, size_t, size_t) {
+        if(id == 3)
+            resentBytes += 384;
+        else
+            otherBytes += 384;
+    });
+    check(resumed.upload({1, 2, 3}), "resumed upload");
+    results = resumed.results();
+    check(results["controllers"]["3"]["ok"] && results["controllers"]["3"]["installed"], "controller 3 told to install");
+    check(otherBytes == 0, "installed controllers not written again");
+    check(resentBytes > 0 && resentBytes < total - firstBytes + 2 * 384, "only the rest of controller 3 written");
+
+    // Each controller checked the image's CRC and installed it once.
+    for(uint8_t id : {1, 2, 3})
+        check(installs(*bus, id) == 1, "controller " + std::to_string(id) + " installed once");
+    check(access(resumeFile.c_str(), F_OK) != 0, "resume file removed when done");
+    std::remove(resumeFile.c_str());
+
+    // Losing a packet now and then over a whole image doesn't give up on a controller that is working.
+    bus->controller(2)->setDropEvery(20);
+    FirmwareUpdater noisy(bus);
+    noisy.setImage(firmware);
+    noisy.setTimeout(0.05f);
+    noisy.setRetries(1);
+    noisy.setProgressCallback([&](uint8_t id, size_t done, size_t total) {
+        // Let the jump through, it isn't acknowledged so can't be retried.
+        if(done == total)
+            bus->controller(id)->setDropEvery(0);
+    });
+    check(noisy.upload({2}), "upload with lost packets");
+    for(int i = 0; i < 100 && installs(*bus, 2) != 2; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    check(installs(*bus, 2) == 2, "controller 2 installed again");
+    bus->stop();
+
+    return checkSummary();
+}
@@ -0,0 +1,216 @@
+//
+// Created by charles on 18/10/26.
+//
+
+// Tests the telemetry column files: samples read back exactly as written, across blocks, restarts, NaN values and
+// jumps in time, reading a time range, following a file while it is written, and many files open at once.
+
+#include <iostream>
+#include <filesystem>
+#include <cstring>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <random>
+#include <sys/resource.h>
+#include "multivesc/TelemetryColumn.hh"
+#include "TestCheck.hh"
+
+using namespace multivesc;
+using namespace multivesc::test;
+
+namespace {
+    uint32_t floatBits(float value)
+    {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    }
+
+    //! Compare samples bit for bit, so NaN values count as the same.
+    bool sameSamples(const std::vector<int64_t> &times, const std::vector<float> &values,
+                     const std::vector<int64_t> &expectTimes, const std::vector<float> &expectValues,
+                     size_t from, size_t to)
+    {
+        if(times.size() != to - from || values.size() != to - from)
+            return false;
+        for(size_t i = from; i < to; i++) {
+            if(times[i - from] != expectTimes[i] || floatBits(values[i - from]) != floatBits(expectValues[i]))
+                return false;
+        }
+        return true;
+    }
+
+    //! Samples of a status value at about 1 kHz with jitter, with the awkward cases mixed in.
+    void makeSamples(size_t count, std::vector<int64_t> &times, std::vector<float> &values)
+    {
+        std::mt19937 random(42);
+        std::uniform_int_distribution<int> jitter(-40, 40);
+        std::uniform_real_distribution<float> noise(-5.0f, 5.0f);
+        int64_t time = 1700000000000000;
+        float value = 1000.0f;
+        for(size_t i = 0; i < count; i++) {
+            time += 1000 + jitter(random);
+            if(i % 997 == 500)
+                time += 3600000000LL * 24 * 30; // A month with nothing logged, too far to store as a change
+            else if(i % 211 == 100)
+                time += 5000000; // A few seconds missing
+            if(i % 50 < 20)
+                value += noise(random);
+            float sample = value;
+            if(i % 333 == 7)
+                sample = std::numeric_limits<float>::quiet_NaN();
+            else if(i % 333 == 8)
+                sample = -std::numeric_limits<float>::infinity();
+            else if(i % 333 == 9)
+                sample = -0.0f;
+            times.push_back(time);
+            values.push_back(sample);
+        }
+    }
+
+    void testRoundTrip(const std::string &dir)
+    {
+        std::vector<int64_t> times;
+        std::vector<float> values;
+        makeSamples(5300, times, values);
+        std::string filename = dir + "/round_trip.tlm";
+
+        // Written in two runs, the second carrying on from the first.
+        size_t firstRun = 3000;
+        TelemetryColumnWriter writer;
+        check(writer.open(filename, 3, 1000), "create column");
+        for(size_t i = 0; i < firstRun; i++)
+            check(writer.append(times[i], values[i]), "append sample");
+        writer.close();
+        check(writer.open(filename, 3, 1000), "open column to carry on");
+        check(writer.sampleCount() == firstRun, "samples found when carrying on");
+        for(size_t i = firstRun; i < times.size(); i++)
+            check(writer.append(times[i], values[i]), "append sample");
+        writer.close();
+
+        TelemetryColumnWriter wrongType;
+        check(!wrongType.open(filename, 4, 1000), "column for another value left alone");
+
+        TelemetryColumnReader reader;
+        check(reader.open(filename), "open column to read");
+        check(reader.valueType() == 3, "value type");
+        check(reader.sampleCount() == times.size(), "sample count");
+        std::vector<int64_t> readTimes;
+        std::vector<float> readValues;
+        check(reader.read(readTimes, readValues) == times.size(), "read all samples");
+        check(sameSamples(readTimes, readValues, times, values, 0, times.size()), "samples read back exactly");
+
+        // A time range, starting and ending between samples.
+        readTimes.clear();
+        readValues.clear();
+        reader.read(readTimes, readValues, times[1200] - 1, times[4100] + 1);
+        check(sameSamples(readTimes, readValues, times, values, 1200, 4101), "samples in a time range");
+        readTimes.clear();
+        readValues.clear();
+        check(reader.read(readTimes, readValues, times.back() + 1) == 0, "nothing after the last sample");
+    }
+
+    void testSize(const std::string &dir)
+    {
+        // A status value at 50 Hz that changes now and then, as RPM does holding a setpoint.
+        std::string filename = dir + "/size.tlm";
+        TelemetryColumnWriter writer;
+        check(writer.open(filename, 0), "create column");
+        int64_t time = 1700000000000000;
+        size_t count = 100000;
+        for(size_t i = 0; i < count; i++) {
+            time += 20000;
+            writer.append(time, i % 100 < 5 ? 3000.0f + float(i % 7) : 3000.0f);
+        }
+        writer.close();
+        double bytesPerSample = double(std::filesystem::file_size(filename)) / double(count);
+        std::cout << "Steady status value: " << bytesPerSample << " bytes a sample" << std::endl;
+        check(bytesPerSample < 1.0, "steady values take under a byte a sample");
+    }
+
+    void testFollow(const std::string &dir)
+    {
+        // Enough random values to grow the file past its first megabyte, read as they are published.
+        std::string filename = dir + "/follow.tlm";
+        TelemetryColumnWriter writer;
+        check(writer.open(filename, 1), "create column");
+        TelemetryColumnReader reader;
+        check(reader.open(filename), "open column being written");
+        check(reader.sampleCount() == 0, "no samples before the first publish");
+
+        std::mt19937 random(7);
+        std::uniform_real_distribution<float> noise(-1000.0f, 1000.0f);
+        std::vector<int64_t> times;
+        std::vector<float> values;
+        int64_t time = 1700000000000000;
+        bool allSeen = true;
+        while(times.size() < 300000) {
+            for(int i = 0; i < 5000; i++) {
+                time += 1000;
+                times.push_back(time);
+                values.push_back(noise(random));
+                writer.append(time, values.back());
+            }
+            writer.publish();
+            reader.refresh();
+            std::vector<int64_t> readTimes;
+            std::vector<float> readValues;
+            reader.read(readTimes, readValues);
+            if(reader.sampleCount() != times.size() || !sameSamples(readTimes, readValues, times, values, 0, times.size()))
+                allSeen = false;
+        }
+        check(allSeen, "reader sees each publish");
+        check(writer.bytes() > 1024 * 1024, "file grew past the first step");
+        writer.close();
+    }
+
+    void testManyFiles(const std::string &dir)
+    {
+        // Far more columns than descriptors, as a logger for a large fleet has.
+        struct rlimit saved {};
+        getrlimit(RLIMIT_NOFILE, &saved);
+        struct rlimit limited = saved;
+        limited.rlim_cur = std::min<rlim_t>(saved.rlim_cur, 64);
+        setrlimit(RLIMIT_NOFILE, &limited);
+
+        std::vector<std::unique_ptr<TelemetryColumnWriter>> writers;
+        bool allOpen = true;
+        for(int i = 0; i < 500; i++) {
+            writers.push_back(std::make_unique<TelemetryColumnWriter>());
+            allOpen = writers.back()->open(dir + "/many_" + std::to_string(i) + ".tlm", 2) && allOpen;
+        }
+        bool allWritten = true;
+        for(int i = 0; i < 500; i++) {
+            for(int j = 0; j < 10; j++)
+                allWritten = writers[i]->append(1700000000000000 + j * 1000, float(i + j)) && allWritten;
+            writers[i]->publish();
+        }
+        writers.clear();
+        setrlimit(RLIMIT_NOFILE, &saved);
+        check(allOpen, "more columns open than descriptors allowed");
+        check(allWritten, "samples appended to all the columns");
+
+        TelemetryColumnReader reader;
+        std::vector<int64_t> times;
+        std::vector<float> values;
+        check(reader.open(dir + "/many_499.tlm") && reader.read(times, values) == 10 && values[9] == 508.0f,
+              "last column read back");
+    }
+}
+
+int main()
+{
+    std::string pattern = (std::filesystem::temp_directory_path() / "multivesc_telemetry_XXXXXX").string();
+    if(mkdtemp(pattern.data()) == nullptr) {
+        std::cerr << "Failed to make a directory for the test" << std::endl;
+        return 1;
+    }
+    testRoundTrip(pattern);
+    testSize(pattern);
+    testFollow(pattern);
+    testManyFiles(pattern);
+    std::filesystem::remove_all(pattern);
+    return checkSummary();
+}